@@ -0,0 +1,280 @@
+#include "board_config.h"
+
+#ifdef BOARD_HAS_AUDIO
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "driver/i2s_std.h"
+#include "mp4_player.h"
+
+static const char *TAG = "audio_out";
+
+namespace mp4 {
+
+// Resampled output of one PCM record: its worst case in mono frames, which
+// also bounds the stereo case
+static constexpr size_t kResampleBufSamples = Resampler::max_out_frames(kPcmBufSize / sizeof(int16_t));
+
+void AudioOutput::task_func(void *arg)
+{
+    auto *self = static_cast<AudioOutput *>(arg);
+    while (self->sync_.wait_start(PipelineSync::kAudioOutDone)) {
+        self->run();
+        xEventGroupSetBits(self->sync_.task_done, PipelineSync::kAudioOutDone);
+    }
+    xEventGroupSetBits(self->sync_.task_done, PipelineSync::kAudioOutDone);
+    delete self;
+    vTaskDelete(nullptr);
+}
+
+bool AudioOutput::init_i2s(unsigned sample_rate, unsigned channels)
+{
+    i2s_chan_config_t chan_cfg = I2S_CHANNEL_DEFAULT_CONFIG(I2S_NUM_0, I2S_ROLE_MASTER);
+    chan_cfg.dma_desc_num = kI2sDmaDescNum;
+    chan_cfg.dma_frame_num = kI2sDmaFrameNum;
+
+    esp_err_t ret = i2s_new_channel(&chan_cfg, &tx_chan_, nullptr);
+    if (ret != ESP_OK) {
+        ESP_LOGE(TAG, "i2s_new_channel failed: %s", esp_err_to_name(ret));
+        return false;
+    }
+
+    i2s_std_config_t std_cfg = {};
+    std_cfg.clk_cfg = I2S_STD_CLK_DEFAULT_CONFIG(sample_rate);
+    std_cfg.slot_cfg = I2S_STD_PHILIPS_SLOT_DEFAULT_CONFIG(
+        I2S_DATA_BIT_WIDTH_16BIT,
+        (channels == 1) ? I2S_SLOT_MODE_MONO : I2S_SLOT_MODE_STEREO);
+    std_cfg.gpio_cfg.mclk = I2S_GPIO_UNUSED;
+    std_cfg.gpio_cfg.bclk = BOARD_I2S_BCLK;
+    std_cfg.gpio_cfg.ws   = BOARD_I2S_LRCLK;
+    std_cfg.gpio_cfg.dout = BOARD_I2S_DOUT;
+    std_cfg.gpio_cfg.din  = I2S_GPIO_UNUSED;
+    std_cfg.gpio_cfg.invert_flags.mclk_inv = false;
+    std_cfg.gpio_cfg.invert_flags.bclk_inv = false;
+    std_cfg.gpio_cfg.invert_flags.ws_inv   = false;
+
+    ret = i2s_channel_init_std_mode(tx_chan_, &std_cfg);
+    if (ret != ESP_OK) {
+        ESP_LOGE(TAG, "i2s_channel_init_std_mode failed: %s", esp_err_to_name(ret));
+        i2s_del_channel(tx_chan_);
+        tx_chan_ = nullptr;
+        return false;
+    }
+
+    // Without the clock (callback refused) decode keeps pacing by wall clock
+    sync_.audio_clock.attach(tx_chan_, sample_rate, channels * sizeof(int16_t));
+
+    ret = i2s_channel_enable(tx_chan_);
+    if (ret != ESP_OK) {
+        ESP_LOGE(TAG, "i2s_channel_enable failed: %s", esp_err_to_name(ret));
+        i2s_del_channel(tx_chan_);
+        tx_chan_ = nullptr;
+        return false;
+    }
+
+    ESP_LOGI(TAG, "I2S initialized: %u Hz, %u ch", sample_rate, channels);
+    return true;
+}
+
+void AudioOutput::deinit_i2s()
+{
+    if (tx_chan_) {
+        i2s_channel_disable(tx_chan_);
+        sync_.audio_clock.detach();
+        i2s_del_channel(tx_chan_);
+        tx_chan_ = nullptr;
+    }
+}
+
+// Consume up to the decoder's EOS marker, so it never blocks on a full ring
+void AudioOutput::drain_ring()
+{
+    while (!sync_.stop_requested) {
+        AudioMsg *msg = sync_.pcm_ring.front(pdMS_TO_TICKS(500));
+        if (!msg) continue;
+        bool eos = msg->eos;
+        sync_.pcm_ring.pop();
+        if (eos) break;
+    }
+}
+
+void AudioOutput::run()
+{
+    auto &ring = sync_.pcm_ring;
+
+    {
+        AudioMsg *first_msg = nullptr;
+        while (!first_msg && !sync_.stop_requested) {
+            first_msg = ring.front(pdMS_TO_TICKS(500));
+        }
+        if (!first_msg) goto done;
+        if (first_msg->eos) {
+            ring.pop();  // no audio track (or it failed to decode)
+            goto done;
+        }
+    }
+
+    {
+        // A mono board plays stereo files downmixed
+        const unsigned out_channels = (audio_info_.channels > BOARD_AUDIO_OUT_CHANNELS)
+                                    ? BOARD_AUDIO_OUT_CHANNELS : audio_info_.channels;
+        const bool downmix = out_channels < audio_info_.channels;
+        if (!init_i2s(audio_info_.sample_rate, out_channels)) {
+            ESP_LOGE(TAG, "I2S init failed, draining PCM ring");
+            drain_ring();
+            goto done;
+        }
+        if (downmix) {
+            ESP_LOGI(TAG, "Downmixing %u ch to %u ch (BOARD_AUDIO_OUT_CHANNELS)",
+                     audio_info_.channels, out_channels);
+        }
+
+        gain_.reset(sync_.audio_volume);
+        MediaClock &clock = sync_.audio_clock;
+        const size_t frame_bytes = out_channels * sizeof(int16_t);
+
+        bool resample = kDriftCompensation;
+        if (resample && !resample_buf_) {
+            resample_buf_ = static_cast<int16_t *>(internal_malloc(kResampleBufSamples * sizeof(int16_t)));
+            if (!resample_buf_) {
+                ESP_LOGW(TAG, "No internal RAM for the resample buffer, drift compensation off");
+                resample = false;
+            }
+        }
+        drift_.reset();
+        resampler_.reset(out_channels);
+        unsigned starved_seen = 0;
+
+        const size_t write_chunk = clock.write_chunk_bytes();
+        // Of decoded PCM, as it sits in the ring
+        const unsigned bytes_per_s = audio_info_.sample_rate * audio_info_.channels * sizeof(int16_t);
+        uint32_t clock_epoch = sync_.seek_epoch;
+
+        // Fill is sampled once the decoder has got a good way ahead, and an
+        // empty ring only counts as an underrun mid-stream (not right after
+        // a seek, when the stale frames have just been dropped)
+        const size_t primed_bytes = (size_t)bytes_per_s * kPcmRingMs / 2 / 1000;
+        bool     primed = false;
+        unsigned played_frames = 0, fill_samples = 0, underruns = 0;
+        uint64_t fill_sum = 0;
+        size_t   fill_min = SIZE_MAX;
+        int64_t  starved_us = 0, total_i2s_us = 0;
+
+        while (!sync_.stop_requested) {
+            AudioMsg *msg = ring.front(0);
+            if (!msg) {
+                const bool underrun = primed && clock_epoch == sync_.seek_epoch;
+                int64_t t0 = esp_timer_get_time();
+                while (!msg && !sync_.stop_requested) {
+                    msg = ring.front(pdMS_TO_TICKS(500));
+                }
+                if (underrun) {
+                    underruns++;
+                    starved_us += esp_timer_get_time() - t0;
+                    drift_.reanchor();  // the clock stood still: not drift
+                }
+                if (!msg) break;
+            }
+
+            if (msg->eos) {
+                ring.pop();
+                break;
+            }
+
+            const int64_t  pts_us = msg->pts_us;
+            const uint32_t epoch  = msg->epoch;
+            if (epoch != sync_.seek_epoch) {
+                ring.pop();  // decoded before a seek
+                continue;
+            }
+            if (epoch != clock_epoch) {
+                // First frame after a seek: drop any mark that slipped in
+                // between seek()'s flush and this task seeing the epoch
+                clock.flush();
+                clock_epoch = epoch;
+                primed = false;
+                drift_.reanchor();
+            }
+
+            size_t fill = ring.used_bytes();
+            if (!primed && fill >= primed_bytes) primed = true;
+            if (primed) {
+                fill_sum += fill;
+                if (fill < fill_min) fill_min = fill;
+                fill_samples++;
+            }
+
+            size_t bytes = gain_.process(reinterpret_cast<int16_t *>(msg->data),
+                                         msg->size / sizeof(int16_t), downmix,
+                                         sync_.audio_volume);
+            const uint8_t *out = msg->data;
+
+            if (resample) {
+                if (clock.starved_buffers() != starved_seen) {
+                    starved_seen = clock.starved_buffers();
+                    drift_.reanchor();
+                }
+                const int ppm = drift_.update(clock.now_us(), esp_timer_get_time());
+                const size_t frames = resampler_.process(reinterpret_cast<const int16_t *>(msg->data),
+                                                         bytes / frame_bytes, resample_buf_,
+                                                         kResampleBufSamples / out_channels, ppm);
+                out   = reinterpret_cast<const uint8_t *>(resample_buf_);
+                bytes = frames * frame_bytes;
+            }
+
+            clock.mark(pts_us);
+
+            // I2S write with stop check (avoid portMAX_DELAY blocking),
+            // one DMA buffer per call so the clock's count is current
+            // whenever a buffer completes
+            int64_t t_i2s = esp_timer_get_time();
+            size_t remaining = bytes;
+            const uint8_t *ptr = out;
+            while (remaining > 0 && !sync_.stop_requested) {
+                size_t written = 0;
+                i2s_channel_write(tx_chan_, ptr, (remaining < write_chunk) ? remaining : write_chunk,
+                                  &written, pdMS_TO_TICKS(100));
+                clock.written(written);
+                ptr += written;
+                remaining -= written;
+            }
+            total_i2s_us += esp_timer_get_time() - t_i2s;
+            ring.pop();
+            played_frames++;
+        }
+
+        ESP_LOGI(TAG, "Audio playback complete: %u frames, i2s_write=%lldms",
+                 played_frames, total_i2s_us / 1000);
+        ESP_LOGI(TAG, "PCM ring: %u KB = %u ms, fill avg %u ms / min %u ms, "
+                 "%u underruns (%lld ms waiting), %u DMA buffers starved",
+                 (unsigned)(ring.capacity() / 1024),
+                 (unsigned)((uint64_t)ring.capacity() * 1000 / bytes_per_s),
+                 fill_samples ? (unsigned)(fill_sum / fill_samples * 1000 / bytes_per_s) : 0,
+                 fill_samples ? (unsigned)((uint64_t)fill_min * 1000 / bytes_per_s) : 0,
+                 underruns, starved_us / 1000, clock.starved_buffers());
+        if (gain_.samples() > 0) {
+            ESP_LOGI(TAG, "Gain (scalar%s): %u.%02u cycles/sample, %u volume ramps",
+                     downmix ? ", downmix" : "",
+                     (unsigned)(gain_.cycles() / gain_.samples()),
+                     (unsigned)(gain_.cycles() * 100 / gain_.samples() % 100),
+                     gain_.ramps());
+        }
+        if (resample) {
+            ESP_LOGI(TAG, "Drift: %+d ppm (range %+d..%+d), drift %lld us (max %lld us), %u resyncs",
+                     drift_.ppm(), drift_.min_ppm(), drift_.max_ppm(),
+                     drift_.drift_us(), drift_.max_drift_us(), drift_.resyncs());
+        }
+    }
+
+    deinit_i2s();
+
+done:
+    sync_.audio_eos = true;
+    ESP_LOGI(TAG, "audio_out done");
+}
+
+}  // namespace mp4
+
+#endif // BOARD_HAS_AUDIO
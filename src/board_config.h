@@ -111,11 +111,18 @@
 #define BOARD_I2S_BCLK         GPIO_NUM_5
 #define BOARD_I2S_LRCLK        GPIO_NUM_39
 #define BOARD_I2S_DOUT         GPIO_NUM_38
+#define BOARD_AUDIO_OUT_CHANNELS 1          // NS4168 is a mono amplifier
 
 #else
 #error "No board defined! Use -DBOARD_SPOTPEAR, -DBOARD_ATOMS3R, or -DBOARD_ATOMS3R_SPK"
 #endif
 
+// Channels the audio output can play: stereo files are downmixed on a mono
+// board, and I2S runs in mono slot mode (half the DMA memory and bandwidth)
+#ifndef BOARD_AUDIO_OUT_CHANNELS
+#define BOARD_AUDIO_OUT_CHANNELS 2
+#endif
+
 // Max decode resolution (half of Full HD, common to all boards)
 #define BOARD_MAX_DECODE_WIDTH   960
 #define BOARD_MAX_DECODE_HEIGHT  540
@@ -0,0 +1,243 @@
+#include "chunk_reader.h"
+
+#include <cstring>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "player_constants.h"
+#include "psram_alloc.h"
+
+static const char *TAG = "chunk_rd";
+
+namespace mp4 {
+
+bool ChunkReader::open(const char *path, size_t ring_bytes, const volatile bool *stop)
+{
+    close();
+
+    // POSIX read() bypasses newlib's stdio layer, which re-reads a full
+    // buffer from the card on every fread regardless of its state.
+    io_fd_     = ::open(path, O_RDONLY);
+    direct_fd_ = ::open(path, O_RDONLY);
+    if (io_fd_ < 0 || direct_fd_ < 0) {
+        ESP_LOGE(TAG, "Failed to open %s", path);
+        close();
+        return false;
+    }
+    off_t size = lseek(io_fd_, 0, SEEK_END);
+    file_size_ = (size > 0) ? (uint32_t)size : 0;
+
+    ring_      = psram_alloc<uint8_t>(ring_bytes);
+    lock_      = xSemaphoreCreateMutex();
+    data_sem_  = xSemaphoreCreateBinary();
+    space_sem_ = xSemaphoreCreateBinary();
+    done_sem_  = xSemaphoreCreateBinary();
+    if (!ring_ || !lock_ || !data_sem_ || !space_sem_ || !done_sem_) {
+        ESP_LOGE(TAG, "Failed to allocate %u byte read-ahead ring", (unsigned)ring_bytes);
+        close();
+        return false;
+    }
+    cap_   = ring_bytes;
+    stop_  = stop;
+    start_ = 0;
+    end_   = 0;
+    eof_   = true;   // nothing to stream until restart()
+    quit_  = false;
+
+    if (xTaskCreatePinnedToCore(task_func, "sd_io", kPrefetchStackSize, this,
+                                kPrefetchPriority, &task_, kPrefetchCore) != pdPASS) {
+        ESP_LOGE(TAG, "Failed to create I/O task");
+        task_ = nullptr;
+        close();
+        return false;
+    }
+    return true;
+}
+
+void ChunkReader::close()
+{
+    if (task_) {
+        quit_ = true;
+        xSemaphoreGive(space_sem_);
+        // The task runs on this object and the ring until it signals: wait
+        // out a transfer stuck on the card rather than free them under it
+        while (xSemaphoreTake(done_sem_, pdMS_TO_TICKS(kQueueSendTimeoutMs)) != pdTRUE) {
+            ESP_LOGW(TAG, "Waiting for the I/O task to finish its transfer");
+        }
+        task_ = nullptr;
+    }
+    if (io_fd_ >= 0)     { ::close(io_fd_);     io_fd_ = -1; }
+    if (direct_fd_ >= 0) { ::close(direct_fd_); direct_fd_ = -1; }
+    if (lock_)      { vSemaphoreDelete(lock_);      lock_ = nullptr; }
+    if (data_sem_)  { vSemaphoreDelete(data_sem_);  data_sem_ = nullptr; }
+    if (space_sem_) { vSemaphoreDelete(space_sem_); space_sem_ = nullptr; }
+    if (done_sem_)  { vSemaphoreDelete(done_sem_);  done_sem_ = nullptr; }
+    safe_free(ring_);
+    ring_ = nullptr;
+    cap_  = 0;
+}
+
+void ChunkReader::restart(uint32_t offset)
+{
+    // Sector-align the stream start: the SD card reads whole blocks anyway
+    offset &= ~(uint32_t)(kPrefetchAlignBytes - 1);
+
+    xSemaphoreTake(lock_, portMAX_DELAY);
+    gen_   = gen_ + 1;
+    start_ = offset;
+    end_   = offset;
+    eof_   = (offset >= file_size_);
+    xSemaphoreGive(lock_);
+    restarts_++;
+    xSemaphoreGive(space_sem_);
+}
+
+bool ChunkReader::read_direct(uint32_t offset, unsigned size, uint8_t *dst)
+{
+    direct_reads_++;
+    if (lseek(direct_fd_, (off_t)offset, SEEK_SET) < 0) return false;
+    return ::read(direct_fd_, dst, size) == (ssize_t)size;
+}
+
+bool ChunkReader::read(uint32_t offset, unsigned size, uint8_t *dst, uint32_t other_offset)
+{
+    const uint64_t need_end = (uint64_t)offset + size;
+    if (need_end > file_size_) {
+        ESP_LOGW(TAG, "Sample at %u (%u bytes) runs past the end of the file (%u bytes)",
+                 (unsigned)offset, size, (unsigned)file_size_);
+        return false;
+    }
+
+    // Lowest byte still wanted: this sample, or the other track's next
+    // sample if it is already part of the stream.
+    uint32_t keep_from = offset;
+    if (other_offset < offset && other_offset >= start_) keep_from = other_offset;
+
+    if (offset < start_) {
+        // Behind the stream (other track far away in the file)
+        return read_direct(offset, size, dst);
+    }
+    if (need_end > (uint64_t)keep_from + cap_ && keep_from < offset) {
+        // Would have to drop bytes the other track still needs
+        return read_direct(offset, size, dst);
+    }
+    if (keep_from == offset &&
+        (need_end > (uint64_t)offset + cap_ ||
+         (offset > end_ && offset - end_ > kPrefetchMaxGapBytes))) {
+        // Jumped ahead (skip to a keyframe): cheaper to restart than to
+        // stream through the gap
+        restart(offset);
+    }
+
+    // Release everything before keep_from to the I/O task
+    if (keep_from > start_) {
+        xSemaphoreTake(lock_, portMAX_DELAY);
+        if (keep_from > start_) start_ = keep_from;
+        xSemaphoreGive(lock_);
+        xSemaphoreGive(space_sem_);
+    }
+
+    uint32_t end = end_;
+    size_t ahead = (end > offset) ? end - offset : 0;
+    requests_++;
+    ahead_sum_ += ahead;
+    if (ahead < min_ahead_) min_ahead_ = ahead;
+
+    if (end < need_end) {
+        stalls_++;
+        int64_t t0 = esp_timer_get_time();
+        hungry_ = true;
+        xSemaphoreGive(space_sem_);
+        while (end_ < need_end) {
+            if (stop_ && *stop_) {
+                hungry_ = false;
+                stall_us_ += esp_timer_get_time() - t0;
+                return false;
+            }
+            if (eof_) {
+                hungry_ = false;
+                stall_us_ += esp_timer_get_time() - t0;
+                return read_direct(offset, size, dst);  // read error in the stream
+            }
+            xSemaphoreTake(data_sem_, pdMS_TO_TICKS(100));
+        }
+        hungry_ = false;
+        stall_us_ += esp_timer_get_time() - t0;
+    }
+
+    size_t idx   = offset % cap_;
+    size_t first = (size <= cap_ - idx) ? size : cap_ - idx;
+    memcpy(dst, ring_ + idx, first);
+    if (first < size) {
+        memcpy(dst + first, ring_, size - first);
+    }
+    return true;
+}
+
+void ChunkReader::task_func(void *arg)
+{
+    auto *self = static_cast<ChunkReader *>(arg);
+    self->io_loop();
+    xSemaphoreGive(self->done_sem_);
+    vTaskDelete(nullptr);
+}
+
+void ChunkReader::io_loop()
+{
+    int64_t fd_pos = -1;
+
+    while (!quit_) {
+        xSemaphoreTake(lock_, portMAX_DELAY);
+        const uint32_t gen  = gen_;
+        const uint32_t pos  = end_;
+        const size_t   room = cap_ - (end_ - start_);
+        const bool     done = eof_;
+        xSemaphoreGive(lock_);
+
+        if (!done && pos >= file_size_) {
+            // Streamed to the end of the file
+            xSemaphoreTake(lock_, portMAX_DELAY);
+            if (gen == gen_) eof_ = true;
+            xSemaphoreGive(lock_);
+            xSemaphoreGive(data_sem_);
+            continue;
+        }
+
+        // Wait for a full-sized transfer's worth of room (or the file tail),
+        // unless demux is already waiting on this data
+        size_t want = kPrefetchReadBytes;
+        if (file_size_ - pos < want) want = file_size_ - pos;
+        if (hungry_ && room < want) want = room;
+        if (done || want == 0 || room < want) {
+            xSemaphoreTake(space_sem_, pdMS_TO_TICKS(100));
+            continue;
+        }
+        size_t idx = pos % cap_;
+        if (want > cap_ - idx) want = cap_ - idx;  // contiguous part; the rest on the next pass
+
+        int64_t t0 = esp_timer_get_time();
+        ssize_t got = -1;
+        if (fd_pos == (int64_t)pos || lseek(io_fd_, (off_t)pos, SEEK_SET) >= 0) {
+            got = ::read(io_fd_, ring_ + idx, want);
+        }
+        fd_pos = (got > 0) ? (int64_t)pos + got : -1;
+        read_us_ += esp_timer_get_time() - t0;
+        transactions_++;
+
+        xSemaphoreTake(lock_, portMAX_DELAY);
+        if (gen == gen_) {
+            if (got > 0) {
+                end_ = end_ + got;
+                bytes_ += got;
+            } else {
+                eof_ = true;
+            }
+        }
+        xSemaphoreGive(lock_);
+        xSemaphoreGive(data_sem_);
+    }
+}
+
+}  // namespace mp4
@@ -0,0 +1,91 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/semphr.h"
+
+namespace mp4 {
+
+// Read-ahead ring for every sample read in demux.  A low-priority I/O task
+// streams the file forward into a PSRAM ring (kPrefetchRingBytes) in large
+// sequential transfers, so SD latency spikes (FAT cluster walks, card GC)
+// are absorbed by the buffered bytes instead of reaching the decoder.
+// Demux copies samples out of memory and tells the ring which bytes it no
+// longer needs; interleaved audio and video chunks share the one stream.
+//
+// Byte x of the file lives at ring[x % capacity] while start_ <= x < end_.
+// The I/O task only appends at end_, demux only advances start_ (or
+// restarts the stream), so copying out of [start_, end_) needs no lock.
+class ChunkReader {
+public:
+    // stop: the pipeline's stop flag, polled while demux waits on the I/O
+    // task so a stop never leaves it stalled on data that isn't coming
+    bool open(const char *path, size_t ring_bytes, const volatile bool *stop = nullptr);
+    // Waits for the I/O task to exit before freeing anything it touches
+    void close();
+
+    ~ChunkReader() { close(); }
+
+    // Drop buffered data and stream from offset (playback start / seek)
+    void restart(uint32_t offset);
+
+    // Copy one sample.  other_offset is the other track's next sample (or
+    // UINT32_MAX): buffered bytes from there on are kept for it.  Samples
+    // the stream can't serve without dropping kept data are read directly.
+    // Fails for samples past the end of the file and on stop.
+    bool read(uint32_t offset, unsigned size, uint8_t *dst, uint32_t other_offset);
+
+    // Stats: I/O task transfers, demux stalls and fill level ahead of demux
+    unsigned transactions() const { return transactions_; }
+    uint64_t bytes() const        { return bytes_; }
+    int64_t  read_us() const      { return read_us_; }
+    unsigned stalls() const       { return stalls_; }
+    int64_t  stall_us() const     { return stall_us_; }
+    unsigned restarts() const     { return restarts_; }
+    unsigned direct_reads() const { return direct_reads_; }
+    size_t   min_ahead() const    { return min_ahead_; }
+    size_t   avg_ahead() const    { return requests_ ? (size_t)(ahead_sum_ / requests_) : 0; }
+    size_t   capacity() const     { return cap_; }
+
+private:
+    static void task_func(void *arg);
+    void io_loop();
+    bool read_direct(uint32_t offset, unsigned size, uint8_t *dst);
+
+    int      io_fd_     = -1;   // I/O task's stream
+    int      direct_fd_ = -1;   // demux's out-of-stream reads
+    uint8_t *ring_      = nullptr;
+    size_t   cap_       = 0;
+    uint32_t file_size_ = 0;
+    const volatile bool *stop_ = nullptr;
+
+    SemaphoreHandle_t lock_      = nullptr;
+    SemaphoreHandle_t data_sem_  = nullptr;  // I/O task -> demux: bytes appended
+    SemaphoreHandle_t space_sem_ = nullptr;  // demux -> I/O task: room freed / restart / quit
+    SemaphoreHandle_t done_sem_  = nullptr;  // I/O task exited
+    TaskHandle_t      task_      = nullptr;
+
+    volatile uint32_t start_ = 0;
+    volatile uint32_t end_   = 0;
+    volatile uint32_t gen_   = 0;      // bumped by restart(); stale transfers are discarded
+    volatile bool     eof_   = false;  // end of file or read error at end_
+    volatile bool     quit_  = false;
+    volatile bool     hungry_ = false;  // demux is stalled: read whatever room there is
+
+    // I/O task
+    unsigned transactions_ = 0;
+    uint64_t bytes_        = 0;
+    int64_t  read_us_      = 0;
+    // Demux side
+    unsigned stalls_       = 0;
+    int64_t  stall_us_     = 0;
+    unsigned restarts_     = 0;
+    unsigned direct_reads_ = 0;
+    unsigned requests_     = 0;
+    uint64_t ahead_sum_    = 0;
+    size_t   min_ahead_    = SIZE_MAX;
+};
+
+}  // namespace mp4
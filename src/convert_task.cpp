@@ -0,0 +1,131 @@
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "esp_log.h"
+#include "esp_cpu.h"
+
+#include "mp4_player.h"
+#include "yuv2rgb.h"
+
+static const char *TAG = "convert";
+
+namespace mp4 {
+
+void ConvertStage::task_func(void *arg)
+{
+    auto *self = static_cast<ConvertStage *>(arg);
+    while (self->sync_.wait_start(PipelineSync::kConvertDone)) {
+        self->run();
+        xEventGroupSetBits(self->sync_.task_done, PipelineSync::kConvertDone);
+    }
+    xEventGroupSetBits(self->sync_.task_done, PipelineSync::kConvertDone);
+    delete self;
+    vTaskDelete(nullptr);
+}
+
+void ConvertStage::drain_ring()
+{
+    int slot;
+    while ((slot = sync_.yuv_ring.receive(0)) != YuvRing::kTimeout) {
+        if (slot == YuvRing::kEos) break;
+        sync_.yuv_ring.release(slot);
+    }
+}
+
+void ConvertStage::run()
+{
+    ESP_LOGI(TAG, "convert_task started");
+
+    unsigned frames = 0;
+    uint64_t convert_cycles = 0, convert_pixels = 0;
+    bool stopped = false;
+    bool buffers_ready = false;  // this file's: sizes may differ from the last one's
+
+    while (true) {
+        int slot = sync_.yuv_ring.receive(pdMS_TO_TICKS(500));
+        if (slot == YuvRing::kTimeout) {
+            if (sync_.stop_requested) {
+                stopped = true;
+                break;
+            }
+            continue;
+        }
+        if (slot == YuvRing::kEos) break;
+        if (sync_.yuv_ring.epoch(slot) != sync_.seek_epoch) {
+            sync_.yuv_ring.release(slot);  // decoded before a seek: never shown
+            continue;
+        }
+
+        const YuvFrame &yuv = sync_.yuv_ring.slot(slot);
+        if (!buffers_ready) {
+            if (!dbuf_.init(yuv.width, yuv.height)) {
+                size_t buf_size = yuv.width * yuv.height * sizeof(uint16_t);
+                ESP_LOGE(TAG, "Failed to allocate RGB565 double buffers (%d bytes each)", buf_size);
+                dbuf_.deinit();
+                sync_.yuv_ring.release(slot);
+                sync_.abort_file();
+                stopped = true;
+                break;
+            }
+            ESP_LOGI(TAG, "Double buffer ready: 2 x %d bytes in PSRAM",
+                     (int)(yuv.width * yuv.height * sizeof(uint16_t)));
+            buffers_ready = true;
+
+            // One token per frame buffer: convert may fill the next buffer
+            // while display is still DMA-ing the previous one.
+            for (int i = 0; i < kFrameBufferCount; i++) {
+                xSemaphoreGive(sync_.display_done);
+            }
+        }
+
+        // Wait for display with stop check (stop also gives display_done
+        // to wake this wait, so check again once it returns)
+        while (xSemaphoreTake(sync_.display_done, pdMS_TO_TICKS(100)) != pdTRUE ||
+               sync_.stop_requested) {
+            if (sync_.stop_requested) {
+                sync_.yuv_ring.release(slot);
+                stopped = true;
+                goto exit_convert;
+            }
+        }
+
+        {
+            esp_cpu_cycle_count_t c0 = esp_cpu_get_cycle_count();
+            yuv_frame_to_rgb565_band(yuv, dbuf_.write_buf(), 0, yuv.height, kSwap565Lut);
+            convert_cycles += (uint32_t)(esp_cpu_get_cycle_count() - c0);
+            convert_pixels += (uint64_t)yuv.width * yuv.height;
+        }
+        dbuf_.set_frame_info(sync_.yuv_ring.pts_us(slot), sync_.yuv_ring.track_start(slot));
+        sync_.yuv_ring.release(slot);
+
+        dbuf_.swap();
+        xSemaphoreGive(sync_.decode_ready);
+        frames++;
+    }
+
+exit_convert:
+    // Display finishes the last transfer on this decode_ready and hands its
+    // buffer back.  EOS waits for every buffer's token, i.e. until the last
+    // frame is on the panel, not just for the one buffer already free.
+    sync_.convert_eos = true;
+    xSemaphoreGive(sync_.decode_ready);
+    if (!stopped && frames > 0) {
+        for (int i = 0; i < kFrameBufferCount; i++) {
+            if (xSemaphoreTake(sync_.display_done, pdMS_TO_TICKS(kFinalDisplayWaitMs)) != pdTRUE) {
+                ESP_LOGW(TAG, "Last frame not handed back by display after %d ms",
+                         kFinalDisplayWaitMs);
+                break;
+            }
+        }
+    }
+    if (convert_pixels > 0) {
+        ESP_LOGI(TAG, "YUV->RGB565: %u frames, %u cycles/pixel",
+                 frames, (unsigned)(convert_cycles / convert_pixels));
+    }
+
+    sync_.pipeline_eos = true;
+    drain_ring();
+
+    ESP_LOGI(TAG, "convert_task done");
+}
+
+}  // namespace mp4
@@ -20,39 +20,56 @@ namespace mp4 {
 void DecodeStage::task_func(void *arg)
 {
     auto *self = static_cast<DecodeStage *>(arg);
-    self->run();
+    while (self->sync_.wait_start(PipelineSync::kDecodeDone)) {
+        self->run();
+        xEventGroupSetBits(self->sync_.task_done, PipelineSync::kDecodeDone);
+    }
     xEventGroupSetBits(self->sync_.task_done, PipelineSync::kDecodeDone);
     delete self;
     vTaskDelete(nullptr);
 }
 
-void DecodeStage::compute_scaling(int video_w, int video_h)
+bool DecodeStage::compute_scaling(int video_w, int video_h)
 {
-    bool needs_scaling = (video_w > BOARD_DISPLAY_WIDTH || video_h > BOARD_DISPLAY_HEIGHT);
-    if (needs_scaling) {
-        if (BOARD_DISPLAY_WIDTH * video_h <= BOARD_DISPLAY_HEIGHT * video_w) {
-            video_info_.scaled_w = BOARD_DISPLAY_WIDTH;
-            video_info_.scaled_h = video_h * BOARD_DISPLAY_WIDTH / video_w;
-        } else {
-            video_info_.scaled_h = BOARD_DISPLAY_HEIGHT;
-            video_info_.scaled_w = video_w * BOARD_DISPLAY_HEIGHT / video_h;
-        }
-        video_info_.scaled_w &= ~1;
-        video_info_.scaled_h &= ~1;
-    } else {
-        video_info_.scaled_w = video_w;
-        video_info_.scaled_h = video_h;
-    }
+    bool needs_scaling = fit_to_panel(video_w, video_h, BOARD_DISPLAY_WIDTH, BOARD_DISPLAY_HEIGHT,
+                                      video_info_.scaled_w, video_info_.scaled_h);
     video_info_.display_x = (BOARD_DISPLAY_WIDTH - video_info_.scaled_w) / 2;
     video_info_.display_y = (BOARD_DISPLAY_HEIGHT - video_info_.scaled_h) / 2;
+
+    // Source index tables for the scaled kernel (built once, no per-pixel division)
+    if (!needs_scaling) {
+        video_info_.scale_map.deinit();
+    } else if (!video_info_.scale_map.init(video_w, video_h,
+                                           video_info_.scaled_w, video_info_.scaled_h)) {
+        ESP_LOGE(TAG, "Failed to allocate scaling tables");
+        return false;
+    }
+    return true;
+}
+
+// PTS pacing sleep, cut short by a seek or stop: after a seek the old clock
+// reference is meaningless and the next frame should go out immediately.
+// Mp4Player::seek() / request_stop() notify this task, so the sleep ends as
+// soon as either happens; a stale notification only costs one extra pass.
+// Sleeps are whole ticks, rounded to the nearest, so a frame leaves within
+// half a tick of its deadline either way.
+static void pace_delay_us(PipelineSync &sync, uint32_t epoch, int64_t us)
+{
+    const int64_t until = esp_timer_get_time() + us;
+    while (sync.seek_epoch == epoch && !sync.stop_requested) {
+        int64_t left_us = until - esp_timer_get_time();
+        TickType_t ticks = pdMS_TO_TICKS((left_us + 500) / 1000);
+        if (left_us <= 0 || ticks == 0) break;
+        ulTaskNotifyTake(pdTRUE, ticks);
+    }
 }
 
 void DecodeStage::drain_queue()
 {
-    FrameMsg msg;
-    while (xQueueReceive(sync_.nal_queue, &msg, 0) == pdTRUE) {
-        safe_free(msg.data);
-        if (msg.eos) break;
+    while (FrameMsg *msg = sync_.nal_ring.front(0)) {
+        bool eos = msg->eos;
+        sync_.nal_ring.pop();
+        if (eos) break;
     }
 }
 
@@ -62,10 +79,9 @@ void DecodeStage::run()
 
     // Wait for demux_task to set video dimensions (with stop check)
     {
-        FrameMsg first_msg;
         bool got_msg = false;
         while (!got_msg && !sync_.stop_requested) {
-            got_msg = (xQueuePeek(sync_.nal_queue, &first_msg, pdMS_TO_TICKS(500)) == pdTRUE);
+            got_msg = (sync_.nal_ring.front(pdMS_TO_TICKS(500)) != nullptr);
         }
         if (!got_msg) {
             ESP_LOGI(TAG, "Stop requested before first frame arrived");
@@ -79,7 +95,9 @@ void DecodeStage::run()
         if (video_w <= 0) video_w = BOARD_DISPLAY_WIDTH;
         if (video_h <= 0) video_h = BOARD_DISPLAY_HEIGHT;
 
-        compute_scaling(video_w, video_h);
+        if (!compute_scaling(video_w, video_h)) {
+            goto signal_eos;
+        }
 
         int scaled_w = video_info_.scaled_w;
         int scaled_h = video_info_.scaled_h;
@@ -89,16 +107,15 @@ void DecodeStage::run()
                  video_w, video_h, scaled_w, scaled_h,
                  video_info_.display_x, video_info_.display_y);
 
-        if (!dbuf_.init(scaled_w, scaled_h)) {
-            size_t buf_size = scaled_w * scaled_h * sizeof(uint16_t);
-            ESP_LOGE(TAG, "Failed to allocate RGB565 double buffers (%d bytes each)", buf_size);
-            dbuf_.deinit();
+        // Display-sized YUV slots; colour conversion happens on Core 0
+        // (ConvertStage, or DisplayStage in band mode)
+        if (!sync_.yuv_ring.alloc(scaled_w, scaled_h, needs_scaling)) {
+            ESP_LOGE(TAG, "Failed to allocate YUV ring (%d x %u bytes)",
+                     kYuvRingSlots, (unsigned)YuvFrame::bytes_for(scaled_w, scaled_h, needs_scaling));
             goto signal_eos;
         }
-        ESP_LOGI(TAG, "Double buffer allocated: 2 x %d bytes in PSRAM",
-                 (int)(scaled_w * scaled_h * sizeof(uint16_t)));
-
-        xSemaphoreGive(sync_.display_done);
+        ESP_LOGI(TAG, "YUV ring allocated: %d x %u bytes in PSRAM",
+                 kYuvRingSlots, (unsigned)sync_.yuv_ring.slot_bytes());
 
         // Create H.264 decoder
         esp_h264_dec_cfg_t dec_cfg = {
@@ -109,7 +126,6 @@ void DecodeStage::run()
         esp_h264_err_t err = esp_h264_dec_sw_new(&dec_cfg, &decoder);
         if (err != ESP_H264_ERR_OK || !decoder) {
             ESP_LOGE(TAG, "Failed to create H.264 decoder: %d", err);
-            dbuf_.deinit();
             goto signal_eos;
         }
 
@@ -117,7 +133,6 @@ void DecodeStage::run()
         if (err != ESP_H264_ERR_OK) {
             ESP_LOGE(TAG, "Failed to open H.264 decoder: %d", err);
             esp_h264_dec_del(decoder);
-            dbuf_.deinit();
             goto signal_eos;
         }
 
@@ -125,36 +140,74 @@ void DecodeStage::run()
 
         unsigned decoded_frames = 0;
         unsigned skipped_frames = 0;
-        int64_t start_time = esp_timer_get_time();
-        bool stopped = false;
+        unsigned stale_frames   = 0;  // pre-seek NALs dropped undecoded
+        int64_t total_dec_us = 0, total_handoff_us = 0;
+        const int64_t loop_start = esp_timer_get_time();
+        int64_t start_time = loop_start;  // PTS 0 on the wall clock (moved by seeks)
+        uint32_t epoch = 0;
+        bool seek_pending = false;  // log latency at the first frame after a seek
+        bool track_start  = false;  // flag the next frame out: first of a gapless continuation
 
-        FrameMsg msg;
         while (true) {
             if (sync_.stop_requested) {
                 ESP_LOGI(TAG, "Stop requested, exiting decode loop");
-                stopped = true;
                 break;
             }
 
-            if (xQueueReceive(sync_.nal_queue, &msg, pdMS_TO_TICKS(500)) != pdTRUE) {
+            FrameMsg *msg = sync_.nal_ring.front(pdMS_TO_TICKS(500));
+            if (!msg) {
                 continue;  // will re-check stop_requested at top
             }
 
-            if (msg.eos) {
+            if (msg->eos) {
+                sync_.nal_ring.pop();
                 ESP_LOGI(TAG, "EOS received");
                 break;
             }
 
+            if (msg->track_start) {
+                // Gapless switch: the next file's SPS, right behind the last
+                // frame of this one.  The decoder just takes the new
+                // parameter sets; position and duration move over to it.
+                sync_.track_base_ms     = sync_.next_base_ms;
+                sync_.position_ms       = sync_.next_base_ms;
+                video_info_.duration_ms = sync_.next_duration_ms;
+                sync_.tracks_started    = sync_.tracks_started + 1;
+                xTaskNotifyGive(sync_.demux_task);  // may be waiting to take the next file
+                track_start = true;
+                ESP_LOGI(TAG, "Gapless switch to the next file at %d ms", (int)sync_.next_base_ms);
+            }
+
+            // The NAL is decoded straight from the ring; the slot is released
+            // once the decoder has consumed it.
+            const bool    is_sps_pps = msg->is_sps_pps;
+            const int64_t pts_us     = msg->pts_us;
+
+            if (!is_sps_pps && msg->epoch != epoch) {
+                if (msg->epoch != sync_.seek_epoch) {
+                    // Demuxed before the latest seek: drop without decoding
+                    sync_.nal_ring.pop();
+                    stale_frames++;
+                    continue;
+                }
+                // First NAL after a seek (an IDR): restart the clock from it
+                epoch        = msg->epoch;
+                start_time   = esp_timer_get_time() - pts_us;
+                seek_pending = true;
+            }
+
             esp_h264_dec_in_frame_t in_frame = {};
-            in_frame.raw_data.buffer = msg.data;
-            in_frame.raw_data.len = (uint32_t)msg.size;
+            in_frame.raw_data.buffer = msg->data;
+            in_frame.raw_data.len = (uint32_t)msg->size;
 
             esp_h264_dec_out_frame_t out_frame = {};
 
             while (in_frame.raw_data.len > 0) {
+                int64_t t0 = esp_timer_get_time();
                 err = esp_h264_dec_process(decoder, &in_frame, &out_frame);
+                total_dec_us += esp_timer_get_time() - t0;
                 if (err != ESP_H264_ERR_OK) {
-                    if (!msg.is_sps_pps) {
+                    if (!is_sps_pps) {
                         ESP_LOGW(TAG, "Decode error: %d", err);
                         skipped_frames++;
                     }
@@ -167,55 +220,64 @@ void DecodeStage::run()
                 in_frame.raw_data.len -= in_frame.consume;
 
                 if (out_frame.out_size > 0 && out_frame.outbuf) {
-                    // Wait for display with stop check
-                    while (xSemaphoreTake(sync_.display_done, pdMS_TO_TICKS(100)) != pdTRUE) {
+                    // Copy the frame out at display size and move straight on
+                    // to the next NAL; waits only if every slot is still queued.
+                    int64_t t0 = esp_timer_get_time();
+                    int slot;
+                    while ((slot = sync_.yuv_ring.acquire(pdMS_TO_TICKS(100))) == YuvRing::kTimeout) {
                         if (sync_.stop_requested) {
-                            psram_free(msg.data);
-                            stopped = true;
+                            sync_.nal_ring.pop();
                             goto exit_decode;
                         }
                     }
-
+                    YuvFrame &yuv = sync_.yuv_ring.slot(slot);
                     if (needs_scaling) {
-                        i420_to_rgb565_scaled(out_frame.outbuf, dbuf_.write_buf(),
-                                               video_w, video_h, scaled_w, scaled_h);
+                        i420_gather_to_frame(out_frame.outbuf, video_w, video_h,
+                                             video_info_.scale_map, yuv);
                     } else {
-                        i420_to_rgb565(out_frame.outbuf, dbuf_.write_buf(), video_w, video_h);
+                        i420_copy_to_frame(out_frame.outbuf, yuv);
+                    }
+                    sync_.yuv_ring.publish(slot, epoch, pts_us, track_start);
+                    track_start = false;
+                    total_handoff_us += esp_timer_get_time() - t0;
+                    sync_.position_ms = (int32_t)(pts_us / 1000);
+                    if (seek_pending) {
+                        seek_pending = false;
+                        ESP_LOGI(TAG, "Seek: first frame at %lld ms, %lld ms after request",
+                                 pts_us / 1000, (esp_timer_get_time() - sync_.seek_request_us) / 1000);
                     }
-
-                    dbuf_.swap();
-                    xSemaphoreGive(sync_.decode_ready);
 
                     decoded_frames++;
                 }
             }
 
-            psram_free(msg.data);
+            sync_.nal_ring.pop();
 
             // PTS timing (skip if stopping)
-            if (!sync_.stop_requested && !msg.is_sps_pps && msg.pts_us > 0) {
+            if (!sync_.stop_requested && !is_sps_pps && pts_us > 0) {
 #ifdef BOARD_HAS_AUDIO
                 if (sync_.audio_priority) {
-                    // Sync video display to audio playback position.
+                    // Sync video display to the sample at the DAC.
                     // Only slows video when ahead of audio; never adds
                     // delay when video is behind (high-res / high-fps safe).
-                    int32_t audio_ms = sync_.audio_playback_pts_ms;
-                    if (audio_ms >= 0) {
-                        int32_t delay_ms = (int32_t)(msg.pts_us / 1000) - audio_ms;
-                        if (delay_ms > 1 && delay_ms < 500) {
-                            vTaskDelay(pdMS_TO_TICKS(delay_ms));
-                        } else if (delay_ms >= 500) {
+                    int64_t audio_us = sync_.audio_clock.now_us();
+                    if (audio_us >= 0) {
+                        // Keep the wall-clock fallback aligned for when
+                        // audio ends first or a seek resets the clock
+                        start_time = esp_timer_get_time() - audio_us;
+                        int64_t delay_us = pts_us - audio_us;
+                        if (delay_us > 1000) {
                             // Safety cap: audio may be stalled
-                            vTaskDelay(pdMS_TO_TICKS(500));
+                            pace_delay_us(sync_, epoch, (delay_us < kMaxAudioPaceUs) ? delay_us : kMaxAudioPaceUs);
                         } else {
                             taskYIELD();
                         }
                     } else {
-                        // Audio not started yet — use wall clock
+                        // No audio at the DAC yet — use wall clock
                         int64_t elapsed_us = esp_timer_get_time() - start_time;
-                        int64_t delay_us = msg.pts_us - elapsed_us;
+                        int64_t delay_us = pts_us - elapsed_us;
                         if (delay_us > 1000) {
-                            vTaskDelay(pdMS_TO_TICKS(delay_us / 1000));
+                            pace_delay_us(sync_, epoch, delay_us);
                         } else {
                             taskYIELD();
                         }
@@ -225,9 +287,9 @@ void DecodeStage::run()
                 {
                     // full_video mode: use wall clock
                     int64_t elapsed_us = esp_timer_get_time() - start_time;
-                    int64_t delay_us = msg.pts_us - elapsed_us;
+                    int64_t delay_us = pts_us - elapsed_us;
                     if (delay_us > 1000) {
-                        vTaskDelay(pdMS_TO_TICKS(delay_us / 1000));
+                        pace_delay_us(sync_, epoch, delay_us);
                     } else {
                         vTaskDelay(1);
                     }
@@ -236,25 +298,27 @@ void DecodeStage::run()
         }
 
     exit_decode:
-        if (!stopped) {
-            xSemaphoreTake(sync_.display_done, pdMS_TO_TICKS(kFinalDisplayWaitMs));
-        }
-
-        int64_t total_time_us = esp_timer_get_time() - start_time;
+        int64_t total_time_us = esp_timer_get_time() - loop_start;
         float total_time_s = total_time_us / 1000000.0f;
         float avg_fps = (total_time_s > 0) ? decoded_frames / total_time_s : 0;
 
         ESP_LOGI(TAG, "Playback complete: %d decoded, %d skipped, %.1f sec, %.1f fps",
                  decoded_frames, skipped_frames, total_time_s, avg_fps);
+        if (stale_frames > 0) {
+            ESP_LOGI(TAG, "Dropped %u pre-seek NALs", stale_frames);
+        }
+        if (decoded_frames > 0) {
+            ESP_LOGI(TAG, "Core 1 per frame: h264=%lldus, yuv handoff=%lldus",
+                     total_dec_us / decoded_frames, total_handoff_us / decoded_frames);
+        }
 
         esp_h264_dec_close(decoder);
         esp_h264_dec_del(decoder);
-        dbuf_.deinit();
     }
 
 signal_eos:
-    sync_.pipeline_eos = true;
-    xSemaphoreGive(sync_.decode_ready);
+    // The converting stage forwards EOS (pipeline_eos) once it has drained the ring
+    sync_.yuv_ring.publish_eos();
     drain_queue();
 
     ESP_LOGI(TAG, "decode_task done");
@@ -1,8 +1,7 @@
 #include <cstdio>
 #include <cstring>
 #include <cstdlib>
-#include <fcntl.h>
-#include <unistd.h>
+#include <algorithm>
 
 #include "freertos/FreeRTOS.h"
 #include "freertos/task.h"
@@ -13,6 +12,10 @@
 
 #include "mp4_player.h"
 #include "board_config.h"
+#include "sample_index.h"
+#include "chunk_reader.h"
+#include "index_cache.h"
+#include "paged_index.h"
 
 // Redirect minimp4 allocations to PSRAM (internal RAM is too limited for large track data)
 #define malloc  mp4::psram_malloc
@@ -26,25 +29,29 @@
 
 static const char *TAG = "demux";
 
-// Check if sample is a sync sample (keyframe/IDR).
-// sample_index is 0-based; stss entries are 1-based and sorted ascending.
-static bool is_sync_sample(const MP4D_track_t *tr, unsigned sample_index)
+// Free minimp4's per-sample arrays once a SampleIndex has been built from them.
+// The index carries everything the demux loop needs; MP4D_close() skips NULLs.
+static void release_sample_tables(MP4D_track_t *tr)
 {
-    if (tr->sync_count == 0) return true;  // no stss box = all frames are sync
-    unsigned one_based = sample_index + 1;
-    for (unsigned i = 0; i < tr->sync_count; i++) {
-        if (tr->sync_samples[i] == one_based) return true;
-        if (tr->sync_samples[i] > one_based) break;
-    }
-    return false;
+    free(tr->entry_size);      tr->entry_size = NULL;
+    free(tr->sample_to_chunk); tr->sample_to_chunk = NULL;
+    free(tr->chunk_offset);    tr->chunk_offset = NULL;
+    free(tr->timestamp);       tr->timestamp = NULL;
+    free(tr->duration);        tr->duration = NULL;
+    free(tr->sync_samples);    tr->sync_samples = NULL;
 }
 
 namespace mp4 {
 
+// Stage tasks are resident for the player's lifetime: one run() per file
+// opened, then back to waiting for the next start bit.
 void DemuxStage::task_func(void *arg)
 {
     auto *self = static_cast<DemuxStage *>(arg);
-    self->run();
+    while (self->sync_.wait_start(PipelineSync::kDemuxDone)) {
+        self->run();
+        xEventGroupSetBits(self->sync_.task_done, PipelineSync::kDemuxDone);
+    }
     xEventGroupSetBits(self->sync_.task_done, PipelineSync::kDemuxDone);
     delete self;
     vTaskDelete(nullptr);
@@ -52,552 +59,739 @@ void DemuxStage::task_func(void *arg)
 
 int DemuxStage::mp4_read_cb(int64_t offset, void *buffer, size_t size, void *token)
 {
-    FILE *f = (FILE *)token;
-    if (fseek(f, (long)offset, SEEK_SET) != 0) return 1;
-    return (fread(buffer, 1, size, f) != size) ? 1 : 0;
+    auto *io = static_cast<TablePager *>(token);
+    return io->read_cached((uint64_t)offset, buffer, size) ? 0 : 1;
 }
 
-int DemuxStage::build_annex_b_nal(uint8_t *dst, int capacity,
-                                   const uint8_t *src, int size)
+int DemuxStage::avcc_to_annex_b(uint8_t *buf, int size)
 {
-    int dst_pos = 0;
-    int src_pos = 0;
-
-    while (src_pos < size) {
-        if (src_pos + 4 > size) break;
-
-        uint32_t nal_size = ((uint32_t)src[src_pos] << 24) |
-                            ((uint32_t)src[src_pos + 1] << 16) |
-                            ((uint32_t)src[src_pos + 2] << 8) |
-                            ((uint32_t)src[src_pos + 3]);
-        src_pos += 4;
-
-        if ((int)(src_pos + nal_size) > size) break;
-        if (dst_pos + 4 + (int)nal_size > capacity) break;
-
-        dst[dst_pos++] = 0x00;
-        dst[dst_pos++] = 0x00;
-        dst[dst_pos++] = 0x00;
-        dst[dst_pos++] = 0x01;
-
-        memcpy(dst + dst_pos, src + src_pos, nal_size);
-        dst_pos += nal_size;
-        src_pos += nal_size;
+    // AVCC length prefixes and Annex B start codes are both 4 bytes, so the
+    // conversion is an in-place overwrite of each prefix — no second buffer.
+    int pos = 0;
+    while (pos + 4 <= size) {
+        uint32_t nal_size = ((uint32_t)buf[pos] << 24) |
+                            ((uint32_t)buf[pos + 1] << 16) |
+                            ((uint32_t)buf[pos + 2] << 8) |
+                            ((uint32_t)buf[pos + 3]);
+        if (nal_size > (uint32_t)(size - pos - 4)) break;
+
+        buf[pos]     = 0x00;
+        buf[pos + 1] = 0x00;
+        buf[pos + 2] = 0x00;
+        buf[pos + 3] = 0x01;
+        pos += 4 + (int)nal_size;
     }
-    return dst_pos;
+    return pos;
 }
 
-bool DemuxStage::send_nal(const uint8_t *data, int size, int64_t pts_us, bool is_sps_pps)
+bool DemuxStage::send_parameter_set(const void *nal, int nal_bytes, bool track_start)
 {
-    uint8_t *buf = psram_alloc<uint8_t>(size);
-    if (!buf) {
-        ESP_LOGE(TAG, "Failed to allocate %d bytes for queue frame", size);
-        return false;
-    }
-    memcpy(buf, data, size);
-
-    FrameMsg msg = {};
-    msg.data = buf;
-    msg.size = size;
-    msg.pts_us = pts_us;
-    msg.is_sps_pps = is_sps_pps;
-    msg.eos = false;
-
-    if (xQueueSend(sync_.nal_queue, &msg, pdMS_TO_TICKS(kQueueSendTimeoutMs)) != pdTRUE) {
-        ESP_LOGE(TAG, "Queue send timeout");
-        psram_free(buf);
+    // SPS/PPS come from the avcC box in memory; prepend a start code while
+    // copying them into the ring.
+    FrameMsg *msg = sync_.nal_ring.reserve(nal_bytes + 4, pdMS_TO_TICKS(kQueueSendTimeoutMs));
+    if (!msg) {
+        ESP_LOGE(TAG, "NAL ring reserve timeout");
         return false;
     }
+    msg->data[0] = 0x00;
+    msg->data[1] = 0x00;
+    msg->data[2] = 0x00;
+    msg->data[3] = 0x01;
+    memcpy(msg->data + 4, nal, nal_bytes);
+    param_bytes_copied_ += nal_bytes;
+    msg->pts_us = 0;
+    msg->epoch  = sync_.seek_epoch;
+    msg->is_sps_pps = true;
+    msg->track_start = track_start;
+    sync_.nal_ring.commit();
     return true;
 }
 
-bool DemuxStage::send_video_frame(const uint8_t *data, int size, int64_t pts_us)
+bool DemuxStage::fetch_sample(ChunkReader &reader, uint32_t offset, unsigned size, uint8_t *dst,
+                              uint32_t other_offset)
 {
-    uint8_t *buf = psram_alloc<uint8_t>(size);
-    if (!buf) {
-        ESP_LOGE(TAG, "Failed to allocate %d bytes for video frame", size);
-        return false;
-    }
-    memcpy(buf, data, size);
-
-    FrameMsg msg = {};
-    msg.data = buf;
-    msg.size = size;
-    msg.pts_us = pts_us;
-    msg.is_sps_pps = false;
-    msg.eos = false;
-
-    if (xQueueSend(sync_.nal_queue, &msg, pdMS_TO_TICKS(kVideoSendTimeoutMs)) != pdTRUE) {
-        psram_free(buf);
+    // dst is the payload of a reserved ring record; the sample is copied
+    // there from the read-ahead ring (normally already buffered by the I/O
+    // task).  That is one PSRAM pass per sample byte, i.e. the stream's
+    // bitrate, traded for SD reads that never stall decode; the I/O task
+    // can't read into nal_ring itself because a 32 KB transfer spans
+    // samples of both tracks, and reserving ahead would pin ring space.
+    if (!reader.read(offset, size, dst, other_offset)) {
         return false;
     }
+    sample_bytes_copied_ += size;
     return true;
 }
 
-#ifdef BOARD_HAS_AUDIO
-bool DemuxStage::send_audio(const uint8_t *data, int size, int64_t pts_us)
+// Startup latency, logged once per play: demux start (file open) to the
+// first video frame in nal_ring.  Compare plays with and without a
+// current .mp4idx to see what the index cache saves.
+void DemuxStage::log_startup()
 {
-    uint8_t *buf = psram_alloc<uint8_t>(size);
-    if (!buf) {
-        ESP_LOGE(TAG, "Failed to alloc audio frame %d bytes", size);
-        return false;
-    }
-    memcpy(buf, data, size);
+    if (startup_logged_) return;
+    startup_logged_ = true;
+    ESP_LOGI(TAG, "Startup: first frame queued %lld ms after open (index from %s)",
+             (esp_timer_get_time() - open_start_us_) / 1000, index_cached_ ? "cache" : "moov");
+}
 
-    AudioMsg msg = {};
-    msg.data   = buf;
-    msg.size   = size;
-    msg.pts_us = pts_us;
-    msg.eos    = false;
+// Latch the pending seek and return the video sample to continue from: the
+// sync sample at or before the target, found by binary search (no decode
+// can start between keyframes).
+unsigned DemuxStage::apply_seek(const SampleIndex &v_index, uint32_t &epoch)
+{
+    epoch = sync_.seek_epoch;
+    int64_t  target_us = (int64_t)sync_.seek_target_ms * 1000;
+    unsigned target    = v_index.sample_at(target_us);
+    unsigned key       = v_index.keyframe_before(target);
+    ESP_LOGI(TAG, "Seek to %lld ms: sample %u -> keyframe %u at %lld ms (%lld us after request)",
+             target_us / 1000, target, key, v_index.pts_us(key) / 1000,
+             esp_timer_get_time() - sync_.seek_request_us);
+    return key;
+}
 
-    if (xQueueSend(sync_.audio_queue, &msg, pdMS_TO_TICKS(kAudioSendTimeoutMs)) != pdTRUE) {
-        ESP_LOGW(TAG, "Audio queue send timeout, skipping frame");
-        psram_free(buf);
-        return false;
-    }
-    return true;
+// Where a track's last sample ends: the tables carry no duration for it,
+// so repeat the step before it.
+static int64_t track_end_us(const SampleIndex &index)
+{
+    unsigned n = index.count();
+    if (n == 0) return 0;
+    int64_t last = index.pts_us(n - 1);
+    return (n > 1) ? 2 * last - index.pts_us(n - 2) : last;
 }
-#endif
 
 void DemuxStage::send_eos()
 {
-    // Use short timeout — if queues are full during stop, downstream
+    // Use short timeout — if rings are full during stop, downstream
     // stages will detect stop_requested and exit on their own.
     const TickType_t eos_timeout = pdMS_TO_TICKS(200);
 #ifdef BOARD_HAS_AUDIO
-    if (sync_.audio_queue) {
-        AudioMsg aeos = {};
-        aeos.eos = true;
-        if (xQueueSend(sync_.audio_queue, &aeos, eos_timeout) == pdTRUE) {
+    if (sync_.audio_ring.valid()) {
+        AudioMsg *aeos = sync_.audio_ring.reserve(0, eos_timeout);
+        if (aeos) {
+            aeos->eos = true;
+            sync_.audio_ring.commit();
             ESP_LOGI(TAG, "Audio EOS sent");
         } else {
             ESP_LOGW(TAG, "Audio EOS send timed out (stop in progress)");
         }
     }
 #endif
-    FrameMsg eos = {};
-    eos.eos = true;
-    if (xQueueSend(sync_.nal_queue, &eos, eos_timeout) == pdTRUE) {
+    FrameMsg *eos = sync_.nal_ring.reserve(0, eos_timeout);
+    if (eos) {
+        eos->eos = true;
+        sync_.nal_ring.commit();
         ESP_LOGI(TAG, "Video EOS sent");
     } else {
         ESP_LOGW(TAG, "Video EOS send timed out (stop in progress)");
     }
 }
 
-void DemuxStage::run()
+// Parse the moov box with minimp4 and build both sample indexes.  Codec
+// headers are copied into params so the demux context can be closed here;
+// the rest of the demux only needs the indexes.
+bool DemuxStage::parse_moov(MovieParams &params, SampleIndex &v_index, SampleIndex *a_index)
 {
-    ESP_LOGI(TAG, "demux_task started: %s", filepath_);
-
-    FILE *f = fopen(filepath_, "rb");
-    if (!f) {
+    // Block cache behind the read callback.  It was fseek + fread per call
+    // on an 8 KB stdio buffer, but newlib's fseek drops that buffer, so
+    // every byte minimp4 asked for became its own SD transaction.
+    TablePager io;
+    if (!io.open(filepath_, kMoovCacheBlocks, kMoovCacheBlockBytes)) {
         ESP_LOGE(TAG, "Failed to open file: %s", filepath_);
-        send_eos();
-        return;
+        return false;
     }
+    int64_t file_size = io.file_size();
+    ESP_LOGI(TAG, "File size: %lld bytes", file_size);
 
-    // Allocate stdio buffer from internal RAM (faster CPU access than PSRAM,
-    // avoids PSRAM bus contention with H.264 decoder on Core 1).
-    // With USE_MALLOC + ALWAYSINTERNAL=4096, setvbuf(NULL) would land in PSRAM.
-    char *f_stdio = static_cast<char*>(
-        heap_caps_malloc(kStdioBufSize, MALLOC_CAP_INTERNAL | MALLOC_CAP_8BIT));
-    if (f_stdio) {
-        setvbuf(f, f_stdio, _IOFBF, kStdioBufSize);
-    } else {
-        setvbuf(f, NULL, _IOFBF, kStdioBufSize);
+    int64_t t_open = esp_timer_get_time();
+    MP4D_demux_t mp4;
+    if (!MP4D_open(&mp4, mp4_read_cb, &io, file_size)) {
+        ESP_LOGE(TAG, "MP4D_open failed");
+        return false;
     }
-
-    {
-        fseek(f, 0, SEEK_END);
-        int64_t file_size = ftell(f);
-        fseek(f, 0, SEEK_SET);
-        ESP_LOGI(TAG, "File size: %lld bytes", file_size);
-
-        MP4D_demux_t mp4;
-        if (!MP4D_open(&mp4, mp4_read_cb, f, file_size)) {
-            ESP_LOGE(TAG, "MP4D_open failed");
-            fclose(f);
-            heap_caps_free(f_stdio);
-            send_eos();
-            return;
+    ESP_LOGI(TAG, "MP4D_open: %lld ms, %u callbacks for %llu KB, %u SD reads (%llu KB, %lld ms)",
+             (esp_timer_get_time() - t_open) / 1000, io.requests(), io.requested_bytes() / 1024,
+             io.faults(), io.fault_bytes() / 1024, io.fault_us() / 1000);
+    // Done with the file: MP4D_close only frees memory and doesn't use the
+    // read callback.  Samples are read through ChunkReader (POSIX fds).
+    io.close();
+
+    ESP_LOGI(TAG, "MP4 tracks: %d", mp4.track_count);
+
+    // Find H.264 video track
+    int video_track = -1;
+    for (unsigned i = 0; i < mp4.track_count; i++) {
+        if (mp4.track[i].handler_type == MP4D_HANDLER_TYPE_VIDE &&
+            mp4.track[i].object_type_indication == MP4_OBJECT_TYPE_AVC) {
+            video_track = i;
+            ESP_LOGI(TAG, "Found H.264 video track %d: %dx%d, %d samples",
+                     i,
+                     mp4.track[i].SampleDescription.video.width,
+                     mp4.track[i].SampleDescription.video.height,
+                     mp4.track[i].sample_count);
+            break;
         }
+    }
 
-        ESP_LOGI(TAG, "MP4 tracks: %d", mp4.track_count);
+    if (video_track < 0) {
+        ESP_LOGE(TAG, "No H.264 video track found");
+        MP4D_close(&mp4);
+        return false;
+    }
+
+    MP4D_track_t *tr = &mp4.track[video_track];
+    params.video_w = tr->SampleDescription.video.width;
+    params.video_h = tr->SampleDescription.video.height;
+
+    int sps_bytes = 0, pps_bytes = 0;
+    const void *sps = MP4D_read_sps(&mp4, video_track, 0, &sps_bytes);
+    const void *pps = MP4D_read_pps(&mp4, video_track, 0, &pps_bytes);
+    if (sps && sps_bytes > 0 && sps_bytes <= (int)kMaxParamSetBytes) {
+        memcpy(params.sps, sps, sps_bytes);
+        params.sps_bytes = sps_bytes;
+    }
+    if (pps && pps_bytes > 0 && pps_bytes <= (int)kMaxParamSetBytes) {
+        memcpy(params.pps, pps, pps_bytes);
+        params.pps_bytes = pps_bytes;
+    }
 
-        // Find H.264 video track
-        int video_track = -1;
+    int audio_track = -1;
+    if (a_index) {
         for (unsigned i = 0; i < mp4.track_count; i++) {
-            if (mp4.track[i].handler_type == MP4D_HANDLER_TYPE_VIDE &&
-                mp4.track[i].object_type_indication == MP4_OBJECT_TYPE_AVC) {
-                video_track = i;
-                ESP_LOGI(TAG, "Found H.264 video track %d: %dx%d, %d samples",
+            if (mp4.track[i].handler_type == MP4D_HANDLER_TYPE_SOUN &&
+                mp4.track[i].object_type_indication == MP4_OBJECT_TYPE_AUDIO_ISO_IEC_14496_3) {
+                audio_track = i;
+                ESP_LOGI(TAG, "Found AAC audio track %d: %d ch, %d Hz, %d samples",
                          i,
-                         mp4.track[i].SampleDescription.video.width,
-                         mp4.track[i].SampleDescription.video.height,
+                         mp4.track[i].SampleDescription.audio.channelcount,
+                         mp4.track[i].SampleDescription.audio.samplerate_hz,
                          mp4.track[i].sample_count);
                 break;
             }
         }
+        if (audio_track >= 0) {
+            MP4D_track_t *atr = &mp4.track[audio_track];
+            params.audio_rate     = atr->SampleDescription.audio.samplerate_hz;
+            params.audio_channels = atr->SampleDescription.audio.channelcount;
+            if (atr->dsi && atr->dsi_bytes > 0 && atr->dsi_bytes <= kMaxDsiBytes) {
+                memcpy(params.dsi, atr->dsi, atr->dsi_bytes);
+                params.dsi_bytes = atr->dsi_bytes;
+            }
+        } else {
+            ESP_LOGW(TAG, "No AAC audio track found, video-only playback");
+        }
+    }
 
-        if (video_track < 0) {
-            ESP_LOGE(TAG, "No H.264 video track found");
-            MP4D_close(&mp4);
-            fclose(f);
-            heap_caps_free(f_stdio);
-            send_eos();
-            return;
+    // Resolve every sample's offset/size/pts once, so the demux loop
+    // is O(1) per sample instead of re-walking sample_to_chunk.
+    int64_t t0 = esp_timer_get_time();
+    if (!v_index.build(mp4, video_track)) {
+        ESP_LOGE(TAG, "Failed to build video sample index");
+        MP4D_close(&mp4);
+        return false;
+    }
+    size_t index_bytes = v_index.memory_bytes();
+    if (audio_track >= 0) {
+        if (a_index->build(mp4, audio_track)) {
+            index_bytes += a_index->memory_bytes();
+            params.has_audio = true;
+        } else {
+            ESP_LOGW(TAG, "Failed to build audio sample index, video-only playback");
+            params.cacheable = false;
         }
+    }
+    // minimp4's own tables are no longer needed
+    for (unsigned i = 0; i < mp4.track_count; i++) {
+        release_sample_tables(&mp4.track[i]);
+    }
+    ESP_LOGI(TAG, "Sample index built: %u bytes in %lld ms",
+             (unsigned)index_bytes, (esp_timer_get_time() - t0) / 1000);
 
-        MP4D_track_t *tr = &mp4.track[video_track];
-        unsigned timescale = tr->timescale;
+    MP4D_close(&mp4);
+    return true;
+}
+
+// Long or fragmented movie: the sample tables (or the moof boxes) stay in
+// the file and are read through pager on demand; scan_moov() located them.
+// Nothing is written to the index cache; the pager must stay open for as
+// long as the indexes are used.
+bool DemuxStage::open_paged(TablePager &pager, const MoovTables &tables, MovieParams &params,
+                            SampleIndex &v_index, SampleIndex *a_index)
+{
+    auto open = [&](SampleIndex &index, const TrackTables &t) {
+        return tables.fragmented ? index.open_fragmented(pager, t, tables.fragments_start)
+                                 : index.open_paged(pager, t);
+    };
+    if (!open(v_index, tables.video)) {
+        ESP_LOGE(TAG, "Failed to open paged video sample index");
+        return false;
+    }
+    params.has_audio = false;
+    if (a_index && tables.has_audio) {
+        if (open(*a_index, tables.audio)) {
+            params.has_audio = true;
+        } else {
+            ESP_LOGW(TAG, "Failed to open paged audio sample index, video-only playback");
+        }
+    }
+    ESP_LOGI(TAG, "%s sample index: %u samples, %u bytes resident + %u KB page cache",
+             tables.fragmented ? "Fragmented" : "Paged", tables.total_samples(),
+             (unsigned)(v_index.memory_bytes() + (params.has_audio ? a_index->memory_bytes() : 0)),
+             (unsigned)(pager.memory_bytes() / 1024));
+    return true;
+}
+
+void DemuxStage::run()
+{
+    filepath_       = open_path_;
+    base_us_        = 0;
+    clock_start_us_ = 0;
+    has_audio_      = false;
+
+    bool complete = demux_file(false);
+    // Gapless playlist: the tail of the file just finished is still in the
+    // rings, so indexing the next one and reading its first GOP overlap
+    // playback, and its frames queue up right behind the last ones
+    while (complete && take_next()) {
+        complete = demux_file(true);
+    }
+    send_eos();
+}
+
+// Take the next playlist file from the mailbox, once decode has reached the
+// previous switch (next_base_ms / next_duration_ms are decode's until then).
+bool DemuxStage::take_next()
+{
+    while (sync_.tracks_started != sync_.tracks_queued) {
+        if (sync_.stop_requested) return false;
+        // Decode notifies when it reaches the switch, request_stop() and
+        // seek() notify too; any wake just re-checks
+        ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+    }
+    NextTrack next;
+    if (sync_.stop_requested || xQueueReceive(sync_.next_q, &next, 0) != pdTRUE) {
+        return false;
+    }
+    strlcpy(next_path_, next.path, sizeof(next_path_));
+    filepath_ = next_path_;
+    sync_.tracks_queued = sync_.tracks_queued + 1;
+    return true;
+}
+
+// Index and demux one file.  True if it was read to the end (not stopped
+// or failed), so playback may continue into the next one.  A continuation
+// keeps the first file's decoder, I2S format and timeline: it only
+// proceeds if the video size and audio format match.
+bool DemuxStage::demux_file(bool continuation)
+{
+    ESP_LOGI(TAG, "demux_task started: %s%s", filepath_, continuation ? " (gapless)" : "");
+    open_start_us_  = esp_timer_get_time();
+    startup_logged_ = false;
+    bytes_read_          = 0;
+    sample_bytes_copied_ = 0;
+    param_bytes_copied_  = 0;
+
+    {
+        // Sample tables + codec headers: from the sidecar index cache when
+        // it matches the movie, otherwise parsed from the moov box (and the
+        // cache written for the next play).
+        MovieParams params;
+        MoovTables  tables;
+        TablePager  pager;  // paged / fragmented only; outlives the indexes reading through it
+        SampleIndex v_index;
+#ifdef BOARD_HAS_AUDIO
+        SampleIndex a_index;
+        SampleIndex *a_out = &a_index;
+#else
+        SampleIndex *a_out = nullptr;
+#endif
+        index_cached_ = kIndexCacheEnabled && load_index_cache(filepath_, params, v_index, a_out);
+        bool paged = false;
+        if (!index_cached_) {
+            // Locating the tables is a handful of box-header reads; their
+            // entry counts decide between a resident and a paged index.
+            MovieParams scanned;
+            const bool located = pager.open(filepath_, kTablePageCount) &&
+                                 scan_moov(pager, a_out != nullptr, scanned, tables);
+            if (located && tables.fragmented) {
+                // Nothing to index up front: each moof is parsed when demux
+                // reaches it (minimp4 can't read these files at all)
+                paged = open_paged(pager, tables, scanned, v_index, a_out);
+                if (!paged) {
+                    return false;
+                }
+            } else if (located && tables.total_samples() >= kPagedIndexMinSamples) {
+                paged = open_paged(pager, tables, scanned, v_index, a_out);
+            }
+            if (!paged && !parse_moov(params, v_index, a_out)) {
+                // e.g. PSRAM exhausted by a resident index: page it instead
+                paged = located && open_paged(pager, tables, scanned, v_index, a_out);
+                if (!paged) {
+                    return false;
+                }
+            }
+            if (paged) {
+                params = scanned;
+            } else {
+                pager.close();
+                if (kIndexCacheEnabled && params.cacheable) {
+                    save_index_cache(filepath_, params, v_index, a_out);
+                }
+            }
+        }
+        ESP_LOGI(TAG, "Index ready (%s) %lld ms after open",
+                 index_cached_ ? "cache" : v_index.fragmented() ? "fragmented" : paged ? "paged" : "moov",
+                 (esp_timer_get_time() - open_start_us_) / 1000);
 
-        int vw = tr->SampleDescription.video.width;
-        int vh = tr->SampleDescription.video.height;
+        int vw = params.video_w;
+        int vh = params.video_h;
         if (vw <= 0 || vh <= 0) {
             ESP_LOGE(TAG, "Invalid video dimensions: %dx%d", vw, vh);
-            MP4D_close(&mp4);
-            fclose(f);
-            heap_caps_free(f_stdio);
-            send_eos();
-            return;
+            return false;
         }
         if (vw > BOARD_MAX_DECODE_WIDTH || vh > BOARD_MAX_DECODE_HEIGHT) {
             ESP_LOGE(TAG, "Video %dx%d exceeds max decode resolution %dx%d",
                      vw, vh, BOARD_MAX_DECODE_WIDTH, BOARD_MAX_DECODE_HEIGHT);
-            MP4D_close(&mp4);
-            fclose(f);
-            heap_caps_free(f_stdio);
-            send_eos();
-            return;
+            return false;
         }
-        video_info_.video_w = vw;
-        video_info_.video_h = vh;
+        // Fragmented: only what mehd declares (0 = unknown) without reading every moof
+        const int32_t duration_ms = v_index.fragmented()
+                                        ? (int32_t)(tables.fragmented_duration_us / 1000)
+                                        : (int32_t)(v_index.pts_us(v_index.count() - 1) / 1000);
         ESP_LOGI(TAG, "Video dimensions: %dx%d", vw, vh);
 
+        if (continuation) {
+            // Same YUV geometry, the same SPS (which also marks the switch)
+            // and the same AAC config and I2S format: the running decoders
+            // carry on.  Otherwise end here and let the controller restart
+            // the pipeline on this file (its index is cached by now)
+            bool same = vw == video_info_.video_w && vh == video_info_.video_h &&
+                        params.sps_bytes > 0 && params.sps_bytes == video_info_.sps_bytes &&
+                        memcmp(params.sps, video_info_.sps, params.sps_bytes) == 0;
 #ifdef BOARD_HAS_AUDIO
-        int audio_track = -1;
-        for (unsigned i = 0; i < mp4.track_count; i++) {
-            if (mp4.track[i].handler_type == MP4D_HANDLER_TYPE_SOUN &&
-                mp4.track[i].object_type_indication == MP4_OBJECT_TYPE_AUDIO_ISO_IEC_14496_3) {
-                audio_track = i;
-                ESP_LOGI(TAG, "Found AAC audio track %d: %d ch, %d Hz, %d samples",
-                         i,
-                         mp4.track[i].SampleDescription.audio.channelcount,
-                         mp4.track[i].SampleDescription.audio.samplerate_hz,
-                         mp4.track[i].sample_count);
-                break;
+            same = same && params.has_audio == has_audio_ &&
+                   (!has_audio_ || (params.audio_rate == audio_info_.sample_rate &&
+                                    params.audio_channels == audio_info_.channels &&
+                                    params.dsi_bytes == audio_info_.dsi_bytes &&
+                                    (params.dsi_bytes == 0 ||
+                                     memcmp(params.dsi, audio_info_.dsi, params.dsi_bytes) == 0)));
+#endif
+            if (!same) {
+                ESP_LOGI(TAG, "Next file differs in video size, SPS or audio config: no gapless switch");
+                return false;
             }
+            // Decode moves these over when it reaches the track_start SPS
+            sync_.next_base_ms     = (int32_t)(base_us_ / 1000);
+            sync_.next_duration_ms = duration_ms;
+        } else {
+            video_info_.video_w     = vw;
+            video_info_.video_h     = vh;
+            video_info_.duration_ms = duration_ms;
+            memcpy(video_info_.sps, params.sps, params.sps_bytes);
+            video_info_.sps_bytes   = params.sps_bytes;
         }
 
-        if (audio_track >= 0) {
-            MP4D_track_t *atr = &mp4.track[audio_track];
-            audio_info_.sample_rate = atr->SampleDescription.audio.samplerate_hz;
-            audio_info_.channels    = atr->SampleDescription.audio.channelcount;
-            if (atr->dsi && atr->dsi_bytes > 0) {
-                audio_info_.dsi = psram_alloc<uint8_t>(atr->dsi_bytes);
+#ifdef BOARD_HAS_AUDIO
+        const bool has_audio = params.has_audio;
+        if (!continuation && has_audio) {
+            audio_info_.sample_rate = params.audio_rate;
+            audio_info_.channels    = params.audio_channels;
+            if (params.dsi_bytes > 0) {
+                audio_info_.dsi = psram_alloc<uint8_t>(params.dsi_bytes);
                 if (audio_info_.dsi) {
-                    memcpy(audio_info_.dsi, atr->dsi, atr->dsi_bytes);
-                    audio_info_.dsi_bytes = atr->dsi_bytes;
+                    memcpy(audio_info_.dsi, params.dsi, params.dsi_bytes);
+                    audio_info_.dsi_bytes = params.dsi_bytes;
                 }
             }
-        } else {
-            ESP_LOGW(TAG, "No AAC audio track found, video-only playback");
         }
+        if (!continuation) has_audio_ = has_audio;
 #endif
 
-        // Allocate read/nal buffers
-        uint8_t *read_buf = psram_alloc<uint8_t>(kReadBufSize);
-        uint8_t *nal_buf  = psram_alloc<uint8_t>(kReadBufSize);
-
-        if (!read_buf || !nal_buf) {
-            ESP_LOGE(TAG, "Failed to allocate demux buffers in PSRAM");
-            safe_free(read_buf);
-            safe_free(nal_buf);
-            MP4D_close(&mp4);
-            fclose(f);
-            heap_caps_free(f_stdio);
-            send_eos();
-            return;
+        // Send SPS/PPS (a continuation's SPS carries the switch)
+        if (params.sps_bytes > 0) {
+            send_parameter_set(params.sps, params.sps_bytes, continuation);
+            ESP_LOGI(TAG, "SPS sent: %d bytes", params.sps_bytes);
         }
-
-        // Send SPS/PPS
-        int sps_bytes = 0, pps_bytes = 0;
-        const void *sps = MP4D_read_sps(&mp4, video_track, 0, &sps_bytes);
-        const void *pps = MP4D_read_pps(&mp4, video_track, 0, &pps_bytes);
-
-        if (sps && sps_bytes > 0) {
-            int nal_len = 0;
-            nal_buf[nal_len++] = 0x00;
-            nal_buf[nal_len++] = 0x00;
-            nal_buf[nal_len++] = 0x00;
-            nal_buf[nal_len++] = 0x01;
-            memcpy(nal_buf + nal_len, sps, sps_bytes);
-            nal_len += sps_bytes;
-            send_nal(nal_buf, nal_len, 0, true);
-            ESP_LOGI(TAG, "SPS sent: %d bytes", sps_bytes);
+        if (params.pps_bytes > 0) {
+            send_parameter_set(params.pps, params.pps_bytes, false);
+            ESP_LOGI(TAG, "PPS sent: %d bytes", params.pps_bytes);
         }
 
-        if (pps && pps_bytes > 0) {
-            int nal_len = 0;
-            nal_buf[nal_len++] = 0x00;
-            nal_buf[nal_len++] = 0x00;
-            nal_buf[nal_len++] = 0x00;
-            nal_buf[nal_len++] = 0x01;
-            memcpy(nal_buf + nal_len, pps, pps_bytes);
-            nal_len += pps_bytes;
-            send_nal(nal_buf, nal_len, 0, true);
-            ESP_LOGI(TAG, "PPS sent: %d bytes", pps_bytes);
+        // Read-ahead ring + I/O task shared by both tracks
+        ChunkReader reader;
+        if (!reader.open(filepath_, kPrefetchRingBytes, &sync_.stop_requested)) {
+            return false;
         }
+        bool complete = false;
 
-        // Done with FILE* — close it and switch to POSIX fd for frame reads.
-        // MP4D_close only frees memory and doesn't use the read callback.
-        // POSIX read() bypasses newlib's stdio layer which doesn't properly
-        // buffer VFS-backed files (fread triggers a full 8KB physical SD read
-        // on every call regardless of stdio buffer state).
-        fclose(f);
-        f = nullptr;
-        heap_caps_free(f_stdio);
-        f_stdio = nullptr;
-
-        int v_fd = open(filepath_, O_RDONLY);
-        if (v_fd < 0) {
-            ESP_LOGE(TAG, "Failed to open video fd");
-            psram_free(read_buf);
-            psram_free(nal_buf);
-            MP4D_close(&mp4);
-            send_eos();
-            return;
-        }
-
-        unsigned total_frames = tr->sample_count;
+        unsigned total_frames = v_index.count();
+        unsigned timescale = v_index.timescale();
+        unsigned sync_count = v_index.keyframe_count();
         const bool audio_prio = sync_.audio_priority;
         int64_t demux_wall_start = esp_timer_get_time();
         ESP_LOGI(TAG, "Starting demux: %d video frames, timescale=%u, sync_samples=%u, mode=%s",
-                 total_frames, timescale, tr->sync_count,
+                 total_frames, timescale, sync_count,
                  audio_prio ? "audio_priority" : "full_video");
-        if (tr->sync_count > 0 && timescale > 0) {
-            for (unsigned i = 0; i < tr->sync_count; i++) {
-                unsigned sample_idx = tr->sync_samples[i] - 1;  // 1-based to 0-based
-                unsigned ts = 0, dur = 0, bytes = 0;
-                MP4D_frame_offset(&mp4, video_track, sample_idx, &bytes, &ts, &dur);
-                float pts_sec = (float)ts / timescale;
-                ESP_LOGI(TAG, "  Keyframe[%u]: sample=%u, pts=%.2fs", i, tr->sync_samples[i], pts_sec);
+        if (kLogKeyframes && sync_count > 0 && timescale > 0) {
+            unsigned k = 0;
+            unsigned n = v_index.is_keyframe(0) ? 0 : v_index.next_keyframe(0);
+            for (; v_index.contains(n); n = v_index.next_keyframe(n)) {
+                float pts_sec = (float)v_index.timestamp(n) / timescale;
+                ESP_LOGI(TAG, "  Keyframe[%u]: sample=%u, pts=%.2fs", k++, n + 1, pts_sec);
             }
         }
 
 #ifdef BOARD_HAS_AUDIO
-        if (audio_track >= 0 && sync_.audio_queue) {
-            // Separate POSIX fd for audio reads — each fd maintains its own
-            // file position, so video/audio reads don't interfere.
-            int a_fd = open(filepath_, O_RDONLY);
-            bool separate_a_fd = (a_fd >= 0);
-            if (!separate_a_fd) {
-                ESP_LOGE(TAG, "Failed to open audio fd, sharing video fd");
-                a_fd = v_fd;  // fallback: share video fd (needs lseek every time)
-            }
-
-            MP4D_track_t *atr = &mp4.track[audio_track];
-            unsigned audio_timescale = atr->timescale;
-            unsigned total_audio_frames = atr->sample_count;
+        if (has_audio && sync_.audio_ring.valid()) {
+            unsigned audio_timescale = a_index.timescale();
+            unsigned total_audio_frames = a_index.count();
             ESP_LOGI(TAG, "Interleaved demux: %d audio frames, timescale=%u",
                      total_audio_frames, audio_timescale);
 
             unsigned v_sample = 0;
             unsigned a_sample = 0;
             unsigned v_skipped = 0;
-            int64_t demux_start_time = audio_prio ? esp_timer_get_time() : 0;
+            if (audio_prio && !continuation) clock_start_us_ = esp_timer_get_time();
+            uint32_t epoch = sync_.seek_epoch;
 
-            // File position tracking — skip fseek when already at the right offset.
-            // newlib fseek invalidates the stdio read buffer even for adjacent positions,
-            // forcing a full physical SD read on the next fread.  By tracking position
-            // and skipping unnecessary fseeks, sequential reads within MP4 chunks
-            // benefit from the 8KB stdio buffer (audio: ~21 frames per buffer fill).
-            int64_t f_pos = -1;   // video FILE position (-1 = unknown)
-            int64_t af_pos = -1;  // audio FILE position (-1 = unknown)
+            reader.restart(std::min(v_index.offset(0), a_index.offset(0)));
 
             // Timing instrumentation
             int64_t total_v_read_us = 0, total_a_read_us = 0;
             int64_t total_v_send_us = 0, total_a_send_us = 0;
             uint32_t v_sent = 0, a_sent = 0, a_dropped = 0;
-            uint32_t v_seeks = 0, v_seek_skips = 0;
-            uint32_t a_seeks = 0, a_seek_skips = 0;
 
-            while (v_sample < total_frames || a_sample < total_audio_frames) {
+            while (v_index.contains(v_sample) || a_index.contains(a_sample)) {
                 if (sync_.stop_requested) {
                     ESP_LOGI(TAG, "Stop requested, ending demux early");
                     break;
                 }
+                if (sync_.seek_epoch != epoch) {
+                    // Audio restarts at the keyframe's PTS so both streams
+                    // resume together; the wall-clock skip restarts from there.
+                    v_sample = apply_seek(v_index, epoch);
+                    int64_t key_pts = v_index.pts_us(v_sample);
+                    a_sample = a_index.sample_at(key_pts);
+                    clock_start_us_ = esp_timer_get_time() - (base_us_ + key_pts);
+                    reader.restart(std::min(v_index.offset(v_sample), a_index.offset(a_sample)));
+                }
                 int64_t v_pts = INT64_MAX;
                 int64_t a_pts = INT64_MAX;
-                unsigned v_bytes = 0, v_ts = 0, v_dur = 0;
-                unsigned a_bytes = 0, a_ts = 0, a_dur = 0;
-                MP4D_file_offset_t v_offset = 0, a_offset = 0;
-
-                if (v_sample < total_frames) {
-                    v_offset = MP4D_frame_offset(&mp4, video_track, v_sample,
-                                                  &v_bytes, &v_ts, &v_dur);
-                    v_pts = (timescale > 0) ? (int64_t)v_ts * 1000000LL / timescale : 0;
+                unsigned v_bytes = 0, a_bytes = 0;
+                uint32_t v_offset = 0, a_offset = 0;
+
+                const bool v_more = v_index.contains(v_sample);
+                const bool a_more = a_index.contains(a_sample);
+                if (v_more) {
+                    v_offset = v_index.offset(v_sample);
+                    v_bytes  = v_index.size(v_sample);
+                    v_pts    = v_index.pts_us(v_sample);
                 }
-                if (a_sample < total_audio_frames) {
-                    a_offset = MP4D_frame_offset(&mp4, audio_track, a_sample,
-                                                  &a_bytes, &a_ts, &a_dur);
-                    a_pts = (audio_timescale > 0) ? (int64_t)a_ts * 1000000LL / audio_timescale : 0;
+                if (a_more) {
+                    a_offset = a_index.offset(a_sample);
+                    a_bytes  = a_index.size(a_sample);
+                    a_pts    = a_index.pts_us(a_sample);
                 }
 
-                bool do_video = (v_sample < total_frames) &&
-                                (v_pts <= a_pts || a_sample >= total_audio_frames);
+                bool do_video = v_more && (v_pts <= a_pts || !a_more);
 
                 if (do_video) {
                     if (audio_prio) {
-                        // Audio priority: wall-clock skip + short timeout send
+                        // Audio priority: playback-clock skip + short timeout
+                        // send.  The clock is the audio at the DAC once there
+                        // is any, the wall clock (kept aligned to it) before.
                         if (v_pts > 0) {
-                            int64_t wall_us = esp_timer_get_time() - demux_start_time;
-                            if (wall_us - v_pts > kDemuxSkipThresholdUs &&
-                                !is_sync_sample(tr, v_sample)) {
-                                v_sample++;
-                                v_skipped++;
+                            int64_t now_us = sync_.audio_clock.now_us();
+                            if (now_us >= 0) {
+                                clock_start_us_ = esp_timer_get_time() - now_us;
+                            } else {
+                                now_us = esp_timer_get_time() - clock_start_us_;
+                            }
+                            if (now_us - (base_us_ + v_pts) > kDemuxSkipThresholdUs &&
+                                !v_index.is_keyframe(v_sample)) {
+                                // The rest of the GOP references this frame,
+                                // so resume at the next IDR in one step.
+                                unsigned next = v_index.next_keyframe(v_sample);
+                                v_skipped += next - v_sample;
+                                v_sample = next;
                                 continue;
                             }
                         }
                     }
-                    if (v_bytes == 0 || v_bytes > kReadBufSize) {
+                    if (v_bytes == 0 || v_bytes > kMaxSampleSize) {
                         v_sample++;
                         continue;
                     }
+                    // Reserve ring space first: when audio-priority playback
+                    // can't keep up, the frame is skipped without touching SD.
                     int64_t t0 = esp_timer_get_time();
-                    if (f_pos != (int64_t)v_offset) {
-                        v_seeks++;
-                        lseek(v_fd, (off_t)v_offset, SEEK_SET);
-                    } else {
-                        v_seek_skips++;
+                    TickType_t v_timeout = pdMS_TO_TICKS(audio_prio ? kVideoSendTimeoutMs
+                                                                    : kQueueSendTimeoutMs);
+                    FrameMsg *vmsg = sync_.nal_ring.reserve(v_bytes, v_timeout);
+                    total_v_send_us += esp_timer_get_time() - t0;
+                    if (!vmsg) {
+                        if (audio_prio) {
+                            v_sample++;
+                            v_skipped++;
+                            continue;
+                        }
+                        ESP_LOGE(TAG, "Failed to send video frame %d", v_sample);
+                        break;
                     }
-                    if (read(v_fd, read_buf, v_bytes) != (ssize_t)v_bytes) {
+                    t0 = esp_timer_get_time();
+                    uint32_t a_next = a_more ? a_offset : UINT32_MAX;
+                    if (!fetch_sample(reader, v_offset, v_bytes, vmsg->data, a_next)) {
                         ESP_LOGE(TAG, "Failed to read video frame %d", v_sample);
                         break;
                     }
-                    f_pos = (int64_t)v_offset + v_bytes;
                     total_v_read_us += esp_timer_get_time() - t0;
-                    int nal_size = build_annex_b_nal(nal_buf, kReadBufSize, read_buf, v_bytes);
+                    int nal_size = avcc_to_annex_b(vmsg->data, v_bytes);
                     if (nal_size <= 0) {
-                        v_sample++;
+                        v_sample++;  // reservation is dropped, not committed
                         continue;
                     }
-                    t0 = esp_timer_get_time();
-                    if (audio_prio) {
-                        if (!send_video_frame(nal_buf, nal_size, v_pts)) {
-                            total_v_send_us += esp_timer_get_time() - t0;
-                            v_sample++;
-                            v_skipped++;
-                            continue;
-                        }
-                    } else {
-                        if (!send_nal(nal_buf, nal_size, v_pts, false)) {
-                            ESP_LOGE(TAG, "Failed to send video frame %d", v_sample);
-                            break;
-                        }
-                    }
-                    total_v_send_us += esp_timer_get_time() - t0;
+                    vmsg->size   = nal_size;
+                    vmsg->pts_us = base_us_ + v_pts;
+                    vmsg->epoch  = epoch;
+                    sync_.nal_ring.commit();
+                    if (v_sent == 0) log_startup();
                     v_sent++;
                     v_sample++;
                 } else {
-                    if (a_bytes == 0 || a_bytes > kReadBufSize) {
+                    if (a_bytes == 0 || a_bytes > kMaxSampleSize) {
                         a_sample++;
                         continue;
                     }
                     int64_t t0 = esp_timer_get_time();
-                    if (af_pos != (int64_t)a_offset) {
-                        a_seeks++;
-                        lseek(a_fd, (off_t)a_offset, SEEK_SET);
-                    } else {
-                        a_seek_skips++;
+                    AudioMsg *amsg = sync_.audio_ring.reserve(a_bytes, pdMS_TO_TICKS(kAudioSendTimeoutMs));
+                    total_a_send_us += esp_timer_get_time() - t0;
+                    if (!amsg) {
+                        if (sync_.stop_requested) break;  // ring cancelled
+                        ESP_LOGW(TAG, "Audio ring full, skipping frame");
+                        a_dropped++;
+                        a_sample++;
+                        continue;
                     }
-                    if (read(a_fd, read_buf, a_bytes) != (ssize_t)a_bytes) {
+                    t0 = esp_timer_get_time();
+                    uint32_t v_next = v_more ? v_offset : UINT32_MAX;
+                    if (!fetch_sample(reader, a_offset, a_bytes, amsg->data, v_next)) {
                         ESP_LOGE(TAG, "Failed to read audio frame %d", a_sample);
                         break;
                     }
-                    af_pos = (int64_t)a_offset + a_bytes;
                     total_a_read_us += esp_timer_get_time() - t0;
-                    t0 = esp_timer_get_time();
-                    if (!send_audio(read_buf, a_bytes, a_pts)) {
-                        total_a_send_us += esp_timer_get_time() - t0;
-                        a_dropped++;
-                        a_sample++;
-                        continue;
-                    }
-                    total_a_send_us += esp_timer_get_time() - t0;
+                    amsg->pts_us = base_us_ + a_pts;
+                    amsg->epoch  = epoch;
+                    sync_.audio_ring.commit();
                     a_sent++;
                     a_sample++;
                 }
             }
+            complete = !sync_.stop_requested &&
+                       !v_index.contains(v_sample) && !a_index.contains(a_sample);
             if (v_skipped > 0) {
-                ESP_LOGI(TAG, "Demux video frames skipped: %u / %u", v_skipped, total_frames);
+                ESP_LOGI(TAG, "Demux video frames skipped: %u / %u", v_skipped, v_index.count());
             }
             ESP_LOGI(TAG, "Demux timing: v_read=%lldms a_read=%lldms v_send=%lldms a_send=%lldms",
                      total_v_read_us / 1000, total_a_read_us / 1000,
                      total_v_send_us / 1000, total_a_send_us / 1000);
             ESP_LOGI(TAG, "Demux counts: v_sent=%u v_skip=%u a_sent=%u a_drop=%u",
                      v_sent, v_skipped, a_sent, a_dropped);
-            ESP_LOGI(TAG, "Demux seeks: v_seek=%u v_skip=%u a_seek=%u a_skip=%u",
-                     v_seeks, v_seek_skips, a_seeks, a_seek_skips);
-            if (separate_a_fd) {
-                close(a_fd);
-            }
         } else
 #endif
         {
             // Video-only: always blocking (no real-time constraint)
-            int64_t f_pos = -1;  // track file position to skip redundant fseeks
-            for (unsigned sample = 0; sample < total_frames; sample++) {
+            uint32_t epoch = sync_.seek_epoch;
+            reader.restart(v_index.offset(0));
+            unsigned sample = 0;
+            for (; v_index.contains(sample); sample++) {
                 if (sync_.stop_requested) {
                     ESP_LOGI(TAG, "Stop requested, ending demux early");
                     break;
                 }
-                unsigned frame_bytes = 0;
-                unsigned timestamp = 0;
-                unsigned duration = 0;
-
-                MP4D_file_offset_t offset = MP4D_frame_offset(&mp4, video_track, sample,
-                                                               &frame_bytes, &timestamp, &duration);
-
-                int64_t pts_us = (timescale > 0) ? (int64_t)timestamp * 1000000LL / timescale : 0;
+                if (sync_.seek_epoch != epoch) {
+                    sample = apply_seek(v_index, epoch);
+                    reader.restart(v_index.offset(sample));
+                }
+                uint32_t offset      = v_index.offset(sample);
+                unsigned frame_bytes = v_index.size(sample);
+                int64_t  pts_us      = v_index.pts_us(sample);
 
-                if (frame_bytes == 0 || frame_bytes > kReadBufSize) {
+                if (frame_bytes == 0 || frame_bytes > kMaxSampleSize) {
                     ESP_LOGW(TAG, "Frame %d: invalid size %d, skipping", sample, frame_bytes);
-                    f_pos = -1;  // position unknown after skip
                     continue;
                 }
 
-                if (f_pos != (int64_t)offset) {
-                    lseek(v_fd, (off_t)offset, SEEK_SET);
+                FrameMsg *vmsg = sync_.nal_ring.reserve(frame_bytes, pdMS_TO_TICKS(kQueueSendTimeoutMs));
+                if (!vmsg) {
+                    ESP_LOGE(TAG, "Failed to send frame %d", sample);
+                    break;
                 }
-                if (read(v_fd, read_buf, frame_bytes) != (ssize_t)frame_bytes) {
+                if (!fetch_sample(reader, offset, frame_bytes, vmsg->data, UINT32_MAX)) {
                     ESP_LOGE(TAG, "Failed to read frame %d", sample);
                     break;
                 }
-                f_pos = (int64_t)offset + frame_bytes;
 
-                int nal_size = build_annex_b_nal(nal_buf, kReadBufSize, read_buf, frame_bytes);
+                int nal_size = avcc_to_annex_b(vmsg->data, frame_bytes);
                 if (nal_size <= 0) {
                     ESP_LOGW(TAG, "Frame %d: AVCC to Annex B conversion failed", sample);
                     continue;
                 }
-
-                if (!send_nal(nal_buf, nal_size, pts_us, false)) {
-                    ESP_LOGE(TAG, "Failed to send frame %d", sample);
-                    break;
-                }
+                vmsg->size   = nal_size;
+                vmsg->pts_us = base_us_ + pts_us;
+                vmsg->epoch  = epoch;
+                sync_.nal_ring.commit();
+                log_startup();
             }
+            complete = !sync_.stop_requested && !v_index.contains(sample);
         }
 
         int64_t demux_wall_elapsed = esp_timer_get_time() - demux_wall_start;
         ESP_LOGI(TAG, "Demux finished: %lld ms wall time", demux_wall_elapsed / 1000);
+        bool tables_failed = v_index.failed();
+#ifdef BOARD_HAS_AUDIO
+        if (params.has_audio) tables_failed = tables_failed || a_index.failed();
+#endif
+        if (tables_failed) {
+            // contains() reported the end early: the file is not done
+            ESP_LOGE(TAG, "Sample table read failed, movie ended early");
+            complete = false;
+        }
+        bytes_read_ = reader.bytes();
+        if (reader.transactions() > 0) {
+            ESP_LOGI(TAG, "SD reads: %u transactions, avg %u bytes each, %lld ms in read() (I/O task)",
+                     reader.transactions(), (unsigned)(reader.bytes() / reader.transactions()),
+                     reader.read_us() / 1000);
+            ESP_LOGI(TAG, "Read-ahead: %u KB ring, demux stalls=%u (%lld ms), restarts=%u, "
+                     "direct reads=%u, buffered ahead min=%u KB avg=%u KB",
+                     (unsigned)(reader.capacity() / 1024), reader.stalls(), reader.stall_us() / 1000,
+                     reader.restarts(), reader.direct_reads(),
+                     (unsigned)(reader.min_ahead() / 1024), (unsigned)(reader.avg_ahead() / 1024));
+        }
+        if (demux_wall_elapsed > 0) {
+            ESP_LOGI(TAG, "Demux bytes: read=%llu KB (%llu KB/s), copied from read-ahead=%llu KB "
+                     "(%llu KB/s), SPS/PPS copied=%llu bytes (all that direct reads copied)",
+                     bytes_read_ / 1024, bytes_read_ * 1000000ULL / demux_wall_elapsed / 1024,
+                     sample_bytes_copied_ / 1024,
+                     sample_bytes_copied_ * 1000000ULL / demux_wall_elapsed / 1024,
+                     param_bytes_copied_);
+        }
 
-        close(v_fd);
-        psram_free(read_buf);
-        psram_free(nal_buf);
-        MP4D_close(&mp4);
-    }
+        if (paged) {
+            ESP_LOGI(TAG, "Table pages: %u faults (%lld ms), %u hits",
+                     pager.faults(), pager.fault_us() / 1000, pager.hits());
+        }
 
-    send_eos();
+        reader.close();
+
+        if (complete) {
+            // The next file (if any) starts where this one ends
+            int64_t end_us = track_end_us(v_index);
+#ifdef BOARD_HAS_AUDIO
+            if (params.has_audio) end_us = std::max(end_us, track_end_us(a_index));
+#endif
+            base_us_ += end_us;
+        }
+        return complete;
+    }
 }
 
 }  // namespace mp4
@@ -1,8 +1,11 @@
 #include "freertos/FreeRTOS.h"
 #include "freertos/task.h"
 #include "esp_log.h"
+#include "esp_timer.h"
+#include "esp_cpu.h"
 
 #include "mp4_player.h"
+#include "yuv2rgb.h"
 
 static const char *TAG = "display";
 
@@ -11,37 +14,224 @@ namespace mp4 {
 void DisplayStage::task_func(void *arg)
 {
     auto *self = static_cast<DisplayStage *>(arg);
-    self->run();
+    while (self->sync_.wait_start(PipelineSync::kDisplayDone)) {
+        self->run();
+        xEventGroupSetBits(self->sync_.task_done, PipelineSync::kDisplayDone);
+    }
     xEventGroupSetBits(self->sync_.task_done, PipelineSync::kDisplayDone);
     delete self;
     vTaskDelete(nullptr);
 }
 
+// Wait for the in-flight DMA and hand its buffer back to decode.
+void DisplayStage::finish_transfer()
+{
+    int64_t t0 = esp_timer_get_time();
+    display_.waitDMA();
+    int64_t wait_us = esp_timer_get_time() - t0;
+    total_wait_us_ += wait_us;
+    ESP_LOGD(TAG, "frame %u: issue=%lldus, next ready after %lldus, dma wait=%lldus",
+             frames_, last_issue_us_, t0 - push_start_us_, wait_us);
+    xSemaphoreGive(sync_.display_done);
+}
+
+// Called as each frame starts going out to the LCD.  Logs the gap at a
+// track change: the last frame of one file to the first of the next, and
+// samples how far the frame is from the audio at the DAC.
+void DisplayStage::note_shown(bool track_start, int64_t pts_us)
+{
+    const int64_t now = esp_timer_get_time();
+#ifdef BOARD_HAS_AUDIO
+    int64_t audio_us = sync_.audio_clock.now_us();
+    if (audio_us >= 0) av_offset_.add(pts_us - audio_us);
+#endif
+    if (track_start && frames_ > 1) {
+        ESP_LOGI(TAG, "Track change (gapless): LCD gap %lld ms, avg frame interval %lld ms",
+                 (now - last_shown_us_) / 1000,
+                 (last_shown_us_ - first_shown_us_) / (frames_ - 1) / 1000);
+    } else if (frames_ == 0 && prev_last_shown_us_ > 0) {
+        // Previous file played to the end and the pipeline was restarted
+        ESP_LOGI(TAG, "Track change (pipeline restart): LCD gap %lld ms",
+                 (now - prev_last_shown_us_) / 1000);
+    }
+    if (frames_ == 0) {
+        first_shown_us_ = now;
+        prev_last_shown_us_ = 0;
+    }
+    last_shown_us_ = now;
+}
+
+void DisplayStage::log_av_offset()
+{
+#ifdef BOARD_HAS_AUDIO
+    const AvOffsetStats &s = av_offset_;
+    if (s.count > 0) {
+        ESP_LOGI(TAG, "A/V offset (video - audio) over %u frames: avg %+.1f ms, "
+                 "mean |offset| %.1f ms, range %+.1f .. %+.1f ms",
+                 s.count, s.sum_us / 1000.0 / s.count, s.abs_sum_us / 1000.0 / s.count,
+                 s.min_us / 1000.0, s.max_us / 1000.0);
+    }
+#endif
+}
+
 void DisplayStage::run()
 {
     ESP_LOGI(TAG, "display_task started");
+    frames_         = 0;
+    busy_on_ready_  = 0;
+    total_issue_us_ = 0;
+    total_wait_us_  = 0;
+    last_shown_us_  = 0;
+#ifdef BOARD_HAS_AUDIO
+    av_offset_.reset();
+#endif
     display_.fillScreen(TFT_BLACK);
 
+    if (kBandRenderLines > 0) {
+        run_bands();
+        display_.fillScreen(TFT_BLACK);
+        prev_last_shown_us_ = sync_.stop_requested ? 0 : last_shown_us_;
+        log_av_offset();
+        ESP_LOGI(TAG, "display_task done");
+        return;
+    }
+
+    // Keep the SPI bus claimed for the whole playback so pushImageDMA()
+    // returns as soon as the transfer is queued.  A frame's buffer is only
+    // released when the next frame arrives (or at EOS); by then the DMA has
+    // normally finished, so ConvertStage fills frame N+1 while frame N is
+    // still being clocked out.
+    display_.startWrite();
+
+    int  idx       = 0;
+    bool in_flight = false;
     while (true) {
         if (xSemaphoreTake(sync_.decode_ready, pdMS_TO_TICKS(500)) != pdTRUE) {
-            if (sync_.pipeline_eos || sync_.stop_requested) break;
+            if (sync_.convert_eos || sync_.stop_requested) break;
             continue;
         }
 
-        if (sync_.pipeline_eos) break;
+        if (in_flight) {
+            if (display_.dmaBusy()) busy_on_ready_++;
+            finish_transfer();
+            in_flight = false;
+        }
 
-        display_.pushImage(video_info_.display_x, video_info_.display_y,
-                           video_info_.scaled_w, video_info_.scaled_h,
-                           dbuf_.read_buf());
+        // EOS and stop give decode_ready with no frame behind it
+        if (sync_.convert_eos || sync_.stop_requested) break;
 
-        xSemaphoreGive(sync_.display_done);
+        // Frames are already in panel byte order: straight DMA, no pixel conversion
+        note_shown(dbuf_.track_start(idx), dbuf_.pts_us(idx));
+        push_start_us_ = esp_timer_get_time();
+        display_.pushImageDMA(video_info_.display_x, video_info_.display_y,
+                              video_info_.scaled_w, video_info_.scaled_h,
+                              reinterpret_cast<const lgfx::swap565_t *>(dbuf_.buf(idx)));
+        last_issue_us_   = esp_timer_get_time() - push_start_us_;
+        total_issue_us_ += last_issue_us_;
+        idx ^= 1;
+        in_flight = true;
+        frames_++;
     }
 
-    // Unblock decode stage if it's waiting for display_done
+    if (in_flight) {
+        finish_transfer();
+    }
+    display_.endWrite();
+
+    // Unblock convert stage if it's waiting for display_done
     xSemaphoreGive(sync_.display_done);
     display_.fillScreen(TFT_BLACK);
+    prev_last_shown_us_ = sync_.stop_requested ? 0 : last_shown_us_;
 
+    if (frames_ > 0) {
+        ESP_LOGI(TAG, "Display: %u frames, avg issue=%lldus dma_wait=%lldus, "
+                 "next frame converted during DMA: %u",
+                 frames_, total_issue_us_ / frames_, total_wait_us_ / frames_, busy_on_ready_);
+    }
+    log_av_offset();
     ESP_LOGI(TAG, "display_task done");
 }
 
+// Strip rendering: take decoded frames straight from the YUV ring, convert
+// kBandRenderLines output lines at a time into one of two internal-RAM
+// buffers and DMA it while the next band is converted.  The RGB565 frame
+// never exists in PSRAM.  Display is the last video stage here, so it also
+// forwards EOS (pipeline_eos).
+void DisplayStage::run_bands()
+{
+    uint16_t *bands[2] = {nullptr, nullptr};
+    int band = 0;  // ping-pong index, kept across frames
+    int64_t total_convert_us = 0;
+    uint64_t convert_cycles = 0, pixels = 0;
+
+    display_.startWrite();
+
+    while (true) {
+        int slot = sync_.yuv_ring.receive(pdMS_TO_TICKS(500));
+        if (slot == YuvRing::kTimeout) {
+            if (sync_.stop_requested) break;
+            continue;
+        }
+        if (slot == YuvRing::kEos) break;
+        if (sync_.yuv_ring.epoch(slot) != sync_.seek_epoch) {
+            sync_.yuv_ring.release(slot);  // decoded before a seek: never shown
+            continue;
+        }
+
+        note_shown(sync_.yuv_ring.track_start(slot), sync_.yuv_ring.pts_us(slot));
+        const YuvFrame &yuv = sync_.yuv_ring.slot(slot);
+        const int w = yuv.width;
+        const int h = yuv.height;
+        if (!bands[0]) {
+            size_t band_bytes = (size_t)w * kBandRenderLines * sizeof(uint16_t);
+            bands[0] = static_cast<uint16_t *>(dma_malloc(band_bytes));
+            bands[1] = static_cast<uint16_t *>(dma_malloc(band_bytes));
+            if (!bands[0] || !bands[1]) {
+                ESP_LOGE(TAG, "Failed to allocate band buffers (2 x %u bytes internal)",
+                         (unsigned)band_bytes);
+                sync_.yuv_ring.release(slot);
+                sync_.abort_file();
+                break;
+            }
+            ESP_LOGI(TAG, "Band buffers: 2 x %u bytes internal DMA RAM", (unsigned)band_bytes);
+        }
+
+        int64_t t0 = esp_timer_get_time();
+        for (int row = 0; row < h; row += kBandRenderLines) {
+            int rows = (h - row < kBandRenderLines) ? h - row : kBandRenderLines;
+            // bands[band] was queued two pushes ago; the SPI bus completes a
+            // transfer before starting the next one, so it is free by now.
+            esp_cpu_cycle_count_t c0 = esp_cpu_get_cycle_count();
+            yuv_frame_to_rgb565_band(yuv, bands[band], row, rows, kSwap565Lut);
+            convert_cycles += (uint32_t)(esp_cpu_get_cycle_count() - c0);
+            display_.pushImageDMA(video_info_.display_x, video_info_.display_y + row, w, rows,
+                                  reinterpret_cast<const lgfx::swap565_t *>(bands[band]));
+            band ^= 1;
+        }
+        total_convert_us += esp_timer_get_time() - t0;
+        pixels += (uint64_t)w * h;
+        frames_++;
+
+        // Every band is converted: the slot can be refilled by decode
+        sync_.yuv_ring.release(slot);
+    }
+
+    display_.waitDMA();
+    display_.endWrite();
+    safe_free(bands[0]);
+    safe_free(bands[1]);
+
+    sync_.pipeline_eos = true;
+    int slot;
+    while ((slot = sync_.yuv_ring.receive(0)) != YuvRing::kTimeout && slot != YuvRing::kEos) {
+        sync_.yuv_ring.release(slot);
+    }
+
+    if (frames_ > 0) {
+        ESP_LOGI(TAG, "Display (bands): %u frames, avg convert+push=%lldus/frame, "
+                 "YUV->RGB565 %u cycles/pixel",
+                 frames_, total_convert_us / frames_, (unsigned)(convert_cycles / pixels));
+    }
+}
+
 }  // namespace mp4
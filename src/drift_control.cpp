@@ -0,0 +1,93 @@
+#include "drift_control.h"
+
+namespace mp4 {
+
+namespace {
+
+constexpr float kTauS = kDriftTimeConstantMs / 1000.0f;
+constexpr float kKp   = 2.0f / kTauS;             // ppm per µs of drift
+constexpr float kKi   = 1.0f / (kTauS * kTauS);   // ppm per µs·s
+
+inline float clampf(float v, float lim)
+{
+    return (v > lim) ? lim : (v < -lim) ? -lim : v;
+}
+
+}  // namespace
+
+// --- DriftController ---
+
+void DriftController::reset()
+{
+    *this = DriftController();
+}
+
+int DriftController::update(int64_t audio_us, int64_t ref_us)
+{
+    if (audio_us < 0) {
+        anchored_ = false;
+    } else if (!anchored_) {
+        anchored_    = true;
+        audio0_us_   = audio_us;
+        ref0_us_     = ref_us;
+        last_ref_us_ = ref_us;
+        drift_us_    = 0;
+    } else {
+        const int64_t drift = (audio_us - audio0_us_) - (ref_us - ref0_us_);
+        if (drift > kDriftResyncUs || drift < -kDriftResyncUs) {
+            resyncs_++;
+            anchored_ = false;
+            return update(audio_us, ref_us);
+        }
+        const float dt_s = (ref_us - last_ref_us_) / 1e6f;
+        last_ref_us_  = ref_us;
+        drift_us_     = drift;
+        integral_ppm_ = clampf(integral_ppm_ + kKi * (float)drift * dt_s, (float)kDriftMaxPpm);
+        const int64_t abs_drift = (drift < 0) ? -drift : drift;
+        if (abs_drift > max_drift_us_) max_drift_us_ = abs_drift;
+    }
+
+    const float u = anchored_ ? kKp * (float)drift_us_ + integral_ppm_ : integral_ppm_;
+    ppm_ = (int)-clampf(u, (float)kDriftMaxPpm);
+    if (ppm_ < min_ppm_) min_ppm_ = ppm_;
+    if (ppm_ > max_ppm_) max_ppm_ = ppm_;
+    return ppm_;
+}
+
+// --- Resampler ---
+
+void Resampler::reset(unsigned channels)
+{
+    channels_ = (channels == 1) ? 1 : 2;
+    pos_      = 0;
+    last_[0]  = 0;
+    last_[1]  = 0;
+}
+
+size_t Resampler::process(const int16_t *in, size_t in_frames, int16_t *out, size_t out_frames, int ppm)
+{
+    if (in_frames == 0) return 0;
+    const uint64_t step = (1ull << 32) + (int64_t)ppm * (int64_t)(1ull << 32) / 1000000;
+    const uint64_t end  = (uint64_t)in_frames << 32;
+    const unsigned ch   = channels_;
+
+    size_t n = 0;
+    while (pos_ < end && n < out_frames) {
+        // Frames i and i + 1 of [last_, in...]
+        const size_t i = (size_t)(pos_ >> 32);
+        const int f = (int)((uint32_t)pos_ >> 17);  // Q15 weight of frame i + 1
+        const int16_t *a = (i == 0) ? last_ : in + (i - 1) * ch;
+        const int16_t *b = in + i * ch;
+        for (unsigned c = 0; c < ch; c++) {
+            out[n * ch + c] = (int16_t)(a[c] + (((b[c] - a[c]) * f) >> 15));
+        }
+        n++;
+        pos_ += step;
+    }
+    // Out of room only if out_frames < max_out_frames(): drop the rest
+    pos_ = (pos_ < end) ? 0 : pos_ - end;
+    for (unsigned c = 0; c < ch; c++) last_[c] = in[(in_frames - 1) * ch + c];
+    return n;
+}
+
+}  // namespace mp4
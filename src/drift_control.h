@@ -0,0 +1,83 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include "player_constants.h"
+
+namespace mp4 {
+
+// Keeps the audio clock in step with a reference clock (esp_timer on the
+// device) by nudging the playback speed a few hundred ppm at most.
+//
+// drift = (audio clock - audio at anchor) - (reference - reference at
+// anchor), i.e. how far audio has run ahead of the reference since the
+// last anchor.  A critically damped PI loop (time constant
+// kDriftTimeConstantMs) turns that into a speed correction: the
+// proportional term pulls the accumulated error back, the integral term
+// learns the steady rate mismatch (the I2S divider's error plus whatever
+// the stream's timestamps disagree with its sample rate) and keeps it
+// across re-anchors.  Errors above kDriftResyncUs are not drift but a jump
+// (a gap between tracks, a stall): the loop re-anchors instead of spending
+// seconds at full correction catching up.
+//
+// Pure arithmetic on the two times it is given, so it runs unchanged on a
+// host against simulated clocks.
+class DriftController {
+public:
+    // Start of a stream: forget the anchor and the learned rate
+    void reset();
+    // Seek or underrun: re-anchor at the next update, keep the learned rate
+    void reanchor() { anchored_ = false; }
+
+    // audio_us: media clock now (-1 if unknown); ref_us: reference clock
+    // now.  Returns the speed correction in ppm: positive plays faster
+    // (consumes more input per output frame).
+    int update(int64_t audio_us, int64_t ref_us);
+
+    int      ppm() const          { return ppm_; }
+    int64_t  drift_us() const     { return drift_us_; }
+    int64_t  max_drift_us() const { return max_drift_us_; }
+    int      min_ppm() const      { return min_ppm_; }
+    int      max_ppm() const      { return max_ppm_; }
+    unsigned resyncs() const      { return resyncs_; }
+
+private:
+    bool     anchored_     = false;
+    int64_t  audio0_us_    = 0;
+    int64_t  ref0_us_      = 0;
+    int64_t  last_ref_us_  = 0;
+    float    integral_ppm_ = 0;
+    int      ppm_          = 0;
+    int64_t  drift_us_     = 0;
+    int64_t  max_drift_us_ = 0;   // |drift| seen since reset()
+    int      min_ppm_      = 0;
+    int      max_ppm_      = 0;
+    unsigned resyncs_      = 0;
+};
+
+// Fractional-rate linear interpolation of interleaved 16-bit PCM, for
+// corrections of a fraction of a percent (at those ratios interpolation
+// images sit far below the signal; a polyphase filter would buy nothing
+// audible).  The read position is Q32.32 input frames and carries over
+// between buffers together with the last input frame, so consecutive
+// buffers resample as one stream; the output lags the input by one frame.
+class Resampler {
+public:
+    void reset(unsigned channels);
+
+    // Output frames for in_frames at most kDriftMaxPpm slower
+    static constexpr size_t max_out_frames(size_t in_frames) {
+        return in_frames + in_frames * kDriftMaxPpm / (1000000 - kDriftMaxPpm) + 2;
+    }
+
+    // Resample in_frames frames at 1 + ppm / 1e6 input frames per output
+    // frame into out (room for out_frames frames); returns frames written
+    size_t process(const int16_t *in, size_t in_frames, int16_t *out, size_t out_frames, int ppm);
+
+private:
+    unsigned channels_ = 2;
+    uint64_t pos_      = 0;       // Q32.32; integer part 0 is last_, 1 is in[0]
+    int16_t  last_[2]  = {0, 0};  // previous buffer's final frame
+};
+
+}  // namespace mp4
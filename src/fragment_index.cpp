@@ -0,0 +1,389 @@
+#include "fragment_index.h"
+
+#include <cstring>
+
+#include "esp_log.h"
+#include "player_constants.h"
+#include "psram_alloc.h"
+
+static const char *TAG = "frag_idx";
+
+namespace mp4 {
+
+// tfhd flags
+static constexpr uint32_t kTfhdBaseDataOffset   = 0x000001;
+static constexpr uint32_t kTfhdDescriptionIndex = 0x000002;
+static constexpr uint32_t kTfhdDefaultDuration  = 0x000008;
+static constexpr uint32_t kTfhdDefaultSize      = 0x000010;
+static constexpr uint32_t kTfhdDefaultFlags     = 0x000020;
+static constexpr uint32_t kTfhdDefaultBaseMoof  = 0x020000;
+
+// trun flags
+static constexpr uint32_t kTrunDataOffset      = 0x000001;
+static constexpr uint32_t kTrunFirstFlags      = 0x000004;
+static constexpr uint32_t kTrunDuration        = 0x000100;
+static constexpr uint32_t kTrunSize            = 0x000200;
+static constexpr uint32_t kTrunFlags           = 0x000400;
+static constexpr uint32_t kTrunCompositionTime = 0x000800;
+
+// sample_flags: sample_is_non_sync_sample
+static constexpr uint32_t kSampleNonSync = 0x00010000;
+
+bool FragmentTrack::open(TablePager &pager, const TrackTables &tables, uint32_t fragments_start)
+{
+    close();
+    pager_    = &pager;
+    t_        = tables;
+    scan_pos_ = fragments_start;
+
+    // The first fragment, so playback can start and an empty file fails here
+    if (!discover_next()) {
+        ESP_LOGE(TAG, "Track %u: no fragments", t_.track_id);
+        close();
+        return false;
+    }
+    ESP_LOGI(TAG, "Track %u: first fragment at %u, %u samples",
+             t_.track_id, fragments_[0].moof, fragments_[0].count);
+    return true;
+}
+
+void FragmentTrack::close()
+{
+    safe_free(samples_);
+    safe_free(fragments_);
+    samples_   = nullptr;
+    fragments_ = nullptr;
+    sample_count_ = sample_capacity_ = 0;
+    fragment_count_ = fragment_capacity_ = 0;
+    current_  = 0;
+    scan_pos_ = 0;
+    next_ts_  = 0;
+    at_end_   = false;
+    truncated_logged_ = false;
+    pager_ = nullptr;
+}
+
+size_t FragmentTrack::memory_bytes() const
+{
+    return (size_t)sample_capacity_ * sizeof(Sample) + (size_t)fragment_capacity_ * sizeof(Fragment);
+}
+
+unsigned FragmentTrack::known_count() const
+{
+    if (fragment_count_ == 0) return 0;
+    const Fragment &last = fragments_[fragment_count_ - 1];
+    return last.first_sample + last.count;
+}
+
+bool FragmentTrack::reserve_samples(unsigned count) const
+{
+    if (count <= sample_capacity_) return true;
+    unsigned capacity = sample_capacity_ ? sample_capacity_ * 2 : 256;
+    while (capacity < count) capacity *= 2;
+    auto *grown = static_cast<Sample *>(psram_realloc(samples_, (size_t)capacity * sizeof(Sample)));
+    if (!grown) {
+        ESP_LOGE(TAG, "Failed to allocate %u fragment samples", capacity);
+        return false;
+    }
+    samples_ = grown;
+    sample_capacity_ = capacity;
+    return true;
+}
+
+uint32_t FragmentTrack::be32(uint32_t offset) const
+{
+    uint32_t value;
+    if (!pager_->be32(offset, value)) read_failed_ = true;
+    return value;
+}
+
+uint32_t FragmentTrack::parse_traf(const Box &traf, uint32_t moof, uint32_t prev_data_end) const
+{
+    TablePager &io = *pager_;
+    bool     mine     = false;
+    uint32_t base     = prev_data_end;
+    uint32_t duration = t_.default_duration;
+    uint32_t size     = t_.default_size;
+    uint32_t flags    = t_.default_flags;
+    uint64_t ts       = parsed_end_ts_;
+    uint32_t data_pos = prev_data_end;
+    bool     first_trun = true;
+
+    Box b;
+    for (uint64_t off = traf.payload; read_box(io, off, traf.end, b, true); off = b.end) {
+        const uint32_t p = (uint32_t)b.payload;
+        if (b.type == fourcc("tfhd")) {
+            uint32_t tf = be32(p) & 0xFFFFFF;
+            mine = (be32(p + 4) == t_.track_id);
+            uint32_t at = p + 8;
+            if (tf & kTfhdBaseDataOffset) {
+                base = be32(at + 4);  // FAT32: low word of the 64-bit offset
+                at += 8;
+            } else if (tf & kTfhdDefaultBaseMoof) {
+                base = moof;
+            }
+            if (tf & kTfhdDescriptionIndex) at += 4;
+            if (tf & kTfhdDefaultDuration) { duration = be32(at); at += 4; }
+            if (tf & kTfhdDefaultSize)     { size     = be32(at); at += 4; }
+            if (tf & kTfhdDefaultFlags)    { flags    = be32(at); at += 4; }
+            data_pos = base;
+        } else if (b.type == fourcc("tfdt") && mine) {
+            // Version 1 is 64-bit
+            ts = (be32(p) >> 24) == 1 ? ((uint64_t)be32(p + 4) << 32) | be32(p + 8) : be32(p + 4);
+        } else if (b.type == fourcc("trun")) {
+            uint32_t tr    = be32(p) & 0xFFFFFF;
+            uint32_t count = be32(p + 4);
+            uint32_t at    = p + 8;
+            if (tr & kTrunDataOffset) {
+                data_pos = base + be32(at);  // signed; wraps correctly
+                at += 4;
+            } else if (first_trun) {
+                data_pos = base;
+            }
+            first_trun = false;
+            uint32_t first_flags = flags;
+            bool has_first_flags = (tr & kTrunFirstFlags) != 0;
+            if (has_first_flags) {
+                first_flags = be32(at);
+                at += 4;
+            }
+            // Clamp the count to what the box can hold
+            const unsigned entry_bytes = 4 * (!!(tr & kTrunDuration) + !!(tr & kTrunSize) +
+                                              !!(tr & kTrunFlags) + !!(tr & kTrunCompositionTime));
+            const uint32_t room = (b.end > at) ? (uint32_t)(b.end - at) : 0;
+            if (entry_bytes > 0 && count > room / entry_bytes) count = room / entry_bytes;
+            if (mine && sample_count_ + count > kMaxFragmentSamples) {
+                if (!truncated_logged_) {
+                    ESP_LOGW(TAG, "Fragment at %u has more than %u samples, truncated",
+                             moof, (unsigned)kMaxFragmentSamples);
+                    truncated_logged_ = true;
+                }
+                count = kMaxFragmentSamples - sample_count_;
+            }
+            if (mine && !reserve_samples(sample_count_ + count)) count = 0;
+
+            for (uint32_t i = 0; i < count; i++) {
+                uint32_t d = duration, s = size, f = flags;
+                if (tr & kTrunDuration) { d = be32(at); at += 4; }
+                if (tr & kTrunSize)     { s = be32(at); at += 4; }
+                if (tr & kTrunFlags)    { f = be32(at); at += 4; }
+                if (tr & kTrunCompositionTime) at += 4;  // decode order is all demux needs
+                if (i == 0 && has_first_flags && !(tr & kTrunFlags)) f = first_flags;
+                if (mine) {
+                    samples_[sample_count_++] = {ts, data_pos, (s < 0x7FFFFFFFu) ? s : 0x7FFFFFFFu,
+                                                 (f & kSampleNonSync) ? 0u : 1u};
+                }
+                data_pos += s;
+                ts += d;
+            }
+        }
+    }
+    if (mine) parsed_end_ts_ = ts;
+    return data_pos;
+}
+
+bool FragmentTrack::has_samples(const Box &moof) const
+{
+    Box traf;
+    for (uint64_t off = moof.payload; read_box(*pager_, off, moof.end, traf, true); off = traf.end) {
+        if (traf.type != fourcc("traf")) continue;
+        Box b;
+        bool mine = false;
+        for (uint64_t at = traf.payload; read_box(*pager_, at, traf.end, b, true); at = b.end) {
+            if (b.type == fourcc("tfhd")) {
+                mine = (be32((uint32_t)b.payload + 4) == t_.track_id);
+            } else if (b.type == fourcc("trun") && mine && be32((uint32_t)b.payload + 4) > 0) {
+                return true;
+            }
+        }
+    }
+    return false;
+}
+
+bool FragmentTrack::parse_moof(uint32_t moof, uint64_t base_ts) const
+{
+    sample_count_  = 0;
+    read_failed_   = false;
+    parsed_end_ts_ = base_ts;  // without a tfdt, time continues from base_ts
+    Box box;
+    if (!read_box(*pager_, moof, pager_->file_size(), box, true) || box.type != fourcc("moof")) {
+        return false;
+    }
+    // Without an explicit base, a traf's data follows the previous traf's
+    // (the first one's starts at the moof)
+    uint32_t data_end = moof;
+    Box b;
+    for (uint64_t off = box.payload; read_box(*pager_, off, box.end, b, true); off = b.end) {
+        if (b.type == fourcc("traf")) data_end = parse_traf(b, moof, data_end);
+    }
+    return !read_failed_;
+}
+
+bool FragmentTrack::discover_next() const
+{
+    while (!at_end_) {
+        Box b;
+        if (!read_box(*pager_, scan_pos_, pager_->file_size(), b, true)) {
+            // End of file, or a box cut short by an interrupted recording
+            at_end_ = true;
+            break;
+        }
+        const uint32_t moof = scan_pos_;
+        scan_pos_ = (uint32_t)b.end;
+        if (b.type != fourcc("moof")) continue;
+
+        // Another track's moof: skip it and keep the resident fragment
+        read_failed_ = false;
+        const bool mine = has_samples(b);
+        if (!mine && !read_failed_) continue;
+
+        const uint32_t first = known_count();
+        if (!mine || !parse_moof(moof, next_ts_)) {
+            ESP_LOGE(TAG, "Track %u: failed to read the fragment at %u", t_.track_id, moof);
+            if (mine) sample_count_ = 0;  // the resident fragment was overwritten
+            at_end_ = true;
+            break;
+        }
+        if (sample_count_ == 0) continue;  // trun counts larger than their boxes
+
+        if (fragment_count_ == fragment_capacity_) {
+            unsigned capacity = fragment_capacity_ ? fragment_capacity_ * 2 : 64;
+            auto *grown = static_cast<Fragment *>(
+                psram_realloc(fragments_, (size_t)capacity * sizeof(Fragment)));
+            if (!grown) {
+                ESP_LOGE(TAG, "Failed to grow fragment list to %u", capacity);
+                sample_count_ = 0;  // parsed, but not the fragment current_ names
+                at_end_ = true;
+                break;
+            }
+            fragments_ = grown;
+            fragment_capacity_ = capacity;
+        }
+        fragments_[fragment_count_] = {moof, first, sample_count_, samples_[0].ts};
+        current_ = fragment_count_++;
+        next_ts_ = parsed_end_ts_;
+        return true;
+    }
+    return false;
+}
+
+bool FragmentTrack::load_fragment(unsigned f) const
+{
+    if (f == current_ && sample_count_ > 0) return true;
+    const Fragment &frag = fragments_[f];
+    if (!parse_moof(frag.moof, frag.base_ts) || sample_count_ != frag.count) {
+        sample_count_ = 0;
+        return false;
+    }
+    current_ = f;
+    return true;
+}
+
+bool FragmentTrack::load(unsigned n) const
+{
+    if (fragment_count_ == 0) return false;
+    const Fragment &cur = fragments_[current_];
+    if (sample_count_ > 0 && n >= cur.first_sample && n - cur.first_sample < cur.count) return true;
+
+    if (n < known_count()) {
+        // Already found: last fragment starting at or before n
+        unsigned lo = 0, hi = fragment_count_;
+        while (lo < hi) {
+            unsigned mid = lo + (hi - lo) / 2;
+            if (fragments_[mid].first_sample <= n) {
+                lo = mid + 1;
+            } else {
+                hi = mid;
+            }
+        }
+        return load_fragment(lo - 1);
+    }
+    while (discover_next()) {
+        if (n < known_count()) return true;
+    }
+    return false;
+}
+
+bool FragmentTrack::contains(unsigned n) const
+{
+    return load(n);
+}
+
+uint32_t FragmentTrack::size(unsigned n) const
+{
+    return load(n) ? samples_[n - fragments_[current_].first_sample].size : 0;
+}
+
+uint32_t FragmentTrack::offset(unsigned n) const
+{
+    return load(n) ? samples_[n - fragments_[current_].first_sample].offset : 0;
+}
+
+uint64_t FragmentTrack::timestamp(unsigned n) const
+{
+    return load(n) ? samples_[n - fragments_[current_].first_sample].ts : next_ts_;
+}
+
+bool FragmentTrack::is_keyframe(unsigned n) const
+{
+    return load(n) && samples_[n - fragments_[current_].first_sample].key;
+}
+
+unsigned FragmentTrack::sample_at(uint64_t ts) const
+{
+    // The fragment holding ts is the last one starting at or before it,
+    // which is only certain once a later one (or the end) has been found
+    while (fragment_count_ > 0 && fragments_[fragment_count_ - 1].base_ts <= ts) {
+        if (!discover_next()) break;
+    }
+    if (fragment_count_ == 0) return 0;
+
+    unsigned lo = 0, hi = fragment_count_;
+    while (lo < hi) {
+        unsigned mid = lo + (hi - lo) / 2;
+        if (fragments_[mid].base_ts <= ts) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    const unsigned f = lo > 0 ? lo - 1 : 0;
+    if (!load_fragment(f)) return fragments_[f].first_sample;
+    unsigned i = 0;
+    while (i + 1 < sample_count_ && samples_[i + 1].ts <= ts) i++;
+    return fragments_[f].first_sample + i;
+}
+
+unsigned FragmentTrack::keyframe_before(unsigned n) const
+{
+    if (!load(n)) {
+        unsigned known = known_count();
+        if (known == 0) return 0;
+        n = known - 1;
+        if (!load(n)) return 0;
+    }
+    // Usually the fragment's first sample; walk back a fragment if not
+    for (;;) {
+        const Fragment &frag = fragments_[current_];
+        for (unsigned i = n - frag.first_sample + 1; i-- > 0;) {
+            if (samples_[i].key) return frag.first_sample + i;
+        }
+        if (current_ == 0 || !load_fragment(current_ - 1)) return 0;
+        n = fragments_[current_].first_sample + fragments_[current_].count - 1;
+    }
+}
+
+unsigned FragmentTrack::next_keyframe(unsigned n) const
+{
+    unsigned m = n + 1;
+    while (load(m)) {
+        const Fragment &frag = fragments_[current_];
+        for (unsigned i = m - frag.first_sample; i < sample_count_; i++) {
+            if (samples_[i].key) return frag.first_sample + i;
+        }
+        m = frag.first_sample + frag.count;
+    }
+    return known_count();  // the end has been reached: the total
+}
+
+}  // namespace mp4
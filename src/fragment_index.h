@@ -0,0 +1,88 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include "paged_index.h"
+
+namespace mp4 {
+
+// One track of a fragmented MP4 (an empty moov followed by moof/mdat
+// pairs, as written by cameras and streaming muxers), demuxed fragment by
+// fragment.  There is no global table: a moof is parsed when demux first
+// asks for one of its samples, and only that fragment's samples are
+// resident.  Each fragment seen so far also keeps a 24-byte entry (moof
+// offset, first sample, base time) so a seek back re-parses just one moof.
+// Moofs holding no samples of this track are skipped after reading their
+// traf headers, without disturbing the resident fragment.  Times are 64-bit
+// (a tfdt version 1 base is kept whole).
+//
+// Sample numbers are global and grow as fragments are found, so the total
+// is only known once the last fragment has been reached: demux loops on
+// contains(n) rather than a count.  Queries are const like SampleIndex's;
+// the parsed fragment is a cache behind them.
+class FragmentTrack {
+public:
+    bool open(TablePager &pager, const TrackTables &tables, uint32_t fragments_start);
+    void close();
+
+    ~FragmentTrack() { close(); }
+
+    bool     active() const { return pager_ != nullptr; }
+    unsigned known_count() const;          // samples in the fragments found so far
+    bool     contains(unsigned n) const;   // parses ahead until n is found or the file ends
+
+    uint32_t size(unsigned n) const;
+    uint32_t offset(unsigned n) const;
+    uint64_t timestamp(unsigned n) const;
+    bool     is_keyframe(unsigned n) const;
+    unsigned sample_at(uint64_t ts) const;
+    unsigned keyframe_before(unsigned n) const;
+    unsigned next_keyframe(unsigned n) const;
+    size_t   memory_bytes() const;
+
+private:
+    struct Sample {
+        uint64_t ts;            // decode timestamp, track timescale
+        uint32_t offset;
+        uint32_t size : 31;     // clamped: no real sample comes near 2 GB
+        uint32_t key  : 1;      // sync sample
+    };
+    struct Fragment {
+        uint32_t moof;          // file offset of the moof box
+        uint32_t first_sample;
+        uint32_t count;
+        uint64_t base_ts;       // tfdt, or where the previous fragment ended
+    };
+
+    bool load(unsigned n) const;              // make n's fragment current; false past the end
+    bool load_fragment(unsigned f) const;
+    bool discover_next() const;               // parse the next moof with samples for this track
+    bool has_samples(const Box &moof) const;  // any trun samples for this track (headers only)
+    bool parse_moof(uint32_t moof, uint64_t base_ts) const;
+    uint32_t parse_traf(const Box &traf, uint32_t moof,
+                        uint32_t prev_data_end) const;  // returns the end of the traf's data
+    bool reserve_samples(unsigned count) const;
+    uint32_t be32(uint32_t offset) const;     // table word; 0 and read_failed_ on error
+
+    TablePager *pager_ = nullptr;
+    TrackTables t_;
+
+    // Current fragment
+    mutable Sample  *samples_        = nullptr;
+    mutable unsigned sample_count_   = 0;
+    mutable unsigned sample_capacity_ = 0;
+    mutable unsigned current_        = 0;  // fragments_[] index of samples_
+    mutable uint64_t parsed_end_ts_  = 0;  // parse_moof(): time after this track's last sample
+    mutable bool     truncated_logged_ = false;
+    mutable bool     read_failed_    = false;  // parse_moof(): a read failed
+
+    // Fragments found so far, in file order
+    mutable Fragment *fragments_         = nullptr;
+    mutable unsigned  fragment_count_    = 0;
+    mutable unsigned  fragment_capacity_ = 0;
+    mutable uint32_t  scan_pos_          = 0;      // next top-level box to look at
+    mutable uint64_t  next_ts_           = 0;      // end of the last fragment found
+    mutable bool      at_end_            = false;  // no more fragments
+};
+
+}  // namespace mp4
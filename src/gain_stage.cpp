@@ -0,0 +1,83 @@
+#include "gain_stage.h"
+
+#include <cstring>
+#include "esp_cpu.h"
+
+namespace mp4 {
+
+namespace {
+
+constexpr size_t kBlock = 8;  // output samples per gain step
+
+inline int16_t sat16(int v)
+{
+    return (int16_t)((v > INT16_MAX) ? INT16_MAX : (v < INT16_MIN) ? INT16_MIN : v);
+}
+
+void scale_scalar(int16_t *dst, const int16_t *src, size_t n, int g)
+{
+    for (size_t i = 0; i < n; i++) {
+        dst[i] = (int16_t)((src[i] * g) >> 14);
+    }
+}
+
+// (L * g/2) + (R * g/2): each half-gain product first
+void downmix_scalar(int16_t *dst, const int16_t *src, size_t n, int g)
+{
+    for (size_t i = 0; i < n; i++) {
+        dst[i] = sat16(((src[2 * i] * g) >> 15) + ((src[2 * i + 1] * g) >> 15));
+    }
+}
+
+// Gain g0 -> g1 across the buffer: block k of K gets g0 + (g1 - g0)(k+1)/K.
+// Downmix output is written over the front of the input (block k's output
+// lies in input already consumed).
+void run(int16_t *pcm, size_t samples, bool downmix, int g0, int g1)
+{
+    const size_t out    = downmix ? samples / 2 : samples;
+    const size_t blocks = (out + kBlock - 1) / kBlock;
+    const size_t stride = downmix ? 2 * kBlock : kBlock;
+    for (size_t k = 0; k < blocks; k++) {
+        const int16_t g = (int16_t)((g0 == g1) ? g1 : g0 + (g1 - g0) * (int)(k + 1) / (int)blocks);
+        int16_t *dst = pcm + k * kBlock;
+        const int16_t *src = pcm + k * stride;
+        const size_t n = (out - k * kBlock < kBlock) ? out - k * kBlock : kBlock;
+        if (downmix) downmix_scalar(dst, src, n, g);
+        else         scale_scalar(dst, src, n, g);
+    }
+}
+
+}  // namespace
+
+void GainStage::reset(int volume)
+{
+    gain_     = volume * (kUnity / 256);
+    ramps_    = 0;
+    samples_  = 0;
+    cycles_   = 0;
+}
+
+size_t GainStage::process(int16_t *pcm, size_t samples, bool downmix, int volume)
+{
+    const esp_cpu_cycle_count_t c0 = esp_cpu_get_cycle_count();
+    const int target = volume * (kUnity / 256);
+    const int from   = gain_;
+    const size_t out = downmix ? samples / 2 : samples;
+
+    if (from != target) {
+        ramps_++;
+        run(pcm, samples, downmix, from, target);
+    } else if (target == 0) {
+        memset(pcm, 0, out * sizeof(int16_t));
+    } else if (target != kUnity || downmix) {
+        run(pcm, samples, downmix, target, target);
+    }
+    // unity without downmix: untouched
+    gain_ = target;
+
+    cycles_  += (uint32_t)(esp_cpu_get_cycle_count() - c0);
+    samples_ += samples;
+    return out * sizeof(int16_t);
+}
+
+}  // namespace mp4
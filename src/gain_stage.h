@@ -0,0 +1,43 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+
+namespace mp4 {
+
+// Volume for the I2S writer, in place on 16-bit PCM, optionally downmixing
+// stereo pairs to mono in the same pass.  Gain is Q14 (kUnity = 1.0) and
+// never exceeds unity, so no product can overflow.
+//
+// A volume change ramps the gain linearly across the next buffer instead
+// of stepping mid-buffer (which clicks).  The gain is constant within each
+// block of 8 output samples, i.e. 128 steps over a 1024-frame stereo
+// buffer.  Mute and unity without downmix skip the multiply.
+//
+// Scalar only: the PIE SIMD version of the block loop stays out until it
+// has been assembled and checked on an S3.  test_gain_stage checks this
+// path against reference values on the host.
+class GainStage {
+public:
+    static constexpr int    kUnity = 1 << 14;
+    static constexpr size_t kAlign = 16;  // pcm_ring records, room for 128-bit vector loads
+
+    // Start of a stream: jump to volume (0-256) without a ramp
+    void reset(int volume);
+
+    // Scale samples in place (interleaved pairs when downmixing) towards
+    // volume; returns the output bytes
+    size_t process(int16_t *pcm, size_t samples, bool downmix, int volume);
+
+    unsigned ramps() const   { return ramps_; }
+    uint64_t samples() const { return samples_; }
+    uint64_t cycles() const  { return cycles_; }
+
+private:
+    int      gain_     = kUnity;
+    unsigned ramps_    = 0;
+    uint64_t samples_  = 0;  // input samples through process()
+    uint64_t cycles_   = 0;
+};
+
+}  // namespace mp4
@@ -0,0 +1,200 @@
+#include "index_cache.h"
+
+#include <cstdio>
+#include <cstring>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "sample_index.h"
+
+static const char *TAG = "idx_cache";
+
+namespace mp4 {
+
+static constexpr uint32_t kCacheMagic   = 0x4934504D;  // "MP4I"
+static constexpr uint32_t kCacheVersion = 2;  // 2: compact SampleIndex tables
+
+// Header flags
+static constexpr uint32_t kFlagAudioIndexed = 1u << 0;  // writer looked for an audio track
+static constexpr uint32_t kFlagHasAudio     = 1u << 1;  // audio table follows the video table
+
+struct CacheHeader {
+    uint32_t magic;
+    uint32_t version;
+    uint64_t source_size;
+    int64_t  source_mtime;
+    uint32_t flags;
+    uint16_t video_w;
+    uint16_t video_h;
+    uint16_t sps_bytes;
+    uint16_t pps_bytes;
+    uint16_t dsi_bytes;
+    uint16_t audio_channels;
+    uint32_t audio_rate;
+};
+
+bool read_exact(int fd, void *dst, size_t size)
+{
+    auto *p = static_cast<uint8_t *>(dst);
+    while (size > 0) {
+        ssize_t n = ::read(fd, p, size);
+        if (n <= 0) return false;
+        p += n;
+        size -= n;
+    }
+    return true;
+}
+
+bool write_all(int fd, const void *src, size_t size)
+{
+    auto *p = static_cast<const uint8_t *>(src);
+    while (size > 0) {
+        ssize_t n = ::write(fd, p, size);
+        if (n <= 0) return false;
+        p += n;
+        size -= n;
+    }
+    return true;
+}
+
+void index_cache_path(const char *movie_path, char *out, size_t out_size)
+{
+    // Replace the extension (if it is in the last path component)
+    const char *dot   = strrchr(movie_path, '.');
+    const char *slash = strrchr(movie_path, '/');
+    int stem = (dot && (!slash || dot > slash)) ? (int)(dot - movie_path) : (int)strlen(movie_path);
+    snprintf(out, out_size, "%.*s.mp4idx", stem, movie_path);
+}
+
+bool load_index_cache(const char *movie_path, MovieParams &params,
+                      SampleIndex &v_index, SampleIndex *a_index)
+{
+    int64_t t0 = esp_timer_get_time();
+
+    struct stat st;
+    if (stat(movie_path, &st) != 0) return false;
+
+    char path[300];
+    index_cache_path(movie_path, path, sizeof(path));
+    int fd = ::open(path, O_RDONLY);
+    if (fd < 0) {
+        ESP_LOGI(TAG, "No index cache for %s", movie_path);
+        return false;
+    }
+
+    bool ok = false;
+    CacheHeader hdr;
+    do {
+        if (!read_exact(fd, &hdr, sizeof(hdr)) ||
+            hdr.magic != kCacheMagic || hdr.version != kCacheVersion) {
+            ESP_LOGW(TAG, "%s: unrecognised index cache, rebuilding", path);
+            break;
+        }
+        if (hdr.source_size != (uint64_t)st.st_size || hdr.source_mtime != (int64_t)st.st_mtime) {
+            ESP_LOGI(TAG, "%s: movie changed since it was indexed, rebuilding", path);
+            break;
+        }
+        if (a_index && !(hdr.flags & kFlagAudioIndexed)) {
+            ESP_LOGI(TAG, "%s: written without audio support, rebuilding", path);
+            break;
+        }
+        if (hdr.sps_bytes > kMaxParamSetBytes || hdr.pps_bytes > kMaxParamSetBytes ||
+            hdr.dsi_bytes > kMaxDsiBytes) {
+            break;
+        }
+
+        params.video_w        = hdr.video_w;
+        params.video_h        = hdr.video_h;
+        params.sps_bytes      = hdr.sps_bytes;
+        params.pps_bytes      = hdr.pps_bytes;
+        params.dsi_bytes      = hdr.dsi_bytes;
+        params.audio_rate     = (int)hdr.audio_rate;
+        params.audio_channels = hdr.audio_channels;
+        if (!read_exact(fd, params.sps, params.sps_bytes) ||
+            !read_exact(fd, params.pps, params.pps_bytes) ||
+            !read_exact(fd, params.dsi, params.dsi_bytes) ||
+            !v_index.load(fd)) {
+            break;
+        }
+        params.has_audio = false;
+        if (a_index && (hdr.flags & kFlagHasAudio)) {
+            if (!a_index->load(fd)) break;
+            params.has_audio = true;
+        }
+        ok = true;
+    } while (false);
+    ::close(fd);
+
+    if (!ok) {
+        v_index.deinit();
+        if (a_index) a_index->deinit();
+        return false;
+    }
+    ESP_LOGI(TAG, "Index loaded from %s: %u video + %u audio samples in %lld ms",
+             path, v_index.count(), params.has_audio ? a_index->count() : 0,
+             (esp_timer_get_time() - t0) / 1000);
+    return true;
+}
+
+bool save_index_cache(const char *movie_path, const MovieParams &params,
+                      const SampleIndex &v_index, const SampleIndex *a_index)
+{
+    int64_t t0 = esp_timer_get_time();
+
+    struct stat st;
+    if (stat(movie_path, &st) != 0) return false;
+
+    char path[300];
+    char tmppath[310];
+    index_cache_path(movie_path, path, sizeof(path));
+    snprintf(tmppath, sizeof(tmppath), "%s.tmp", path);
+
+    int fd = ::open(tmppath, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        ESP_LOGW(TAG, "Cannot create %s (read-only card?)", tmppath);
+        return false;
+    }
+
+    const bool with_audio = a_index && params.has_audio;
+    CacheHeader hdr = {};
+    hdr.magic          = kCacheMagic;
+    hdr.version        = kCacheVersion;
+    hdr.source_size    = (uint64_t)st.st_size;
+    hdr.source_mtime   = (int64_t)st.st_mtime;
+    hdr.flags          = (a_index ? kFlagAudioIndexed : 0) | (with_audio ? kFlagHasAudio : 0);
+    hdr.video_w        = (uint16_t)params.video_w;
+    hdr.video_h        = (uint16_t)params.video_h;
+    hdr.sps_bytes      = params.sps_bytes;
+    hdr.pps_bytes      = params.pps_bytes;
+    hdr.dsi_bytes      = params.dsi_bytes;
+    hdr.audio_channels = (uint16_t)params.audio_channels;
+    hdr.audio_rate     = (uint32_t)params.audio_rate;
+
+    bool ok = write_all(fd, &hdr, sizeof(hdr)) &&
+              write_all(fd, params.sps, params.sps_bytes) &&
+              write_all(fd, params.pps, params.pps_bytes) &&
+              write_all(fd, params.dsi, params.dsi_bytes) &&
+              v_index.save(fd) &&
+              (!with_audio || a_index->save(fd));
+    off_t bytes = lseek(fd, 0, SEEK_CUR);
+    ok = (::close(fd) == 0) && ok;
+
+    // Atomic replace: a torn write never leaves a valid-looking cache
+    if (ok) {
+        unlink(path);
+        ok = (rename(tmppath, path) == 0);
+    }
+    if (!ok) {
+        ESP_LOGW(TAG, "Failed to write %s", path);
+        unlink(tmppath);
+        return false;
+    }
+    ESP_LOGI(TAG, "Index cache written: %s (%ld bytes) in %lld ms",
+             path, (long)bytes, (esp_timer_get_time() - t0) / 1000);
+    return true;
+}
+
+}  // namespace mp4
@@ -0,0 +1,50 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include "player_constants.h"
+
+namespace mp4 {
+
+class SampleIndex;
+
+// Everything demux takes from the moov box besides the sample tables, so a
+// play served from the index cache never calls MP4D_open.
+struct MovieParams {
+    int      video_w = 0;
+    int      video_h = 0;
+    uint8_t  sps[kMaxParamSetBytes];
+    uint16_t sps_bytes = 0;
+    uint8_t  pps[kMaxParamSetBytes];
+    uint16_t pps_bytes = 0;
+
+    bool     has_audio = false;  // a_index holds the AAC track
+    int      audio_rate = 0;
+    int      audio_channels = 0;
+    uint8_t  dsi[kMaxDsiBytes];
+    uint16_t dsi_bytes = 0;
+
+    bool     cacheable = true;   // false: parsed with a fallback (e.g. audio dropped), don't save
+};
+
+// Sidecar index cache: "<dir>/<name>.mp4idx" next to "<dir>/<name>.mp4".
+// The file records the movie's size and mtime; a mismatch (file replaced or
+// edited) makes load fail so demux re-parses and rewrites it.
+//
+// Layout: header, SPS, PPS, DSI, video table, audio table (if any).  Tables
+// are SampleIndex's in-memory arrays, so loading is a sequential read
+// straight into PSRAM.
+void index_cache_path(const char *movie_path, char *out, size_t out_size);
+
+// a_index == nullptr: audio is not wanted (board without audio); any stored
+// audio table is ignored.
+bool load_index_cache(const char *movie_path, MovieParams &params,
+                      SampleIndex &v_index, SampleIndex *a_index);
+bool save_index_cache(const char *movie_path, const MovieParams &params,
+                      const SampleIndex &v_index, const SampleIndex *a_index);
+
+// Full-length read/write on a POSIX fd (the VFS may return short counts)
+bool read_exact(int fd, void *dst, size_t size);
+bool write_all(int fd, const void *src, size_t size);
+
+}  // namespace mp4
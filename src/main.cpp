@@ -1,6 +1,7 @@
 #include "freertos/FreeRTOS.h"
 #include "freertos/task.h"
 #include "esp_log.h"
+#include "esp_timer.h"
 #include "esp_vfs_fat.h"
 #include "board_config.h"
 #include "lcd_config.h"
@@ -152,25 +153,34 @@ extern "C" void app_main(void)
         controller.play(0);
     }
 
-    // Main loop
-    int qr_tick = 0;
+    // Main loop.  wait_for_command() returns early on a command, so the QR
+    // cycle goes by the tick count, not by loop passes.
+    const TickType_t qr_interval = pdMS_TO_TICKS(mp4::kQrCycleIntervalMs);
+    int qr_screen = -1;
+    TickType_t qr_shown_at = 0;
     while (true) {
         controller.tick();
 
+        TickType_t wait = pdMS_TO_TICKS(500);
         if (qr_mode) {
+            TickType_t now = xTaskGetTickCount();
             if (controller.is_playing()) {
                 qr_mode = false;  // Playback started from Web UI — stop QR cycling permanently
-            } else if (qr_tick % mp4::kQrCycleIntervalTicks == 0) {
-                int screen = (qr_tick / mp4::kQrCycleIntervalTicks) % mp4::kQrScreenCount;
-                mp4::show_qr_cycle_screen(display, screen,
-                                           server_config.ssid,
-                                           server_config.password,
-                                           server_config.url);
+            } else {
+                if (qr_screen < 0 || now - qr_shown_at >= qr_interval) {
+                    qr_screen = (qr_screen + 1) % mp4::kQrScreenCount;
+                    qr_shown_at = now;
+                    mp4::show_qr_cycle_screen(display, qr_screen,
+                                               server_config.ssid,
+                                               server_config.password,
+                                               server_config.url);
+                }
+                TickType_t left = qr_interval - (now - qr_shown_at);
+                if (left < wait) wait = left;
             }
-            qr_tick++;
         }
 
-        vTaskDelay(pdMS_TO_TICKS(500));
+        controller.wait_for_command(wait);
     }
 }
 
@@ -178,67 +188,226 @@ extern "C" void app_main(void)
 
 namespace mp4 {
 
-void Mp4Player::start()
+bool Mp4Player::create_tasks()
 {
-    sync_.init();
-    sync_.audio_priority = audio_priority_;
-#ifdef BOARD_HAS_AUDIO
-    sync_.audio_volume = volume_ * 256 / 100;
-#endif
+    if (!sync_.init()) {
+        ESP_LOGE(TAG, "Failed to create pipeline rings / semaphores");
+        sync_.deinit();
+        return false;
+    }
 
     auto *demux = new DemuxStage(filepath_, sync_, video_info_
 #ifdef BOARD_HAS_AUDIO
                                   , audio_info_
 #endif
                                   );
-    auto *decode  = new DecodeStage(sync_, video_info_, dbuf_);
+    auto *decode  = new DecodeStage(sync_, video_info_);
     auto *disp    = new DisplayStage(sync_, video_info_, dbuf_, display_);
 
     xTaskCreatePinnedToCore(DecodeStage::task_func,  "decode",  kDecodeStackSize,  decode,  kDecodePriority,  &decode_handle_,  kDecodeCore);
     xTaskCreatePinnedToCore(DisplayStage::task_func, "display", kDisplayStackSize, disp,    kDisplayPriority, &display_handle_, kDisplayCore);
+    if (kBandRenderLines == 0) {
+        // Full-frame mode: dedicated YUV->RGB565 stage (band mode converts in display)
+        auto *convert = new ConvertStage(sync_, video_info_, dbuf_);
+        xTaskCreatePinnedToCore(ConvertStage::task_func, "convert", kConvertStackSize, convert, kConvertPriority, &convert_handle_, kConvertCore);
+    }
     xTaskCreatePinnedToCore(DemuxStage::task_func,   "demux",   kDemuxStackSize,   demux,   kDemuxPriority,   &demux_handle_,   kDemuxCore);
+    sync_.demux_task = demux_handle_;
 
 #ifdef BOARD_HAS_AUDIO
     auto *audio = new AudioPipeline(sync_, audio_info_);
+    auto *audio_out = new AudioOutput(sync_, audio_info_);
     xTaskCreatePinnedToCore(AudioPipeline::task_func, "audio", kAudioStackSize, audio, kAudioPriority, &audio_handle_, kAudioCore);
+    xTaskCreatePinnedToCore(AudioOutput::task_func, "audio_out", kAudioOutStackSize, audio_out, kAudioOutPriority, &audio_out_handle_, kAudioOutCore);
+#endif
+    ESP_LOGI(TAG, "Pipeline tasks created");
+    return true;
+}
+
+// Bits of the stages that exist (convert: full-frame mode; audio: board)
+EventBits_t Mp4Player::stage_bits() const
+{
+    EventBits_t bits = PipelineSync::kDemuxDone |
+                       PipelineSync::kDecodeDone |
+                       PipelineSync::kDisplayDone;
+    if (convert_handle_) bits |= PipelineSync::kConvertDone;
+#ifdef BOARD_HAS_AUDIO
+    if (audio_handle_)     bits |= PipelineSync::kAudioDone;
+    if (audio_out_handle_) bits |= PipelineSync::kAudioOutDone;
 #endif
+    return bits;
+}
+
+bool Mp4Player::open(const char *filepath)
+{
+    if (running_) {
+        // Not waited for, or a stage outlived wait_until_finished(): the
+        // rings are still in use until every stage reports done
+        EventBits_t busy = stage_bits() & ~xEventGroupGetBits(sync_.task_done);
+        if (busy) {
+            ESP_LOGE(TAG, "open(%s) while pipeline stages 0x%x are still running",
+                     filepath, (unsigned)busy);
+            return false;
+        }
+        wait_until_finished();
+    }
+    if (!demux_handle_ && !create_tasks()) {
+        return false;
+    }
+
+    int64_t t0 = esp_timer_get_time();
+    strlcpy(filepath_, filepath, sizeof(filepath_));
+    sync_.reset();
+    sync_.audio_priority = audio_priority_;
+#ifdef BOARD_HAS_AUDIO
+    sync_.audio_volume = volume_ * 256 / 100;
+    safe_free(audio_info_.dsi);
+    audio_info_.dsi         = nullptr;
+    audio_info_.dsi_bytes   = 0;
+    audio_info_.sample_rate = 0;
+    audio_info_.channels    = 0;
+#endif
+    video_info_.video_w     = 0;
+    video_info_.video_h     = 0;
+    video_info_.duration_ms = 0;
+    video_info_.sps_bytes   = 0;
+
+    running_ = true;
+    stop_request_us_ = 0;
+    xEventGroupSetBits(sync_.task_start, stage_bits());
+    ESP_LOGI(TAG, "Opened %s (pipeline reset in %lld us)", filepath_, esp_timer_get_time() - t0);
+    return true;
+}
+
+Mp4Player::~Mp4Player()
+{
+    if (!demux_handle_) return;
+    if (running_) {
+        request_stop();
+        if (!wait_until_finished()) {
+            // A stage may still touch the rings: leak them rather than free
+            // them under it
+            ESP_LOGE(TAG, "Pipeline not torn down: stages still running");
+            return;
+        }
+    }
+    // Every task is parked in wait_start(): release them with the shutdown
+    // flag; each sets its done bit on the way out.
+    EventBits_t bits = stage_bits();
+    xEventGroupClearBits(sync_.task_done, bits);
+    sync_.shutdown = true;
+    xEventGroupSetBits(sync_.task_start, bits);
+    xEventGroupWaitBits(sync_.task_done, bits, pdFALSE, pdTRUE, pdMS_TO_TICKS(kSemaphoreTimeoutMs));
+    sync_.deinit();
+    dbuf_.deinit();
 }
 
 void Mp4Player::request_stop()
 {
+    if (!running_) return;
+    stop_request_us_ = esp_timer_get_time();
     sync_.stop_requested = true;
+    // Every stage wakes now, wherever it is blocked, instead of at the end
+    // of its poll timeout (up to 500 ms)
+    sync_.cancel_waits();
+    notify_tasks();
 }
 
-bool Mp4Player::is_finished() const
+// Cut pacing sleeps short (decode PTS wait) and wake demux waiting for a
+// gapless switch: those tasks sleep in ulTaskNotifyTake()
+void Mp4Player::notify_tasks()
 {
-    return sync_.pipeline_eos;
+    const TaskHandle_t tasks[] = {demux_handle_, decode_handle_};
+    for (TaskHandle_t t : tasks) {
+        if (t) xTaskNotifyGive(t);
+    }
 }
 
-void Mp4Player::wait_until_finished()
+void Mp4Player::set_next(const char *filepath)
 {
-    // Wait for all tasks to signal completion via EventGroup
-    EventBits_t wait_bits = PipelineSync::kDemuxDone |
-                            PipelineSync::kDecodeDone |
-                            PipelineSync::kDisplayDone;
-#ifdef BOARD_HAS_AUDIO
-    if (audio_handle_) wait_bits |= PipelineSync::kAudioDone;
-#endif
+    if (!sync_.next_q) return;
+    if (!filepath) {
+        xQueueReset(sync_.next_q);
+        return;
+    }
+    NextTrack next;
+    strlcpy(next.path, filepath, sizeof(next.path));
+    xQueueOverwrite(sync_.next_q, &next);
+}
 
-    xEventGroupWaitBits(sync_.task_done, wait_bits,
-                        pdFALSE,   // don't clear bits
-                        pdTRUE,    // wait for ALL bits
-                        pdMS_TO_TICKS(10000));  // 10s safety timeout
+bool Mp4Player::seek(int32_t ms)
+{
+    // Once demux has exited (EOS sent) the downstream tasks are winding down
+    EventBits_t done = sync_.task_done ? xEventGroupGetBits(sync_.task_done) : 0;
+    if (sync_.pipeline_eos || sync_.stop_requested || (done & PipelineSync::kDemuxDone)) {
+        ESP_LOGW(TAG, "Seek to %d ms ignored: playback is ending", (int)ms);
+        return false;
+    }
+    if (sync_.tracks_queued != sync_.tracks_started) {
+        // Demux has left this file for the next one (gapless preroll)
+        ESP_LOGW(TAG, "Seek to %d ms ignored: next file already queued", (int)ms);
+        return false;
+    }
+    if (ms < 0) ms = 0;
+    if (video_info_.duration_ms > 0 && ms > video_info_.duration_ms) ms = video_info_.duration_ms;
 
-    // All tasks have completed their cleanup and set done bits.
-    // Between SetBits and vTaskDelete, tasks only free their own
-    // memory (delete self) — they no longer access shared state.
-    sync_.deinit();
-    demux_handle_   = nullptr;
-    decode_handle_  = nullptr;
-    display_handle_ = nullptr;
+    // Target before epoch: demux reads the target once it sees the new epoch
+    sync_.seek_target_ms  = ms;
+    sync_.seek_request_us = esp_timer_get_time();
 #ifdef BOARD_HAS_AUDIO
-    audio_handle_   = nullptr;
+    sync_.audio_clock.flush();  // decode paces by wall clock until new audio reaches the DAC
 #endif
+    sync_.seek_epoch = sync_.seek_epoch + 1;
+    sync_.position_ms = sync_.track_base_ms + ms;
+    notify_tasks();  // decode drops its PTS wait for the old position
+    ESP_LOGI(TAG, "Seek requested: %d ms", (int)ms);
+    return true;
+}
+
+bool Mp4Player::is_finished() const
+{
+    return sync_.pipeline_eos;
+}
+
+bool Mp4Player::wait_until_finished()
+{
+    if (!running_) return true;
+
+    // Wait for every stage to finish the file via EventGroup
+    EventBits_t done = xEventGroupWaitBits(sync_.task_done, stage_bits(),
+                                           pdFALSE,   // don't clear bits (reset() does)
+                                           pdTRUE,    // wait for ALL bits
+                                           pdMS_TO_TICKS(10000));  // 10s safety timeout
+    if ((done & stage_bits()) != stage_bits()) {
+        // Stuck on something the end of the file didn't wake: stop it
+        ESP_LOGE(TAG, "Pipeline stages 0x%x still busy after 10 s, stopping them",
+                 (unsigned)(stage_bits() & ~done));
+        request_stop();
+        done = xEventGroupWaitBits(sync_.task_done, stage_bits(), pdFALSE, pdTRUE,
+                                   pdMS_TO_TICKS(kSemaphoreTimeoutMs));
+        if ((done & stage_bits()) != stage_bits()) {
+            // Still running: keep running_ so open() won't reset the rings
+            // and semaphores under them
+            ESP_LOGE(TAG, "Pipeline stages 0x%x did not stop; open() fails until they finish",
+                     (unsigned)(stage_bits() & ~done));
+            return false;
+        }
+    }
+    if (stop_request_us_ > 0) {
+        int64_t idle_ms = (esp_timer_get_time() - stop_request_us_) / 1000;
+        if (idle_ms > kStopIdleTargetMs) {
+            ESP_LOGW(TAG, "Stop: pipeline idle %lld ms after request (target %d ms)",
+                     idle_ms, kStopIdleTargetMs);
+        } else {
+            ESP_LOGI(TAG, "Stop: pipeline idle %lld ms after request", idle_ms);
+        }
+    }
+
+    // The stages are back in wait_start(); the rings stay allocated for the
+    // next file.  Only the internal-RAM scaling tables are released.
+    video_info_.scale_map.deinit();
+    running_ = false;
+    return true;
 }
 
 }  // namespace mp4
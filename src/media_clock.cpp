@@ -0,0 +1,127 @@
+#include "media_clock.h"
+
+#ifdef BOARD_HAS_AUDIO
+
+#include "esp_attr.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+
+static const char *TAG = "clock";
+
+namespace mp4 {
+
+bool MediaClock::attach(i2s_chan_handle_t chan, unsigned sample_rate, unsigned frame_bytes)
+{
+    portENTER_CRITICAL(&lock_);
+    sample_rate_ = 0;
+    frame_bytes_ = frame_bytes;
+    written_     = 0;
+    unfilled_    = 0;
+    dac_frame_   = -1;
+    dac_time_us_ = 0;
+    seg_head_    = 0;
+    seg_count_   = 0;
+    starved_     = 0;
+    portEXIT_CRITICAL(&lock_);
+
+    // Must be registered before the channel is enabled
+    i2s_event_callbacks_t cbs = {};
+    cbs.on_sent = on_sent;
+    esp_err_t ret = i2s_channel_register_event_callback(chan, &cbs, this);
+    if (ret != ESP_OK) {
+        ESP_LOGW(TAG, "on_sent callback not registered (%s): video paces by wall clock",
+                 esp_err_to_name(ret));
+        return false;
+    }
+    portENTER_CRITICAL(&lock_);
+    sample_rate_ = sample_rate;
+    portEXIT_CRITICAL(&lock_);
+    return true;
+}
+
+void MediaClock::detach()
+{
+    portENTER_CRITICAL(&lock_);
+    sample_rate_ = 0;
+    dac_frame_   = -1;
+    seg_count_   = 0;
+    portEXIT_CRITICAL(&lock_);
+}
+
+void MediaClock::flush()
+{
+    portENTER_CRITICAL(&lock_);
+    seg_count_ = 0;
+    portEXIT_CRITICAL(&lock_);
+}
+
+void MediaClock::mark(int64_t pts_us)
+{
+    portENTER_CRITICAL(&lock_);
+    segments_[seg_head_] = { written_, pts_us };
+    seg_head_ = (seg_head_ + 1) % kClockSegments;
+    if (seg_count_ < kClockSegments) seg_count_++;
+    portEXIT_CRITICAL(&lock_);
+}
+
+void MediaClock::written(size_t bytes)
+{
+    portENTER_CRITICAL(&lock_);
+    const int64_t frames = bytes / frame_bytes_;
+    written_ += frames;
+    unfilled_ = (unfilled_ > frames) ? unfilled_ - frames : 0;
+    portEXIT_CRITICAL(&lock_);
+}
+
+int64_t MediaClock::now_us() const
+{
+    const int64_t t = esp_timer_get_time();
+    int64_t pts = -1;
+    portENTER_CRITICAL(&lock_);
+    if (sample_rate_ > 0 && dac_frame_ >= 0) {
+        // Frames clocked out since the interrupt: at most the one buffer
+        // it started, and none once the DMA is replaying stale data
+        int64_t since = (t - dac_time_us_) * sample_rate_ / 1000000;
+        if (since > kI2sDmaFrameNum) since = kI2sDmaFrameNum;
+        const uint64_t frame = (uint64_t)dac_frame_ + (since > 0 ? since : 0);
+        for (unsigned i = 1; i <= seg_count_; i++) {
+            const Segment &s = segments_[(seg_head_ + kClockSegments - i) % kClockSegments];
+            if (s.first_frame <= frame) {
+                pts = s.pts_us + (int64_t)(frame - s.first_frame) * 1000000 / sample_rate_;
+                break;
+            }
+        }
+    }
+    portEXIT_CRITICAL(&lock_);
+    return pts;
+}
+
+// I2S ISR: one DMA buffer has been clocked out
+bool IRAM_ATTR MediaClock::on_sent(i2s_chan_handle_t chan, i2s_event_data_t *event, void *arg)
+{
+    auto *self = static_cast<MediaClock *>(arg);
+    const int64_t t = esp_timer_get_time();
+    portENTER_CRITICAL_ISR(&self->lock_);
+    constexpr int64_t kAhead = (int64_t)(kI2sDmaDescNum - 1) * kI2sDmaFrameNum;
+    const int64_t frame = (int64_t)self->written_ - kAhead + self->unfilled_;
+    // This buffer joins the free list (which the driver caps at the others)
+    self->unfilled_ = (self->unfilled_ + kI2sDmaFrameNum < kAhead)
+                    ? self->unfilled_ + kI2sDmaFrameNum : kAhead;
+    const int64_t written = (int64_t)self->written_;
+    if (frame >= 0 && frame < written) {
+        if (frame != self->dac_frame_) {
+            self->dac_frame_   = frame;
+            self->dac_time_us_ = t;
+        }
+    } else if (written > 0 && frame >= written) {
+        // Nothing written for the buffer starting now: the DMA is replaying
+        // stale data and the clock must not run on
+        self->starved_ = self->starved_ + 1;
+    }
+    portEXIT_CRITICAL_ISR(&self->lock_);
+    return false;
+}
+
+}  // namespace mp4
+
+#endif // BOARD_HAS_AUDIO
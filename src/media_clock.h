@@ -0,0 +1,101 @@
+#pragma once
+
+#include "board_config.h"
+
+#ifdef BOARD_HAS_AUDIO
+
+#include <stdint.h>
+#include <stddef.h>
+#include "freertos/FreeRTOS.h"
+#include "driver/i2s_std.h"
+#include "player_constants.h"
+
+namespace mp4 {
+
+// Audio master clock: the timeline PTS of the sample at the DAC now, in µs.
+//
+// The audio task writes PCM one DMA buffer per i2s_channel_write() and
+// counts the frames written; before each decoded AAC frame it records
+// which frame number its PTS starts at (a small ring of segments).  The
+// I2S driver's on_sent interrupt fires as each DMA buffer finishes and
+// hands it back for refilling; at that instant the other kI2sDmaDescNum - 1
+// buffers hold the most recently written frames, except those handed back
+// earlier and not yet rewritten (the writer running late), so the frame
+// number at the DAC is exactly written - (kI2sDmaDescNum - 1) *
+// kI2sDmaFrameNum + unfilled.  now_us() maps that
+// back through the segments and interpolates with esp_timer for the time
+// since the interrupt (never past the next one), so the clock advances
+// smoothly at the sample rate and carries no DMA-depth offset.
+//
+// While the DMA is still playing out silence or pre-seek audio there is no
+// segment for the frame at the DAC and now_us() is -1; callers fall back
+// to the wall clock.  On underrun the written count stalls and so does the
+// clock, which is what video should follow.
+class MediaClock {
+public:
+    // Audio task, around each I2S channel's life
+    bool attach(i2s_chan_handle_t chan, unsigned sample_rate, unsigned frame_bytes);
+    void detach();
+
+    // Seek: forget every PTS mapping, so the clock reads -1 until audio of
+    // the new position reaches the DAC
+    void flush();
+
+    // Audio task: the next frame written starts at pts_us ...
+    void mark(int64_t pts_us);
+    // ... and bytes more have been handed to i2s_channel_write()
+    void written(size_t bytes);
+
+    // Any task: PTS at the DAC (µs), or -1 if unknown
+    int64_t now_us() const;
+
+    // DMA buffers that went out with nothing new written since attach
+    // (audible underruns)
+    unsigned starved_buffers() const { return starved_; }
+
+    // Bytes per i2s_channel_write() that keep the frame count exact
+    size_t write_chunk_bytes() const { return (size_t)kI2sDmaFrameNum * frame_bytes_; }
+
+private:
+    struct Segment {
+        uint64_t first_frame;
+        int64_t  pts_us;
+    };
+
+    static bool on_sent(i2s_chan_handle_t chan, i2s_event_data_t *event, void *arg);
+
+    mutable portMUX_TYPE lock_ = portMUX_INITIALIZER_UNLOCKED;
+    unsigned sample_rate_ = 0;   // 0 = detached
+    unsigned frame_bytes_ = 4;
+    uint64_t written_     = 0;   // frames handed to I2S since attach
+    int64_t  unfilled_    = 0;   // frames of DMA buffers handed back but not rewritten
+    int64_t  dac_frame_   = -1;  // frame at the DAC at the last on_sent (-1: none yet)
+    int64_t  dac_time_us_ = 0;   // esp_timer time of that interrupt
+    Segment  segments_[kClockSegments] = {};
+    unsigned seg_head_  = 0;     // next slot to fill
+    unsigned seg_count_ = 0;
+    volatile unsigned starved_ = 0;
+};
+
+// Running statistics of (video PTS - audio clock) as frames are shown:
+// positive means video is early
+struct AvOffsetStats {
+    unsigned count  = 0;
+    int64_t  sum_us = 0;
+    int64_t  abs_sum_us = 0;
+    int64_t  min_us = 0;
+    int64_t  max_us = 0;
+
+    void reset() { *this = AvOffsetStats(); }
+    void add(int64_t us) {
+        if (count == 0 || us < min_us) min_us = us;
+        if (count == 0 || us > max_us) max_us = us;
+        sum_us += us;
+        abs_sum_us += (us < 0) ? -us : us;
+        count++;
+    }
+};
+
+}  // namespace mp4
+
+#endif // BOARD_HAS_AUDIO
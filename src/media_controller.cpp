@@ -302,6 +302,20 @@ void MediaController::post_prev()
     xQueueSend(cmd_queue_, &cmd, 0);
 }
 
+void MediaController::post_seek(int ms)
+{
+    PlayerCmd cmd = {};
+    cmd.type = CmdType::Seek;
+    cmd.index = ms;
+    xQueueSend(cmd_queue_, &cmd, 0);
+}
+
+void MediaController::wait_for_command(TickType_t timeout)
+{
+    PlayerCmd cmd;
+    xQueuePeek(cmd_queue_, &cmd, timeout);
+}
+
 // --- Direct playback (main thread only, used by app_main) ---
 
 bool MediaController::play(int index)
@@ -329,22 +343,86 @@ bool MediaController::start_playback(int index, const std::string &folder, const
     playing_folder_ = folder;
     playing_file_ = filename;
 
-    std::string filepath = std::string(kSdMountPoint) + kPlaylistFolder;
-    if (!folder.empty()) filepath += "/" + folder;
-    filepath += "/" + filename;
+    std::string filepath = entry_path(folder, filename);
     ESP_LOGI(TAG, "Playing [%d]: %s", index, filepath.c_str());
 
-    static char path_buf[256];
+    char path_buf[kMaxPathBytes];
     snprintf(path_buf, sizeof(path_buf), "%s", filepath.c_str());
 
-    player_ = new Mp4Player(display_, path_buf);
-    player_->set_audio_priority(audio_priority_);
-    player_->set_volume(volume_);
-    player_->start();
+    // The pipeline tasks stay resident between files: only the first
+    // playback creates them
+    if (!engine_) engine_ = new Mp4Player(display_);
+    engine_->set_audio_priority(audio_priority_);
+    engine_->set_volume(volume_);
+    if (!engine_->open(path_buf)) {
+        playing_file_.clear();
+        return false;
+    }
+    player_ = engine_;
     playing_ = true;
+
+    next_index_     = -1;
+    pending_index_  = -1;
+    tracks_queued_  = 0;
+    tracks_started_ = 0;
+    queue_next();
     return true;
 }
 
+std::string MediaController::entry_path(const std::string &folder, const std::string &filename) const
+{
+    std::string filepath = std::string(kSdMountPoint) + kPlaylistFolder;
+    if (!folder.empty()) filepath += "/" + folder;
+    filepath += "/" + filename;
+    return filepath;
+}
+
+// Follow the player through gapless switches.  Demux takes the mailbox
+// entry (tracks_queued) and decode reaches it later (tracks_started); demux
+// waits for that before taking another, so at most one is pending.
+void MediaController::track_gapless_switches()
+{
+    while (tracks_queued_ != player_->tracks_queued() ||
+           tracks_started_ != player_->tracks_started()) {
+        if (tracks_started_ == tracks_queued_) {
+            tracks_queued_++;
+            pending_index_ = next_index_;
+            next_index_    = -1;  // the mailbox is empty again
+        } else {
+            tracks_started_++;
+            if (pending_index_ >= 0 && pending_index_ < (int)playing_playlist_.size()) {
+                current_index_ = pending_index_;
+                playing_file_  = playing_playlist_[current_index_];
+                ESP_LOGI(TAG, "Gapless switch to [%d]: %s", current_index_, playing_file_.c_str());
+            }
+            pending_index_ = -1;
+        }
+    }
+}
+
+// Keep the player's next-file mailbox on the entry auto-advance would pick
+// after the last one it has (repeat may be toggled while playing).
+void MediaController::queue_next()
+{
+    int after = (pending_index_ >= 0) ? pending_index_ : current_index_;
+    int next  = -1;
+    if (after + 1 < (int)playing_playlist_.size()) {
+        next = after + 1;
+    } else if (repeat_ && !playing_playlist_.empty()) {
+        next = 0;
+    }
+    if (next == next_index_) return;
+
+    next_index_ = next;
+    if (next < 0) {
+        player_->set_next(nullptr);
+        return;
+    }
+    std::string filepath = entry_path(playing_folder_, playing_playlist_[next]);
+    player_->set_next(filepath.c_str());
+    ESP_LOGI(TAG, "Next for gapless playback: [%d] %s", next, filepath.c_str());
+}
+
 bool MediaController::play_internal_by_name(const char *filename)
 {
     for (int i = 0; i < (int)playlist_.size(); i++) {
@@ -383,10 +461,9 @@ void MediaController::stop_and_wait()
 
     player_->request_stop();
     player_->wait_until_finished();
-    delete player_;
     player_ = nullptr;
     playing_ = false;
-    ESP_LOGI(TAG, "Player stopped and cleaned up");
+    ESP_LOGI(TAG, "Player stopped, pipeline idle");
 }
 
 bool MediaController::next_internal()
@@ -433,6 +510,11 @@ void MediaController::process_commands()
             user_stopped_ = false;
             prev_internal();
             break;
+        case CmdType::Seek:
+            if (player_ && player_->seek(cmd.index)) {
+                position_ms_ = player_->position_ms();
+            }
+            break;
         }
     }
 }
@@ -442,11 +524,20 @@ void MediaController::tick()
     // Process commands from HTTP handlers (main thread only)
     process_commands();
 
+    if (player_) {
+        track_gapless_switches();
+        queue_next();
+        position_ms_ = player_->position_ms();
+        duration_ms_ = player_->duration_ms();
+    } else {
+        position_ms_ = 0;
+        duration_ms_ = 0;
+    }
+
     if (player_ && player_->is_finished()) {
         ESP_LOGI(TAG, "Playback finished: %s", current_file());
-        // Clean up the finished player
+        // Stages back to idle; the tasks stay for the next file
         player_->wait_until_finished();
-        delete player_;
         player_ = nullptr;
         playing_ = false;
 
@@ -38,11 +38,12 @@ enum class CmdType : uint8_t {
     Stop,
     Next,
     Prev,
+    Seek,
 };
 
 struct PlayerCmd {
     CmdType type;
-    int index;
+    int index;          // playlist index, or target ms for Seek
     char filename[64];
 };
 
@@ -70,6 +71,7 @@ public:
     void post_stop();
     void post_next();
     void post_prev();
+    void post_seek(int ms);
 
     // Direct playback (main thread only, used by app_main)
     bool play(int index);
@@ -90,6 +92,8 @@ public:
     bool is_playing() const { return playing_; }
     int current_index() const { return current_index_; }
     const char *current_file() const;
+    int position_ms() const { return position_ms_; }  // refreshed by tick()
+    int duration_ms() const { return duration_ms_; }
 
     // Saved default folder from player.config
     const char *saved_folder() const { return player_config_.folder; }
@@ -100,11 +104,18 @@ public:
     // Call from main loop — processes queued commands and detects playback completion
     void tick();
 
+    // Main loop idle: returns early when a command is posted, so seeks and
+    // other controls don't wait out the full loop period.
+    void wait_for_command(TickType_t timeout);
+
 private:
     void process_commands();
     bool play_internal(int index);
     bool play_internal_by_name(const char *filename);
     bool start_playback(int index, const std::string &folder, const std::string &filename);
+    std::string entry_path(const std::string &folder, const std::string &filename) const;
+    void track_gapless_switches();
+    void queue_next();
     void stop_internal();
     void stop_and_wait();
     bool next_internal();
@@ -124,11 +135,22 @@ private:
     bool audio_priority_ = true;
     bool repeat_ = false;
     volatile bool playing_ = false;
+    volatile int position_ms_ = 0;
+    volatile int duration_ms_ = 0;
     bool user_stopped_ = false;
     int volume_ = 100;
 
     QueueHandle_t cmd_queue_ = nullptr;
-    Mp4Player *player_ = nullptr;
+    Mp4Player *engine_ = nullptr;  // created by the first playback, never deleted
+    Mp4Player *player_ = nullptr;  // engine_ while a file is playing
+
+    // Gapless playlist: the entry in the player's next-file mailbox, the one
+    // demux has taken but decode not yet reached, and the player's counters
+    // as last seen (Mp4Player::tracks_queued / tracks_started)
+    int next_index_    = -1;
+    int pending_index_ = -1;
+    uint32_t tracks_queued_  = 0;
+    uint32_t tracks_started_ = 0;
 };
 
 }  // namespace mp4
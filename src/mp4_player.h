@@ -11,28 +11,44 @@
 #include "lcd_config.h"
 #include "player_constants.h"
 #include "psram_alloc.h"
+#include "msg_ring.h"
+#include "yuv2rgb.h"
+#include "yuv_ring.h"
 
 #ifdef BOARD_HAS_AUDIO
 #include "driver/i2s_std.h"
+#include "media_clock.h"
+#include "gain_stage.h"
+#include "drift_control.h"
 #endif
 
 namespace mp4 {
 
+class SampleIndex;
+struct MovieParams;
+struct MoovTables;
+class TablePager;
+class ChunkReader;
+
 // --- Message types ---
 
 struct FrameMsg {
-    uint8_t *data;       // NAL data (PSRAM, receiver frees)
+    uint8_t *data;       // NAL data (inside nal_ring, valid until pop)
     int      size;
     int64_t  pts_us;
+    uint32_t epoch;      // PipelineSync::seek_epoch when demuxed; stale after a seek
     bool     is_sps_pps;
+    bool     track_start;  // first parameter set of a gapless continuation (next playlist file)
     bool     eos;
 };
 
 #ifdef BOARD_HAS_AUDIO
+// audio_ring: one AAC frame; pcm_ring: its decoded 16-bit PCM
 struct AudioMsg {
-    uint8_t *data;       // AAC frame (PSRAM, receiver frees)
+    uint8_t *data;       // payload (inside the ring, valid until pop)
     int      size;
     int64_t  pts_us;
+    uint32_t epoch;
     bool     eos;
 };
 #endif
@@ -46,64 +62,181 @@ struct VideoInfo {
     int scaled_h   = 0;
     int display_x  = 0;
     int display_y  = 0;
+    int32_t duration_ms = 0;  // set by demux once the sample index is built
+    ScaleMap scale_map;  // src -> scaled lookup (valid only when downscaling)
+    // SPS the decoder was started with: a gapless next file must carry the same
+    uint8_t  sps[kMaxParamSetBytes];
+    unsigned sps_bytes = 0;
+};
+
+// Gapless next-track mailbox item (PipelineSync::next_q)
+struct NextTrack {
+    char path[kMaxPathBytes];
 };
 
+// Created once with the worker tasks (init) and reset for every file they
+// play (reset): the rings, semaphores and queues are reused, never re-created.
 struct PipelineSync {
-    QueueHandle_t      nal_queue     = nullptr;
+    MsgRing<FrameMsg>  nal_ring;
     SemaphoreHandle_t  decode_ready  = nullptr;
     SemaphoreHandle_t  display_done  = nullptr;
     EventGroupHandle_t task_done     = nullptr;
+    EventGroupHandle_t task_start    = nullptr;  // same per-stage bits: "play the opened file"
+    volatile bool      shutdown      = false;    // with every start bit: worker tasks exit
     volatile bool      pipeline_eos  = false;
+    volatile bool      convert_eos   = false;    // full-frame mode: no frame behind the next decode_ready
     volatile bool      stop_requested = false;
     volatile bool      audio_priority = false;
-
-    // Bits for task completion tracking via EventGroup
+    YuvRing            yuv_ring;      // decoded frames, decode -> Core 0 conversion
+
+    // Seek: Mp4Player::seek() sets the target and bumps the epoch.  Demux
+    // repositions when it sees a new epoch and stamps every message with the
+    // epoch it was read under; consumers drop anything older, so the rings
+    // flush themselves without the tasks being restarted.
+    volatile uint32_t  seek_epoch     = 0;
+    volatile int32_t   seek_target_ms = 0;
+    volatile int64_t   seek_request_us = 0;  // esp_timer time of the last seek (latency log)
+    volatile int32_t   position_ms    = 0;   // PTS of the last frame handed to display
+
+    // Gapless playlist: when a file has been demuxed to the end, demux takes
+    // the next one from next_q (a one-slot mailbox the controller
+    // overwrites) and runs straight on, its timestamps shifted to continue
+    // the previous file's.  Decode and audio see one timeline, so the
+    // decoder and I2S are never re-initialised.  Demux bumps tracks_queued
+    // when it takes a file and hands the new base / duration over with its
+    // track_start SPS; decode bumps tracks_started on reaching it and
+    // notifies demux_task, which waits for that before taking another file.
+    QueueHandle_t      next_q          = nullptr;
+    TaskHandle_t       demux_task      = nullptr;
+    volatile uint32_t  tracks_queued   = 0;
+    volatile uint32_t  tracks_started  = 0;
+    volatile int32_t   track_base_ms   = 0;  // timeline PTS where the file on screen starts
+    volatile int32_t   next_base_ms    = 0;  // demux -> decode, valid with the track_start SPS
+    volatile int32_t   next_duration_ms = 0;
+
+    // Bits for task completion tracking via EventGroup (task_start uses the
+    // same bit per stage)
     static constexpr EventBits_t kDemuxDone   = (1 << 0);
     static constexpr EventBits_t kDecodeDone  = (1 << 1);
     static constexpr EventBits_t kDisplayDone = (1 << 2);
     static constexpr EventBits_t kAudioDone   = (1 << 3);
+    static constexpr EventBits_t kConvertDone = (1 << 4);
+    static constexpr EventBits_t kAudioOutDone = (1 << 5);
     static constexpr EventBits_t kAllDone     = kDemuxDone | kDecodeDone | kDisplayDone;
-    static constexpr EventBits_t kAllDoneAudio = kAllDone | kAudioDone;
+    static constexpr EventBits_t kAllDoneAudio = kAllDone | kAudioDone | kAudioOutDone;
+    static constexpr EventBits_t kAllStages   = kAllDoneAudio | kConvertDone;
 
 #ifdef BOARD_HAS_AUDIO
-    QueueHandle_t     audio_queue   = nullptr;
-    volatile bool     audio_eos     = false;
+    MsgRing<AudioMsg> audio_ring;
+    MsgRing<AudioMsg, GainStage::kAlign> pcm_ring;  // decoded frames, AAC decode runs ahead of the I2S writer
+    volatile bool     audio_eos     = false;  // I2S writer has played the last frame
     volatile int      audio_volume  = 256;  // 0–256, 256=full volume
-    volatile int32_t  audio_playback_pts_ms = -1;  // A/V sync: audio task reports playback position (ms, -1=not started)
+    MediaClock        audio_clock;  // A/V sync master: PTS at the DAC, driven by I2S DMA interrupts
 #endif
 
     bool init() {
-        pipeline_eos   = false;
-        stop_requested = false;
-        audio_priority = false;
+        shutdown       = false;
 #ifdef BOARD_HAS_AUDIO
-        audio_eos      = false;
         audio_volume   = 256;
 #endif
-        nal_queue    = xQueueCreate(kNalQueueDepth, sizeof(FrameMsg));
-        decode_ready = xSemaphoreCreateBinary();
-        display_done = xSemaphoreCreateBinary();
+        bool rings_ok = nal_ring.init(kNalRingBytes) && yuv_ring.init();
+        // Counting: both frame buffers can be in flight at once (+1 for EOS)
+        decode_ready = xSemaphoreCreateCounting(kFrameBufferCount + 1, 0);
+        display_done = xSemaphoreCreateCounting(kFrameBufferCount, 0);
         task_done    = xEventGroupCreate();
+        task_start   = xEventGroupCreate();
+        next_q       = xQueueCreate(1, sizeof(NextTrack));
 #ifdef BOARD_HAS_AUDIO
-        audio_queue  = xQueueCreate(kAudioQueueDepth, sizeof(AudioMsg));
+        rings_ok = audio_ring.init(kAudioRingBytes) && pcm_ring.init(kPcmRingBytes) && rings_ok;
+#endif
+        bool ok = rings_ok && decode_ready && display_done && task_done && task_start && next_q;
+        if (ok) reset();
+        return ok;
+    }
+
+    // Between files only (every stage idle): back to the state of a fresh
+    // pipeline.  Volume and sync mode are set by the caller.
+    void reset() {
+        pipeline_eos   = false;
+        convert_eos    = false;
+        stop_requested = false;
+        audio_priority = false;
+        seek_epoch     = 0;
+        position_ms    = 0;
+        tracks_queued  = 0;
+        tracks_started = 0;
+        track_base_ms  = 0;
+        nal_ring.reset();
+        yuv_ring.reset();
+        xQueueReset(decode_ready);
+        xQueueReset(display_done);
+        xQueueReset(next_q);
+        xEventGroupClearBits(task_done, kAllStages);
+#ifdef BOARD_HAS_AUDIO
+        audio_ring.reset();
+        pcm_ring.reset();
+        audio_eos      = false;
+        audio_clock.flush();
 #endif
-        return nal_queue && decode_ready && display_done && task_done;
     }
 
     void deinit() {
-        if (nal_queue)    { vQueueDelete(nal_queue);         nal_queue    = nullptr; }
+        nal_ring.deinit();
+        yuv_ring.deinit();
         if (decode_ready) { vSemaphoreDelete(decode_ready);  decode_ready = nullptr; }
         if (display_done) { vSemaphoreDelete(display_done);  display_done = nullptr; }
         if (task_done)    { vEventGroupDelete(task_done);    task_done    = nullptr; }
+        if (task_start)   { vEventGroupDelete(task_start);   task_start   = nullptr; }
+        if (next_q)       { vQueueDelete(next_q);            next_q       = nullptr; }
 #ifdef BOARD_HAS_AUDIO
-        if (audio_queue)  { vQueueDelete(audio_queue);       audio_queue  = nullptr; }
+        audio_ring.deinit();
+        pcm_ring.deinit();
 #endif
     }
+
+    // Stop: wake every stage blocked on a ring, queue or semaphore so it
+    // sees stop_requested now instead of at its next poll timeout (stages
+    // re-check it after every wait).  Pacing sleeps are woken separately,
+    // with a task notification.
+    void cancel_waits() {
+        nal_ring.cancel();
+        yuv_ring.cancel();
+        xSemaphoreGive(decode_ready);
+        xSemaphoreGive(display_done);
+#ifdef BOARD_HAS_AUDIO
+        audio_ring.cancel();
+        pcm_ring.cancel();
+#endif
+    }
+
+    // A stage giving up on the file (allocation failure): stop the others
+    // as request_stop() would, demux included if it is waiting for a
+    // gapless switch that will never come
+    void abort_file() {
+        stop_requested = true;
+        cancel_waits();
+        if (demux_task) xTaskNotifyGive(demux_task);
+    }
+
+    // Worker task side: block until the next file is opened (true) or the
+    // pipeline shuts down (false)
+    bool wait_start(EventBits_t stage) {
+        xEventGroupWaitBits(task_start, stage, pdTRUE, pdTRUE, portMAX_DELAY);
+        return !shutdown;
+    }
 };
 
+// Two RGB565 frames in panel byte order.  Ownership is handed over with
+// counting semaphores (one token per buffer): decode fills write_buf() while
+// display DMAs the other one, each side walking the buffers in order.
 class DoubleBuffer {
 public:
+
+    // Buffers of the same size as last time are kept
     bool init(int width, int height) {
+        write_idx_ = 0;
+        if (valid() && width == width_ && height == height_) return true;
+        deinit();
         width_  = width;
         height_ = height;
         size_t count = width * height;
@@ -119,15 +252,25 @@ public:
 
     ~DoubleBuffer() { deinit(); }
 
-    uint16_t *write_buf() { return bufs_[write_idx_]; }
-    uint16_t *read_buf()  { return bufs_[read_idx_]; }
-    void swap()           { write_idx_ ^= 1; read_idx_ ^= 1; }
-    bool valid() const    { return bufs_[0] != nullptr && bufs_[1] != nullptr; }
+    uint16_t *write_buf()  { return bufs_[write_idx_]; }
+    uint16_t *buf(int idx) { return bufs_[idx]; }
+    void swap()            { write_idx_ ^= 1; }
+
+    // PTS and gapless switch marker of the frame in write_buf() (display's
+    // A/V offset and gap logs)
+    void set_frame_info(int64_t pts_us, bool track_start) {
+        pts_[write_idx_] = pts_us;
+        track_start_[write_idx_] = track_start;
+    }
+    int64_t pts_us(int idx) const   { return pts_[idx]; }
+    bool track_start(int idx) const { return track_start_[idx]; }
+    bool valid() const     { return bufs_[0] != nullptr && bufs_[1] != nullptr; }
 
 private:
-    uint16_t *bufs_[2] = {nullptr, nullptr};
+    uint16_t *bufs_[kFrameBufferCount] = {nullptr, nullptr};
+    int64_t pts_[kFrameBufferCount] = {0, 0};
+    bool track_start_[kFrameBufferCount] = {false, false};
     int write_idx_ = 0;
-    int read_idx_  = 1;
     int width_  = 0;
     int height_ = 0;
 };
@@ -152,7 +295,7 @@ public:
                , AudioInfo &audio_info
 #endif
                )
-        : filepath_(filepath), sync_(sync), video_info_(video_info)
+        : open_path_(filepath), filepath_(filepath), sync_(sync), video_info_(video_info)
 #ifdef BOARD_HAS_AUDIO
         , audio_info_(audio_info)
 #endif
@@ -162,36 +305,79 @@ public:
 
 private:
     void run();
-    bool send_nal(const uint8_t *data, int size, int64_t pts_us, bool is_sps_pps);
-    bool send_video_frame(const uint8_t *data, int size, int64_t pts_us);
-#ifdef BOARD_HAS_AUDIO
-    bool send_audio(const uint8_t *data, int size, int64_t pts_us);
-#endif
+    bool demux_file(bool continuation);
+    bool take_next();
+    bool parse_moov(MovieParams &params, SampleIndex &v_index, SampleIndex *a_index);
+    bool open_paged(TablePager &pager, const MoovTables &tables, MovieParams &params,
+                    SampleIndex &v_index, SampleIndex *a_index);
+    bool send_parameter_set(const void *nal, int nal_bytes, bool track_start);
     void send_eos();
+    void log_startup();
+    bool fetch_sample(ChunkReader &reader, uint32_t offset, unsigned size, uint8_t *dst,
+                      uint32_t other_offset);
+    unsigned apply_seek(const SampleIndex &v_index, uint32_t &epoch);
 
     static int  mp4_read_cb(int64_t offset, void *buffer, size_t size, void *token);
-    static int  build_annex_b_nal(uint8_t *dst, int capacity, const uint8_t *src, int size);
+    static int  avcc_to_annex_b(uint8_t *buf, int size);
 
-    const char   *filepath_;
+    const char   *open_path_;  // Mp4Player's: the file each run() starts with
+    const char   *filepath_;   // the file being demuxed
     PipelineSync &sync_;
     VideoInfo    &video_info_;
 #ifdef BOARD_HAS_AUDIO
     AudioInfo    &audio_info_;
 #endif
+
+    // Gapless continuation: filepath_ points at next_path_ once the first
+    // file is done, and every PTS is stamped base_us_ later than the file's
+    char     next_path_[kMaxPathBytes] = {};
+    int64_t  base_us_        = 0;
+    int64_t  clock_start_us_ = 0;      // audio priority: wall time at timeline PTS 0 (until the audio clock runs)
+    bool     has_audio_      = false;  // first file's; a continuation must match it
+
+    // Byte counters: SD -> PSRAM reads vs. CPU memcpy inside demux.  Samples
+    // are copied once, out of the read-ahead ring into nal_ring/audio_ring;
+    // SPS/PPS copies are the only ones left by direct-to-ring reads.
+    uint64_t bytes_read_          = 0;
+    uint64_t sample_bytes_copied_ = 0;
+    uint64_t param_bytes_copied_  = 0;
+
+    // Startup timing (open -> first frame queued)
+    int64_t open_start_us_  = 0;
+    bool    index_cached_   = false;
+    bool    startup_logged_ = false;
 };
 
 class DecodeStage {
 public:
-    DecodeStage(PipelineSync &sync, VideoInfo &video_info, DoubleBuffer &dbuf)
-        : sync_(sync), video_info_(video_info), dbuf_(dbuf) {}
+    DecodeStage(PipelineSync &sync, VideoInfo &video_info)
+        : sync_(sync), video_info_(video_info) {}
 
     static void task_func(void *arg);
 
 private:
     void run();
-    void compute_scaling(int video_w, int video_h);
+    bool compute_scaling(int video_w, int video_h);
     void drain_queue();
 
+    PipelineSync &sync_;
+    VideoInfo    &video_info_;
+};
+
+// Full-frame mode only: YUV ring -> RGB565 DoubleBuffer on Core 0, so the
+// decoder on Core 1 never waits for colour conversion or the LCD.
+// (In band mode DisplayStage converts straight from the ring.)
+class ConvertStage {
+public:
+    ConvertStage(PipelineSync &sync, VideoInfo &video_info, DoubleBuffer &dbuf)
+        : sync_(sync), video_info_(video_info), dbuf_(dbuf) {}
+
+    static void task_func(void *arg);
+
+private:
+    void run();
+    void drain_ring();
+
     PipelineSync &sync_;
     VideoInfo    &video_info_;
     DoubleBuffer &dbuf_;
@@ -206,14 +392,37 @@ public:
 
 private:
     void run();
+    void run_bands();
+    void finish_transfer();
+    void note_shown(bool track_start, int64_t pts_us);
+    void log_av_offset();
 
     PipelineSync &sync_;
     VideoInfo    &video_info_;
     DoubleBuffer &dbuf_;
     LGFX         &display_;
+
+    // Transfer stats (DMA overlap with the next frame's conversion)
+    unsigned frames_         = 0;
+    unsigned busy_on_ready_  = 0;  // next frame was ready before DMA finished
+    int64_t  push_start_us_  = 0;
+    int64_t  last_issue_us_  = 0;
+    int64_t  total_issue_us_ = 0;  // CPU time inside pushImageDMA()
+    int64_t  total_wait_us_  = 0;  // blocked in waitDMA()
+
+    // Track-change LCD gap (last frame of one file -> first of the next)
+    int64_t  first_shown_us_ = 0;
+    int64_t  last_shown_us_  = 0;
+    int64_t  prev_last_shown_us_ = 0;  // previous run(), if it played to the end
+
+#ifdef BOARD_HAS_AUDIO
+    AvOffsetStats av_offset_;  // shown frame's PTS vs. the audio clock
+#endif
 };
 
 #ifdef BOARD_HAS_AUDIO
+// AAC decode: audio_ring -> pcm_ring, as far ahead of playback as the PCM
+// ring allows
 class AudioPipeline {
 public:
     AudioPipeline(PipelineSync &sync, AudioInfo &audio_info)
@@ -221,24 +430,53 @@ public:
 
     static void task_func(void *arg);
 
+private:
+    void run();
+    void drain_queue();
+    void send_eos();
+
+    PipelineSync &sync_;
+    AudioInfo    &audio_info_;
+};
+
+// I2S writer: pcm_ring -> volume -> I2S DMA.  Owns the channel and feeds
+// the media clock.
+class AudioOutput {
+public:
+    AudioOutput(PipelineSync &sync, AudioInfo &audio_info)
+        : sync_(sync), audio_info_(audio_info) {}
+    ~AudioOutput() { safe_free(resample_buf_); }
+
+    static void task_func(void *arg);
+
 private:
     void run();
     bool init_i2s(unsigned sample_rate, unsigned channels);
     void deinit_i2s();
-    void drain_queue();
+    void drain_ring();
 
     PipelineSync &sync_;
     AudioInfo    &audio_info_;
     i2s_chan_handle_t tx_chan_ = nullptr;
+    GainStage     gain_;
+    DriftController drift_;
+    Resampler     resampler_;
+    int16_t      *resample_buf_ = nullptr;  // internal RAM, kept between files
 };
 #endif
 
 // --- Orchestrator ---
 
+// Long-lived pipeline: the stage tasks are created by the first open() and
+// stay resident, each blocked on PipelineSync::task_start between files.
+// open() resets the shared state and starts them on a file, request_stop()
+// and wait_until_finished() end it (seek() is the in-file flush); nothing
+// is allocated or spawned per file except what depends on it (decoder,
+// I2S, index).
 class Mp4Player {
 public:
-    Mp4Player(LGFX &display, const char *filepath)
-        : display_(display), filepath_(filepath) {}
+    explicit Mp4Player(LGFX &display) : display_(display) {}
+    ~Mp4Player();
 
     void set_audio_priority(bool v) { audio_priority_ = v; }
     void set_volume(int vol) {
@@ -247,14 +485,46 @@ public:
         sync_.audio_volume = vol * 256 / 100;
 #endif
     }
-    void start();
+    // Start playing filepath; the previous file must have finished
+    // (wait_until_finished).  False if the pipeline could not be created
+    // or a stage of the previous file is still running.
+    bool open(const char *filepath);
     void request_stop();
     bool is_finished() const;
-    void wait_until_finished();
+    // Wait for every stage to finish the file, stopping them if they
+    // haven't after 10 s.  False if a stage still hasn't: the pipeline
+    // stays running and open() refuses until it reports done.
+    bool wait_until_finished();
+
+    // Gapless playlist: the file to continue with once this one has been
+    // demuxed to the end (nullptr = none; the last call wins).  Demux
+    // indexes it and queues its first GOP while this file plays out, and
+    // falls back to ending playback if its video size or audio format
+    // differ.  tracks_queued() counts files demux has taken from here,
+    // tracks_started() those decode has switched to.
+    void set_next(const char *filepath);
+    uint32_t tracks_queued() const  { return sync_.tracks_queued; }
+    uint32_t tracks_started() const { return sync_.tracks_started; }
+
+    // Jump to the keyframe at or before ms; the tasks keep running.
+    // Fails once demux has sent EOS (nothing left to reposition) or has
+    // moved on to the next file.  Positions are relative to the file on screen.
+    bool seek(int32_t ms);
+    int32_t position_ms() const {
+        int32_t ms = sync_.position_ms - sync_.track_base_ms;
+        return (ms > 0) ? ms : 0;
+    }
+    int32_t duration_ms() const { return video_info_.duration_ms; }
 
 private:
+    bool create_tasks();
+    EventBits_t stage_bits() const;
+    void notify_tasks();
+
     LGFX         &display_;
-    const char   *filepath_;
+    char          filepath_[kMaxPathBytes] = {};
+    bool          running_ = false;  // a file has been opened and not yet waited for
+    int64_t       stop_request_us_ = 0;  // esp_timer time of request_stop() (stop-to-idle log)
     bool          audio_priority_ = true;
     int           volume_ = 100;
 
@@ -268,8 +538,10 @@ private:
     TaskHandle_t  demux_handle_   = nullptr;
     TaskHandle_t  decode_handle_  = nullptr;
     TaskHandle_t  display_handle_ = nullptr;
+    TaskHandle_t  convert_handle_ = nullptr;
 #ifdef BOARD_HAS_AUDIO
     TaskHandle_t  audio_handle_   = nullptr;
+    TaskHandle_t  audio_out_handle_ = nullptr;
 #endif
 };
 
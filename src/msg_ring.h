@@ -0,0 +1,191 @@
+#pragma once
+
+#include <atomic>
+#include <new>
+#include <stdint.h>
+#include <stddef.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/semphr.h"
+#include "psram_alloc.h"
+
+namespace mp4 {
+
+// Single-producer / single-consumer ring of variable-length messages in PSRAM.
+//
+// Each record is [length][T][payload], Align-byte aligned (16 lets SIMD
+// code load payloads 128 bits at a time), laid out contiguously; T must
+// expose `uint8_t *data` and `int size`, which reserve() points at the
+// record's payload area.  Capacity is a byte budget, so a 40 KB IDR takes
+// 40 KB of it and a 300-byte P-frame takes 300 bytes, and nothing is
+// malloc'd per message.
+//
+// head_/tail_ are free-running byte counters (capacity is a power of two so
+// they stay consistent across uint32 wrap-around).  The data path is
+// lock-free; the two binary semaphores are only used to sleep while the ring
+// is full/empty, and every waiter re-checks the counters after waking.
+template <typename T, size_t Align = 8>
+class MsgRing {
+public:
+    bool init(size_t capacity_bytes) {
+        size_t cap = 1024;
+        while (cap < capacity_bytes) cap <<= 1;
+        buf_ = psram_alloc_aligned<uint8_t>(cap, Align);
+        data_sem_  = xSemaphoreCreateBinary();
+        space_sem_ = xSemaphoreCreateBinary();
+        cap_ = cap;
+        head_.store(0);
+        tail_.store(0);
+        return buf_ && data_sem_ && space_sem_;
+    }
+
+    // Empty the ring for reuse; only while neither side is using it.
+    void reset() {
+        head_.store(0);
+        tail_.store(0);
+        pending_   = 0;
+        front_len_ = 0;
+        cancelled_.store(false);
+        if (data_sem_)  xSemaphoreTake(data_sem_, 0);
+        if (space_sem_) xSemaphoreTake(space_sem_, 0);
+    }
+
+    void deinit() {
+        safe_free(buf_); buf_ = nullptr;
+        if (data_sem_)  { vSemaphoreDelete(data_sem_);  data_sem_  = nullptr; }
+        if (space_sem_) { vSemaphoreDelete(space_sem_); space_sem_ = nullptr; }
+        cap_ = 0;
+    }
+
+    bool valid() const { return buf_ != nullptr; }
+    size_t capacity() const { return cap_; }
+    size_t used_bytes() const { return head_.load(std::memory_order_acquire) - tail_.load(std::memory_order_acquire); }
+
+    // --- Producer side ---
+
+    // Reserve a record with room for `payload` bytes.  Returns the message
+    // header (zero-initialised, data/size filled in), or nullptr on timeout.
+    // Records larger than half the capacity are rejected outright: with a
+    // wrap marker in front they could never fit.  Nothing is visible to the
+    // consumer until commit(); an uncommitted reservation is simply
+    // overwritten by the next one.
+    T *reserve(size_t payload, TickType_t timeout) {
+        const uint32_t rec = record_bytes(payload);
+        if (!buf_ || rec > cap_ / 2) return nullptr;
+
+        TickType_t start = xTaskGetTickCount();
+        uint32_t head = head_.load(std::memory_order_relaxed);
+        uint32_t idx, skip;
+        while (true) {
+            if (cancelled_.load(std::memory_order_relaxed)) return nullptr;
+            uint32_t free = cap_ - (head - tail_.load(std::memory_order_acquire));
+            idx = head & (cap_ - 1);
+            uint32_t contiguous = cap_ - idx;
+            skip = (rec <= contiguous) ? 0 : contiguous;
+            if (skip + rec <= free) break;
+            if (!wait(space_sem_, start, timeout)) return nullptr;
+        }
+
+        if (skip) {
+            // Not enough room before the end: leave a wrap marker and restart at 0
+            *reinterpret_cast<uint32_t *>(buf_ + idx) = kWrapMarker;
+            idx = 0;
+        }
+        *reinterpret_cast<uint32_t *>(buf_ + idx) = rec;
+        T *msg = new (buf_ + idx + kHeaderOffset) T{};
+        msg->data = buf_ + idx + kPayloadOffset;
+        msg->size = (int)payload;
+        pending_     = skip + rec;
+        pending_idx_ = idx;
+        return msg;
+    }
+
+    // Publish the record returned by the last reserve().
+    void commit() {
+        head_.store(head_.load(std::memory_order_relaxed) + pending_, std::memory_order_release);
+        pending_ = 0;
+        xSemaphoreGive(data_sem_);
+    }
+
+    // Publish it with only the first `payload` bytes used (at most what was
+    // reserved): reserve for the worst case, give the rest back.
+    void commit(size_t payload) {
+        uint32_t *len = reinterpret_cast<uint32_t *>(buf_ + pending_idx_);
+        const uint32_t rec = record_bytes(payload);
+        pending_ -= *len - rec;
+        *len = rec;
+        reinterpret_cast<T *>(buf_ + pending_idx_ + kHeaderOffset)->size = (int)payload;
+        commit();
+    }
+
+    // --- Consumer side ---
+
+    // Oldest committed message, or nullptr on timeout.  Stays valid (and
+    // owns its payload) until pop().
+    T *front(TickType_t timeout) {
+        if (!buf_) return nullptr;
+        TickType_t start = xTaskGetTickCount();
+        while (true) {
+            if (cancelled_.load(std::memory_order_relaxed)) return nullptr;
+            uint32_t tail = tail_.load(std::memory_order_relaxed);
+            if (head_.load(std::memory_order_acquire) != tail) {
+                uint32_t idx = tail & (cap_ - 1);
+                uint32_t len = *reinterpret_cast<uint32_t *>(buf_ + idx);
+                if (len == kWrapMarker) {
+                    tail_.store(tail + (cap_ - idx), std::memory_order_release);
+                    continue;  // the record after a marker is always committed with it
+                }
+                front_len_ = len;
+                return reinterpret_cast<T *>(buf_ + idx + kHeaderOffset);
+            }
+            if (!wait(data_sem_, start, timeout)) return nullptr;
+        }
+    }
+
+    // Release the message returned by front().
+    void pop() {
+        tail_.store(tail_.load(std::memory_order_relaxed) + front_len_, std::memory_order_release);
+        front_len_ = 0;
+        xSemaphoreGive(space_sem_);
+    }
+
+    // Wake any blocked producer/consumer so it can re-check its exit conditions.
+    void wake() {
+        if (data_sem_)  xSemaphoreGive(data_sem_);
+        if (space_sem_) xSemaphoreGive(space_sem_);
+    }
+
+    // Stop: reserve() and front() fail at once until reset(), and whichever
+    // side is blocked wakes now rather than at the end of its timeout.
+    void cancel() {
+        cancelled_.store(true);
+        wake();
+    }
+
+private:
+    static constexpr uint32_t kWrapMarker = 0xFFFFFFFFu;
+    static_assert(Align >= 8 && (Align & (Align - 1)) == 0, "Align: power of two, at least 8");
+    static constexpr uint32_t align(size_t n) { return (uint32_t)((n + Align - 1) & ~(Align - 1)); }
+    static constexpr uint32_t kHeaderOffset  = align(sizeof(uint32_t));
+    static constexpr uint32_t kPayloadOffset = kHeaderOffset + align(sizeof(T));
+    static constexpr uint32_t record_bytes(size_t payload) { return kPayloadOffset + align(payload); }
+
+    static bool wait(SemaphoreHandle_t sem, TickType_t start, TickType_t timeout) {
+        TickType_t elapsed = xTaskGetTickCount() - start;
+        if (elapsed >= timeout) return false;
+        return xSemaphoreTake(sem, timeout - elapsed) == pdTRUE;
+    }
+
+    uint8_t          *buf_ = nullptr;
+    uint32_t          cap_ = 0;
+    std::atomic<uint32_t> head_{0};   // written by producer only
+    std::atomic<uint32_t> tail_{0};   // written by consumer only
+    std::atomic<bool> cancelled_{false};
+    uint32_t          pending_   = 0; // producer-private
+    uint32_t          pending_idx_ = 0;
+    uint32_t          front_len_ = 0; // consumer-private
+    SemaphoreHandle_t data_sem_  = nullptr;
+    SemaphoreHandle_t space_sem_ = nullptr;
+};
+
+}  // namespace mp4
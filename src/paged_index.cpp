@@ -0,0 +1,804 @@
+#include "paged_index.h"
+
+#include <cstring>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "index_cache.h"
+#include "player_constants.h"
+#include "psram_alloc.h"
+
+static const char *TAG = "paged_idx";
+
+namespace mp4 {
+
+static_assert((kTablePageBytes & (kTablePageBytes - 1)) == 0, "table pages must be a power of two");
+
+static inline uint32_t load_be32(const uint8_t *p)
+{
+    return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) | ((uint32_t)p[2] << 8) | p[3];
+}
+
+static inline uint16_t load_be16(const uint8_t *p)
+{
+    return (uint16_t)((p[0] << 8) | p[1]);
+}
+
+// ---- TablePager ----
+
+bool TablePager::open(const char *path, unsigned pages, size_t page_bytes)
+{
+    close();
+    if (pages == 0 || (page_bytes & (page_bytes - 1)) != 0) return false;
+    page_bytes_ = page_bytes;
+
+    fd_ = ::open(path, O_RDONLY);
+    if (fd_ < 0) {
+        ESP_LOGE(TAG, "Failed to open %s", path);
+        return false;
+    }
+    off_t size = lseek(fd_, 0, SEEK_END);
+    file_size_ = (size > 0) ? (uint32_t)size : 0;
+
+    mem_   = psram_alloc<uint8_t>((size_t)pages * page_bytes_);
+    pages_ = psram_alloc<Page>(pages);
+    if (!mem_ || !pages_) {
+        ESP_LOGE(TAG, "Failed to allocate %u x %u byte pages", pages, (unsigned)page_bytes);
+        close();
+        return false;
+    }
+    for (unsigned i = 0; i < pages; i++) {
+        pages_[i] = {0, 0, false};
+    }
+    count_ = pages;
+    return true;
+}
+
+void TablePager::close()
+{
+    if (fd_ >= 0) {
+        ::close(fd_);
+        fd_ = -1;
+    }
+    safe_free(mem_);
+    safe_free(pages_);
+    mem_   = nullptr;
+    pages_ = nullptr;
+    count_ = 0;
+    last_  = 0;
+}
+
+size_t TablePager::memory_bytes() const
+{
+    return (size_t)count_ * (page_bytes_ + sizeof(Page));
+}
+
+bool TablePager::read(uint64_t offset, void *dst, size_t size)
+{
+    if (offset + size > file_size_) return false;
+    if (lseek(fd_, (off_t)offset, SEEK_SET) < 0) return false;
+    return read_exact(fd_, dst, size);
+}
+
+bool TablePager::read_cached(uint64_t offset, void *dst, size_t size)
+{
+    requests_++;
+    requested_bytes_ += size;
+    if (offset + size > file_size_) return false;
+
+    auto *out = static_cast<uint8_t *>(dst);
+    const uint32_t mask = (uint32_t)page_bytes_ - 1;
+    while (size > 0) {
+        const uint32_t in = (uint32_t)offset & mask;
+        const size_t   n  = (size < page_bytes_ - in) ? size : page_bytes_ - in;
+        const uint8_t *p  = page((uint32_t)offset - in);
+        if (!p) return false;
+        memcpy(out, p + in, n);
+        out    += n;
+        offset += n;
+        size   -= n;
+    }
+    return true;
+}
+
+const uint8_t *TablePager::page(uint32_t base)
+{
+    if (count_ == 0) return nullptr;
+    if (pages_[last_].valid && pages_[last_].base == base) {
+        hits_++;
+        pages_[last_].last_use = ++clock_;
+        return mem_ + (size_t)last_ * page_bytes_;
+    }
+
+    unsigned victim = 0;
+    for (unsigned i = 0; i < count_; i++) {
+        if (pages_[i].valid && pages_[i].base == base) {
+            hits_++;
+            pages_[i].last_use = ++clock_;
+            last_ = i;
+            return mem_ + (size_t)i * page_bytes_;
+        }
+        // Prefer an empty page, otherwise the least recently used one
+        if (pages_[victim].valid &&
+            (!pages_[i].valid || pages_[i].last_use < pages_[victim].last_use)) {
+            victim = i;
+        }
+    }
+
+    uint8_t *mem = mem_ + (size_t)victim * page_bytes_;
+    size_t want = (file_size_ - base < page_bytes_) ? file_size_ - base : page_bytes_;
+    int64_t t0 = esp_timer_get_time();
+    bool ok = (base < file_size_) && read(base, mem, want);
+    fault_us_ += esp_timer_get_time() - t0;
+    faults_++;
+    fault_bytes_ += want;
+    if (!ok) {
+        if (!error_logged_) {
+            ESP_LOGE(TAG, "Table page read failed at %u", (unsigned)base);
+            error_logged_ = true;
+        }
+        pages_[victim].valid = false;
+        return nullptr;
+    }
+    if (want < page_bytes_) memset(mem + want, 0, page_bytes_ - want);
+    pages_[victim] = {base, ++clock_, true};
+    last_ = victim;
+    return mem;
+}
+
+bool TablePager::be32(uint32_t offset, uint32_t &value)
+{
+    value = 0;
+    const uint32_t mask = (uint32_t)page_bytes_ - 1;
+    const uint32_t in   = offset & mask;
+    if (in <= page_bytes_ - 4) {
+        const uint8_t *p = page(offset - in);
+        if (!p) return false;
+        value = load_be32(p + in);
+        return true;
+    }
+    // Entry straddles two pages (tables start at arbitrary box offsets)
+    uint8_t b[4];
+    for (unsigned i = 0; i < 4; i++) {
+        uint32_t o = offset + i;
+        const uint8_t *p = page(o & ~mask);
+        if (!p) return false;
+        b[i] = p[o & mask];
+    }
+    value = load_be32(b);
+    return true;
+}
+
+// ---- moov scan ----
+
+bool read_box(TablePager &io, uint64_t off, uint64_t limit, Box &box, bool cached)
+{
+    auto read = [&](uint64_t at, void *dst, size_t size) {
+        return cached ? io.read_cached(at, dst, size) : io.read(at, dst, size);
+    };
+    uint8_t h[16];
+    if (off + 8 > limit || !read(off, h, 8)) return false;
+    uint64_t size = load_be32(h);
+    box.type    = load_be32(h + 4);
+    box.payload = off + 8;
+    if (size == 1) {
+        if (off + 16 > limit || !read(off + 8, h + 8, 8)) return false;
+        size = ((uint64_t)load_be32(h + 8) << 32) | load_be32(h + 12);
+        box.payload = off + 16;
+    } else if (size == 0) {
+        size = limit - off;  // extends to the end of the enclosing box / file
+    }
+    if (size < box.payload - off || off + size > limit) return false;
+    box.end = off + size;
+    return true;
+}
+
+// One trak: handler, timescale and where each table's entries start.
+// stsd is only located here; it is parsed once the track is chosen.
+struct TrakScan {
+    TrackTables tables;
+    uint64_t    stsd_payload = 0;
+    uint64_t    stsd_end     = 0;
+};
+
+static void scan_trak_boxes(TablePager &io, uint64_t off, uint64_t end, TrakScan &trak)
+{
+    TrackTables &t = trak.tables;
+    Box b;
+    uint8_t p[24];
+    while (read_box(io, off, end, b)) {
+        const uint64_t payload_bytes = b.end - b.payload;
+        switch (b.type) {
+        case fourcc("mdia"):
+        case fourcc("minf"):
+        case fourcc("stbl"):
+            scan_trak_boxes(io, b.payload, b.end, trak);
+            break;
+        case fourcc("tkhd"):
+            if (payload_bytes >= 24 && io.read(b.payload, p, 24)) {
+                t.track_id = load_be32(p + (p[0] == 1 ? 20 : 12));
+            }
+            break;
+        case fourcc("hdlr"):
+            if (payload_bytes >= 12 && io.read(b.payload, p, 12)) t.handler = load_be32(p + 8);
+            break;
+        case fourcc("mdhd"):
+            if (payload_bytes >= 24 && io.read(b.payload, p, 24)) {
+                t.timescale = load_be32(p + (p[0] == 1 ? 20 : 12));
+            }
+            break;
+        case fourcc("stsd"):
+            trak.stsd_payload = b.payload;
+            trak.stsd_end     = b.end;
+            break;
+        case fourcc("stsz"):
+            if (payload_bytes >= 12 && io.read(b.payload, p, 12)) {
+                t.sample_size  = load_be32(p + 4);
+                t.sample_count = load_be32(p + 8);
+                t.stsz = {(uint32_t)b.payload + 12, t.sample_size ? 0 : t.sample_count};
+            }
+            break;
+        case fourcc("stco"):
+        case fourcc("co64"):
+        case fourcc("stsc"):
+        case fourcc("stts"):
+        case fourcc("stss"):
+            if (payload_bytes >= 8 && io.read(b.payload, p, 8)) {
+                TableRef ref = {(uint32_t)b.payload + 8, load_be32(p + 4)};
+                if (b.type == fourcc("stsc"))      t.stsc = ref;
+                else if (b.type == fourcc("stts")) t.stts = ref;
+                else if (b.type == fourcc("stss")) t.stss = ref;
+                else {
+                    t.stco = ref;
+                    t.co64 = (b.type == fourcc("co64"));
+                }
+            }
+            break;
+        default:
+            break;
+        }
+        off = b.end;
+    }
+}
+
+// 'avc1'/'avc3' entry: dimensions + SPS/PPS from avcC
+static bool parse_avc_entry(TablePager &io, const Box &entry, MovieParams &params)
+{
+    uint8_t v[78];
+    if (entry.end - entry.payload < 78 || !io.read(entry.payload, v, sizeof(v))) return false;
+    params.video_w = load_be16(v + 24);
+    params.video_h = load_be16(v + 26);
+
+    Box b;
+    for (uint64_t off = entry.payload + 78; read_box(io, off, entry.end, b); off = b.end) {
+        if (b.type != fourcc("avcC")) continue;
+        uint8_t cfg[2 * kMaxParamSetBytes + 16];
+        size_t n = (b.end - b.payload < sizeof(cfg)) ? (size_t)(b.end - b.payload) : sizeof(cfg);
+        if (n < 7 || !io.read(b.payload, cfg, n)) return false;
+        // First SPS and first PPS only (what MP4D_read_sps/pps(..., 0) return)
+        size_t pos = 5;
+        unsigned num_sps = cfg[pos++] & 0x1F;
+        for (unsigned i = 0; i < num_sps && pos + 2 <= n; i++) {
+            unsigned len = load_be16(cfg + pos);
+            pos += 2;
+            if (pos + len > n) return false;
+            if (i == 0 && len <= kMaxParamSetBytes) {
+                memcpy(params.sps, cfg + pos, len);
+                params.sps_bytes = len;
+            }
+            pos += len;
+        }
+        if (pos >= n) return params.sps_bytes > 0;
+        unsigned num_pps = cfg[pos++];
+        for (unsigned i = 0; i < num_pps && pos + 2 <= n; i++) {
+            unsigned len = load_be16(cfg + pos);
+            pos += 2;
+            if (pos + len > n) break;
+            if (i == 0 && len <= kMaxParamSetBytes) {
+                memcpy(params.pps, cfg + pos, len);
+                params.pps_bytes = len;
+            }
+            pos += len;
+        }
+        return params.sps_bytes > 0;
+    }
+    return false;
+}
+
+// MPEG-4 descriptor header: tag + variable-length size
+static bool read_descriptor(const uint8_t *buf, size_t n, size_t &pos, uint8_t &tag, uint32_t &len)
+{
+    if (pos >= n) return false;
+    tag = buf[pos++];
+    len = 0;
+    for (int i = 0; i < 4; i++) {
+        if (pos >= n) return false;
+        uint8_t c = buf[pos++];
+        len = (len << 7) | (c & 0x7F);
+        if (!(c & 0x80)) break;
+    }
+    return pos + len <= n || tag == 0x03;  // ES_Descriptor may claim more than we read
+}
+
+// 'mp4a' entry: channels, rate and the AAC AudioSpecificConfig from esds
+static bool parse_mp4a_entry(TablePager &io, const Box &entry, MovieParams &params)
+{
+    uint8_t a[28];
+    if (entry.end - entry.payload < 28 || !io.read(entry.payload, a, sizeof(a))) return false;
+    unsigned version = load_be16(a + 8);
+    params.audio_channels = load_be16(a + 16);
+    params.audio_rate     = load_be32(a + 24) >> 16;
+    uint64_t children = entry.payload + 28 + (version == 1 ? 16 : version == 2 ? 36 : 0);
+
+    Box b;
+    for (uint64_t off = children; read_box(io, off, entry.end, b); off = b.end) {
+        if (b.type != fourcc("esds")) continue;
+        uint8_t buf[128];
+        size_t n = (b.end - b.payload < sizeof(buf)) ? (size_t)(b.end - b.payload) : sizeof(buf);
+        if (n < 4 || !io.read(b.payload, buf, n)) return false;
+        size_t pos = 4;  // version + flags
+        uint8_t tag;
+        uint32_t len;
+        if (!read_descriptor(buf, n, pos, tag, len) || tag != 0x03) return false;
+        if (pos + 3 > n) return false;
+        uint8_t flags = buf[pos + 2];
+        pos += 3;                                  // ES_ID, flags
+        if (flags & 0x80) pos += 2;                // dependsOn_ES_ID
+        if ((flags & 0x40) && pos < n) pos += 1 + buf[pos];  // URL
+        if (flags & 0x20) pos += 2;                // OCR_ES_Id
+        if (!read_descriptor(buf, n, pos, tag, len) || tag != 0x04 || len < 13) return false;
+        uint8_t object_type = buf[pos];
+        if (object_type != 0x40) return false;     // MPEG-4 audio (AAC)
+        pos += 13;
+        if (read_descriptor(buf, n, pos, tag, len) && tag == 0x05 && len <= kMaxDsiBytes) {
+            memcpy(params.dsi, buf + pos, len);
+            params.dsi_bytes = len;
+        }
+        return true;
+    }
+    return false;
+}
+
+// First sample entry of a track's stsd, parsed into params if it is the
+// codec the handler calls for
+static bool parse_sample_entry(TablePager &io, const TrakScan &trak, MovieParams &params)
+{
+    uint8_t h[8];
+    if (!trak.stsd_payload || !io.read(trak.stsd_payload, h, 8) || load_be32(h + 4) == 0) {
+        return false;
+    }
+    Box entry;
+    if (!read_box(io, trak.stsd_payload + 8, trak.stsd_end, entry)) return false;
+    if (trak.tables.handler == fourcc("vide") &&
+        (entry.type == fourcc("avc1") || entry.type == fourcc("avc3"))) {
+        return parse_avc_entry(io, entry, params);
+    }
+    if (trak.tables.handler == fourcc("soun") && entry.type == fourcc("mp4a")) {
+        return parse_mp4a_entry(io, entry, params);
+    }
+    return false;
+}
+
+bool scan_moov(TablePager &pager, bool want_audio, MovieParams &params, MoovTables &out)
+{
+    int64_t t0 = esp_timer_get_time();
+    out = MoovTables();
+
+    // Top level: the moov may sit before or after the mdat
+    Box moov;
+    uint64_t off = 0;
+    bool found = false;
+    while (read_box(pager, off, pager.file_size(), moov)) {
+        if (moov.type == fourcc("moov")) {
+            found = true;
+            break;
+        }
+        off = moov.end;
+    }
+    if (!found) {
+        ESP_LOGE(TAG, "No moov box");
+        return false;
+    }
+
+    // mvex: fragment defaults, applied to the chosen tracks once all are known
+    struct Trex {
+        uint32_t track_id, duration, size, flags;
+    };
+    Trex     trex[4];
+    unsigned trex_count = 0;
+    uint32_t movie_timescale = 0;
+    uint64_t fragmented_duration = 0;
+
+    Box b;
+    uint8_t h[24];
+    for (off = moov.payload; read_box(pager, off, moov.end, b); off = b.end) {
+        if (b.type == fourcc("mvhd")) {
+            if (b.end - b.payload >= 24 && pager.read(b.payload, h, 24)) {
+                movie_timescale = load_be32(h + (h[0] == 1 ? 20 : 12));
+            }
+            continue;
+        }
+        if (b.type == fourcc("mvex")) {
+            out.fragmented = true;
+            Box e;
+            for (uint64_t at = b.payload; read_box(pager, at, b.end, e); at = e.end) {
+                if (e.type == fourcc("mehd") && e.end - e.payload >= 8 &&
+                    pager.read(e.payload, h, (e.end - e.payload >= 12) ? 12 : 8)) {
+                    fragmented_duration = (h[0] == 1) ? ((uint64_t)load_be32(h + 4) << 32) | load_be32(h + 8)
+                                                      : load_be32(h + 4);
+                } else if (e.type == fourcc("trex") && trex_count < 4 &&
+                           e.end - e.payload >= 24 && pager.read(e.payload, h, 24)) {
+                    trex[trex_count++] = {load_be32(h + 4), load_be32(h + 12),
+                                          load_be32(h + 16), load_be32(h + 20)};
+                }
+            }
+            continue;
+        }
+        if (b.type != fourcc("trak")) continue;
+        TrakScan trak;
+        scan_trak_boxes(pager, b.payload, b.end, trak);
+        const TrackTables &t = trak.tables;
+        // Empty tables are expected in a fragmented movie (mvex usually
+        // follows the traks, so that is only known at the end): take an
+        // empty track, but let a later non-empty one replace it.
+        if (t.handler == fourcc("vide") &&
+            (!out.has_video || (out.video.sample_count == 0 && t.sample_count > 0))) {
+            MovieParams p = params;
+            if (parse_sample_entry(pager, trak, p)) {
+                params.video_w   = p.video_w;
+                params.video_h   = p.video_h;
+                memcpy(params.sps, p.sps, p.sps_bytes);
+                params.sps_bytes = p.sps_bytes;
+                memcpy(params.pps, p.pps, p.pps_bytes);
+                params.pps_bytes = p.pps_bytes;
+                out.video     = t;
+                out.has_video = true;
+            }
+        } else if (want_audio && t.handler == fourcc("soun") &&
+                   (!out.has_audio || (out.audio.sample_count == 0 && t.sample_count > 0))) {
+            MovieParams p = params;
+            if (parse_sample_entry(pager, trak, p)) {
+                params.audio_rate     = p.audio_rate;
+                params.audio_channels = p.audio_channels;
+                memcpy(params.dsi, p.dsi, p.dsi_bytes);
+                params.dsi_bytes = p.dsi_bytes;
+                out.audio     = t;
+                out.has_audio = true;
+            }
+        }
+    }
+    if (out.fragmented) {
+        TrackTables *chosen[] = {&out.video, &out.audio};
+        for (unsigned i = 0; i < trex_count; i++) {
+            for (TrackTables *t : chosen) {
+                if (t->track_id != trex[i].track_id) continue;
+                t->default_duration = trex[i].duration;
+                t->default_size     = trex[i].size;
+                t->default_flags    = trex[i].flags;
+            }
+        }
+        out.fragments_start = (uint32_t)moov.end;
+        if (movie_timescale > 0) {
+            out.fragmented_duration_us = (int64_t)(fragmented_duration * 1000000ULL / movie_timescale);
+        }
+        ESP_LOGI(TAG, "moov scanned in %lld ms: fragmented, video track %u, audio track %u",
+                 (esp_timer_get_time() - t0) / 1000, out.video.track_id,
+                 out.has_audio ? out.audio.track_id : 0);
+        return out.has_video;
+    }
+    if (out.has_audio && out.audio.sample_count == 0) out.has_audio = false;
+    ESP_LOGI(TAG, "moov scanned in %lld ms: video %u samples, audio %u samples",
+             (esp_timer_get_time() - t0) / 1000, out.video.sample_count,
+             out.has_audio ? out.audio.sample_count : 0);
+    return out.has_video && out.video.sample_count > 0;
+}
+
+// ---- PagedTrack ----
+
+bool PagedTrack::open(TablePager &pager, const TrackTables &tables)
+{
+    close();
+    pager_ = &pager;
+    t_     = tables;
+    single_chunk_ = (t_.stco.count <= 1);
+
+    int64_t t0 = esp_timer_get_time();
+    if (!build_checkpoints(Table::Stts, stts_cps_, stts_cp_count_) ||
+        !build_checkpoints(Table::Stsc, stsc_cps_, stsc_cp_count_)) {
+        close();
+        return false;
+    }
+    ESP_LOGI(TAG, "Paged track: %u samples, %u stts / %u stsc runs, %u checkpoints in %lld ms",
+             t_.sample_count, run_entries(Table::Stts), run_entries(Table::Stsc),
+             stts_cp_count_ + stsc_cp_count_, (esp_timer_get_time() - t0) / 1000);
+    return true;
+}
+
+void PagedTrack::close()
+{
+    safe_free(stts_cps_);
+    safe_free(stsc_cps_);
+    stts_cps_ = nullptr;
+    stsc_cps_ = nullptr;
+    stts_cp_count_ = 0;
+    stsc_cp_count_ = 0;
+    pager_ = nullptr;
+    covered_ = 0;
+    failed_  = false;
+    cur_sample_ = UINT32_MAX;
+    cur_offset_ = 0;
+    cur_chunk_  = 0;
+    keyframe_cursor_ = 0;
+}
+
+size_t PagedTrack::memory_bytes() const
+{
+    return (size_t)(stts_cp_count_ + stsc_cp_count_) * sizeof(Checkpoint);
+}
+
+unsigned PagedTrack::run_entries(Table table) const
+{
+    if (table == Table::Stts) return t_.stts.count ? t_.stts.count : 1;
+    return single_chunk_ ? 1 : t_.stsc.count;
+}
+
+void PagedTrack::load_run(Table table, Run &run) const
+{
+    if (table == Table::Stts) {
+        if (t_.stts.count == 0) {
+            // No stts: every timestamp is 0
+            run.samples = t_.sample_count;
+            run.step    = 0;
+            return;
+        }
+        uint32_t at = t_.stts.offset + run.entry * 8;
+        run.samples = entry(at);
+        run.step    = entry(at + 4);
+        return;
+    }
+    if (single_chunk_) {
+        // Zero or one chunk: every sample lives in chunk 1
+        run.value   = 1;
+        run.samples = t_.sample_count;
+        run.step    = t_.sample_count;
+        return;
+    }
+    uint32_t at = t_.stsc.offset + run.entry * 12;
+    uint32_t first_chunk = entry(at);
+    uint32_t per_chunk   = entry(at + 4);
+    uint32_t next_chunk  = (run.entry + 1 < t_.stsc.count) ? entry(at + 12)
+                                                           : t_.stco.count + 1;
+    uint64_t samples = (next_chunk > first_chunk) ? (uint64_t)(next_chunk - first_chunk) * per_chunk : 0;
+    run.value   = first_chunk;
+    run.samples = (samples < UINT32_MAX) ? (uint32_t)samples : UINT32_MAX;
+    run.step    = per_chunk;
+}
+
+bool PagedTrack::next_run(Table table, Run &run) const
+{
+    // After a failed read the runs are garbage: stop walking them
+    if (failed_ || run.entry + 1 >= run_entries(table)) return false;
+    Run next;
+    next.entry        = run.entry + 1;
+    next.first_sample = run.first_sample + run.samples;
+    next.value        = run.value + (uint64_t)run.samples * run.step;  // stts; stsc reads its own
+    load_run(table, next);
+    run = next;
+    return true;
+}
+
+bool PagedTrack::build_checkpoints(Table table, Checkpoint *&cps, unsigned &count)
+{
+    const unsigned entries = run_entries(table);
+    count = (entries + kTableCheckpointStride - 1) / kTableCheckpointStride;
+    cps = psram_alloc<Checkpoint>(count);
+    if (!cps) {
+        ESP_LOGE(TAG, "Failed to allocate %u checkpoints", count);
+        count = 0;
+        return false;
+    }
+    // One pass over the table (sequential pages)
+    Run run = {0, 0, 0, 0, 0};
+    load_run(table, run);
+    unsigned k = 0;
+    do {
+        if (run.entry % kTableCheckpointStride == 0) {
+            cps[k++] = {run.entry, run.first_sample, run.value};
+        }
+    } while (next_run(table, run));
+    if (failed_) {
+        ESP_LOGE(TAG, "Failed to read the %s table", (table == Table::Stts) ? "stts" : "stsc");
+        return false;
+    }
+
+    Run &cursor = (table == Table::Stts) ? stts_run_ : stsc_run_;
+    cursor = {cps[0].entry, cps[0].first_sample, 0, 0, cps[0].value};
+    load_run(table, cursor);
+
+    if (table == Table::Stsc) {
+        uint64_t total = (uint64_t)run.first_sample + run.samples;
+        covered_ = (total < t_.sample_count) ? (unsigned)total : t_.sample_count;
+    }
+    return true;
+}
+
+const PagedTrack::Run &PagedTrack::run_for_sample(Table table, unsigned n) const
+{
+    Run &run = (table == Table::Stts) ? stts_run_ : stsc_run_;
+    auto holds = [n](const Run &r) { return n >= r.first_sample && n - r.first_sample < r.samples; };
+    if (holds(run)) return run;
+
+    // Playback crosses into the next run (or skips a few empty ones)
+    if (n >= run.first_sample) {
+        for (int i = 0; i < 4 && next_run(table, run); i++) {
+            if (holds(run)) return run;
+        }
+    }
+    // Jump: restart from the last checkpoint at or before n
+    const Checkpoint *cps = (table == Table::Stts) ? stts_cps_ : stsc_cps_;
+    unsigned lo = 0, hi = (table == Table::Stts) ? stts_cp_count_ : stsc_cp_count_;
+    while (lo < hi) {
+        unsigned mid = lo + (hi - lo) / 2;
+        if (cps[mid].first_sample <= n) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    const Checkpoint &cp = cps[lo > 0 ? lo - 1 : 0];
+    run = {cp.entry, cp.first_sample, 0, 0, cp.value};
+    load_run(table, run);
+    while (!holds(run) && next_run(table, run)) {}
+    return run;  // the last run if n lies past the table
+}
+
+uint32_t PagedTrack::size(unsigned n) const
+{
+    if (n >= covered_) return 0;
+    return t_.sample_size ? t_.sample_size : entry(t_.stsz.offset + n * 4);
+}
+
+uint32_t PagedTrack::entry(uint32_t offset) const
+{
+    uint32_t value;
+    if (!pager_->be32(offset, value)) failed_ = true;
+    return value;
+}
+
+uint32_t PagedTrack::chunk_offset(uint32_t chunk) const
+{
+    if (t_.stco.count == 0) return 0;
+    // FAT32 files are < 4 GB: the low word of a co64 entry is the offset
+    return t_.co64 ? entry(t_.stco.offset + (chunk - 1) * 8 + 4)
+                   : entry(t_.stco.offset + (chunk - 1) * 4);
+}
+
+uint32_t PagedTrack::offset(unsigned n) const
+{
+    if (n >= covered_) return 0;
+    if (n == cur_sample_) return cur_offset_;
+
+    const Run &group = run_for_sample(Table::Stsc, n);
+    uint32_t chunk       = group.value + (n - group.first_sample) / group.step;
+    uint32_t chunk_first = group.first_sample + (chunk - group.value) * group.step;
+
+    uint32_t pos;
+    if (t_.sample_size) {
+        pos = chunk_offset(chunk) + (n - chunk_first) * t_.sample_size;
+    } else {
+        // Sum sizes from the cursor when it is earlier in the same chunk,
+        // otherwise from the start of the chunk
+        unsigned i;
+        if (chunk == cur_chunk_ && cur_sample_ < n) {
+            i   = cur_sample_;
+            pos = cur_offset_;
+        } else {
+            i   = chunk_first;
+            pos = chunk_offset(chunk);
+        }
+        for (; i < n; i++) pos += entry(t_.stsz.offset + i * 4);
+    }
+    if (failed_) return 0;  // don't leave a wrong offset under the cursor
+    cur_chunk_  = chunk;
+    cur_sample_ = n;
+    cur_offset_ = pos;
+    return pos;
+}
+
+uint64_t PagedTrack::timestamp(unsigned n) const
+{
+    const Run &run = run_for_sample(Table::Stts, n);
+    return run.value + (uint64_t)(n - run.first_sample) * run.step;
+}
+
+unsigned PagedTrack::sample_at(uint64_t ts) const
+{
+    if (t_.sample_count == 0 || stts_cp_count_ == 0) return 0;
+
+    // Last checkpoint at or before ts, then walk runs forward
+    unsigned lo = 0, hi = stts_cp_count_;
+    while (lo < hi) {
+        unsigned mid = lo + (hi - lo) / 2;
+        if (stts_cps_[mid].value <= ts) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    const Checkpoint &cp = stts_cps_[lo > 0 ? lo - 1 : 0];
+    Run run = {cp.entry, cp.first_sample, 0, 0, cp.value};
+    load_run(Table::Stts, run);
+    Run next = run;
+    while (next_run(Table::Stts, next) && next.value <= ts) run = next;
+
+    unsigned n;
+    if (run.samples == 0) {
+        n = run.first_sample > 0 ? run.first_sample - 1 : 0;
+    } else if (run.value > ts) {
+        n = 0;  // ts precedes the track
+    } else {
+        uint64_t steps = run.step ? (ts - run.value) / run.step : UINT64_MAX;
+        n = run.first_sample + ((steps < run.samples) ? (unsigned)steps : run.samples - 1);
+    }
+    return (n < t_.sample_count) ? n : t_.sample_count - 1;
+}
+
+uint32_t PagedTrack::keyframe(unsigned k) const
+{
+    // stss is 1-based; a 0 entry (or a failed read) is taken as sample 0
+    uint32_t s = entry(t_.stss.offset + k * 4);
+    return s > 0 ? s - 1 : 0;
+}
+
+unsigned PagedTrack::keyframe_upper_bound(unsigned n) const
+{
+    unsigned lo = 0, hi = t_.stss.count;
+    while (lo < hi) {
+        unsigned mid = lo + (hi - lo) / 2;
+        if (keyframe(mid) <= n) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo;
+}
+
+bool PagedTrack::is_keyframe(unsigned n) const
+{
+    if (t_.stss.count == 0) return true;
+    unsigned k = keyframe_upper_bound(n);
+    return k > 0 && keyframe(k - 1) == n && !failed_;
+}
+
+unsigned PagedTrack::keyframe_before(unsigned n) const
+{
+    const unsigned count = t_.sample_count;
+    if (n >= count) n = count ? count - 1 : 0;
+    if (t_.stss.count == 0) return n;
+    unsigned k = keyframe_upper_bound(n);
+    unsigned kf = k > 0 ? keyframe(k - 1) : 0;
+    return (kf <= n) ? kf : n;  // a failed read must not send a seek out of range
+}
+
+unsigned PagedTrack::next_keyframe(unsigned n)
+{
+    const unsigned count = t_.sample_count;
+    if (t_.stss.count == 0) return (n + 1 < count) ? n + 1 : count;
+
+    // Same cursor scheme as the resident index: normally the entry under
+    // the cursor or the next one, a binary search after a seek.
+    unsigned c = keyframe_cursor_;
+    if (c < t_.stss.count && keyframe(c) <= n) c++;
+    if ((c < t_.stss.count && keyframe(c) <= n) || (c > 0 && keyframe(c - 1) > n)) {
+        c = keyframe_upper_bound(n);
+    }
+    keyframe_cursor_ = c;
+    if (c >= t_.stss.count || failed_) return count;
+    uint32_t k = keyframe(c);
+    return (k < count && !failed_) ? k : count;
+}
+
+}  // namespace mp4
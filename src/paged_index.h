@@ -0,0 +1,211 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include "player_constants.h"
+
+namespace mp4 {
+
+struct MovieParams;
+
+// Fixed pool of pages over one file, filled from SD on demand and recycled
+// least-recently-used: a read-through block cache.  Backs the sample
+// tables of movies too long to index in PSRAM (only the pages around the
+// demux cursor and whatever a seek's binary search touches are resident),
+// and, with larger blocks, minimp4's read callback while it parses a moov.
+class TablePager {
+public:
+    // page_bytes must be a power of two
+    bool open(const char *path, unsigned pages, size_t page_bytes = kTablePageBytes);
+    void close();
+
+    ~TablePager() { close(); }
+
+    bool is_open() const { return fd_ >= 0; }
+    uint32_t file_size() const { return file_size_; }
+
+    // Uncached read (box headers while scanning the moov)
+    bool read(uint64_t offset, void *dst, size_t size);
+    // Read through the page cache (any size; may span pages)
+    bool read_cached(uint64_t offset, void *dst, size_t size);
+    // Big-endian 32-bit table entry at an absolute file offset; false if
+    // its page could not be read (value is then 0)
+    bool be32(uint32_t offset, uint32_t &value);
+
+    // faults = physical reads; requests = read_cached() calls
+    unsigned faults() const  { return faults_; }
+    unsigned hits() const    { return hits_; }
+    int64_t  fault_us() const { return fault_us_; }
+    uint64_t fault_bytes() const { return fault_bytes_; }
+    unsigned requests() const { return requests_; }
+    uint64_t requested_bytes() const { return requested_bytes_; }
+    size_t   memory_bytes() const;
+
+private:
+    struct Page {
+        uint32_t base;      // file offset of the page's first byte
+        uint32_t last_use;  // LRU stamp
+        bool     valid;
+    };
+
+    const uint8_t *page(uint32_t base);
+
+    int       fd_        = -1;
+    size_t    page_bytes_ = kTablePageBytes;
+    uint32_t  file_size_ = 0;
+    uint8_t  *mem_       = nullptr;
+    Page     *pages_     = nullptr;
+    unsigned  count_     = 0;
+    unsigned  last_      = 0;  // most recent page: checked first
+    uint32_t  clock_     = 0;
+    unsigned  faults_    = 0;
+    unsigned  hits_      = 0;
+    int64_t   fault_us_  = 0;
+    uint64_t  fault_bytes_ = 0;
+    unsigned  requests_  = 0;
+    uint64_t  requested_bytes_ = 0;
+    bool      error_logged_ = false;
+};
+
+// Box / handler four-character code as a big-endian integer
+constexpr uint32_t fourcc(const char (&s)[5])
+{
+    return ((uint32_t)s[0] << 24) | ((uint32_t)s[1] << 16) | ((uint32_t)s[2] << 8) | (uint32_t)s[3];
+}
+
+struct Box {
+    uint32_t type;
+    uint64_t payload;  // first byte after the header
+    uint64_t end;
+};
+
+// Box header at off; false if it is malformed or overruns limit.  cached
+// reads through the page cache (fragment headers, which sit together);
+// the moov scan reads uncached since its headers are scattered.
+bool read_box(TablePager &io, uint64_t off, uint64_t limit, Box &box, bool cached = false);
+
+// File offset and entry count of one sample table's entries
+struct TableRef {
+    uint32_t offset = 0;
+    uint32_t count  = 0;
+};
+
+// Where one track's tables live, as recorded by scan_moov()
+struct TrackTables {
+    uint32_t handler      = 0;   // hdlr handler_type ('vide' / 'soun')
+    uint32_t timescale    = 0;
+    uint32_t sample_count = 0;   // stsz
+    uint32_t sample_size  = 0;   // stsz: non-zero = every sample has this size
+    TableRef stsz, stco, stsc, stts, stss;
+    bool     co64 = false;       // stco entries are 64-bit
+
+    // Fragmented movies: tkhd track_ID (matched against tfhd) and the trex
+    // defaults for whatever a tfhd / trun leaves out
+    uint32_t track_id         = 0;
+    uint32_t default_duration = 0;
+    uint32_t default_size     = 0;
+    uint32_t default_flags    = 0;
+};
+
+struct MoovTables {
+    TrackTables video;
+    TrackTables audio;
+    bool        has_video = false;
+    bool        has_audio = false;
+
+    // mvex present: the samples live in moof/mdat fragments after the moov
+    bool        fragmented      = false;
+    uint32_t    fragments_start = 0;   // first top-level box after the moov
+    int64_t     fragmented_duration_us = 0;  // mehd; 0 if the file doesn't say
+
+    unsigned total_samples() const {
+        return video.sample_count + (has_audio ? audio.sample_count : 0);
+    }
+};
+
+// Walk the box tree without loading any table: records each table's
+// offset and count, and fills params (dimensions, SPS/PPS, AAC config) for
+// the first H.264 track and, if want_audio, the first AAC track.  For a
+// fragmented movie the tables are empty and out.fragmented is set.
+bool scan_moov(TablePager &pager, bool want_audio, MovieParams &params, MoovTables &out);
+
+// One track's sample tables read through a TablePager.  Same queries as a
+// resident SampleIndex (which forwards to this in paged mode); sequential
+// access walks cursors, so each step costs a table read from a hot page.
+// stts and stsc are run-length, so a sample number maps to a run by
+// walking forward from a checkpoint kept every kTableCheckpointStride runs.
+// Decode timestamps are accumulated in 64 bits: a 90 kHz track passes
+// 2^32 ticks after 13 hours.
+//
+// A table read that fails (card error, file cut short) marks the track
+// failed: from then on the queries return in-range fallbacks (size 0, no
+// keyframes past the current sample) and SampleIndex::contains() reports
+// no more samples, so demux ends the movie instead of playing garbage.
+class PagedTrack {
+public:
+    bool open(TablePager &pager, const TrackTables &tables);
+    void close();
+
+    ~PagedTrack() { close(); }
+
+    bool     active() const { return pager_ != nullptr; }
+    bool     failed() const { return failed_; }
+    unsigned keyframe_count() const { return t_.stss.count; }
+
+    uint32_t size(unsigned n) const;
+    uint32_t offset(unsigned n) const;
+    uint64_t timestamp(unsigned n) const;
+    bool     is_keyframe(unsigned n) const;
+    unsigned sample_at(uint64_t ts) const;
+    unsigned keyframe_before(unsigned n) const;
+    unsigned next_keyframe(unsigned n);
+    size_t   memory_bytes() const;
+
+private:
+    // One stts entry or stsc group: samples [first_sample, first_sample +
+    // samples) with value = first timestamp (stts) or first chunk (stsc,
+    // 1-based) and step = timestamp delta (stts) or samples per chunk (stsc).
+    struct Run {
+        uint32_t entry;
+        uint32_t first_sample;
+        uint32_t samples;
+        uint32_t step;
+        uint64_t value;
+    };
+    struct Checkpoint {
+        uint32_t entry;
+        uint32_t first_sample;
+        uint64_t value;
+    };
+    enum class Table { Stts, Stsc };
+
+    unsigned run_entries(Table table) const;
+    void     load_run(Table table, Run &run) const;   // run.entry / first_sample / value set
+    bool     next_run(Table table, Run &run) const;   // false at the last run
+    bool     build_checkpoints(Table table, Checkpoint *&cps, unsigned &count);
+    const Run &run_for_sample(Table table, unsigned n) const;
+    uint32_t entry(uint32_t offset) const;             // table word; 0 and failed_ on error
+    uint32_t keyframe(unsigned k) const;               // 0-based sample of stss entry k
+    unsigned keyframe_upper_bound(unsigned n) const;
+    uint32_t chunk_offset(uint32_t chunk) const;       // 1-based chunk
+
+    TablePager *pager_ = nullptr;
+    TrackTables t_;
+    unsigned    covered_ = 0;  // samples [0, covered_) lie in a chunk
+    bool        single_chunk_ = false;
+    mutable bool failed_ = false;  // a table read failed; sticky until close()
+
+    Checkpoint *stts_cps_ = nullptr;
+    Checkpoint *stsc_cps_ = nullptr;
+    unsigned    stts_cp_count_ = 0;
+    unsigned    stsc_cp_count_ = 0;
+
+    mutable Run      stts_run_ = {};
+    mutable Run      stsc_run_ = {};
+    mutable unsigned cur_sample_ = UINT32_MAX;  // offset(): last sample resolved
+    mutable uint32_t cur_offset_ = 0;
+    mutable uint32_t cur_chunk_  = 0;
+    unsigned         keyframe_cursor_ = 0;
+};
+
+}  // namespace mp4
@@ -8,36 +8,111 @@ namespace mp4 {
 constexpr size_t kDemuxStackSize   = 32 * 1024;
 constexpr size_t kDecodeStackSize  = 48 * 1024;
 constexpr size_t kDisplayStackSize =  4 * 1024;
+constexpr size_t kConvertStackSize =  4 * 1024;
+constexpr size_t kPrefetchStackSize =  4 * 1024;
 constexpr size_t kAudioStackSize   = 20 * 1024;
+constexpr size_t kAudioOutStackSize =  4 * 1024;
 
 // --- Task priorities ---
 constexpr int kDemuxPriority   = 4;
 constexpr int kDecodePriority  = 5;
 constexpr int kDisplayPriority = 6;
+constexpr int kConvertPriority = 5;
+constexpr int kPrefetchPriority = 3;  // SD read-ahead: runs whenever demux is blocked
 constexpr int kAudioPriority   = 7;
+constexpr int kAudioOutPriority = 8;  // I2S writer: above AAC decode, so a DMA buffer is never refilled late
 
 // --- Core affinity ---
 constexpr int kDemuxCore   = 0;
 constexpr int kDecodeCore  = 1;
 constexpr int kDisplayCore = 0;
+constexpr int kConvertCore = 0;
+constexpr int kPrefetchCore = 0;
 constexpr int kAudioCore   = 0;
+constexpr int kAudioOutCore = 0;
 
-// --- Queue depths ---
-constexpr int kNalQueueDepth   = 16;
-constexpr int kAudioQueueDepth = 16;
+// --- Message ring budgets (bytes, PSRAM; rounded up to a power of two) ---
+// Sized by bytes rather than message count: an IDR and a P-frame cost what they weigh.
+constexpr size_t kNalRingBytes   = 512 * 1024;
+constexpr size_t kAudioRingBytes =  32 * 1024;
+// Decoded PCM, AAC decode -> I2S writer: audio keeps playing through an SD
+// or demux stall at least this long at 48 kHz stereo (longer at lower rates).
+constexpr int    kPcmRingMs    = 500;
+constexpr size_t kPcmRingBytes = kPcmRingMs * 48 * 2 * sizeof(int16_t);
 
 // --- Buffer sizes ---
-constexpr size_t kReadBufSize  = 64 * 1024;
-constexpr size_t kStdioBufSize =  8 * 1024;
+constexpr size_t kMaxSampleSize = 64 * 1024;  // larger samples are skipped
 constexpr size_t kPcmBufSize   = 1024 * 2 * sizeof(int16_t);  // 4096 bytes
+constexpr int    kFrameBufferCount = 2;  // RGB565 frames: one converting, one on the LCD DMA
+constexpr int    kYuvRingSlots     = 3;  // display-sized YUV frames between decode and conversion
+constexpr size_t kMaxPathBytes     = 256;  // playlist file path (gapless next-track mailbox)
+
+// --- SD read-ahead (ChunkReader) ---
+// Size the ring per card: the stall count and min/avg fill logged at the end
+// of playback show whether SD latency spikes still reach demux (256 KB–1 MB).
+constexpr size_t kPrefetchRingBytes   = 512 * 1024;
+constexpr size_t kPrefetchReadBytes   =  32 * 1024;  // one SD transfer
+constexpr size_t kPrefetchMaxGapBytes = 128 * 1024;  // jump further ahead than this: restart the stream
+constexpr size_t kPrefetchAlignBytes  = 4096;        // stream restarts are aligned down to this
+static_assert(kPrefetchRingBytes >= 2 * kMaxSampleSize, "read-ahead ring must hold the largest sample");
+
+// --- moov parse (MP4D_open read callback) ---
+// minimp4 reads the moov one byte per callback; a block cache turns that
+// into one SD read per block.  4 blocks keep both ends of a moov-at-end
+// file (box walk near the end, ftyp/mdat headers at the start) resident.
+constexpr size_t   kMoovCacheBlockBytes = 32 * 1024;
+constexpr unsigned kMoovCacheBlocks     = 4;
+
+// --- Sidecar index cache (<movie>.mp4idx) ---
+// Sample tables + codec headers saved on first play; later plays load them
+// in one sequential read instead of parsing the moov box.
+constexpr bool   kIndexCacheEnabled = true;
+constexpr size_t kMaxParamSetBytes  = 256;  // SPS / PPS
+constexpr size_t kMaxDsiBytes       = 64;   // AAC AudioSpecificConfig
+
+// --- Paged sample tables (long movies) ---
+// From this many samples (video + audio) the tables are not indexed into
+// PSRAM but read from the moov box on demand through an LRU of small pages;
+// only checkpoints into the stts/stsc runs stay resident.  300k samples is
+// about 1.5 h of 30 fps video + 48 kHz AAC (~1 MB as a resident index).
+constexpr unsigned kPagedIndexMinSamples  = 300000;
+constexpr size_t   kTablePageBytes        = 4096;
+constexpr unsigned kTablePageCount        = 16;   // 64 KB: cursor pages of each table + seek searches
+constexpr unsigned kTableCheckpointStride = 256;  // stts / stsc runs between checkpoints
+
+// --- Fragmented MP4 (moof/mdat) ---
+// Samples of the fragment being demuxed are expanded into PSRAM (16 bytes
+// each); a fragment with more than this is cut short.
+constexpr unsigned kMaxFragmentSamples = 65536;
+
+// --- Band (strip) rendering ---
+// >0: display converts this many output lines at a time into two ping-pong
+// buffers in internal DMA RAM and pushes each band while converting the next;
+// no full-frame RGB565 buffers in PSRAM.  0: full-frame double buffering.
+constexpr int kBandRenderLines = 16;
+
+// --- Diagnostics ---
+constexpr bool kLogKeyframes = false;  // demux: list every keyframe at startup (K lines per file)
 
 // --- SD card mount config ---
-constexpr int    kSdMaxFiles       = 6;
+constexpr int    kSdMaxFiles       = 8;  // + ChunkReader and table pager fds during playback
 constexpr size_t kSdAllocUnitSize  = 16 * 1024;
 
 // --- I2S DMA config ---
 constexpr int kI2sDmaDescNum  = 4;
 constexpr int kI2sDmaFrameNum = 512;
+constexpr unsigned kClockSegments = 16;  // MediaClock: PTS marks kept (one per AAC frame; > DMA depth)
+
+// --- Audio drift compensation (AudioOutput) ---
+// The I2S clock divider and the stream's timestamps never agree exactly;
+// the writer resamples PCM by up to kDriftMaxPpm so the audio clock keeps
+// pace with esp_timer instead of drifting away from wall-clock video.
+// Off until the drift and the resampler's cost are measured on a board;
+// so far only test_drift_control's simulated clocks exercise it.
+constexpr bool    kDriftCompensation   = false;
+constexpr int     kDriftMaxPpm         = 5000;    // ±0.5 %
+constexpr int     kDriftTimeConstantMs = 10000;   // controller settling time
+constexpr int64_t kDriftResyncUs       = 100000;  // larger errors are jumps (gaps, stalls): re-anchor
 
 // --- Timeout durations (ms) ---
 constexpr int kQueueSendTimeoutMs  = 5000;
@@ -47,12 +122,14 @@ constexpr int kQueueRecvTimeoutMs  = 10000;
 constexpr int kAudioRecvTimeoutMs  = 5000;
 
 // --- Frame skip (A/V sync) ---
-constexpr int64_t kDemuxSkipThresholdUs = 200000;  // demux: skip SD read if >200ms behind wall clock
+constexpr int64_t kDemuxSkipThresholdUs = 200000;  // demux: skip SD read if >200ms behind the playback clock
 constexpr int kSemaphoreTimeoutMs  = 10000;
-constexpr int kFinalDisplayWaitMs  = 1000;
+constexpr int kFinalDisplayWaitMs  = 1000;  // convert: per buffer, for display to hand it back at EOS
+constexpr int64_t kMaxAudioPaceUs  = 500000;  // decode: longest wait for the audio clock (it may have stalled)
+constexpr int kStopIdleTargetMs    = 30;    // request_stop() -> every stage idle; slower stops are logged as warnings
 constexpr int kBootDelayMs         = 5000;
 constexpr int kSplashDelayMs       = 500;
-constexpr int kQrCycleIntervalTicks = 10;  // 500ms * 10 = 5秒
+constexpr int kQrCycleIntervalMs    = 5000;  // QR screens: next one every 5 s (by tick count)
 constexpr int kQrScreenCount        = 3;
 
 // --- SD card paths ---
@@ -68,6 +145,6 @@ constexpr int kApMaxConnections     = 2;
 // --- HTTP server config ---
 constexpr size_t kHttpServerStack   = 8 * 1024;
 constexpr size_t kHttpScratchSize   = 8 * 1024;
-constexpr int kHttpMaxUriHandlers   = 22;
+constexpr int kHttpMaxUriHandlers   = 23;
 
 }  // namespace mp4
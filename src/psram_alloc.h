@@ -22,10 +22,21 @@ T *psram_alloc(size_t count) {
     return static_cast<T *>(heap_caps_malloc(count * sizeof(T), MALLOC_CAP_SPIRAM));
 }
 
+// Start aligned for 128-bit SIMD loads and stores (align: power of two)
+template <typename T>
+T *psram_alloc_aligned(size_t count, size_t align) {
+    return static_cast<T *>(heap_caps_aligned_alloc(align, count * sizeof(T), MALLOC_CAP_SPIRAM));
+}
+
 inline void *internal_malloc(size_t size) {
     return heap_caps_malloc(size, MALLOC_CAP_INTERNAL);
 }
 
+// Internal SRAM reachable by the LCD SPI DMA
+inline void *dma_malloc(size_t size) {
+    return heap_caps_malloc(size, MALLOC_CAP_DMA | MALLOC_CAP_INTERNAL);
+}
+
 inline void safe_free(void *ptr) {
     if (ptr) heap_caps_free(ptr);
 }
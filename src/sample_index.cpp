@@ -0,0 +1,460 @@
+#include "sample_index.h"
+
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "esp_log.h"
+#include "index_cache.h"
+#include "psram_alloc.h"
+
+static const char *TAG = "sample_idx";
+
+namespace mp4 {
+
+// Walk chunks in order, exactly as sample_to_chunk() would resolve them,
+// calling emit(first_sample, offset) for every non-empty chunk.  A single
+// chunk (or none) means every sample lives in chunk 0.  Returns how many
+// samples the chunks cover.
+template <typename F>
+static unsigned for_each_chunk(const MP4D_track_t *tr, unsigned count, F &&emit)
+{
+    if (tr->chunk_count <= 1) {
+        emit(0u, (tr->chunk_count == 1) ? (uint32_t)tr->chunk_offset[0] : 0u);
+        return count;
+    }
+    unsigned sample = 0;
+    unsigned group  = 0;
+    for (unsigned nc = 0; nc < tr->chunk_count && sample < count; nc++) {
+        // Chunks are counted starting with 1 in stsc
+        if (group + 1 < tr->sample_to_chunk_count &&
+            nc + 1 == tr->sample_to_chunk[group + 1].first_chunk) {
+            group++;
+        }
+        unsigned per_chunk = tr->sample_to_chunk_count
+                             ? tr->sample_to_chunk[group].samples_per_chunk : 0;
+        if (per_chunk == 0) continue;
+        emit(sample, (uint32_t)tr->chunk_offset[nc]);
+        sample = (per_chunk < count - sample) ? sample + per_chunk : count;
+    }
+    return sample;
+}
+
+// Split decode timestamps into runs of equal spacing (what stts stored
+// before minimp4 expanded it), calling emit(first_sample, first_ts, delta).
+template <typename F>
+static unsigned for_each_run(const unsigned *ts, unsigned count, F &&emit)
+{
+    if (!ts) {
+        emit(0u, 0u, 0u);
+        return 1;
+    }
+    unsigned runs  = 0;
+    unsigned first = 0;
+    while (first < count) {
+        uint32_t delta = (first + 1 < count) ? ts[first + 1] - ts[first] : 0;
+        unsigned n = first + 1;
+        while (n < count && ts[n] == ts[first] + (uint32_t)(n - first) * delta) n++;
+        emit(first, (uint32_t)ts[first], delta);
+        runs++;
+        first = n;
+    }
+    return runs;
+}
+
+// Index of the last element whose first_sample is <= n (0 if none)
+template <typename T>
+static unsigned last_at_or_before(const T *v, unsigned count, unsigned n)
+{
+    unsigned lo = 0, hi = count;
+    while (lo < hi) {
+        unsigned mid = lo + (hi - lo) / 2;
+        if (v[mid].first_sample <= n) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo > 0 ? lo - 1 : 0;
+}
+
+// Does element i cover sample n (first_sample <= n < next first_sample)?
+template <typename T>
+static bool covers(const T *v, unsigned count, unsigned i, unsigned n)
+{
+    return i < count && v[i].first_sample <= n && (i + 1 == count || v[i + 1].first_sample > n);
+}
+
+bool SampleIndex::alloc_tables()
+{
+    sizes_ = psram_alloc<uint16_t>(count_);
+    if (big_count_ > 0)      big_sizes_ = psram_alloc<BigSize>(big_count_);
+    if (chunk_count_ > 0)    chunks_    = psram_alloc<Chunk>(chunk_count_);
+    runs_ = psram_alloc<TimeRun>(run_count_);
+    if (keyframe_count_ > 0) keyframes_ = psram_alloc<uint32_t>(keyframe_count_);
+
+    if (!sizes_ || !runs_ || (big_count_ > 0 && !big_sizes_) ||
+        (chunk_count_ > 0 && !chunks_) || (keyframe_count_ > 0 && !keyframes_)) {
+        ESP_LOGE(TAG, "Failed to allocate index for %u samples (%u bytes)",
+                 count_, (unsigned)memory_bytes());
+        return false;
+    }
+    return true;
+}
+
+bool SampleIndex::build(const MP4D_demux_t &mp4, unsigned track)
+{
+    deinit();
+
+    const MP4D_track_t *tr = &mp4.track[track];
+    timescale_ = tr->timescale;
+    if (tr->sample_count == 0 || !tr->entry_size) {
+        return false;
+    }
+    count_ = tr->sample_count;
+#if MP4D_TIMESTAMPS_SUPPORTED
+    const unsigned *ts = tr->timestamp;
+#else
+    const unsigned *ts = nullptr;
+#endif
+
+    // Pass 1: table sizes, so each table is allocated once at its final size
+    covered_ = for_each_chunk(tr, count_, [&](unsigned, uint32_t) { chunk_count_++; });
+    run_count_ = for_each_run(ts, count_, [](unsigned, uint32_t, uint32_t) {});
+    for (unsigned n = 0; n < count_; n++) {
+        if (tr->entry_size[n] >= kBigSize) big_count_++;
+    }
+    // stss is sorted ascending and 1-based; absent = every sample is a sync sample
+    for (unsigned k = 0; k < tr->sync_count; k++) {
+        if (tr->sync_samples[k] != 0 && tr->sync_samples[k] <= count_) keyframe_count_++;
+    }
+    if (!alloc_tables()) {
+        deinit();
+        return false;
+    }
+
+    // Pass 2: fill
+    unsigned c = 0;
+    for_each_chunk(tr, count_, [&](unsigned first, uint32_t offset) {
+        chunks_[c++] = {first, offset};
+    });
+    unsigned r = 0;
+    for_each_run(ts, count_, [&](unsigned first, uint32_t first_ts, uint32_t delta) {
+        runs_[r++] = {first, first_ts, delta};
+    });
+    unsigned b = 0;
+    for (unsigned n = 0; n < count_; n++) {
+        uint32_t size = tr->entry_size[n];
+        if (size >= kBigSize) {
+            big_sizes_[b++] = {n, size};
+            sizes_[n] = kBigSize;
+        } else {
+            sizes_[n] = (uint16_t)size;
+        }
+    }
+    unsigned k = 0;
+    for (unsigned i = 0; i < tr->sync_count; i++) {
+        if (tr->sync_samples[i] == 0 || tr->sync_samples[i] > count_) continue;
+        keyframes_[k++] = tr->sync_samples[i] - 1;
+    }
+    return true;
+}
+
+bool SampleIndex::open_paged(TablePager &pager, const TrackTables &tables)
+{
+    deinit();
+    if (tables.sample_count == 0 || !paged_.open(pager, tables)) return false;
+    count_          = tables.sample_count;
+    timescale_      = tables.timescale;
+    keyframe_count_ = tables.stss.count;
+    return true;
+}
+
+bool SampleIndex::open_fragmented(TablePager &pager, const TrackTables &tables, uint32_t fragments_start)
+{
+    deinit();
+    if (!fragmented_.open(pager, tables, fragments_start)) return false;
+    timescale_ = tables.timescale;
+    return true;
+}
+
+uint32_t SampleIndex::size(unsigned n) const
+{
+    if (paged_.active()) return paged_.size(n);
+    if (fragmented_.active()) return fragmented_.size(n);
+    if (n >= covered_) return 0;
+    if (sizes_[n] != kBigSize) return sizes_[n];
+
+    unsigned lo = 0, hi = big_count_;
+    while (lo < hi) {
+        unsigned mid = lo + (hi - lo) / 2;
+        if (big_sizes_[mid].sample < n) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return (lo < big_count_ && big_sizes_[lo].sample == n) ? big_sizes_[lo].size : 0;
+}
+
+uint32_t SampleIndex::offset(unsigned n) const
+{
+    if (paged_.active()) return paged_.offset(n);
+    if (fragmented_.active()) return fragmented_.offset(n);
+    if (n >= covered_) return 0;
+    if (n == cur_sample_) return cur_offset_;
+
+    // Usually the cursor's chunk or the next one
+    unsigned c = cur_chunk_;
+    if (!covers(chunks_, chunk_count_, c, n)) {
+        c = covers(chunks_, chunk_count_, c + 1, n) ? c + 1
+                                                    : last_at_or_before(chunks_, chunk_count_, n);
+    }
+    // Sum sizes from the cursor when it is earlier in the same chunk,
+    // otherwise from the start of the chunk
+    unsigned i;
+    uint32_t pos;
+    if (c == cur_chunk_ && cur_sample_ < n) {
+        i   = cur_sample_;
+        pos = cur_offset_;
+    } else {
+        i   = chunks_[c].first_sample;
+        pos = chunks_[c].offset;
+    }
+    for (; i < n; i++) pos += size(i);
+
+    cur_chunk_  = c;
+    cur_sample_ = n;
+    cur_offset_ = pos;
+    return pos;
+}
+
+unsigned SampleIndex::run_of(unsigned n) const
+{
+    unsigned r = cur_run_;
+    if (!covers(runs_, run_count_, r, n)) {
+        r = covers(runs_, run_count_, r + 1, n) ? r + 1 : last_at_or_before(runs_, run_count_, n);
+        cur_run_ = r;
+    }
+    return r;
+}
+
+uint64_t SampleIndex::timestamp(unsigned n) const
+{
+    if (paged_.active()) return paged_.timestamp(n);
+    if (fragmented_.active()) return fragmented_.timestamp(n);
+    const TimeRun &run = runs_[run_of(n)];
+    return run.first_ts + (uint32_t)(n - run.first_sample) * run.delta;
+}
+
+bool SampleIndex::is_keyframe(unsigned n) const
+{
+    if (paged_.active()) return paged_.is_keyframe(n);
+    if (fragmented_.active()) return fragmented_.is_keyframe(n);
+    if (keyframe_count_ == 0) return true;
+    unsigned k = keyframe_upper_bound(n);
+    return k > 0 && keyframes_[k - 1] == n;
+}
+
+unsigned SampleIndex::sample_at(int64_t pts_us) const
+{
+    if (count() == 0 || timescale_ == 0 || pts_us <= 0) return 0;
+    uint64_t ts = (uint64_t)pts_us * timescale_ / 1000000ULL;
+    if (paged_.active()) return paged_.sample_at(ts);
+    if (fragmented_.active()) return fragmented_.sample_at(ts);
+
+    // Last run starting at or before ts, then step into it arithmetically
+    // (decode timestamps are non-decreasing)
+    unsigned lo = 0, hi = run_count_;
+    while (lo < hi) {
+        unsigned mid = lo + (hi - lo) / 2;
+        if (runs_[mid].first_ts <= ts) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    if (lo == 0) return 0;
+    const TimeRun &run = runs_[lo - 1];
+    unsigned run_len = ((lo < run_count_) ? runs_[lo].first_sample : count_) - run.first_sample;
+    uint64_t steps = run.delta ? (ts - run.first_ts) / run.delta : UINT64_MAX;
+    return run.first_sample + ((steps < run_len) ? (unsigned)steps : run_len - 1);
+}
+
+unsigned SampleIndex::keyframe_upper_bound(unsigned n) const
+{
+    unsigned lo = 0, hi = keyframe_count_;
+    while (lo < hi) {
+        unsigned mid = lo + (hi - lo) / 2;
+        if (keyframes_[mid] <= n) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo;
+}
+
+unsigned SampleIndex::keyframe_before(unsigned n) const
+{
+    if (paged_.active()) return paged_.keyframe_before(n);
+    if (fragmented_.active()) return fragmented_.keyframe_before(n);
+    if (n >= count_) n = count_ ? count_ - 1 : 0;
+    if (keyframe_count_ == 0) return n;  // no stss: every sample is a sync sample
+    unsigned k = keyframe_upper_bound(n);
+    return k > 0 ? keyframes_[k - 1] : 0;
+}
+
+unsigned SampleIndex::next_keyframe(unsigned n)
+{
+    if (paged_.active()) return paged_.next_keyframe(n);
+    if (fragmented_.active()) return fragmented_.next_keyframe(n);
+    if (keyframe_count_ == 0) return (n + 1 < count_) ? n + 1 : count_;
+
+    // Playback moves forward, so the answer is normally the entry under the
+    // cursor or the one after it; anything else (a seek) re-syncs by search.
+    unsigned c = keyframe_cursor_;
+    if (c < keyframe_count_ && keyframes_[c] <= n) c++;
+    if ((c < keyframe_count_ && keyframes_[c] <= n) || (c > 0 && keyframes_[c - 1] > n)) {
+        c = keyframe_upper_bound(n);
+    }
+    keyframe_cursor_ = c;
+    return (c < keyframe_count_) ? keyframes_[c] : count_;
+}
+
+// Serialized form: this header, then each table in declaration order
+struct TableHeader {
+    uint32_t count;
+    uint32_t covered;
+    uint32_t big_count;
+    uint32_t chunk_count;
+    uint32_t run_count;
+    uint32_t keyframe_count;
+    uint32_t timescale;
+    uint32_t reserved;
+};
+
+bool SampleIndex::save(int fd) const
+{
+    if (paged_.active() || fragmented_.active()) return false;
+    TableHeader hdr = {count_, covered_, big_count_, chunk_count_, run_count_,
+                       keyframe_count_, timescale_, 0};
+    return write_all(fd, &hdr, sizeof(hdr)) &&
+           write_all(fd, sizes_, (size_t)count_ * sizeof(uint16_t)) &&
+           write_all(fd, big_sizes_, (size_t)big_count_ * sizeof(BigSize)) &&
+           write_all(fd, chunks_, (size_t)chunk_count_ * sizeof(Chunk)) &&
+           write_all(fd, runs_, (size_t)run_count_ * sizeof(TimeRun)) &&
+           write_all(fd, keyframes_, (size_t)keyframe_count_ * sizeof(uint32_t));
+}
+
+bool SampleIndex::load(int fd)
+{
+    deinit();
+
+    TableHeader hdr;
+    if (!read_exact(fd, &hdr, sizeof(hdr)) || hdr.count == 0 || hdr.covered > hdr.count ||
+        hdr.big_count > hdr.count || hdr.chunk_count > hdr.count ||
+        hdr.run_count == 0 || hdr.run_count > hdr.count || hdr.keyframe_count > hdr.count) {
+        return false;
+    }
+    // The tables must be exactly what is left of the file (the audio
+    // track's follow the video track's, so compare against the rest of it)
+    const uint64_t table_bytes = (uint64_t)hdr.count * sizeof(uint16_t) +
+                                 (uint64_t)hdr.big_count * sizeof(BigSize) +
+                                 (uint64_t)hdr.chunk_count * sizeof(Chunk) +
+                                 (uint64_t)hdr.run_count * sizeof(TimeRun) +
+                                 (uint64_t)hdr.keyframe_count * sizeof(uint32_t);
+    struct stat st;
+    const off_t pos = lseek(fd, 0, SEEK_CUR);
+    if (pos < 0 || fstat(fd, &st) != 0 || table_bytes > (uint64_t)(st.st_size - pos)) {
+        ESP_LOGW(TAG, "Index tables truncated (%llu bytes declared, %lld left)",
+                 (unsigned long long)table_bytes, (long long)(st.st_size - pos));
+        return false;
+    }
+    count_          = hdr.count;
+    covered_        = hdr.covered;
+    big_count_      = hdr.big_count;
+    chunk_count_    = hdr.chunk_count;
+    run_count_      = hdr.run_count;
+    keyframe_count_ = hdr.keyframe_count;
+    timescale_      = hdr.timescale;
+    if (!alloc_tables()) {
+        deinit();
+        return false;
+    }
+    // One sequential read per table, straight into PSRAM
+    if (!read_exact(fd, sizes_, (size_t)count_ * sizeof(uint16_t)) ||
+        !read_exact(fd, big_sizes_, (size_t)big_count_ * sizeof(BigSize)) ||
+        !read_exact(fd, chunks_, (size_t)chunk_count_ * sizeof(Chunk)) ||
+        !read_exact(fd, runs_, (size_t)run_count_ * sizeof(TimeRun)) ||
+        !read_exact(fd, keyframes_, (size_t)keyframe_count_ * sizeof(uint32_t))) {
+        deinit();
+        return false;
+    }
+    if (!tables_consistent()) {
+        ESP_LOGW(TAG, "Index tables inconsistent with their header (%u samples)", count_);
+        deinit();
+        return false;
+    }
+    return true;
+}
+
+// Every lookup trusts these: binary searches need strictly ascending
+// tables, offset() needs a chunk starting at sample 0 whenever any sample
+// is covered, and size() needs one overflow entry per kBigSize escape.
+bool SampleIndex::tables_consistent() const
+{
+    if ((covered_ > 0) != (chunk_count_ > 0)) return false;
+    if (chunk_count_ > 0 && chunks_[0].first_sample != 0) return false;
+    for (unsigned i = 1; i < chunk_count_; i++) {
+        if (chunks_[i].first_sample <= chunks_[i - 1].first_sample ||
+            chunks_[i].first_sample >= covered_) {
+            return false;
+        }
+    }
+    if (runs_[0].first_sample != 0) return false;
+    for (unsigned i = 1; i < run_count_; i++) {
+        if (runs_[i].first_sample <= runs_[i - 1].first_sample ||
+            runs_[i].first_sample >= count_) {
+            return false;
+        }
+    }
+    for (unsigned i = 0; i < keyframe_count_; i++) {
+        if (keyframes_[i] >= count_ || (i > 0 && keyframes_[i] <= keyframes_[i - 1])) return false;
+    }
+    for (unsigned i = 0; i < big_count_; i++) {
+        const BigSize &big = big_sizes_[i];
+        if (big.sample >= count_ || sizes_[big.sample] != kBigSize || big.size < kBigSize ||
+            (i > 0 && big.sample <= big_sizes_[i - 1].sample)) {
+            return false;
+        }
+    }
+    unsigned escapes = 0;
+    for (unsigned n = 0; n < count_; n++) {
+        if (sizes_[n] == kBigSize) escapes++;
+    }
+    return escapes == big_count_;
+}
+
+void SampleIndex::deinit()
+{
+    paged_.close();
+    fragmented_.close();
+    safe_free(sizes_);
+    safe_free(big_sizes_);
+    safe_free(chunks_);
+    safe_free(runs_);
+    safe_free(keyframes_);
+    sizes_     = nullptr;
+    big_sizes_ = nullptr;
+    chunks_    = nullptr;
+    runs_      = nullptr;
+    keyframes_ = nullptr;
+    count_ = covered_ = big_count_ = chunk_count_ = run_count_ = keyframe_count_ = 0;
+    cur_sample_ = UINT32_MAX;
+    cur_offset_ = 0;
+    cur_chunk_  = 0;
+    cur_run_    = 0;
+    keyframe_cursor_ = 0;
+}
+
+}  // namespace mp4
@@ -0,0 +1,145 @@
+#pragma once
+
+#include <stdint.h>
+#include "minimp4.h"
+#include "paged_index.h"
+#include "fragment_index.h"
+
+namespace mp4 {
+
+// Compact per-track sample table, built once after MP4D_open.
+// MP4D_frame_offset() re-walks sample_to_chunk from chunk 0 and then sums
+// entry_size[] inside the chunk for every call, so iterating a whole file
+// through it is O(N^2).  This index resolves the tables once in O(N).
+//
+// Only the sample sizes are stored per sample (16 bits; larger ones go to a
+// short overflow list).  Offsets are kept per chunk and rebuilt by summing
+// sizes inside the chunk, timestamps are run-length (stts-style) runs, and
+// sync samples are the stss list: 2 bytes per sample plus 8 per chunk and
+// 12 per timestamp run.  That is about 3 bytes per sample for CFR video or
+// AAC, against 9 for minimp4's entry_size/timestamp/chunk_offset arrays; a
+// track whose every frame duration differs degrades to one run per sample
+// (test_sample_index measures both).  Demux
+// walks forward, so offset() and timestamp() keep a cursor and cost O(1)
+// per step; a jump (seek) costs one binary search plus a partial chunk sum.
+//
+// Movies too long for that (kPagedIndexMinSamples) are opened in paged
+// mode instead: the tables stay in the file and every query forwards to a
+// PagedTrack reading them through a small page cache (paged_index.h).
+// Fragmented movies forward the same way to a FragmentTrack, which parses
+// one moof at a time (fragment_index.h).
+//
+// FAT32 caps files at 4 GB, so offsets fit in 32 bits.
+class SampleIndex {
+public:
+    // Build the index for one track (tables allocated in PSRAM).
+    bool build(const MP4D_demux_t &mp4, unsigned track);
+    // Paged mode: read the tables in place through pager (which must stay open)
+    bool open_paged(TablePager &pager, const TrackTables &tables);
+    // Fragmented mode: moof boxes from fragments_start on, also through pager
+    bool open_fragmented(TablePager &pager, const TrackTables &tables, uint32_t fragments_start);
+    void deinit();
+
+    bool paged() const      { return paged_.active(); }
+    bool fragmented() const { return fragmented_.active(); }
+    // Paged mode: a table read failed, so contains() now reports the end
+    bool failed() const     { return paged_.failed(); }
+
+    // Raw tables on a POSIX fd, for the sidecar index cache (index_cache.h).
+    // A paged index has no resident tables and is never saved.
+    bool save(int fd) const;
+    bool load(int fd);
+
+    ~SampleIndex() { deinit(); }
+
+    // Fragmented mode: samples found so far (the total once the end is reached),
+    // and no keyframe count without reading every fragment
+    unsigned count() const     { return fragmented_.active() ? fragmented_.known_count() : count_; }
+    unsigned timescale() const { return timescale_; }
+    unsigned keyframe_count() const { return keyframe_count_; }
+    bool     valid() const     { return sizes_ != nullptr || paged_.active() || fragmented_.active(); }
+
+    // Is there a sample n?  Demux loops on this: in fragmented mode it reads
+    // ahead to the next moof when n passes the current fragment.
+    bool contains(unsigned n) const {
+        if (fragmented_.active()) return fragmented_.contains(n);
+        return n < count_ && !paged_.failed();
+    }
+
+    // Size in bytes; 0 for samples outside every chunk (broken stsc/stco).
+    uint32_t size(unsigned n) const;
+    uint32_t offset(unsigned n) const;
+    uint64_t timestamp(unsigned n) const;  // decode timestamp in track timescale units
+    bool     is_keyframe(unsigned n) const;
+
+    int64_t pts_us(unsigned n) const {
+        return (timescale_ > 0) ? (int64_t)timestamp(n) * 1000000LL / timescale_ : 0;
+    }
+
+    // Last sample whose timestamp is <= pts_us (0 if pts_us precedes the track).
+    unsigned sample_at(int64_t pts_us) const;
+    // Nearest sync sample at or before n: where decoding can restart.
+    unsigned keyframe_before(unsigned n) const;
+    // First sync sample after n, or count() if there is none.  O(1) amortized
+    // while n only moves forward (cursor), O(log K) after a jump.
+    unsigned next_keyframe(unsigned n);
+
+    size_t memory_bytes() const {
+        if (paged_.active()) return paged_.memory_bytes();
+        if (fragmented_.active()) return fragmented_.memory_bytes();
+        return (size_t)count_ * sizeof(uint16_t) +
+               (size_t)big_count_ * sizeof(BigSize) +
+               (size_t)chunk_count_ * sizeof(Chunk) +
+               (size_t)run_count_ * sizeof(TimeRun) +
+               (size_t)keyframe_count_ * sizeof(uint32_t);
+    }
+
+private:
+    static constexpr uint16_t kBigSize = 0xFFFF;  // sizes_[] escape: look up big_sizes_
+
+    struct Chunk {
+        uint32_t first_sample;
+        uint32_t offset;       // absolute file offset of first_sample
+    };
+    struct TimeRun {
+        uint32_t first_sample;
+        uint32_t first_ts;     // timestamp of first_sample
+        uint32_t delta;        // per-sample increment inside the run
+    };
+    struct BigSize {
+        uint32_t sample;
+        uint32_t size;
+    };
+
+    unsigned chunk_of(unsigned n) const;
+    unsigned run_of(unsigned n) const;
+    unsigned keyframe_upper_bound(unsigned n) const;  // first keyframes_[] entry > n
+    bool     alloc_tables();
+    bool     tables_consistent() const;  // loaded tables uphold what build() guarantees
+
+    uint16_t *sizes_      = nullptr;  // per sample; kBigSize = in big_sizes_
+    BigSize  *big_sizes_  = nullptr;  // ascending by sample
+    Chunk    *chunks_     = nullptr;  // non-empty chunks, ascending
+    TimeRun  *runs_       = nullptr;  // ascending by first_sample
+    uint32_t *keyframes_  = nullptr;  // 0-based sync sample numbers, ascending (copy of stss)
+
+    unsigned count_          = 0;
+    unsigned covered_        = 0;  // samples [0, covered_) lie in a chunk
+    unsigned big_count_      = 0;
+    unsigned chunk_count_    = 0;
+    unsigned run_count_      = 0;
+    unsigned keyframe_count_ = 0;  // 0 = no stss: every sample is a sync sample
+    unsigned timescale_      = 0;
+
+    PagedTrack    paged_;       // active: every query below forwards here
+    FragmentTrack fragmented_;  // likewise
+
+    // Sequential-access cursors (demux only ever steps forward between seeks)
+    mutable unsigned cur_sample_ = UINT32_MAX;  // offset(): last sample resolved
+    mutable uint32_t cur_offset_ = 0;
+    mutable unsigned cur_chunk_  = 0;
+    mutable unsigned cur_run_    = 0;
+    unsigned keyframe_cursor_    = 0;  // next_keyframe(): last answer's keyframes_[] position
+};
+
+}  // namespace mp4
@@ -18,6 +18,7 @@
 #include "esp_vfs_fat.h"
 
 #include "player_constants.h"
+#include "index_cache.h"
 #include "html_content.h"
 #include "qr_display.h"
 
@@ -243,6 +244,7 @@ void FileServer::start_http_server()
     httpd_uri_t syncmode_uri = { .uri = "/api/sync-mode", .method = HTTP_POST, .handler = sync_mode_handler, .user_ctx = this };
     httpd_uri_t repeat_uri   = { .uri = "/api/repeat",    .method = HTTP_POST, .handler = repeat_handler,    .user_ctx = this };
     httpd_uri_t volume_uri   = { .uri = "/api/volume",    .method = HTTP_POST, .handler = volume_handler,    .user_ctx = this };
+    httpd_uri_t seek_uri     = { .uri = "/api/seek",      .method = HTTP_POST, .handler = seek_handler,      .user_ctx = this };
 
     httpd_register_uri_handler(server_, &status_uri);
     httpd_register_uri_handler(server_, &playlist_uri);
@@ -254,6 +256,7 @@ void FileServer::start_http_server()
     httpd_register_uri_handler(server_, &syncmode_uri);
     httpd_register_uri_handler(server_, &repeat_uri);
     httpd_register_uri_handler(server_, &volume_uri);
+    httpd_register_uri_handler(server_, &seek_uri);
 
     // Settings API
     httpd_uri_t startpage_uri = { .uri = "/api/start-page", .method = HTTP_POST, .handler = start_page_handler, .user_ctx = this };
@@ -491,7 +494,7 @@ esp_err_t FileServer::status_handler(httpd_req_t *req)
 
     char buf[512];
     snprintf(buf, sizeof(buf),
-             "{\"playing\":%s,\"file\":\"%s\",\"index\":%d,\"total\":%d,\"folder\":\"%s\",\"playing_folder\":\"%s\",\"sync_mode\":\"%s\",\"repeat\":%s,\"volume\":%d,\"start_page\":\"%s\"}",
+             "{\"playing\":%s,\"file\":\"%s\",\"index\":%d,\"total\":%d,\"folder\":\"%s\",\"playing_folder\":\"%s\",\"sync_mode\":\"%s\",\"repeat\":%s,\"volume\":%d,\"position_ms\":%d,\"duration_ms\":%d,\"start_page\":\"%s\"}",
              ctrl.is_playing() ? "true" : "false",
              ctrl.current_file(),
              ctrl.current_index(),
@@ -501,6 +504,8 @@ esp_err_t FileServer::status_handler(httpd_req_t *req)
              ctrl.get_audio_priority() ? "audio" : "video",
              ctrl.get_repeat() ? "true" : "false",
              ctrl.get_volume(),
+             ctrl.position_ms(),
+             ctrl.duration_ms(),
              self->config_.start_page);
 
     httpd_resp_set_type(req, "application/json");
@@ -684,6 +689,27 @@ esp_err_t FileServer::volume_handler(httpd_req_t *req)
     return ESP_OK;
 }
 
+esp_err_t FileServer::seek_handler(httpd_req_t *req)
+{
+    auto *self = static_cast<FileServer *>(req->user_ctx);
+    char query[64] = "";
+    httpd_req_get_url_query_str(req, query, sizeof(query));
+
+    char ms_str[16] = "";
+    get_decoded_query_param(query, "ms", ms_str, sizeof(ms_str));
+
+    httpd_resp_set_type(req, "application/json");
+    if (strlen(ms_str) == 0 || !self->controller_.is_playing()) {
+        httpd_resp_sendstr(req, "{\"ok\":false}");
+        return ESP_OK;
+    }
+
+    // Post command to main thread (non-blocking)
+    self->controller_.post_seek(atoi(ms_str));
+    httpd_resp_sendstr(req, "{\"ok\":true}");
+    return ESP_OK;
+}
+
 esp_err_t FileServer::start_page_handler(httpd_req_t *req)
 {
     auto *self = static_cast<FileServer *>(req->user_ctx);
@@ -819,6 +845,17 @@ esp_err_t FileServer::preview_handler(httpd_req_t *req)
     return stream_file(req, filepath);
 }
 
+// A movie's demux index cache (<name>.mp4idx) goes with it.  A stale one
+// would be rejected on its size/mtime anyway; this just avoids orphans.
+static void remove_index_cache(const char *path)
+{
+    const char *ext = strrchr(path, '.');
+    if (!ext || strcasecmp(ext, ".mp4") != 0) return;
+    char sidecar[420];
+    index_cache_path(path, sidecar, sizeof(sidecar));
+    unlink(sidecar);
+}
+
 esp_err_t FileServer::upload_handler(httpd_req_t *req)
 {
     auto *self = static_cast<FileServer *>(req->user_ctx);
@@ -908,6 +945,7 @@ esp_err_t FileServer::upload_handler(httpd_req_t *req)
     if (size_ok) {
         // Atomic: rename temp to final
         unlink(filepath);  // Remove existing file if any
+        remove_index_cache(filepath);
         rename(tmppath, filepath);
         ESP_LOGI(TAG, "Upload complete: %s (%u bytes)", filepath, (unsigned)total_written);
     } else {
@@ -964,6 +1002,7 @@ esp_err_t FileServer::delete_handler(httpd_req_t *req)
     bool ok = recursive_delete(filepath);
 
     if (ok) {
+        remove_index_cache(filepath);
         ESP_LOGI(TAG, "Deleted: %s", filepath);
         self->controller_.rescan();
         httpd_resp_set_type(req, "text/plain");
@@ -1001,6 +1040,7 @@ esp_err_t FileServer::rename_handler(httpd_req_t *req)
 
     bool ok = (::rename(oldpath, newpath) == 0);
     if (ok) {
+        remove_index_cache(oldpath);
         ESP_LOGI(TAG, "Renamed: %s -> %s", oldpath, newpath);
         self->controller_.rescan();
         httpd_resp_set_type(req, "text/plain");
@@ -1,6 +1,8 @@
 #pragma once
 
 #include <stdint.h>
+#include <string.h>
+#include "psram_alloc.h"
 
 namespace mp4 {
 
@@ -18,10 +20,103 @@ static inline uint16_t yuv_to_rgb565(int y, int u, int v)
     return ((r & 0xF8) << 8) | ((g & 0xFC) << 3) | (b >> 3);
 }
 
+// --- Table-driven fast path ---
+//
+// Bit-exact with yuv_to_rgb565(): the three chroma terms are computed once
+// per horizontal pixel pair, and clamping + channel packing is folded into
+// lookup tables indexed by the unclamped channel value, so the per-pixel
+// work is three loads and two ORs with no branches.
+//
+// Unclamped ranges (y in 0..255, u/v in -128..127):
+//   r = y + ((v*359)>>8)           -> -180..433
+//   g = y - ((u*88 + v*183)>>8)    -> -134..391
+//   b = y + ((u*454)>>8)           -> -227..480
+// so a table covering -256..511 handles every input.
+//
+// kSwap565Lut emits panel byte order (big-endian RGB565, lgfx::swap565_t) so
+// the frame can be DMA'd to the LCD as-is; byte-swapping each channel table
+// is equivalent to swapping the packed pixel.
+//
+// This is a scalar adaptation of the PIE (ESP32-S3 vector extension)
+// kernel the request asked for, not that kernel.  A bit-exact PIE version
+// needs u8->s16 widening, chroma lane duplication, the green term summed
+// in QACC before its shift, and per-lane clamp and 565 packing: asm the
+// player does not ship until it has been assembled and checked on an S3.
+// The tables cost 4.5 KB of flash rodata each (only the ones referenced
+// are linked).  test/test_yuv2rgb holds them bit-exact against
+// yuv_to_rgb565() and reports cycles per pixel on the host; on the device
+// ConvertStage and the band renderer log theirs from the CPU cycle counter.
+struct Rgb565Lut {
+    static constexpr int kBias = 256;
+    static constexpr int kSize = 768;
+    uint16_t r[kSize];
+    uint16_t g[kSize];
+    uint16_t b[kSize];
+
+    constexpr explicit Rgb565Lut(bool swap) : r(), g(), b() {
+        for (int i = 0; i < kSize; i++) {
+            int c = i - kBias;
+            c = (c < 0) ? 0 : (c > 255) ? 255 : c;
+            r[i] = pack((c & 0xF8) << 8, swap);
+            g[i] = pack((c & 0xFC) << 3, swap);
+            b[i] = pack(c >> 3, swap);
+        }
+    }
+
+private:
+    static constexpr uint16_t pack(int v, bool swap) {
+        return swap ? (uint16_t)(((v & 0xFF) << 8) | ((v >> 8) & 0xFF)) : (uint16_t)v;
+    }
+};
+
+inline constexpr Rgb565Lut kRgb565Lut{false};
+inline constexpr Rgb565Lut kSwap565Lut{true};
+
+// Convert one row; 16 pixels (8 chroma pairs) per loop iteration.
+static inline void i420_row_to_rgb565(const uint8_t *y_row, const uint8_t *u_row,
+                                      const uint8_t *v_row, uint16_t *dst, int width,
+                                      const Rgb565Lut &lut = kRgb565Lut)
+{
+    const uint16_t *lr = lut.r + Rgb565Lut::kBias;
+    const uint16_t *lg = lut.g + Rgb565Lut::kBias;
+    const uint16_t *lb = lut.b + Rgb565Lut::kBias;
+
+#define MP4_YUV_PAIR(k)                                                  \
+    do {                                                                 \
+        int u  = u_row[(k)] - 128;                                       \
+        int v  = v_row[(k)] - 128;                                       \
+        int rv = (v * 359) >> 8;                                         \
+        int gc = (u * 88 + v * 183) >> 8;                                \
+        int bu = (u * 454) >> 8;                                         \
+        int y0 = y_row[2 * (k)];                                         \
+        int y1 = y_row[2 * (k) + 1];                                     \
+        dst[2 * (k)]     = lr[y0 + rv] | lg[y0 - gc] | lb[y0 + bu];      \
+        dst[2 * (k) + 1] = lr[y1 + rv] | lg[y1 - gc] | lb[y1 + bu];      \
+    } while (0)
+
+    int i = 0;
+    for (; i + 16 <= width; i += 16) {
+        MP4_YUV_PAIR(0); MP4_YUV_PAIR(1); MP4_YUV_PAIR(2); MP4_YUV_PAIR(3);
+        MP4_YUV_PAIR(4); MP4_YUV_PAIR(5); MP4_YUV_PAIR(6); MP4_YUV_PAIR(7);
+        y_row += 16; u_row += 8; v_row += 8; dst += 16;
+    }
+    for (; i + 2 <= width; i += 2) {
+        MP4_YUV_PAIR(0);
+        y_row += 2; u_row += 1; v_row += 1; dst += 2;
+    }
+    if (i < width) {  // odd cropped width
+        int u = u_row[0] - 128;
+        int v = v_row[0] - 128;
+        int y = y_row[0];
+        dst[0] = lr[y + ((v * 359) >> 8)] | lg[y - ((u * 88 + v * 183) >> 8)] | lb[y + ((u * 454) >> 8)];
+    }
+#undef MP4_YUV_PAIR
+}
+
 // H.264 macroblock alignment: round up to multiple of 16
 static inline int mb_align(int dim) { return (dim + 15) & ~15; }
 
-// Convert a full I420 frame to RGB565 (1:1, no scaling)
+// Convert a full I420 frame to RGB565 (1:1, no scaling) -- per-pixel reference
 // i420_buf: contiguous I420 buffer [Y][U][V] from H.264 decoder
 // width/height: visible video dimensions
 static inline void i420_to_rgb565(const uint8_t *i420_buf, uint16_t *rgb565,
@@ -47,30 +142,217 @@ static inline void i420_to_rgb565(const uint8_t *i420_buf, uint16_t *rgb565,
     }
 }
 
-// Convert I420 to RGB565 with nearest-neighbor downscaling
-// src_w/src_h: original decoder output dimensions
-// dst_w/dst_h: scaled output dimensions (must be <= src_w/src_h)
-static inline void i420_to_rgb565_scaled(const uint8_t *i420_buf, uint16_t *rgb565,
-                                          int src_w, int src_h, int dst_w, int dst_h)
+// Convert rows [row0, row0+rows) of planar I420 into `band` (rows * width
+// pixels) with the table-driven row kernel.  Pass kSwap565Lut for panel
+// byte order.
+static inline void i420_planes_to_rgb565_band(const uint8_t *y_plane, const uint8_t *u_plane,
+                                               const uint8_t *v_plane, int y_stride, int uv_stride,
+                                               uint16_t *band, int width, int row0, int rows,
+                                               const Rgb565Lut &lut = kRgb565Lut)
+{
+    for (int j = row0; j < row0 + rows; j++) {
+        i420_row_to_rgb565(y_plane + j * y_stride,
+                           u_plane + (j / 2) * uv_stride,
+                           v_plane + (j / 2) * uv_stride,
+                           band + (j - row0) * width, width, lut);
+    }
+}
+
+// Display size for a src_w x src_h video on a max_w x max_h panel: 1:1 if
+// it fits, else the largest size at the video's aspect ratio, rounded
+// down to even dimensions (960x540 on a 240x240 panel shows as 240x134).
+// Returns whether the video is downscaled.
+static inline bool fit_to_panel(int src_w, int src_h, int max_w, int max_h, int &w, int &h)
+{
+    if (src_w <= max_w && src_h <= max_h) {
+        w = src_w;
+        h = src_h;
+        return false;
+    }
+    if (max_w * src_h <= max_h * src_w) {
+        w = max_w;
+        h = src_h * max_w / src_w;
+    } else {
+        h = max_h;
+        w = src_w * max_h / src_h;
+    }
+    w &= ~1;
+    h &= ~1;
+    return true;
+}
+
+// Nearest-neighbour source lookup for one (src -> dst) geometry, built once
+// per video so the gather never divides.  Tables live in internal RAM
+// (~4 bytes per output column + 8 bytes per output row) since they are read
+// for every pixel alongside the PSRAM frame.
+class ScaleMap {
+public:
+    ScaleMap() = default;
+    ScaleMap(const ScaleMap &) = delete;
+    ScaleMap &operator=(const ScaleMap &) = delete;
+
+    bool init(int src_w, int src_h, int dst_w, int dst_h) {
+        deinit();
+        size_t bytes = (size_t)dst_w * 2 * sizeof(uint16_t) +
+                       (size_t)dst_h * 2 * sizeof(uint32_t);
+        mem_ = static_cast<uint8_t *>(internal_malloc(bytes));
+        if (!mem_) return false;
+        row_y_  = reinterpret_cast<uint32_t *>(mem_);
+        row_uv_ = row_y_ + dst_h;
+        col_y_  = reinterpret_cast<uint16_t *>(row_uv_ + dst_h);
+        col_uv_ = col_y_ + dst_w;
+        dst_w_  = dst_w;
+        dst_h_  = dst_h;
+
+        int stride_w = mb_align(src_w);
+        for (int j = 0; j < dst_h; j++) {
+            int src_y  = j * src_h / dst_h;
+            row_y_[j]  = (uint32_t)(src_y * stride_w);
+            row_uv_[j] = (uint32_t)((src_y / 2) * (stride_w / 2));
+        }
+        for (int i = 0; i < dst_w; i++) {
+            int src_x  = i * src_w / dst_w;
+            col_y_[i]  = (uint16_t)src_x;
+            col_uv_[i] = (uint16_t)(src_x / 2);
+        }
+        return true;
+    }
+
+    void deinit() {
+        safe_free(mem_);
+        mem_ = nullptr;
+        dst_w_ = dst_h_ = 0;
+    }
+
+    ~ScaleMap() { deinit(); }
+
+    bool valid() const { return mem_ != nullptr; }
+    int dst_w() const  { return dst_w_; }
+    int dst_h() const  { return dst_h_; }
+
+    const uint32_t *row_y() const  { return row_y_; }   // offset into Y plane
+    const uint32_t *row_uv() const { return row_uv_; }  // offset into U/V planes
+    const uint16_t *col_y() const  { return col_y_; }   // column in Y row
+    const uint16_t *col_uv() const { return col_uv_; }  // column in U/V row
+
+private:
+    uint8_t  *mem_    = nullptr;
+    uint32_t *row_y_  = nullptr;
+    uint32_t *row_uv_ = nullptr;
+    uint16_t *col_y_  = nullptr;
+    uint16_t *col_uv_ = nullptr;
+    int dst_w_ = 0;
+    int dst_h_ = 0;
+};
+
+// --- Decoupled conversion (decode -> YUV ring -> convert) ---
+//
+// The decoder reuses its output buffer, so a frame handed to another core
+// has to be copied out first.  The copy is kept at display size:
+//   1:1      -> visible I420 rows (4:2:0, strides = width, width/2)
+//   scaled   -> nearest-neighbour gather of Y/U/V per output pixel (4:4:4),
+//               so the display side converts it without a second lookup
+struct YuvFrame {
+    uint8_t *y = nullptr;
+    uint8_t *u = nullptr;
+    uint8_t *v = nullptr;
+    int  width       = 0;
+    int  height      = 0;
+    int  y_stride    = 0;
+    int  uv_stride   = 0;
+    bool chroma_full = false;  // 4:4:4 (gathered) instead of 4:2:0
+
+    // Bytes needed for a width x height frame in either layout
+    static size_t bytes_for(int width, int height, bool chroma_full) {
+        size_t luma = (size_t)width * height;
+        size_t chroma = chroma_full ? luma : (size_t)((width + 1) / 2) * ((height + 1) / 2);
+        return luma + 2 * chroma;
+    }
+
+    void bind(uint8_t *mem, int w, int h, bool full) {
+        width       = w;
+        height      = h;
+        chroma_full = full;
+        y_stride    = w;
+        uv_stride   = full ? w : (w + 1) / 2;
+        int uv_rows = full ? h : (h + 1) / 2;
+        y = mem;
+        u = y + (size_t)y_stride * h;
+        v = u + (size_t)uv_stride * uv_rows;
+    }
+};
+
+// Copy the visible area of a decoder I420 frame (1:1)
+static inline void i420_copy_to_frame(const uint8_t *i420_buf, YuvFrame &f)
+{
+    int stride_w = mb_align(f.width);
+    int stride_h = mb_align(f.height);
+    const uint8_t *y_plane = i420_buf;
+    const uint8_t *u_plane = i420_buf + stride_w * stride_h;
+    const uint8_t *v_plane = u_plane + (stride_w / 2) * (stride_h / 2);
+
+    for (int j = 0; j < f.height; j++) {
+        memcpy(f.y + j * f.y_stride, y_plane + j * stride_w, f.width);
+    }
+    for (int j = 0; j < (f.height + 1) / 2; j++) {
+        memcpy(f.u + j * f.uv_stride, u_plane + j * (stride_w / 2), f.uv_stride);
+        memcpy(f.v + j * f.uv_stride, v_plane + j * (stride_w / 2), f.uv_stride);
+    }
+}
+
+// Gather the source samples of every output pixel (downscaling)
+static inline void i420_gather_to_frame(const uint8_t *i420_buf, int src_w, int src_h,
+                                        const ScaleMap &map, YuvFrame &f)
 {
     int stride_w = mb_align(src_w);
     int stride_h = mb_align(src_h);
-
     const uint8_t *y_plane = i420_buf;
     const uint8_t *u_plane = i420_buf + stride_w * stride_h;
     const uint8_t *v_plane = u_plane + (stride_w / 2) * (stride_h / 2);
-    int half_stride = stride_w / 2;
+    const uint16_t *col_y  = map.col_y();
+    const uint16_t *col_uv = map.col_uv();
 
-    for (int j = 0; j < dst_h; j++) {
-        int src_y = j * src_h / dst_h;
-        const uint8_t *y_row = y_plane + src_y * stride_w;
-        const uint8_t *u_row = u_plane + (src_y / 2) * half_stride;
-        const uint8_t *v_row = v_plane + (src_y / 2) * half_stride;
+    for (int j = 0; j < f.height; j++) {
+        const uint8_t *y_row = y_plane + map.row_y()[j];
+        const uint8_t *u_row = u_plane + map.row_uv()[j];
+        const uint8_t *v_row = v_plane + map.row_uv()[j];
+        uint8_t *yd = f.y + j * f.y_stride;
+        uint8_t *ud = f.u + j * f.uv_stride;
+        uint8_t *vd = f.v + j * f.uv_stride;
+        for (int i = 0; i < f.width; i++) {
+            yd[i] = y_row[col_y[i]];
+            ud[i] = u_row[col_uv[i]];
+            vd[i] = v_row[col_uv[i]];
+        }
+    }
+}
 
-        for (int i = 0; i < dst_w; i++) {
-            int src_x = i * src_w / dst_w;
-            rgb565[j * dst_w + i] = yuv_to_rgb565(
-                y_row[src_x], u_row[src_x / 2] - 128, v_row[src_x / 2] - 128);
+// Convert rows [row0, row0+rows) of a YuvFrame into `band`
+static inline void yuv_frame_to_rgb565_band(const YuvFrame &f, uint16_t *band,
+                                            int row0, int rows,
+                                            const Rgb565Lut &lut = kRgb565Lut)
+{
+    if (!f.chroma_full) {
+        i420_planes_to_rgb565_band(f.y, f.u, f.v, f.y_stride, f.uv_stride,
+                                   band, f.width, row0, rows, lut);
+        return;
+    }
+
+    const uint16_t *lr = lut.r + Rgb565Lut::kBias;
+    const uint16_t *lg = lut.g + Rgb565Lut::kBias;
+    const uint16_t *lb = lut.b + Rgb565Lut::kBias;
+    for (int j = row0; j < row0 + rows; j++) {
+        const uint8_t *y_row = f.y + j * f.y_stride;
+        const uint8_t *u_row = f.u + j * f.uv_stride;
+        const uint8_t *v_row = f.v + j * f.uv_stride;
+        uint16_t *dst = band + (j - row0) * f.width;
+        for (int i = 0; i < f.width; i++) {
+            int y = y_row[i];
+            int u = u_row[i] - 128;
+            int v = v_row[i] - 128;
+            dst[i] = lr[y + ((v * 359) >> 8)] |
+                     lg[y - ((u * 88 + v * 183) >> 8)] |
+                     lb[y + ((u * 454) >> 8)];
         }
     }
 }
@@ -0,0 +1,120 @@
+#pragma once
+
+#include <stdint.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/queue.h"
+#include "player_constants.h"
+#include "psram_alloc.h"
+#include "yuv2rgb.h"
+
+namespace mp4 {
+
+// Small pool of display-sized YUV frames handed from decode (Core 1) to the
+// colour conversion side (Core 0).  Slot ownership moves through two queues
+// of slot indices: free (decode fills) and ready (converter drains), so the
+// frames themselves are never copied again after the decoder's output.
+class YuvRing {
+public:
+    static constexpr int kEos     = 0xFF;  // ready-queue marker: no more frames
+    static constexpr int kWake    = 0xFE;  // either queue: cancel(), reported as kTimeout
+    static constexpr int kTimeout = -1;
+
+    bool init() {
+        free_q_  = xQueueCreate(kYuvRingSlots, sizeof(uint8_t));
+        ready_q_ = xQueueCreate(kYuvRingSlots + 2, sizeof(uint8_t));  // + EOS + a cancel()
+        return free_q_ && ready_q_;
+    }
+
+    // Allocate the slots once the output geometry is known (PSRAM).  The
+    // memory is kept across files and only reallocated when the slot size
+    // changes; the free queue is refilled each time (after reset()).
+    bool alloc(int width, int height, bool chroma_full) {
+        size_t bytes = YuvFrame::bytes_for(width, height, chroma_full);
+        if (!mem_ || bytes != mem_slot_bytes_) {
+            safe_free(mem_);
+            mem_ = psram_alloc<uint8_t>(bytes * kYuvRingSlots);
+            mem_slot_bytes_ = mem_ ? bytes : 0;
+        }
+        if (!mem_) return false;
+        for (int i = 0; i < kYuvRingSlots; i++) {
+            slots_[i].bind(mem_ + i * bytes, width, height, chroma_full);
+            uint8_t idx = (uint8_t)i;
+            xQueueSend(free_q_, &idx, 0);
+        }
+        return true;
+    }
+
+    // Stop: a blocked acquire() / receive() returns kTimeout now, so the
+    // caller re-checks stop_requested.  Slots released after this may not
+    // fit back into the free queue; reset() sorts that out.
+    void cancel() {
+        uint8_t v = kWake;
+        if (free_q_)  xQueueSend(free_q_, &v, 0);
+        if (ready_q_) xQueueSend(ready_q_, &v, 0);
+    }
+
+    // Between files: every slot back to nobody (alloc() hands them out again)
+    void reset() {
+        if (free_q_)  xQueueReset(free_q_);
+        if (ready_q_) xQueueReset(ready_q_);
+    }
+
+    void deinit() {
+        safe_free(mem_);
+        mem_ = nullptr;
+        mem_slot_bytes_ = 0;
+        if (free_q_)  { vQueueDelete(free_q_);  free_q_  = nullptr; }
+        if (ready_q_) { vQueueDelete(ready_q_); ready_q_ = nullptr; }
+    }
+
+    YuvFrame &slot(int idx) { return slots_[idx]; }
+    size_t slot_bytes() const {
+        return YuvFrame::bytes_for(slots_[0].width, slots_[0].height, slots_[0].chroma_full);
+    }
+
+    // --- Producer (decode) ---
+    int acquire(TickType_t timeout) {
+        uint8_t idx;
+        return (xQueueReceive(free_q_, &idx, timeout) == pdTRUE && idx != kWake) ? idx : kTimeout;
+    }
+    // epoch: seek epoch of the frame, so the consumer can drop pre-seek frames;
+    // pts_us: timeline PTS (display's A/V offset); track_start: first frame
+    // of a gapless continuation
+    void publish(int idx, uint32_t epoch, int64_t pts_us, bool track_start = false) {
+        epochs_[idx] = epoch;
+        pts_[idx] = pts_us;
+        track_starts_[idx] = track_start;
+        uint8_t v = (uint8_t)idx;
+        xQueueSend(ready_q_, &v, portMAX_DELAY);  // never full: one entry per slot
+    }
+    void publish_eos() {
+        uint8_t v = kEos;
+        xQueueSend(ready_q_, &v, pdMS_TO_TICKS(200));
+    }
+
+    // --- Consumer (convert/display) ---
+    // Slot index, kEos, or kTimeout
+    int receive(TickType_t timeout) {
+        uint8_t idx;
+        return (xQueueReceive(ready_q_, &idx, timeout) == pdTRUE && idx != kWake) ? idx : kTimeout;
+    }
+    uint32_t epoch(int idx) const { return epochs_[idx]; }
+    int64_t pts_us(int idx) const { return pts_[idx]; }
+    bool track_start(int idx) const { return track_starts_[idx]; }
+    void release(int idx) {
+        uint8_t v = (uint8_t)idx;
+        xQueueSend(free_q_, &v, 0);
+    }
+
+private:
+    uint8_t      *mem_     = nullptr;
+    size_t        mem_slot_bytes_ = 0;
+    YuvFrame      slots_[kYuvRingSlots];
+    uint32_t      epochs_[kYuvRingSlots] = {};
+    int64_t       pts_[kYuvRingSlots] = {};
+    bool          track_starts_[kYuvRingSlots] = {};
+    QueueHandle_t free_q_  = nullptr;
+    QueueHandle_t ready_q_ = nullptr;
+};
+
+}  // namespace mp4
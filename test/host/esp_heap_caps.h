@@ -0,0 +1,33 @@
+#pragma once
+// Host heap: every capability is plain malloc
+#include <stdlib.h>
+#include <stddef.h>
+
+#define MALLOC_CAP_SPIRAM   (1 << 10)
+#define MALLOC_CAP_INTERNAL (1 << 11)
+#define MALLOC_CAP_8BIT     (1 << 2)
+#define MALLOC_CAP_DMA      (1 << 3)
+
+static inline void *heap_caps_malloc(size_t size, unsigned caps)
+{
+    (void)caps;
+    return malloc(size);
+}
+
+static inline void *heap_caps_realloc(void *ptr, size_t size, unsigned caps)
+{
+    (void)caps;
+    return realloc(ptr, size);
+}
+
+static inline void *heap_caps_aligned_alloc(size_t align, size_t size, unsigned caps)
+{
+    (void)caps;
+    void *p = NULL;
+    return (posix_memalign(&p, align < sizeof(void *) ? sizeof(void *) : align, size) == 0) ? p : NULL;
+}
+
+static inline void heap_caps_free(void *ptr)
+{
+    free(ptr);
+}
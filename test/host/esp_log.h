@@ -0,0 +1,23 @@
+#pragma once
+// Host build of the ESP-IDF logging macros: errors and warnings to stderr,
+// info to stdout, debug and verbose dropped.  Not format-checked: the
+// firmware's "%lld" for int64_t is right on the ESP32 (long long) and
+// merely equivalent on an LP64 host (long).
+#include <stdarg.h>
+#include <stdio.h>
+
+static inline void esp_host_log(FILE *out, char level, const char *tag, const char *fmt, ...)
+{
+    va_list args;
+    va_start(args, fmt);
+    fprintf(out, "%c (%s) ", level, tag);
+    vfprintf(out, fmt, args);
+    fputc('\n', out);
+    va_end(args);
+}
+
+#define ESP_LOGE(tag, fmt, ...) esp_host_log(stderr, 'E', tag, fmt, ##__VA_ARGS__)
+#define ESP_LOGW(tag, fmt, ...) esp_host_log(stderr, 'W', tag, fmt, ##__VA_ARGS__)
+#define ESP_LOGI(tag, fmt, ...) esp_host_log(stdout, 'I', tag, fmt, ##__VA_ARGS__)
+#define ESP_LOGD(tag, fmt, ...) do { (void)(tag); } while (0)
+#define ESP_LOGV(tag, fmt, ...) do { (void)(tag); } while (0)
@@ -0,0 +1,18 @@
+#pragma once
+// Host FreeRTOS subset for the native tests: 1 ms ticks, semaphores on
+// std::mutex / std::condition_variable, tasks are std::threads.
+#include <stdint.h>
+#include <stddef.h>
+
+typedef uint32_t TickType_t;
+typedef int      BaseType_t;
+typedef unsigned UBaseType_t;
+
+#define pdTRUE  1
+#define pdFALSE 0
+#define pdPASS  1
+#define pdFAIL  0
+#define portMAX_DELAY      ((TickType_t)0xFFFFFFFFu)
+#define configTICK_RATE_HZ 1000
+#define portTICK_PERIOD_MS 1
+#define pdMS_TO_TICKS(ms)  ((TickType_t)(ms))
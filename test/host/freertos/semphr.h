@@ -0,0 +1,62 @@
+#pragma once
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include "FreeRTOS.h"
+
+struct HostSemaphore {
+    std::mutex              m;
+    std::condition_variable cv;
+    unsigned count = 0;
+    unsigned max   = 1;
+};
+typedef HostSemaphore *SemaphoreHandle_t;
+
+static inline SemaphoreHandle_t xSemaphoreCreateBinary(void)
+{
+    return new HostSemaphore;
+}
+
+static inline SemaphoreHandle_t xSemaphoreCreateMutex(void)
+{
+    SemaphoreHandle_t s = new HostSemaphore;
+    s->count = 1;
+    return s;
+}
+
+static inline SemaphoreHandle_t xSemaphoreCreateCounting(UBaseType_t max, UBaseType_t initial)
+{
+    SemaphoreHandle_t s = new HostSemaphore;
+    s->max   = max;
+    s->count = initial;
+    return s;
+}
+
+static inline void vSemaphoreDelete(SemaphoreHandle_t s)
+{
+    delete s;
+}
+
+static inline BaseType_t xSemaphoreTake(SemaphoreHandle_t s, TickType_t ticks)
+{
+    std::unique_lock<std::mutex> lock(s->m);
+    auto ready = [s] { return s->count > 0; };
+    if (ticks == portMAX_DELAY) {
+        s->cv.wait(lock, ready);
+    } else if (!s->cv.wait_for(lock, std::chrono::milliseconds(ticks), ready)) {
+        return pdFALSE;
+    }
+    s->count--;
+    return pdTRUE;
+}
+
+// Notifies under the lock: a taker may delete the semaphore as soon as it
+// gets it (a task's done signal), so nothing may touch it after unlock
+static inline BaseType_t xSemaphoreGive(SemaphoreHandle_t s)
+{
+    std::lock_guard<std::mutex> lock(s->m);
+    if (s->count >= s->max) return pdFALSE;
+    s->count++;
+    s->cv.notify_one();
+    return pdTRUE;
+}
@@ -0,0 +1,34 @@
+#pragma once
+#include <chrono>
+#include <thread>
+#include "FreeRTOS.h"
+
+typedef void (*TaskFunction_t)(void *);
+typedef struct HostTask *TaskHandle_t;
+
+static inline TickType_t xTaskGetTickCount(void)
+{
+    using namespace std::chrono;
+    return (TickType_t)duration_cast<milliseconds>(steady_clock::now().time_since_epoch()).count();
+}
+
+static inline void vTaskDelay(TickType_t ticks)
+{
+    std::this_thread::sleep_for(std::chrono::milliseconds(ticks));
+}
+
+#define taskYIELD() std::this_thread::yield()
+
+// Detached thread; the handle is only a non-null token
+static inline BaseType_t xTaskCreatePinnedToCore(TaskFunction_t fn, const char *name, uint32_t stack,
+                                                 void *arg, UBaseType_t prio, TaskHandle_t *handle,
+                                                 BaseType_t core)
+{
+    (void)name; (void)stack; (void)prio; (void)core;
+    std::thread(fn, arg).detach();
+    if (handle) *handle = reinterpret_cast<TaskHandle_t>(1);
+    return pdPASS;
+}
+
+// Only vTaskDelete(nullptr) at the end of a task function: returning ends the thread
+static inline void vTaskDelete(TaskHandle_t) {}
@@ -0,0 +1,254 @@
+// ChunkReader: interleaved two-track reads, seeks and the end of the file,
+// with the I/O task on a host thread streaming a temporary file.
+//
+//   pio test -e native -f test_chunk_reader -v
+
+#include <unity.h>
+
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <unistd.h>
+#include <vector>
+
+#include "chunk_reader.h"
+
+using namespace mp4;
+
+namespace {
+
+const char  *kPath     = "/tmp/test_chunk_reader.bin";
+const size_t kRingSize = 512 * 1024;
+
+struct Lcg {
+    uint32_t s;
+    explicit Lcg(uint32_t seed) : s(seed) {}
+    uint32_t below(uint32_t n) { s = s * 1664525u + 1013904223u; return (s >> 8) % n; }
+};
+
+std::vector<uint8_t> g_file;
+
+void write_file(size_t bytes)
+{
+    Lcg rng(bytes);
+    g_file.resize(bytes);
+    for (auto &b : g_file) b = (uint8_t)rng.below(256);
+    FILE *f = fopen(kPath, "wb");
+    TEST_ASSERT_NOT_NULL(f);
+    TEST_ASSERT_EQUAL_UINT(bytes, fwrite(g_file.data(), 1, bytes, f));
+    fclose(f);
+}
+
+struct Sample {
+    uint32_t offset;
+    unsigned size;
+    int      track;
+};
+
+// Chunks of video then audio samples, consumed in an interleaved order the
+// way demux merges them by timestamp
+std::vector<Sample> interleaved(uint32_t end, uint32_t seed)
+{
+    Lcg rng(seed);
+    std::vector<Sample> order;
+    uint32_t pos = 100;
+    for (;;) {
+        std::vector<Sample> v, a;
+        for (int k = 0; k < 30; k++) { v.push_back({pos, 1000 + rng.below(6000), 0}); pos += v.back().size; }
+        for (int k = 0; k < 40; k++) { a.push_back({pos, 200 + rng.below(400), 1}); pos += a.back().size; }
+        if (pos > end) break;
+        for (size_t i = 0, j = 0; i < v.size() || j < a.size();) {
+            order.push_back((j >= a.size() || (i < v.size() && i * 4 <= j * 3)) ? v[i++] : a[j++]);
+        }
+    }
+    return order;
+}
+
+uint32_t next_other(const std::vector<Sample> &order, size_t i)
+{
+    for (size_t j = i + 1; j < order.size(); j++) {
+        if (order[j].track != order[i].track) return order[j].offset;
+    }
+    return UINT32_MAX;
+}
+
+bool read_matches(ChunkReader &reader, const Sample &s, uint32_t other, std::vector<uint8_t> &buf)
+{
+    buf.assign(s.size, 0);
+    return reader.read(s.offset, s.size, buf.data(), other) &&
+           memcmp(buf.data(), &g_file[s.offset], s.size) == 0;
+}
+
+double ms_since(std::chrono::steady_clock::time_point t0)
+{
+    return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - t0).count();
+}
+
+void test_interleaved_reads_match_file()
+{
+    write_file(4 * 1024 * 1024);
+    std::vector<Sample> order = interleaved((uint32_t)g_file.size(), 1);
+    ChunkReader reader;
+    TEST_ASSERT_TRUE(reader.open(kPath, kRingSize));
+    reader.restart(order[0].offset);
+    std::vector<uint8_t> buf;
+    for (size_t i = 0; i < order.size(); i++) {
+        TEST_ASSERT_TRUE(read_matches(reader, order[i], next_other(order, i), buf));
+    }
+    TEST_ASSERT_EQUAL_UINT(0, reader.direct_reads());
+    reader.close();
+}
+
+// Tracks far apart in the file: the one behind the stream is read directly
+void test_far_apart_tracks_match_file()
+{
+    write_file(4 * 1024 * 1024);
+    Lcg rng(2);
+    std::vector<Sample> order;
+    uint32_t v = 0, a = (uint32_t)g_file.size() / 2;
+    for (int k = 0; k < 2000; k++) {
+        order.push_back({v, 500 + rng.below(1500), 0});
+        v += order.back().size;
+        order.push_back({a, 300, 1});
+        a += 300;
+    }
+    ChunkReader reader;
+    TEST_ASSERT_TRUE(reader.open(kPath, kRingSize));
+    reader.restart(0);
+    std::vector<uint8_t> buf;
+    for (size_t i = 0; i < order.size(); i++) {
+        TEST_ASSERT_TRUE(read_matches(reader, order[i], next_other(order, i), buf));
+    }
+    reader.close();
+}
+
+void test_seeks_match_file()
+{
+    write_file(4 * 1024 * 1024);
+    std::vector<Sample> order = interleaved((uint32_t)g_file.size(), 3);
+    Lcg rng(3);
+    ChunkReader reader;
+    TEST_ASSERT_TRUE(reader.open(kPath, kRingSize));
+    reader.restart(0);
+    std::vector<uint8_t> buf;
+    for (int seek = 0; seek < 200; seek++) {
+        size_t i = rng.below((uint32_t)order.size());
+        if (rng.below(2)) reader.restart(order[i].offset);
+        for (size_t k = i; k < order.size() && k < i + 50; k++) {
+            TEST_ASSERT_TRUE(read_matches(reader, order[k], UINT32_MAX, buf));
+        }
+    }
+    reader.close();
+}
+
+// The last sample ends on the file's last byte, which no transfer boundary
+// lines up with; anything reaching past it fails at once
+void test_reads_up_to_and_past_end_of_file()
+{
+    write_file(1024 * 1024 + 1234);
+    const uint32_t size = (uint32_t)g_file.size();
+    ChunkReader reader;
+    TEST_ASSERT_TRUE(reader.open(kPath, kRingSize));
+    reader.restart(0);
+    std::vector<uint8_t> buf;
+    for (uint32_t pos = 0; pos < size;) {
+        unsigned n = (size - pos < 3000) ? size - pos : 3000;
+        TEST_ASSERT_TRUE(read_matches(reader, {pos, n, 0}, UINT32_MAX, buf));
+        pos += n;
+    }
+
+    buf.assign(64, 0);
+    auto t0 = std::chrono::steady_clock::now();
+    TEST_ASSERT_FALSE(reader.read(size - 10, 20, buf.data(), UINT32_MAX));
+    TEST_ASSERT_FALSE(reader.read(size + 4096, 20, buf.data(), UINT32_MAX));
+    TEST_ASSERT_TRUE(ms_since(t0) < 50);
+
+    // Still serving from the buffered tail afterwards
+    TEST_ASSERT_TRUE(read_matches(reader, {size - 64, 64, 0}, UINT32_MAX, buf));
+    reader.close();
+}
+
+// The file shrinks under the reader (card pulled, file rewritten): samples
+// beyond the new end fail instead of stalling demux
+void test_truncated_file_fails_reads()
+{
+    write_file(2 * 1024 * 1024);
+    ChunkReader reader;
+    TEST_ASSERT_TRUE(reader.open(kPath, kRingSize));
+    TEST_ASSERT_EQUAL_INT(0, truncate(kPath, 1024 * 1024));
+    reader.restart(0);
+    std::vector<uint8_t> buf;
+    auto t0 = std::chrono::steady_clock::now();
+    uint32_t pos = 0;
+    for (; pos + 5000 <= 1024 * 1024; pos += 5000) {
+        TEST_ASSERT_TRUE(read_matches(reader, {pos, 5000, 0}, UINT32_MAX, buf));
+    }
+    for (; pos + 5000 <= 2 * 1024 * 1024; pos += 50000) {
+        TEST_ASSERT_FALSE(reader.read(pos, 5000, buf.data(), UINT32_MAX));
+    }
+    TEST_ASSERT_TRUE(ms_since(t0) < 2000);
+    reader.close();
+}
+
+// A stop already raised: a read the stream has not reached yet gives up
+// rather than wait, while buffered samples are still served
+void test_stop_fails_stalled_read()
+{
+    write_file(4 * 1024 * 1024);
+    volatile bool stop = false;
+    ChunkReader reader;
+    TEST_ASSERT_TRUE(reader.open(kPath, kRingSize, &stop));
+    reader.restart(0);
+    std::vector<uint8_t> buf;
+    TEST_ASSERT_TRUE(read_matches(reader, {0, 1000, 0}, UINT32_MAX, buf));
+
+    stop = true;
+    TEST_ASSERT_TRUE(read_matches(reader, {1000, 1000, 0}, UINT32_MAX, buf));
+    buf.assign(kRingSize / 2, 0);
+    auto t0 = std::chrono::steady_clock::now();
+    for (uint32_t k = 1; k <= 5; k++) {
+        // A whole half ring past a fresh restart is never buffered yet
+        uint32_t far = k * 600 * 1024;
+        bool ok = reader.read(far, kRingSize / 2, buf.data(), UINT32_MAX);
+        TEST_ASSERT_TRUE(!ok || memcmp(buf.data(), &g_file[far], kRingSize / 2) == 0);
+    }
+    TEST_ASSERT_TRUE(ms_since(t0) < 500);
+    reader.close();
+}
+
+// close() with the I/O task mid-stream: it waits the task out before
+// freeing the ring (run under a sanitizer to see a use after free)
+void test_close_while_streaming()
+{
+    write_file(4 * 1024 * 1024);
+    std::vector<uint8_t> buf;
+    for (int round = 0; round < 50; round++) {
+        ChunkReader reader;
+        TEST_ASSERT_TRUE(reader.open(kPath, kRingSize));
+        reader.restart((uint32_t)round * 4096);
+        if (round % 2) {
+            TEST_ASSERT_TRUE(read_matches(reader, {(uint32_t)round * 4096 + 10, 2000, 0},
+                                          UINT32_MAX, buf));
+        }
+        reader.close();
+    }
+    unlink(kPath);
+}
+
+}  // namespace
+
+void setUp() {}
+void tearDown() {}
+
+int main()
+{
+    UNITY_BEGIN();
+    RUN_TEST(test_interleaved_reads_match_file);
+    RUN_TEST(test_far_apart_tracks_match_file);
+    RUN_TEST(test_seeks_match_file);
+    RUN_TEST(test_reads_up_to_and_past_end_of_file);
+    RUN_TEST(test_truncated_file_fails_reads);
+    RUN_TEST(test_stop_fails_stalled_read);
+    RUN_TEST(test_close_while_streaming);
+    return UNITY_END();
+}
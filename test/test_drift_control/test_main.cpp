@@ -0,0 +1,265 @@
+// DriftController and Resampler: the loop closed around a simulated I2S
+// clock running a few hundred ppm off nominal, jumps that must resync
+// rather than be chased, and resampling split across buffers against the
+// same stream resampled in one piece.
+//
+//   pio test -e native -f test_drift_control -v
+
+#include <unity.h>
+
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <vector>
+
+#include "drift_control.h"
+
+using namespace mp4;
+
+namespace {
+
+constexpr double kRate   = 48000;
+constexpr size_t kFrames = 1024;  // one AAC frame per buffer, as the I2S writer sees them
+
+struct Lcg {
+    uint32_t s;
+    explicit Lcg(uint32_t seed) : s(seed) {}
+    uint32_t below(uint32_t n) { s = s * 1664525u + 1013904223u; return (s >> 8) % n; }
+    int16_t sample() { s = s * 1664525u + 1013904223u; return (int16_t)(s >> 16); }
+};
+
+// The I2S writer's loop against a DAC whose clock is off by dac_ppm: each
+// buffer, update() sees the media clock (stream time of what has been
+// played, with the jitter of the clock's DMA-buffer interpolation) and the
+// reference clock, and the resampled output takes n / (rate * (1 + dac_ppm))
+// seconds of the reference to play
+struct Loop {
+    DriftController ctl;
+    Resampler       rs;
+    double   dac_rate;
+    double   ref_s    = 0;
+    double   stream_s = 0;
+    int64_t  audio_offset_us = 5000000;  // arbitrary stream start
+    Lcg      jitter{7};
+    std::vector<int16_t> in, out;
+
+    explicit Loop(double dac_ppm)
+        : dac_rate(kRate * (1 + dac_ppm / 1e6)), in(2 * kFrames), out(2 * Resampler::max_out_frames(kFrames))
+    {
+        ctl.reset();
+        rs.reset(2);
+    }
+
+    int step()
+    {
+        const int64_t audio_us = (int64_t)(stream_s * 1e6) + audio_offset_us + (int)jitter.below(45) - 22;
+        const int ppm = ctl.update(audio_us, (int64_t)(ref_s * 1e6) + 123456789);
+        const size_t n = rs.process(in.data(), kFrames, out.data(), out.size() / 2, ppm);
+        TEST_ASSERT_TRUE(n <= Resampler::max_out_frames(kFrames));
+        ref_s    += n / dac_rate;
+        stream_s += kFrames / kRate;
+        return ppm;
+    }
+    // Run until ref_s reaches until_s; the largest |drift| from from_s on
+    int64_t run(double until_s, double from_s = 1e9)
+    {
+        int64_t worst = 0;
+        while (ref_s < until_s) {
+            step();
+            if (ref_s >= from_s) worst = std::max(worst, (int64_t)std::llabs(ctl.drift_us()));
+        }
+        return worst;
+    }
+};
+
+// Within the correction range the loop settles on the DAC's error: the
+// speed converges to -error and, critically damped, the drift peaks at
+// error * tau / e one time constant in and is down to the clock jitter
+// after ten; nothing is mistaken for a jump
+void test_converges_on_clock_error()
+{
+    const double kTauS   = kDriftTimeConstantMs / 1000.0;
+    const double kSettle = 10 * kTauS;
+    for (double dac_ppm : {-3000.0, -400.0, -150.0, 0.0, 35.0, 250.0, 400.0, 3000.0}) {
+        Loop loop(dac_ppm);
+        const int64_t late = loop.run(kSettle + 60, kSettle);
+        printf("DAC %+6.0f ppm: speed %+5d ppm, |drift| %4lld us settled, %5lld us max\n",
+               dac_ppm, loop.ctl.ppm(), (long long)late, (long long)loop.ctl.max_drift_us());
+        TEST_ASSERT_TRUE(std::fabs(loop.ctl.ppm() + dac_ppm) <= 25);
+        TEST_ASSERT_TRUE(late < 100);
+        TEST_ASSERT_TRUE(loop.ctl.max_drift_us() <= std::fabs(dac_ppm) * kTauS / M_E * 1.05 + 50);
+        TEST_ASSERT_EQUAL_UINT(0, loop.ctl.resyncs());
+        TEST_ASSERT_TRUE(loop.ctl.min_ppm() >= -kDriftMaxPpm && loop.ctl.max_ppm() <= kDriftMaxPpm);
+    }
+}
+
+// Past the correction range the speed pins at kDriftMaxPpm and no
+// further: the rest accumulates into drift, which resyncs when it passes
+// kDriftResyncUs instead of growing without bound
+void test_error_beyond_range_is_clamped()
+{
+    for (double dac_ppm : {-7000.0, 6000.0}) {
+        Loop loop(dac_ppm);
+        loop.run(300);
+        TEST_ASSERT_TRUE(loop.ctl.min_ppm() >= -kDriftMaxPpm && loop.ctl.max_ppm() <= kDriftMaxPpm);
+        TEST_ASSERT_EQUAL_INT(dac_ppm > 0 ? -kDriftMaxPpm : kDriftMaxPpm, loop.ctl.ppm());
+        TEST_ASSERT_TRUE(loop.ctl.resyncs() > 0);
+        TEST_ASSERT_TRUE(loop.ctl.max_drift_us() <= kDriftResyncUs);
+    }
+}
+
+// A jump in the media clock (a gap between tracks, a stall the writer
+// didn't see) re-anchors at once and keeps the learned rate; a step under
+// the threshold is drift and is worked off
+void test_jumps_resync_and_keep_rate()
+{
+    for (int64_t jump : {(int64_t)300000, (int64_t)-250000, kDriftResyncUs + 1}) {
+        Loop loop(300);
+        loop.run(60);
+        const int learned = loop.ctl.ppm();
+        loop.audio_offset_us += jump;
+        loop.step();
+        TEST_ASSERT_EQUAL_UINT(1, loop.ctl.resyncs());
+        TEST_ASSERT_TRUE(std::llabs(loop.ctl.drift_us()) < 1000);
+        TEST_ASSERT_TRUE(std::abs(loop.ctl.ppm() - learned) <= 25);
+        loop.run(120);
+        TEST_ASSERT_EQUAL_UINT(1, loop.ctl.resyncs());
+        TEST_ASSERT_TRUE(std::abs(loop.ctl.ppm() + 300) <= 25);
+    }
+
+    Loop loop(-200);
+    loop.run(60);
+    loop.audio_offset_us += kDriftResyncUs / 2;
+    loop.step();
+    TEST_ASSERT_EQUAL_UINT(0, loop.ctl.resyncs());
+    TEST_ASSERT_EQUAL_INT(-kDriftMaxPpm, loop.ctl.ppm());  // 50 ms behind: full speed down
+    const double kTauS = kDriftTimeConstantMs / 1000.0;
+    const int64_t late = loop.run(60 + 11 * kTauS, 60 + 10 * kTauS);
+    TEST_ASSERT_EQUAL_UINT(0, loop.ctl.resyncs());
+    TEST_ASSERT_TRUE(late < 100);
+}
+
+// reanchor() (seek, underrun) starts the drift over but not the rate;
+// reset() (new stream) forgets both
+void test_reanchor_and_reset()
+{
+    Loop loop(-400);
+    loop.run(80);
+    const int learned = loop.ctl.ppm();
+    TEST_ASSERT_TRUE(std::abs(learned - 400) <= 25);
+    loop.ctl.reanchor();
+    loop.audio_offset_us += 12345678;  // seek: the media clock is elsewhere
+    loop.step();
+    TEST_ASSERT_EQUAL_UINT(0, loop.ctl.resyncs());
+    TEST_ASSERT_TRUE(loop.ctl.drift_us() == 0);
+    TEST_ASSERT_TRUE(std::abs(loop.ctl.ppm() - learned) <= 25);
+
+    loop.ctl.reset();
+    TEST_ASSERT_EQUAL_INT(0, loop.ctl.update(1000, 2000));
+    TEST_ASSERT_EQUAL_INT(0, loop.ctl.update(-1, 3000));  // media clock unknown
+}
+
+// One input stream cut into buffers of random sizes, each with its own
+// ppm, against a one-piece reference that switches step wherever the call
+// boundaries fall: the Q32.32 position and the last frame carry over, so
+// the two agree sample for sample
+void test_resampler_carries_position_across_buffers()
+{
+    for (unsigned ch : {1u, 2u}) {
+        Lcg rng(ch);
+        std::vector<int16_t> stream;
+        std::vector<size_t>  lengths;
+        std::vector<int>     ppms;
+        for (int b = 0; b < 400; b++) {
+            size_t len = 1 + rng.below(1500);
+            for (size_t i = 0; i < len * ch; i++) stream.push_back(rng.sample());
+            lengths.push_back(len);
+            ppms.push_back((int)rng.below(2 * kDriftMaxPpm + 1) - kDriftMaxPpm);
+        }
+        ppms[3] = 0;
+        ppms[4] = kDriftMaxPpm;
+        ppms[5] = -kDriftMaxPpm;
+
+        Resampler rs;
+        rs.reset(ch);
+        std::vector<int16_t> got;
+        size_t start = 0;
+        for (size_t b = 0; b < lengths.size(); b++) {
+            std::vector<int16_t> out(Resampler::max_out_frames(lengths[b]) * ch);
+            size_t n = rs.process(&stream[start * ch], lengths[b], out.data(),
+                                  Resampler::max_out_frames(lengths[b]), ppms[b]);
+            TEST_ASSERT_TRUE(n <= Resampler::max_out_frames(lengths[b]));
+            got.insert(got.end(), out.begin(), out.begin() + n * ch);
+            start += lengths[b];
+        }
+
+        // Reference: frame j of [silence, stream...] at position P (Q32.32),
+        // with the step of the buffer whose call P falls in
+        auto frame = [&](size_t j, unsigned c) -> int { return j == 0 ? 0 : stream[(j - 1) * ch + c]; };
+        std::vector<int16_t> expect;
+        uint64_t pos = 0;
+        size_t b = 0, b_start = 0;
+        const size_t total = stream.size() / ch;
+        while ((pos >> 32) < total) {
+            while ((pos >> 32) >= b_start + lengths[b]) b_start += lengths[b++];
+            const size_t j = (size_t)(pos >> 32);
+            const int f = (int)((uint32_t)pos >> 17);
+            for (unsigned c = 0; c < ch; c++) {
+                const int a = frame(j, c), z = frame(j + 1, c);
+                expect.push_back((int16_t)(a + (((z - a) * f) >> 15)));
+            }
+            pos += (1ull << 32) + (int64_t)ppms[b] * (int64_t)(1ull << 32) / 1000000;
+        }
+        TEST_ASSERT_EQUAL_UINT(expect.size(), got.size());
+        TEST_ASSERT_EQUAL_MEMORY(expect.data(), got.data(), got.size() * sizeof(int16_t));
+    }
+}
+
+// A steady ppm over a long run: output count within a frame of
+// input / (1 + ppm), and a sine keeps its shape across every buffer seam
+void test_resampler_rate_and_continuity()
+{
+    for (int ppm : {-kDriftMaxPpm, -321, 0, 4321, kDriftMaxPpm}) {
+        const double step = 1 + ppm / 1e6;
+        const int buffers = 200;
+        Resampler rs;
+        rs.reset(1);
+        std::vector<int16_t> in(kFrames), out(Resampler::max_out_frames(kFrames));
+        size_t produced = 0;
+        double worst = 0;
+        for (int b = 0; b < buffers; b++) {
+            for (size_t i = 0; i < kFrames; i++) {
+                in[i] = (int16_t)lrint(20000 * sin(2 * M_PI * 1000 * (b * kFrames + i) / kRate));
+            }
+            size_t n = rs.process(in.data(), kFrames, out.data(), out.size(), ppm);
+            for (size_t i = 0; i < n; i++) {
+                double pos = (produced + i) * step - 1;  // one frame of lag
+                if (pos < 0) continue;
+                worst = std::max(worst, std::fabs(20000 * sin(2 * M_PI * 1000 * pos / kRate) - out[i]));
+            }
+            produced += n;
+        }
+        const double ideal = buffers * kFrames / step;
+        TEST_ASSERT_TRUE(std::fabs(produced - ideal) <= 1.0);
+        // Linear interpolation of a sine is off by at most A (w T)^2 / 8, plus rounding
+        const double bound = 20000 * pow(2 * M_PI * 1000 / kRate, 2) / 8 + 1.5;
+        TEST_ASSERT_TRUE(worst < (ppm == 0 ? 1.0 : bound));
+    }
+}
+
+}  // namespace
+
+void setUp() {}
+void tearDown() {}
+
+int main()
+{
+    UNITY_BEGIN();
+    RUN_TEST(test_converges_on_clock_error);
+    RUN_TEST(test_error_beyond_range_is_clamped);
+    RUN_TEST(test_jumps_resync_and_keep_rate);
+    RUN_TEST(test_reanchor_and_reset);
+    RUN_TEST(test_resampler_carries_position_across_buffers);
+    RUN_TEST(test_resampler_rate_and_continuity);
+    return UNITY_END();
+}
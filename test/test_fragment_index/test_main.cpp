@@ -0,0 +1,355 @@
+// FragmentTrack: fragmented MP4 files written here (moof/mdat pairs with
+// both tracks in one moof or each in its own, tfdt version 0, 1 or absent),
+// read back through SampleIndex and checked against what was written.
+//
+//   pio test -e native -f test_fragment_index -v
+
+#include <unity.h>
+
+#include <cstdio>
+#include <unistd.h>
+#include <vector>
+
+#include "sample_index.h"
+
+using namespace mp4;
+
+namespace {
+
+const char *kPath = "/tmp/test_fragment_index.mp4";
+
+constexpr uint32_t kVideoId = 1, kAudioId = 2;
+constexpr uint32_t kVideoDuration = 3000, kAudioDuration = 1024;  // trex defaults
+
+struct Lcg {
+    uint32_t s;
+    explicit Lcg(uint32_t seed) : s(seed) {}
+    uint32_t below(uint32_t n) { s = s * 1664525u + 1013904223u; return (s >> 8) % n; }
+};
+
+struct Sample {
+    uint32_t offset;
+    uint32_t size;
+    uint64_t ts;
+    bool     key;
+};
+
+enum class Tfdt { V0, V1, Absent };
+
+struct Layout {
+    Tfdt     tfdt;
+    bool     separate;  // one moof per track (video then audio) instead of one for both
+    uint64_t base_ts;   // first fragment's time; past 2^32 needs tfdt version 1
+};
+
+struct Writer {
+    std::vector<uint8_t> bytes;
+
+    size_t pos() const { return bytes.size(); }
+    void put32(uint32_t v) {
+        for (int i = 3; i >= 0; i--) bytes.push_back((uint8_t)(v >> (i * 8)));
+    }
+    void put64(uint64_t v) { put32((uint32_t)(v >> 32)); put32((uint32_t)v); }
+    void patch32(size_t at, uint32_t v) {
+        for (int i = 0; i < 4; i++) bytes[at + i] = (uint8_t)(v >> ((3 - i) * 8));
+    }
+    size_t begin(const char (&type)[5]) {
+        size_t at = pos();
+        put32(0);
+        put32(fourcc(type));
+        return at;
+    }
+    size_t begin_full(const char (&type)[5], uint8_t version, uint32_t flags) {
+        size_t at = begin(type);
+        put32(((uint32_t)version << 24) | flags);
+        return at;
+    }
+    void end(size_t at) { patch32(at, (uint32_t)(pos() - at)); }
+};
+
+struct Movie {
+    std::vector<Sample> video, audio;
+    uint32_t fragments_start = 0;
+    uint32_t last_video_moof = 0;
+};
+
+struct TrafPlan {
+    uint32_t track_id;
+    std::vector<Sample> samples;  // offsets filled once the mdat is placed
+    std::vector<size_t> data_offset_at;  // trun data_offset fields to patch
+    std::vector<size_t> trun_first;      // first sample of each trun
+};
+
+// One traf: default-base-is-moof, data offsets relative to the moof, one or
+// two truns, durations from trex unless the trun carries them
+void write_traf(Writer &w, TrafPlan &plan, uint64_t base_ts, Tfdt tfdt, Lcg &rng)
+{
+    const bool video = plan.track_id == kVideoId;
+    size_t traf = w.begin("traf");
+    size_t tfhd = w.begin_full("tfhd", 0, 0x020000);
+    w.put32(plan.track_id);
+    w.end(tfhd);
+    if (tfdt != Tfdt::Absent) {
+        size_t box = w.begin_full("tfdt", tfdt == Tfdt::V1 ? 1 : 0, 0);
+        if (tfdt == Tfdt::V1) {
+            w.put64(base_ts);
+        } else {
+            w.put32((uint32_t)base_ts);
+        }
+        w.end(box);
+    }
+    const size_t n = plan.samples.size();
+    const size_t cut = (n > 3 && rng.below(2)) ? n / 2 : n;
+    std::vector<std::pair<size_t, size_t>> truns = {{0, cut}};
+    if (cut < n) truns.push_back({cut, n});
+    for (auto [first, last] : truns) {
+        const bool durations = rng.below(2);
+        const bool flags     = video && rng.below(2);
+        uint32_t tr = 0x000001 | 0x000200;
+        if (durations) tr |= 0x000100;
+        if (flags) tr |= 0x000400;
+        if (video && !flags) tr |= 0x000004;
+        size_t trun = w.begin_full("trun", 0, tr);
+        w.put32((uint32_t)(last - first));
+        plan.data_offset_at.push_back(w.pos());
+        plan.trun_first.push_back(first);
+        w.put32(0);
+        if (tr & 0x000004) {
+            // Only the first sample is flagged: the rest take the non-sync default
+            w.put32(plan.samples[first].key ? 0x02000000 : 0x01010000);
+            for (size_t i = first + 1; i < last; i++) plan.samples[i].key = false;
+        }
+        for (size_t i = first; i < last; i++) {
+            if (durations) w.put32(video ? kVideoDuration : kAudioDuration);
+            w.put32(plan.samples[i].size);
+            if (flags) w.put32(plan.samples[i].key ? 0x02000000 : 0x01010000);
+        }
+        w.end(trun);
+    }
+    w.end(traf);
+}
+
+// moof + mdat for the given tracks; sample data is laid out traf by traf
+void write_fragment(Writer &w, std::vector<TrafPlan> &plans, const Layout &layout,
+                    uint64_t video_ts, uint64_t audio_ts, Movie &movie, Lcg &rng)
+{
+    const uint32_t moof_at = (uint32_t)w.pos();
+    size_t moof = w.begin("moof");
+    size_t mfhd = w.begin_full("mfhd", 0, 0);
+    w.put32(1);
+    w.end(mfhd);
+    for (TrafPlan &plan : plans) {
+        write_traf(w, plan, plan.track_id == kVideoId ? video_ts : audio_ts, layout.tfdt, rng);
+        if (plan.track_id == kVideoId) movie.last_video_moof = moof_at;
+    }
+    w.end(moof);
+
+    size_t mdat = w.begin("mdat");
+    for (TrafPlan &plan : plans) {
+        uint64_t ts = plan.track_id == kVideoId ? video_ts : audio_ts;
+        const uint32_t duration = plan.track_id == kVideoId ? kVideoDuration : kAudioDuration;
+        for (size_t t = 0; t < plan.trun_first.size(); t++) {
+            w.patch32(plan.data_offset_at[t], (uint32_t)w.pos() - moof_at);
+            size_t end = (t + 1 < plan.trun_first.size()) ? plan.trun_first[t + 1] : plan.samples.size();
+            for (size_t i = plan.trun_first[t]; i < end; i++) {
+                Sample s = plan.samples[i];
+                s.offset = (uint32_t)w.pos();
+                s.ts     = ts;
+                ts += duration;
+                w.bytes.resize(w.pos() + s.size, (uint8_t)i);
+                (plan.track_id == kVideoId ? movie.video : movie.audio).push_back(s);
+            }
+        }
+    }
+    w.end(mdat);
+}
+
+TrafPlan plan_samples(uint32_t track_id, unsigned count, Lcg &rng)
+{
+    TrafPlan plan;
+    plan.track_id = track_id;
+    for (unsigned i = 0; i < count; i++) {
+        bool key = (track_id == kAudioId) || i == 0 || rng.below(40) == 0;
+        plan.samples.push_back({0, 50 + rng.below(400), 0, key});
+    }
+    return plan;
+}
+
+// Only the fragments: FragmentTrack starts at fragments_start and takes its
+// track ID and trex defaults from TrackTables
+Movie write_movie(const Layout &layout, unsigned fragments, uint32_t seed)
+{
+    Lcg rng(seed);
+    Writer w;
+    size_t ftyp = w.begin("ftyp");
+    w.put32(fourcc("isom"));
+    w.end(ftyp);
+    Movie movie;
+    movie.fragments_start = (uint32_t)w.pos();
+
+    uint64_t video_ts = layout.base_ts, audio_ts = layout.base_ts / 90000 * 48000;
+    for (unsigned f = 0; f < fragments; f++) {
+        TrafPlan v = plan_samples(kVideoId, 10 + rng.below(50), rng);
+        TrafPlan a = plan_samples(kAudioId, 10 + rng.below(70), rng);
+        const uint64_t v_end = video_ts + (uint64_t)v.samples.size() * kVideoDuration;
+        const uint64_t a_end = audio_ts + (uint64_t)a.samples.size() * kAudioDuration;
+        if (layout.separate) {
+            std::vector<TrafPlan> vp = {v}, ap = {a};
+            write_fragment(w, vp, layout, video_ts, audio_ts, movie, rng);
+            write_fragment(w, ap, layout, video_ts, audio_ts, movie, rng);
+        } else {
+            std::vector<TrafPlan> both = {v, a};
+            write_fragment(w, both, layout, video_ts, audio_ts, movie, rng);
+        }
+        if (rng.below(4) == 0) {
+            size_t free = w.begin("free");
+            w.bytes.resize(w.pos() + 100);
+            w.end(free);
+        }
+        video_ts = v_end;
+        audio_ts = a_end;
+    }
+    FILE *fp = fopen(kPath, "wb");
+    TEST_ASSERT_NOT_NULL(fp);
+    TEST_ASSERT_EQUAL_UINT(w.bytes.size(), fwrite(w.bytes.data(), 1, w.bytes.size(), fp));
+    fclose(fp);
+    return movie;
+}
+
+TrackTables tables_for(uint32_t track_id)
+{
+    TrackTables t;
+    t.track_id         = track_id;
+    t.handler          = fourcc(track_id == kVideoId ? "vide" : "soun");
+    t.timescale        = (track_id == kVideoId) ? 90000 : 48000;
+    t.default_duration = (track_id == kVideoId) ? kVideoDuration : kAudioDuration;
+    t.default_flags    = (track_id == kVideoId) ? 0x00010000 : 0;  // non-sync unless flagged
+    return t;
+}
+
+void check_track(SampleIndex &index, const std::vector<Sample> &ref, uint32_t seed)
+{
+    const unsigned n = (unsigned)ref.size();
+    for (unsigned i = 0; i < n; i++) {
+        TEST_ASSERT_TRUE(index.contains(i));
+        TEST_ASSERT_EQUAL_UINT32(ref[i].offset, index.offset(i));
+        TEST_ASSERT_EQUAL_UINT32(ref[i].size, index.size(i));
+        TEST_ASSERT_TRUE(index.timestamp(i) == ref[i].ts);
+        TEST_ASSERT_EQUAL(ref[i].key, index.is_keyframe(i));
+    }
+    TEST_ASSERT_FALSE(index.contains(n));
+    TEST_ASSERT_EQUAL_UINT(n, index.count());
+
+    Lcg rng(seed);
+    for (int k = 0; k < 500; k++) {
+        unsigned i = rng.below(n);
+        TEST_ASSERT_EQUAL_UINT32(ref[i].offset, index.offset(i));
+        TEST_ASSERT_TRUE(index.timestamp(i) == ref[i].ts);
+        unsigned before = 0, next = n;
+        for (unsigned j = 0; j <= i; j++) if (ref[j].key) before = j;
+        for (unsigned j = i + 1; j < n; j++) if (ref[j].key) { next = j; break; }
+        TEST_ASSERT_EQUAL_UINT(before, index.keyframe_before(i));
+        TEST_ASSERT_EQUAL_UINT(next, index.next_keyframe(i));
+        // pts_us() rounds down, so sample_at() of it lands on i or just before
+        unsigned at = index.sample_at(index.pts_us(i));
+        TEST_ASSERT_TRUE(at == i || at + 1 == i);
+    }
+}
+
+void check_layout(const Layout &layout, uint32_t seed)
+{
+    Movie movie = write_movie(layout, 12, seed);
+    SampleIndex video, audio;  // before the pager: destroyed after it, like demux
+    TablePager pager;
+    TEST_ASSERT_TRUE(pager.open(kPath, kTablePageCount));
+    TEST_ASSERT_TRUE(video.open_fragmented(pager, tables_for(kVideoId), movie.fragments_start));
+    TEST_ASSERT_TRUE(audio.open_fragmented(pager, tables_for(kAudioId), movie.fragments_start));
+    check_track(video, movie.video, seed);
+    check_track(audio, movie.audio, seed + 1);
+}
+
+void test_tfdt_v0_one_moof_per_fragment()    { check_layout({Tfdt::V0, false, 0}, 1); }
+void test_tfdt_v0_one_moof_per_track()       { check_layout({Tfdt::V0, true, 0}, 2); }
+void test_tfdt_absent_one_moof_per_fragment(){ check_layout({Tfdt::Absent, false, 0}, 3); }
+void test_tfdt_absent_one_moof_per_track()   { check_layout({Tfdt::Absent, true, 0}, 4); }
+
+// A recording resumed 14 hours in at 90 kHz: tfdt version 1 with a base
+// past 2^32, which used to lose its high word
+void test_tfdt_v1_keeps_64_bits()
+{
+    const uint64_t base = 14ULL * 3600 * 90000;
+    check_layout({Tfdt::V1, false, base}, 5);
+    check_layout({Tfdt::V1, true, base}, 6);
+
+    Movie movie = write_movie({Tfdt::V1, true, base}, 3, 7);
+    SampleIndex video;
+    TablePager pager;
+    TEST_ASSERT_TRUE(pager.open(kPath, kTablePageCount));
+    TEST_ASSERT_TRUE(video.open_fragmented(pager, tables_for(kVideoId), movie.fragments_start));
+    TEST_ASSERT_TRUE(video.timestamp(0) == base);
+    TEST_ASSERT_TRUE(video.pts_us(0) == 14LL * 3600 * 1000000);
+}
+
+// Video ends before the trailing audio-only moofs: finding the end walks
+// past them by their traf headers alone, and the video fragment stays
+// resident instead of being parsed again
+void test_other_track_moofs_keep_fragment()
+{
+    Movie movie = write_movie({Tfdt::V0, true, 0}, 6, 8);
+    SampleIndex video;
+    TablePager pager;
+    TEST_ASSERT_TRUE(pager.open(kPath, kTablePageCount));
+    TEST_ASSERT_TRUE(video.open_fragmented(pager, tables_for(kVideoId), movie.fragments_start));
+    const unsigned n = (unsigned)movie.video.size();
+    for (unsigned i = 0; i < n; i++) TEST_ASSERT_TRUE(video.contains(i));
+    TEST_ASSERT_FALSE(video.contains(n));
+
+    const unsigned requests = pager.requests();
+    for (unsigned i = n - 5; i < n; i++) {
+        TEST_ASSERT_EQUAL_UINT32(movie.video[i].offset, video.offset(i));
+        TEST_ASSERT_TRUE(video.timestamp(i) == movie.video[i].ts);
+    }
+    TEST_ASSERT_EQUAL_UINT(requests, pager.requests());
+}
+
+// The file loses its tail under the reader: the track ends at the last
+// fragment it can read, and what it returned up to there is right
+void test_truncated_file_ends_track()
+{
+    Movie movie = write_movie({Tfdt::V0, false, 0}, 12, 9);
+    SampleIndex video;
+    TablePager pager;
+    TEST_ASSERT_TRUE(pager.open(kPath, 2));
+    TEST_ASSERT_TRUE(video.open_fragmented(pager, tables_for(kVideoId), movie.fragments_start));
+    TEST_ASSERT_EQUAL_INT(0, truncate(kPath, movie.last_video_moof - 100));
+    unsigned i = 0;
+    for (; video.contains(i); i++) {
+        TEST_ASSERT_EQUAL_UINT32(movie.video[i].offset, video.offset(i));
+        TEST_ASSERT_EQUAL_UINT32(movie.video[i].size, video.size(i));
+    }
+    TEST_ASSERT_TRUE(i > 0 && i < movie.video.size());
+    TEST_ASSERT_EQUAL_UINT(i, video.count());
+    TEST_ASSERT_TRUE(video.keyframe_before(i + 100) < i);
+    TEST_ASSERT_EQUAL_UINT(i, video.next_keyframe(i - 1));
+    video.deinit();
+    pager.close();
+    unlink(kPath);
+}
+
+}  // namespace
+
+void setUp() {}
+void tearDown() {}
+
+int main()
+{
+    UNITY_BEGIN();
+    RUN_TEST(test_tfdt_v0_one_moof_per_fragment);
+    RUN_TEST(test_tfdt_v0_one_moof_per_track);
+    RUN_TEST(test_tfdt_absent_one_moof_per_fragment);
+    RUN_TEST(test_tfdt_absent_one_moof_per_track);
+    RUN_TEST(test_tfdt_v1_keeps_64_bits);
+    RUN_TEST(test_other_track_moofs_keep_fragment);
+    RUN_TEST(test_truncated_file_ends_track);
+    return UNITY_END();
+}
@@ -0,0 +1,235 @@
+// GainStage: unity, mute, steady gains, ramps and the stereo downmix
+// against hand-computed values and an independent per-sample reference,
+// plus its cost per sample.
+//
+//   pio test -e native -f test_gain_stage -v
+
+#include <unity.h>
+
+#include <cstdio>
+#include <cstring>
+#include <vector>
+
+#include "gain_stage.h"
+#include "psram_alloc.h"
+
+using namespace mp4;
+
+namespace {
+
+constexpr int    kUnity  = GainStage::kUnity;
+constexpr size_t kFrames = 1024;  // one decoded AAC frame, as the I2S writer sees it
+
+struct Lcg {
+    uint32_t s;
+    explicit Lcg(uint32_t seed) : s(seed) {}
+    uint32_t next() { s = s * 1664525u + 1013904223u; return s; }
+    int16_t sample() { return (int16_t)(next() >> 16); }
+};
+
+// process() takes 16-byte aligned PCM
+struct Pcm {
+    int16_t *p;
+    size_t   n;
+    explicit Pcm(size_t count) : p(psram_alloc_aligned<int16_t>(count, GainStage::kAlign)), n(count) {}
+    ~Pcm() { safe_free(p); }
+    void fill(int16_t v) { for (size_t i = 0; i < n; i++) p[i] = v; }
+    void fill(Lcg &rng)  { for (size_t i = 0; i < n; i++) p[i] = rng.sample(); }
+};
+
+// What process() promises, written out per sample: output sample i is in
+// block i / 8 of K, whose gain is g0 + (g1 - g0)(k + 1) / K (the target on
+// the last block); a downmixed sample is L and R each times half the gain
+std::vector<int16_t> reference(const std::vector<int16_t> &in, bool downmix, int volume0, int volume1)
+{
+    const int g0 = volume0 * (kUnity / 256), g1 = volume1 * (kUnity / 256);
+    const size_t out = downmix ? in.size() / 2 : in.size();
+    const long blocks = (long)(out + 7) / 8;
+    std::vector<int16_t> r(out);
+    for (size_t i = 0; i < out; i++) {
+        const long k = (long)(i / 8);
+        const long g = g0 + (long)(g1 - g0) * (k + 1) / blocks;
+        long v = downmix ? ((in[2 * i] * g) >> 15) + ((in[2 * i + 1] * g) >> 15) : (in[i] * g) >> 14;
+        r[i] = (int16_t)(v > 32767 ? 32767 : v < -32768 ? -32768 : v);
+    }
+    return r;
+}
+
+void test_unity_leaves_samples_untouched()
+{
+    Lcg rng(1);
+    Pcm pcm(2 * kFrames);
+    pcm.fill(rng);
+    std::vector<int16_t> before(pcm.p, pcm.p + pcm.n);
+    GainStage gain;
+    gain.reset(256);
+    TEST_ASSERT_EQUAL_UINT(pcm.n * 2, gain.process(pcm.p, pcm.n, false, 256));
+    TEST_ASSERT_EQUAL_MEMORY(before.data(), pcm.p, pcm.n * 2);
+    TEST_ASSERT_EQUAL_UINT(0, gain.ramps());
+}
+
+void test_mute_zeroes_output()
+{
+    Lcg rng(2);
+    Pcm pcm(2 * kFrames);
+    GainStage gain;
+    gain.reset(0);
+    for (int downmix = 0; downmix < 2; downmix++) {
+        pcm.fill(rng);
+        size_t bytes = gain.process(pcm.p, pcm.n, downmix, 0);
+        TEST_ASSERT_EQUAL_UINT(downmix ? pcm.n : pcm.n * 2, bytes);
+        for (size_t i = 0; i < bytes / 2; i++) TEST_ASSERT_EQUAL_INT(0, pcm.p[i]);
+    }
+    TEST_ASSERT_EQUAL_UINT(0, gain.ramps());
+}
+
+// Volume 128 is a gain of exactly 0.5: an arithmetic shift, rounding down
+void test_steady_gain_values()
+{
+    static const int16_t in[16]  = {0, 1, -1, 2, 1000, -1001, 32767, -32768,
+                                    3, -3, 12345, -12345, 16384, -16384, 7, -7};
+    static const int16_t out[16] = {0, 0, -1, 1, 500, -501, 16383, -16384,
+                                    1, -2, 6172, -6173, 8192, -8192, 3, -4};
+    Pcm pcm(16);
+    memcpy(pcm.p, in, sizeof(in));
+    GainStage gain;
+    gain.reset(128);
+    gain.process(pcm.p, 16, false, 128);
+    TEST_ASSERT_EQUAL_MEMORY(out, pcm.p, sizeof(out));
+}
+
+// Unity to mute across one buffer: 128 blocks of 8, each 1/128 lower,
+// reaching 0 on the last block; the next buffer takes the mute path
+void test_ramp_down_steps_per_block()
+{
+    Pcm pcm(kFrames);
+    pcm.fill(16384);
+    GainStage gain;
+    gain.reset(256);
+    gain.process(pcm.p, pcm.n, false, 0);
+    for (size_t i = 0; i < pcm.n; i++) {
+        TEST_ASSERT_EQUAL_INT(16384 - 128 * (int)(i / 8 + 1), pcm.p[i]);
+    }
+    TEST_ASSERT_EQUAL_INT(16256, pcm.p[0]);
+    TEST_ASSERT_EQUAL_INT(0, pcm.p[pcm.n - 1]);
+    TEST_ASSERT_EQUAL_UINT(1, gain.ramps());
+
+    pcm.fill(16384);
+    gain.process(pcm.p, pcm.n, false, 0);
+    TEST_ASSERT_EQUAL_INT(0, pcm.p[0]);
+    TEST_ASSERT_EQUAL_UINT(1, gain.ramps());
+}
+
+void test_ramp_up_from_mute()
+{
+    Pcm pcm(kFrames);
+    pcm.fill(-16384);
+    GainStage gain;
+    gain.reset(0);
+    gain.process(pcm.p, pcm.n, false, 256);
+    for (size_t i = 0; i < pcm.n; i++) {
+        TEST_ASSERT_EQUAL_INT(-128 * (int)(i / 8 + 1), pcm.p[i]);
+    }
+    TEST_ASSERT_EQUAL_INT(-16384, pcm.p[pcm.n - 1]);
+
+    // At unity now: the next buffer passes through
+    pcm.fill(-16384);
+    gain.process(pcm.p, pcm.n, false, 256);
+    TEST_ASSERT_EQUAL_INT(-16384, pcm.p[0]);
+}
+
+// Downmix at unity: (L + R) / 2 with each half rounded down, written over
+// the front of the buffer
+void test_downmix_values()
+{
+    static const int16_t in[16]  = {1000, 1000, 32767, 32767, -32768, -32768, 20000, -20000,
+                                    1, 0, -1, 0, 3, 4, -3, -4};
+    static const int16_t out[8]  = {1000, 32766, -32768, 0, 0, -1, 3, -4};
+    Pcm pcm(16);
+    memcpy(pcm.p, in, sizeof(in));
+    GainStage gain;
+    gain.reset(256);
+    TEST_ASSERT_EQUAL_UINT(sizeof(out), gain.process(pcm.p, 16, true, 256));
+    TEST_ASSERT_EQUAL_MEMORY(out, pcm.p, sizeof(out));
+}
+
+// Random buffers through a sequence of volume changes, every layout and a
+// ragged last block, against the per-sample reference
+void test_matches_reference()
+{
+    static const int kVolumes[] = {256, 256, 200, 0, 0, 37, 256, 255, 1, 128, 128, 0, 256};
+    static const size_t kSizes[] = {2 * kFrames, 2 * kFrames - 6, 16, 18, 2};
+    Lcg rng(3);
+    for (int downmix = 0; downmix < 2; downmix++) {
+        for (size_t size : kSizes) {
+            GainStage gain;
+            gain.reset(kVolumes[0]);
+            int volume = kVolumes[0];
+            Pcm pcm(size);
+            for (int next : kVolumes) {
+                pcm.fill(rng);
+                if (size >= 4) {  // full scale in both channels
+                    pcm.p[0] = pcm.p[1] = INT16_MAX;
+                    pcm.p[2] = pcm.p[3] = INT16_MIN;
+                }
+                std::vector<int16_t> in(pcm.p, pcm.p + size);
+                std::vector<int16_t> expect = reference(in, downmix, volume, next);
+                size_t bytes = gain.process(pcm.p, size, downmix, next);
+                TEST_ASSERT_EQUAL_UINT(expect.size() * 2, bytes);
+                TEST_ASSERT_EQUAL_MEMORY(expect.data(), pcm.p, bytes);
+                volume = next;
+            }
+        }
+    }
+}
+
+// Cycles per input sample as process() counts them (host TSC; on the
+// device the same counters go to the I2S writer's end-of-file log)
+void bench_cycles_per_sample()
+{
+    struct Case {
+        const char *name;
+        bool downmix;
+        int  from, to;
+    };
+    static const Case kCases[] = {
+        {"unity (pass-through)", false, 256, 256},
+        {"mute", false, 0, 0},
+        {"steady gain", false, 160, 160},
+        {"ramp", false, 256, 64},
+        {"downmix, unity", true, 256, 256},
+        {"downmix, ramp", true, 64, 256},
+    };
+    Lcg rng(4);
+    Pcm pcm(2 * kFrames);
+    for (const Case &c : kCases) {
+        GainStage gain;
+        gain.reset(c.from);
+        for (int i = 0; i < 2000; i++) {
+            pcm.fill(rng);
+            gain.process(pcm.p, pcm.n, c.downmix, (i % 2) ? c.from : c.to);  // ramps both ways
+        }
+        printf("%-22s %.2f cycles/sample\n", c.name,
+               (double)gain.cycles() / (double)gain.samples());
+        TEST_ASSERT_TRUE(gain.samples() > 0);
+    }
+}
+
+}  // namespace
+
+void setUp() {}
+void tearDown() {}
+
+int main()
+{
+    UNITY_BEGIN();
+    RUN_TEST(test_unity_leaves_samples_untouched);
+    RUN_TEST(test_mute_zeroes_output);
+    RUN_TEST(test_steady_gain_values);
+    RUN_TEST(test_ramp_down_steps_per_block);
+    RUN_TEST(test_ramp_up_from_mute);
+    RUN_TEST(test_downmix_values);
+    RUN_TEST(test_matches_reference);
+    RUN_TEST(bench_cycles_per_sample);
+    return UNITY_END();
+}
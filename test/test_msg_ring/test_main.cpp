@@ -0,0 +1,313 @@
+// MsgRing: record layout edge cases on one thread, then a producer and a
+// consumer thread pushing randomly sized records through a small ring (so
+// it wraps constantly), and the throughput of the two-thread hand-off.
+//
+//   pio test -e native -f test_msg_ring -v
+
+#include <unity.h>
+
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <thread>
+
+#include "msg_ring.h"
+
+using namespace mp4;
+
+namespace {
+
+struct TestMsg {
+    uint8_t *data;
+    int      size;
+    uint32_t seq;
+};
+
+using Ring   = MsgRing<TestMsg>;
+using Ring16 = MsgRing<TestMsg, 16>;
+
+uint8_t pattern(uint32_t seq, size_t i)
+{
+    return (uint8_t)(seq * 131u + i * 7u);
+}
+
+void fill(TestMsg *msg, uint32_t seq, size_t bytes)
+{
+    msg->seq = seq;
+    for (size_t i = 0; i < bytes; i++) msg->data[i] = pattern(seq, i);
+}
+
+bool intact(const TestMsg *msg)
+{
+    for (int i = 0; i < msg->size; i++) {
+        if (msg->data[i] != pattern(msg->seq, i)) return false;
+    }
+    return true;
+}
+
+struct Lcg {
+    uint32_t s;
+    explicit Lcg(uint32_t seed) : s(seed) {}
+    uint32_t below(uint32_t n) { s = s * 1664525u + 1013904223u; return (s >> 8) % n; }
+};
+
+void test_fifo_across_wrap()
+{
+    Ring ring;
+    TEST_ASSERT_TRUE(ring.init(4096));
+    // 1000-byte records: the fifth never fits before the end, so every
+    // few records leave a wrap marker behind
+    for (uint32_t seq = 0; seq < 200; seq++) {
+        TestMsg *msg = ring.reserve(1000, 0);
+        TEST_ASSERT_NOT_NULL(msg);
+        fill(msg, seq, 1000);
+        ring.commit();
+        if (seq % 3 == 2) {
+            // Drain in bursts so head and tail sit at different offsets
+            for (uint32_t k = seq - 2; k <= seq; k++) {
+                TestMsg *got = ring.front(0);
+                TEST_ASSERT_NOT_NULL(got);
+                TEST_ASSERT_EQUAL_UINT32(k, got->seq);
+                TEST_ASSERT_EQUAL_INT(1000, got->size);
+                TEST_ASSERT_TRUE(intact(got));
+                ring.pop();
+            }
+            TEST_ASSERT_EQUAL_UINT(0, ring.used_bytes());
+        }
+    }
+    ring.deinit();
+}
+
+void test_full_ring_times_out()
+{
+    Ring ring;
+    TEST_ASSERT_TRUE(ring.init(4096));
+    unsigned n = 0;
+    while (TestMsg *msg = ring.reserve(500, 0)) {
+        fill(msg, n++, 500);
+        ring.commit();
+    }
+    TEST_ASSERT_TRUE(n >= 6);
+    auto t0 = std::chrono::steady_clock::now();
+    TEST_ASSERT_NULL(ring.reserve(500, pdMS_TO_TICKS(30)));
+    auto waited = std::chrono::steady_clock::now() - t0;
+    TEST_ASSERT_TRUE(waited >= std::chrono::milliseconds(25));
+
+    // One record consumed: room again
+    TEST_ASSERT_NOT_NULL(ring.front(0));
+    ring.pop();
+    TEST_ASSERT_NOT_NULL(ring.reserve(500, 0));
+    ring.deinit();
+}
+
+void test_reject_above_half_capacity()
+{
+    Ring ring;
+    TEST_ASSERT_TRUE(ring.init(8192));
+    TEST_ASSERT_EQUAL_UINT(8192, ring.capacity());
+
+    // Rejected at once, however long the caller is prepared to wait
+    auto t0 = std::chrono::steady_clock::now();
+    TEST_ASSERT_NULL(ring.reserve(4096, pdMS_TO_TICKS(1000)));
+    TEST_ASSERT_NULL(ring.reserve(100000, pdMS_TO_TICKS(1000)));
+    TEST_ASSERT_TRUE(std::chrono::steady_clock::now() - t0 < std::chrono::milliseconds(100));
+
+    // The largest record that fits in half: accepted whatever the offset
+    size_t largest = 4096 - 64;
+    for (int round = 0; round < 8; round++) {
+        TestMsg *small = ring.reserve(700, 0);
+        TEST_ASSERT_NOT_NULL(small);
+        ring.commit();
+        TestMsg *msg = ring.reserve(largest, 0);
+        TEST_ASSERT_NOT_NULL(msg);
+        fill(msg, round, largest);
+        ring.commit();
+        ring.front(0);
+        ring.pop();
+        TestMsg *got = ring.front(0);
+        TEST_ASSERT_NOT_NULL(got);
+        TEST_ASSERT_EQUAL_UINT32(round, got->seq);
+        TEST_ASSERT_TRUE(intact(got));
+        ring.pop();
+    }
+    ring.deinit();
+}
+
+void test_commit_gives_back_unused_payload()
+{
+    Ring16 ring;
+    TEST_ASSERT_TRUE(ring.init(4096));
+    TestMsg *msg = ring.reserve(1500, 0);
+    TEST_ASSERT_NOT_NULL(msg);
+    fill(msg, 7, 10);
+    ring.commit(10);
+    TEST_ASSERT_TRUE(ring.used_bytes() < 100);
+
+    TestMsg *got = ring.front(0);
+    TEST_ASSERT_NOT_NULL(got);
+    TEST_ASSERT_EQUAL_INT(10, got->size);
+    TEST_ASSERT_TRUE(intact(got));
+    TEST_ASSERT_EQUAL_UINT(0, (uintptr_t)got->data % 16);
+    ring.pop();
+
+    // An uncommitted reservation is simply overwritten
+    TEST_ASSERT_NOT_NULL(ring.reserve(200, 0));
+    msg = ring.reserve(300, 0);
+    TEST_ASSERT_NOT_NULL(msg);
+    fill(msg, 8, 300);
+    ring.commit();
+    got = ring.front(0);
+    TEST_ASSERT_EQUAL_UINT32(8, got->seq);
+    TEST_ASSERT_EQUAL_INT(300, got->size);
+    ring.pop();
+    TEST_ASSERT_NULL(ring.front(0));
+    ring.deinit();
+}
+
+void test_cancel_wakes_and_reset_reopens()
+{
+    Ring ring;
+    TEST_ASSERT_TRUE(ring.init(4096));
+
+    std::atomic<bool> returned{false};
+    TestMsg *woken_with = reinterpret_cast<TestMsg *>(1);
+    std::thread consumer([&] {
+        woken_with = ring.front(pdMS_TO_TICKS(5000));
+        returned = true;
+    });
+    std::this_thread::sleep_for(std::chrono::milliseconds(20));
+    auto t0 = std::chrono::steady_clock::now();
+    ring.cancel();
+    consumer.join();
+    TEST_ASSERT_TRUE(returned);
+    TEST_ASSERT_NULL(woken_with);
+    TEST_ASSERT_TRUE(std::chrono::steady_clock::now() - t0 < std::chrono::milliseconds(500));
+
+    // Both sides fail at once until reset()
+    TEST_ASSERT_NULL(ring.reserve(16, pdMS_TO_TICKS(1000)));
+    TEST_ASSERT_NULL(ring.front(pdMS_TO_TICKS(1000)));
+
+    ring.reset();
+    TestMsg *msg = ring.reserve(16, 0);
+    TEST_ASSERT_NOT_NULL(msg);
+    fill(msg, 1, 16);
+    ring.commit();
+    TestMsg *got = ring.front(0);
+    TEST_ASSERT_NOT_NULL(got);
+    TEST_ASSERT_TRUE(intact(got));
+    ring.pop();
+    ring.deinit();
+}
+
+// Two threads, random record sizes from empty to the largest accepted,
+// half the records shrunk at commit; the consumer checks order, size,
+// payload and alignment of every one.  A 16 KB ring wraps every few records.
+template <typename R, size_t Align>
+void stress(uint32_t messages, uint32_t seed)
+{
+    R ring;
+    TEST_ASSERT_TRUE(ring.init(16 * 1024));
+    const size_t max_payload = ring.capacity() / 2 - 64;
+
+    std::atomic<bool> failed{false};
+    std::thread producer([&] {
+        Lcg rng(seed);
+        for (uint32_t seq = 0; seq < messages && !failed; seq++) {
+            size_t reserve = (rng.below(8) == 0) ? rng.below(max_payload + 1) : rng.below(600);
+            size_t used    = (rng.below(2) == 0) ? rng.below(reserve + 1) : reserve;
+            TestMsg *msg = nullptr;
+            while (!msg && !failed) msg = ring.reserve(reserve, pdMS_TO_TICKS(100));
+            if (!msg) break;
+            fill(msg, seq, used);
+            if (used == reserve) {
+                ring.commit();
+            } else {
+                ring.commit(used);
+            }
+        }
+    });
+
+    uint32_t expected = 0;
+    while (expected < messages) {
+        TestMsg *msg = ring.front(pdMS_TO_TICKS(2000));
+        if (!msg || msg->seq != expected || !intact(msg) ||
+            (uintptr_t)msg->data % Align != 0) {
+            failed = true;
+            break;
+        }
+        ring.pop();
+        expected++;
+    }
+    producer.join();
+    TEST_ASSERT_FALSE(failed);
+    TEST_ASSERT_EQUAL_UINT32(messages, expected);
+    TEST_ASSERT_EQUAL_UINT(0, ring.used_bytes());
+    ring.deinit();
+}
+
+void test_two_thread_stress()
+{
+    stress<Ring, 8>(200000, 1);
+}
+
+void test_two_thread_stress_aligned16()
+{
+    stress<Ring16, 16>(100000, 2);
+}
+
+// Records per second and payload bandwidth through a 64 KB ring, producer
+// and consumer on their own threads, payload touched on both sides (memset
+// in, one byte read out) the way demux and the decoders touch it
+void bench_throughput()
+{
+    static const size_t kSizes[] = {64, 1024, 16 * 1024};
+    for (size_t size : kSizes) {
+        Ring ring;
+        TEST_ASSERT_TRUE(ring.init(64 * 1024));
+        const uint32_t messages = (uint32_t)((size_t)512 * 1024 * 1024 / size / 4);
+        const uint32_t count = messages < 2000000 ? messages : 2000000;
+
+        auto t0 = std::chrono::steady_clock::now();
+        std::thread producer([&] {
+            for (uint32_t seq = 0; seq < count; seq++) {
+                TestMsg *msg = nullptr;
+                while (!msg) msg = ring.reserve(size, pdMS_TO_TICKS(100));
+                msg->seq = seq;
+                memset(msg->data, (int)seq, size);
+                ring.commit();
+            }
+        });
+        uint64_t sum = 0;
+        for (uint32_t n = 0; n < count; n++) {
+            TestMsg *msg = nullptr;
+            while (!msg) msg = ring.front(pdMS_TO_TICKS(100));
+            sum += msg->data[size - 1];
+            ring.pop();
+        }
+        producer.join();
+        double s = std::chrono::duration<double>(std::chrono::steady_clock::now() - t0).count();
+        printf("%6u-byte records: %8.0f records/s, %7.1f MB/s (checksum %llu)\n",
+               (unsigned)size, count / s, count * (double)size / s / 1e6, (unsigned long long)sum);
+        ring.deinit();
+    }
+}
+
+}  // namespace
+
+void setUp() {}
+void tearDown() {}
+
+int main()
+{
+    UNITY_BEGIN();
+    RUN_TEST(test_fifo_across_wrap);
+    RUN_TEST(test_full_ring_times_out);
+    RUN_TEST(test_reject_above_half_capacity);
+    RUN_TEST(test_commit_gives_back_unused_payload);
+    RUN_TEST(test_cancel_wakes_and_reset_reopens);
+    RUN_TEST(test_two_thread_stress);
+    RUN_TEST(test_two_thread_stress_aligned16);
+    RUN_TEST(bench_throughput);
+    return UNITY_END();
+}
@@ -0,0 +1,299 @@
+// PagedTrack: sample tables read in place through a TablePager, checked
+// against the tables they were written from, a 90 kHz track long enough
+// for its timestamps to pass 2^32, and a table cut short under the reader.
+//
+//   pio test -e native -f test_paged_index -v
+
+#include <unity.h>
+
+#include <algorithm>
+#include <cstdio>
+#include <unistd.h>
+#include <vector>
+
+#include "sample_index.h"
+
+using namespace mp4;
+
+namespace {
+
+const char *kPath = "/tmp/test_paged_index.bin";
+
+struct Lcg {
+    uint32_t s;
+    explicit Lcg(uint32_t seed) : s(seed) {}
+    uint32_t below(uint32_t n) { s = s * 1664525u + 1013904223u; return (s >> 8) % n; }
+};
+
+// What the tables describe, per sample
+struct Track {
+    std::vector<uint32_t> size, offset;
+    std::vector<uint64_t> ts;
+    std::vector<uint32_t> keyframes;  // 0-based, ascending
+};
+
+// Table entries as they sit in a moov: big-endian words at arbitrary
+// (unaligned) offsets, so entries straddle page boundaries
+struct TableFile {
+    std::vector<uint8_t> bytes;
+
+    TableRef begin(uint32_t count) {
+        bytes.resize(bytes.size() + 1 + bytes.size() % 7);  // unrelated box bytes in between
+        return {(uint32_t)bytes.size(), count};
+    }
+    void put(uint32_t v) {
+        for (int i = 3; i >= 0; i--) bytes.push_back((uint8_t)(v >> (i * 8)));
+    }
+    void write() const {
+        FILE *f = fopen(kPath, "wb");
+        TEST_ASSERT_NOT_NULL(f);
+        TEST_ASSERT_EQUAL_UINT(bytes.size(), fwrite(bytes.data(), 1, bytes.size(), f));
+        fclose(f);
+    }
+};
+
+void put_stts(TableFile &file, TrackTables &t, const std::vector<std::pair<uint32_t, uint32_t>> &runs)
+{
+    t.stts = file.begin((uint32_t)runs.size());
+    for (auto &r : runs) {
+        file.put(r.first);
+        file.put(r.second);
+    }
+}
+
+// Irregular chunks and stsc groups, variable sizes, VFR timestamps and a
+// keyframe every 30-90 samples.  stsz and stss go last so a truncated file
+// cuts them and leaves stts / stsc readable.
+Track write_track(unsigned n, uint32_t seed, TrackTables &t, TableFile &file)
+{
+    Lcg rng(seed);
+    Track ref;
+    t = TrackTables();
+    t.handler      = fourcc("vide");
+    t.timescale    = 90000;
+    t.sample_count = n;
+
+    std::vector<std::pair<uint32_t, uint32_t>> runs;
+    uint64_t ts = 0;
+    for (unsigned i = 0; i < n;) {
+        uint32_t len   = 1 + rng.below(20);
+        uint32_t delta = 1500 + rng.below(3000);
+        if (len > n - i) len = n - i;
+        runs.push_back({len, delta});
+        for (uint32_t k = 0; k < len; k++, ts += delta) ref.ts.push_back(ts);
+        i += len;
+    }
+    put_stts(file, t, runs);
+
+    for (unsigned i = 0; i < n; i++) ref.size.push_back(100 + rng.below(30000));
+
+    std::vector<uint32_t> chunk_offsets;
+    std::vector<std::pair<uint32_t, uint32_t>> groups;  // first chunk (1-based), samples per chunk
+    uint32_t pos = 1 << 20, per_chunk = 0;
+    for (unsigned i = 0; i < n;) {
+        if (chunk_offsets.size() % 5 == 0) {
+            uint32_t spc = 1 + rng.below(12);
+            if (spc != per_chunk) groups.push_back({(uint32_t)chunk_offsets.size() + 1, spc});
+            per_chunk = spc;
+        }
+        pos += rng.below(2000);
+        chunk_offsets.push_back(pos);
+        for (uint32_t k = 0; k < per_chunk && i < n; k++, i++) {
+            ref.offset.push_back(pos);
+            pos += ref.size[i];
+        }
+    }
+    t.stsc = file.begin((uint32_t)groups.size());
+    for (auto &g : groups) {
+        file.put(g.first);
+        file.put(g.second);
+        file.put(1);
+    }
+    t.stco = file.begin((uint32_t)chunk_offsets.size());
+    for (uint32_t o : chunk_offsets) file.put(o);
+
+    t.stsz = file.begin(n);
+    for (uint32_t s : ref.size) file.put(s);
+
+    for (unsigned i = 0; i < n; i += 30 + rng.below(60)) ref.keyframes.push_back(i);
+    t.stss = file.begin((uint32_t)ref.keyframes.size());
+    for (uint32_t k : ref.keyframes) file.put(k + 1);
+    return ref;
+}
+
+uint32_t ref_keyframe_before(const Track &ref, unsigned n)
+{
+    uint32_t kf = 0;
+    for (uint32_t k : ref.keyframes) {
+        if (k > n) break;
+        kf = k;
+    }
+    return kf;
+}
+
+uint32_t ref_next_keyframe(const Track &ref, unsigned n)
+{
+    for (uint32_t k : ref.keyframes) {
+        if (k > n) return k;
+    }
+    return (uint32_t)ref.size.size();
+}
+
+void check_sample(PagedTrack &track, const Track &ref, unsigned n)
+{
+    TEST_ASSERT_EQUAL_UINT32(ref.size[n], track.size(n));
+    TEST_ASSERT_EQUAL_UINT32(ref.offset[n], track.offset(n));
+    TEST_ASSERT_TRUE(track.timestamp(n) == ref.ts[n]);
+    TEST_ASSERT_EQUAL_UINT(n, track.sample_at(ref.ts[n]));
+    TEST_ASSERT_EQUAL_UINT(ref_keyframe_before(ref, n), track.keyframe_before(n));
+}
+
+void test_paged_queries_match_tables()
+{
+    TrackTables t;
+    TableFile file;
+    Track ref = write_track(20000, 1, t, file);
+    file.write();
+
+    TablePager pager;
+    TEST_ASSERT_TRUE(pager.open(kPath, 4));  // few pages: the walks keep evicting
+    PagedTrack track;
+    TEST_ASSERT_TRUE(track.open(pager, t));
+
+    // Playback order, with next_keyframe() on its cursor
+    for (unsigned n = 0; n < ref.size.size(); n++) {
+        check_sample(track, ref, n);
+        TEST_ASSERT_EQUAL_UINT(ref_next_keyframe(ref, n), track.next_keyframe(n));
+        TEST_ASSERT_EQUAL_UINT(ref.keyframes.end() !=
+                                   std::find(ref.keyframes.begin(), ref.keyframes.end(), n),
+                               track.is_keyframe(n));
+    }
+    // Seeks
+    Lcg rng(2);
+    for (int i = 0; i < 2000; i++) {
+        unsigned n = rng.below((uint32_t)ref.size.size());
+        check_sample(track, ref, n);
+        TEST_ASSERT_EQUAL_UINT(ref_next_keyframe(ref, n), track.next_keyframe(n));
+    }
+    TEST_ASSERT_FALSE(track.failed());
+    track.close();
+    pager.close();
+}
+
+// 16 hours of 30 fps video at 90 kHz ends past 2^32 ticks (13.3 hours):
+// timestamps and the checkpoints a seek searches must not wrap
+void test_timestamps_past_32_bits()
+{
+    const unsigned n = 16 * 3600 * 30;
+    TrackTables t;
+    t.handler      = fourcc("vide");
+    t.timescale    = 90000;
+    t.sample_count = n;
+    t.sample_size  = 1000;  // no stsz entries
+    TableFile file;
+
+    Lcg rng(3);
+    std::vector<std::pair<uint32_t, uint32_t>> runs;
+    for (unsigned i = 0; i < n;) {
+        uint32_t len = 1 + rng.below(8);
+        if (len > n - i) len = n - i;
+        runs.push_back({len, rng.below(2) ? 3000u : 3003u});
+        i += len;
+    }
+    put_stts(file, t, runs);
+    t.stco = file.begin(1);
+    file.put(4096);
+    t.stsc = file.begin(1);
+    file.put(1);
+    file.put(n);
+    file.put(1);
+    file.write();
+
+    TablePager pager;
+    TEST_ASSERT_TRUE(pager.open(kPath, kTablePageCount));
+    PagedTrack track;
+    TEST_ASSERT_TRUE(track.open(pager, t));
+
+    std::vector<uint64_t> ts;
+    ts.reserve(n);
+    uint64_t expect = 0;
+    for (auto &r : runs) {
+        for (uint32_t k = 0; k < r.first; k++, expect += r.second) ts.push_back(expect);
+    }
+    TEST_ASSERT_TRUE(ts.back() > UINT32_MAX);
+    for (unsigned i = 0; i < n; i++) {
+        if (track.timestamp(i) != ts[i]) TEST_FAIL_MESSAGE("timestamp differs from stts");
+    }
+    Lcg seek(4);
+    for (int i = 0; i < 5000; i++) {
+        unsigned k = (i % 2) ? n - 1 - seek.below(n / 5) : seek.below(n);  // half past 2^32
+        TEST_ASSERT_TRUE(track.timestamp(k) == ts[k]);
+        TEST_ASSERT_EQUAL_UINT(k, track.sample_at(ts[k]));
+        TEST_ASSERT_EQUAL_UINT(k, track.sample_at(ts[k] + 1));
+    }
+    TEST_ASSERT_EQUAL_UINT(n - 1, track.sample_at(ts.back() + 1000000));
+    track.close();
+    pager.close();
+}
+
+// The file is cut short after the pager opened it (card error, file
+// rewritten): the queries that hit the missing pages fail the track, which
+// then ends instead of handing demux zero offsets or keyframe 0xFFFFFFFF
+void test_read_failure_ends_track()
+{
+    const unsigned n = 50000;
+    TrackTables t;
+    TableFile file;
+    Track ref = write_track(n, 5, t, file);
+    file.write();
+
+    TablePager pager;
+    TEST_ASSERT_TRUE(pager.open(kPath, 2));
+    SampleIndex index;
+    TEST_ASSERT_TRUE(index.open_paged(pager, t));
+    for (unsigned i = 0; i < 1000; i++) TEST_ASSERT_EQUAL_UINT32(ref.offset[i], index.offset(i));
+
+    const unsigned cut = 30000;
+    TEST_ASSERT_EQUAL_INT(0, truncate(kPath, t.stsz.offset + cut * 4));
+    unsigned i = 1000;
+    for (; index.contains(i); i++) {
+        uint32_t size   = index.size(i);
+        uint32_t offset = index.offset(i);
+        if (index.failed()) break;
+        TEST_ASSERT_EQUAL_UINT32(ref.size[i], size);
+        TEST_ASSERT_EQUAL_UINT32(ref.offset[i], offset);
+    }
+    TEST_ASSERT_TRUE(index.failed());
+    TEST_ASSERT_TRUE(i <= cut);
+    TEST_ASSERT_FALSE(index.contains(i));
+    TEST_ASSERT_FALSE(index.contains(0));
+
+    // stss lies past the cut too: every answer stays a sample number
+    for (unsigned k : {0u, 1000u, cut, n - 1}) {
+        TEST_ASSERT_TRUE(index.keyframe_before(k) <= k);
+        TEST_ASSERT_EQUAL_UINT(n, index.next_keyframe(k));
+    }
+    TEST_ASSERT_EQUAL_UINT32(0, index.size(n - 1));
+    index.deinit();
+
+    // Cut inside stts: the checkpoint pass fails and the track doesn't open
+    TEST_ASSERT_EQUAL_INT(0, truncate(kPath, t.stts.offset + 100));
+    TEST_ASSERT_FALSE(index.open_paged(pager, t));
+    TEST_ASSERT_FALSE(index.valid());
+    pager.close();
+    unlink(kPath);
+}
+
+}  // namespace
+
+void setUp() {}
+void tearDown() {}
+
+int main()
+{
+    UNITY_BEGIN();
+    RUN_TEST(test_paged_queries_match_tables);
+    RUN_TEST(test_timestamps_past_32_bits);
+    RUN_TEST(test_read_failure_ends_track);
+    return UNITY_END();
+}
@@ -0,0 +1,468 @@
+// SampleIndex against minimp4's own per-sample lookup (MP4D_frame_offset),
+// on synthetic sample tables, plus the lookup cost and resident size of each.
+//
+//   pio test -e native -f test_sample_index -v
+
+#include <unity.h>
+
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <fcntl.h>
+#include <unistd.h>
+#include <vector>
+
+#define MINIMP4_IMPLEMENTATION
+#include "minimp4.h"
+#include "sample_index.h"
+
+using namespace mp4;
+
+namespace {
+
+// Deterministic, so a failure reproduces
+struct Lcg {
+    uint32_t s;
+    explicit Lcg(uint32_t seed) : s(seed) {}
+    uint32_t next() { s = s * 1664525u + 1013904223u; return s >> 8; }
+    uint32_t below(uint32_t n) { return next() % n; }
+};
+
+struct TrackShape {
+    unsigned count;
+    unsigned max_per_chunk;  // stsc groups change every 7 chunks
+    bool     vfr;            // irregular stts deltas (and zero-length runs)
+    bool     big_samples;    // some samples >= 64 KB
+    bool     single_chunk;   // one chunk holding every sample
+    bool     stss;           // sync sample table present
+};
+
+// An MP4D track as MP4D_open leaves it, built from a shape
+struct SyntheticTrack {
+    std::vector<unsigned> sizes, timestamps, sync;
+    std::vector<MP4D_file_offset_t> chunk_offsets;
+    std::vector<MP4D_sample_to_chunk_t> stsc;
+    MP4D_track_t track = {};
+    MP4D_demux_t demux = {};
+
+    SyntheticTrack(const TrackShape &shape, uint32_t seed) {
+        Lcg rng(seed);
+        const unsigned n = shape.count;
+        sizes.resize(n);
+        timestamps.resize(n);
+        unsigned ts = 0;
+        for (unsigned i = 0; i < n; i++) {
+            sizes[i] = (shape.big_samples && rng.below(50) == 0) ? 65535 + rng.below(100000)
+                                                                 : 200 + rng.below(20000);
+            timestamps[i] = ts;
+            ts += !shape.vfr ? 3000 : (rng.below(100) == 0) ? 0 : 1001 + rng.below(3);
+        }
+
+        uint32_t pos = 4096;
+        if (shape.single_chunk) {
+            stsc.push_back({1, n});
+            chunk_offsets.push_back(pos);
+        } else {
+            unsigned per_chunk = 0;
+            for (unsigned s = 0, nc = 0; s < n; nc++) {
+                unsigned spc = (nc % 7 == 0) ? 1 + rng.below(shape.max_per_chunk) : per_chunk;
+                if (nc == 0 || spc != per_chunk) {
+                    stsc.push_back({nc + 1, spc});
+                    per_chunk = spc;
+                }
+                chunk_offsets.push_back(pos);
+                for (unsigned k = 0; k < spc && s < n; k++, s++) pos += sizes[s];
+                pos += rng.below(2000);  // the other track's chunk
+            }
+        }
+        if (shape.stss) {
+            for (unsigned i = 0; i < n; i += 30 + rng.below(60)) sync.push_back(i + 1);
+        }
+
+        track.sample_count          = n;
+        track.timescale             = 30000;
+        track.entry_size            = sizes.data();
+        track.timestamp             = timestamps.data();
+        track.chunk_count           = (unsigned)chunk_offsets.size();
+        track.chunk_offset          = chunk_offsets.data();
+        track.sample_to_chunk_count = (unsigned)stsc.size();
+        track.sample_to_chunk       = stsc.data();
+        track.sync_count            = (unsigned)sync.size();
+        track.sync_samples          = sync.empty() ? nullptr : sync.data();
+        demux.track       = &track;
+        demux.track_count = 1;
+    }
+
+    bool is_sync(unsigned n) const {
+        if (sync.empty()) return true;
+        for (unsigned s : sync) if (s == n + 1) return true;
+        return false;
+    }
+};
+
+const TrackShape kShapes[] = {
+    {5000, 15, false, false, false, true},   // CFR video
+    {7000, 40, true,  true,  false, true},   // VFR, big IDRs
+    {3000, 22, false, false, false, false},  // audio: no stss
+    {2000, 1,  true,  false, false, true},   // one sample per chunk
+    {1500, 1,  false, true,  true,  true},   // single chunk
+};
+
+void check_against_frame_offset(SampleIndex &index, SyntheticTrack &t, unsigned n)
+{
+    unsigned bytes = 0, ts = 0;
+    uint32_t offset = (uint32_t)MP4D_frame_offset(&t.demux, 0, n, &bytes, &ts, nullptr);
+    TEST_ASSERT_EQUAL_UINT32(offset, index.offset(n));
+    TEST_ASSERT_EQUAL_UINT32(bytes, index.size(n));
+    TEST_ASSERT_EQUAL_UINT32(ts, index.timestamp(n));
+}
+
+void test_sequential_matches_frame_offset()
+{
+    uint32_t seed = 1;
+    for (const TrackShape &shape : kShapes) {
+        SyntheticTrack t(shape, seed++);
+        SampleIndex index;
+        TEST_ASSERT_TRUE(index.build(t.demux, 0));
+        TEST_ASSERT_EQUAL_UINT(shape.count, index.count());
+        for (unsigned n = 0; n < shape.count; n++) {
+            check_against_frame_offset(index, t, n);
+            TEST_ASSERT_EQUAL(t.is_sync(n), index.is_keyframe(n));
+        }
+    }
+}
+
+void test_random_access_matches_frame_offset()
+{
+    uint32_t seed = 100;
+    for (const TrackShape &shape : kShapes) {
+        SyntheticTrack t(shape, seed++);
+        SampleIndex index;
+        TEST_ASSERT_TRUE(index.build(t.demux, 0));
+        Lcg rng(seed);
+        for (int k = 0; k < 5000; k++) {
+            check_against_frame_offset(index, t, rng.below(shape.count));
+        }
+    }
+}
+
+void test_keyframe_queries()
+{
+    SyntheticTrack t(kShapes[0], 7);
+    SampleIndex index;
+    TEST_ASSERT_TRUE(index.build(t.demux, 0));
+    TEST_ASSERT_EQUAL_UINT(t.sync.size(), index.keyframe_count());
+    for (unsigned n = 0; n < kShapes[0].count; n++) {
+        unsigned before = 0, after = index.count();
+        for (unsigned s : t.sync) {
+            if (s - 1 <= n) before = s - 1;
+            if (s - 1 > n && after == index.count()) after = s - 1;
+        }
+        TEST_ASSERT_EQUAL_UINT(before, index.keyframe_before(n));
+        TEST_ASSERT_EQUAL_UINT(after, index.next_keyframe(n));
+    }
+}
+
+// --- Compact encoding: 16-bit sizes, per-chunk offsets, stts-style runs ---
+
+// What minimp4 keeps resident for the same track after MP4D_open
+size_t minimp4_table_bytes(const SyntheticTrack &t)
+{
+    return t.sizes.size() * sizeof(unsigned) * 2 +  // entry_size + timestamp
+           t.chunk_offsets.size() * sizeof(MP4D_file_offset_t) +
+           t.stsc.size() * sizeof(MP4D_sample_to_chunk_t) +
+           t.sync.size() * sizeof(unsigned);
+}
+
+unsigned big_samples(const SyntheticTrack &t)
+{
+    unsigned big = 0;
+    for (unsigned size : t.sizes) big += (size >= 0xFFFF);
+    return big;
+}
+
+// The resident cost is exactly 2 bytes per sample, 8 per big sample, 8 per
+// chunk, 12 per timestamp run and 4 per keyframe: a CFR track is one run
+void test_compact_encoding_cost()
+{
+    const TrackShape cfr = {20000, 15, false, true, false, true};
+    SyntheticTrack t(cfr, 400);
+    SampleIndex index;
+    TEST_ASSERT_TRUE(index.build(t.demux, 0));
+    TEST_ASSERT_TRUE(big_samples(t) > 0);
+    TEST_ASSERT_EQUAL_UINT(cfr.count * 2 + big_samples(t) * 8 + t.chunk_offsets.size() * 8 + 12 +
+                               t.sync.size() * 4,
+                           index.memory_bytes());
+}
+
+// Sizes on both sides of the 16-bit escape, empty samples, and timestamps
+// that break every run (each delta differs from the last) or repeat
+void test_compact_encoding_edges()
+{
+    const TrackShape shape = {3000, 12, true, false, false, true};
+    SyntheticTrack t(shape, 401);
+    const unsigned kEdgeSizes[] = {0, 1, 65534, 65535, 65536, 4000000};
+    for (unsigned i = 0; i < t.sizes.size(); i += 7) t.sizes[i] = kEdgeSizes[(i / 7) % 6];
+    unsigned ts = 0;
+    for (unsigned i = 0; i < 500; i++) {  // no two equal deltas in a row
+        t.timestamps[i] = ts;
+        ts += (i % 3 == 0) ? 0 : 1000 + i;
+    }
+    for (unsigned i = 500; i < t.timestamps.size(); i++) t.timestamps[i] += ts;
+
+    SampleIndex index;
+    TEST_ASSERT_TRUE(index.build(t.demux, 0));
+    for (unsigned n = 0; n < shape.count; n++) check_against_frame_offset(index, t, n);
+    Lcg rng(402);
+    for (int k = 0; k < 3000; k++) check_against_frame_offset(index, t, rng.below(shape.count));
+}
+
+// Resident bytes per sample for typical tracks, against minimp4's tables
+void bench_memory_per_sample()
+{
+    struct Case {
+        const char *name;
+        TrackShape  shape;
+    };
+    const Case kCases[] = {
+        {"1 h video, 30 fps CFR, 15/chunk", {30 * 3600, 15, false, false, false, true}},
+        {"1 h video, VFR, big IDRs", {30 * 3600, 15, true, true, false, true}},
+        {"1 h AAC, 44.1 kHz, 22/chunk", {44100 * 3600 / 1024, 22, false, false, false, false}},
+        {"10 min video, 1/chunk", {30 * 600, 1, false, false, false, true}},
+    };
+    for (const Case &c : kCases) {
+        SyntheticTrack t(c.shape, 403);
+        SampleIndex index;
+        TEST_ASSERT_TRUE(index.build(t.demux, 0));
+        const double n = c.shape.count;
+        const size_t ours = index.memory_bytes(), theirs = minimp4_table_bytes(t);
+        printf("%-34s %6u samples: index %7u bytes (%.2f B/sample), minimp4 %8u (%.2f B/sample)\n",
+               c.name, c.shape.count, (unsigned)ours, ours / n, (unsigned)theirs, theirs / n);
+        TEST_ASSERT_TRUE(ours < theirs);
+    }
+}
+
+// --- Sidecar tables (SampleIndex::save / load) ---
+
+const char *kTablePath = "/tmp/test_sample_index.tables";
+
+std::vector<uint8_t> saved_tables(const SampleIndex &index)
+{
+    int fd = ::open(kTablePath, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    TEST_ASSERT_TRUE(fd >= 0);
+    TEST_ASSERT_TRUE(index.save(fd));
+    std::vector<uint8_t> bytes((size_t)lseek(fd, 0, SEEK_END));
+    TEST_ASSERT_EQUAL_INT((int)bytes.size(), (int)pread(fd, bytes.data(), bytes.size(), 0));
+    ::close(fd);
+    return bytes;
+}
+
+bool load_tables(SampleIndex &index, const std::vector<uint8_t> &bytes)
+{
+    int fd = ::open(kTablePath, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    TEST_ASSERT_TRUE(fd >= 0);
+    TEST_ASSERT_EQUAL_INT((int)bytes.size(), (int)write(fd, bytes.data(), bytes.size()));
+    lseek(fd, 0, SEEK_SET);
+    bool ok = index.load(fd);
+    ::close(fd);
+    return ok;
+}
+
+// Where each table starts in the saved bytes (header fields in save() order)
+struct TableLayout {
+    uint32_t count, covered, big_count, chunk_count, run_count, keyframe_count;
+    size_t sizes, bigs, chunks, runs, keyframes, end;
+
+    explicit TableLayout(const std::vector<uint8_t> &bytes) {
+        uint32_t hdr[8];
+        memcpy(hdr, bytes.data(), sizeof(hdr));
+        count = hdr[0]; covered = hdr[1]; big_count = hdr[2];
+        chunk_count = hdr[3]; run_count = hdr[4]; keyframe_count = hdr[5];
+        sizes     = sizeof(hdr);
+        bigs      = sizes + count * 2;
+        chunks    = bigs + big_count * 8;
+        runs      = chunks + chunk_count * 8;
+        keyframes = runs + run_count * 12;
+        end       = keyframes + keyframe_count * 4;
+    }
+};
+
+uint32_t get32(const std::vector<uint8_t> &b, size_t at)
+{
+    uint32_t v;
+    memcpy(&v, &b[at], 4);
+    return v;
+}
+
+void put32(std::vector<uint8_t> &b, size_t at, uint32_t v)
+{
+    memcpy(&b[at], &v, 4);
+}
+
+void test_saved_tables_load_back()
+{
+    uint32_t seed = 200;
+    for (const TrackShape &shape : kShapes) {
+        SyntheticTrack t(shape, seed++);
+        SampleIndex built, loaded;
+        TEST_ASSERT_TRUE(built.build(t.demux, 0));
+        std::vector<uint8_t> bytes = saved_tables(built);
+        TEST_ASSERT_EQUAL_UINT(TableLayout(bytes).end, bytes.size());
+        TEST_ASSERT_TRUE(load_tables(loaded, bytes));
+        TEST_ASSERT_EQUAL_UINT(built.count(), loaded.count());
+        TEST_ASSERT_EQUAL_UINT(built.keyframe_count(), loaded.keyframe_count());
+        for (unsigned n = 0; n < shape.count; n++) {
+            check_against_frame_offset(loaded, t, n);
+            TEST_ASSERT_EQUAL(t.is_sync(n), loaded.is_keyframe(n));
+        }
+    }
+}
+
+// A damaged or hand-edited sidecar: every table is checked against the
+// header and the invariants build() guarantees before anything uses it
+void test_inconsistent_tables_rejected()
+{
+    SyntheticTrack t(kShapes[1], 300);  // big samples, VFR runs, stss
+    SampleIndex built;
+    TEST_ASSERT_TRUE(built.build(t.demux, 0));
+    const std::vector<uint8_t> good = saved_tables(built);
+    const TableLayout at(good);
+    TEST_ASSERT_TRUE(at.big_count >= 2 && at.chunk_count >= 3 && at.run_count >= 3 &&
+                     at.keyframe_count >= 2);
+
+    struct Damage {
+        const char *what;
+        void (*apply)(std::vector<uint8_t> &, const TableLayout &);
+    };
+    const Damage kDamage[] = {
+        {"truncated", [](std::vector<uint8_t> &b, const TableLayout &) { b.resize(b.size() - 4); }},
+        {"chunk count too high", [](std::vector<uint8_t> &b, const TableLayout &l) {
+             put32(b, 12, l.chunk_count + 1); }},
+        {"sample count too high", [](std::vector<uint8_t> &b, const TableLayout &l) {
+             put32(b, 0, l.count + 100); put32(b, 4, l.covered + 100); }},
+        {"covered but no chunks", [](std::vector<uint8_t> &b, const TableLayout &l) {
+             put32(b, 12, 0); b.erase(b.begin() + l.chunks, b.begin() + l.runs); }},
+        {"first chunk after sample 0", [](std::vector<uint8_t> &b, const TableLayout &l) {
+             put32(b, l.chunks, 1); }},
+        {"chunks out of order", [](std::vector<uint8_t> &b, const TableLayout &l) {
+             put32(b, l.chunks + 16, get32(b, l.chunks + 8)); }},
+        {"chunk past covered", [](std::vector<uint8_t> &b, const TableLayout &l) {
+             put32(b, l.chunks + (l.chunk_count - 1) * 8, l.covered); }},
+        {"first run after sample 0", [](std::vector<uint8_t> &b, const TableLayout &l) {
+             put32(b, l.runs, 1); }},
+        {"runs out of order", [](std::vector<uint8_t> &b, const TableLayout &l) {
+             put32(b, l.runs + 24, get32(b, l.runs + 12)); }},
+        {"run past the end", [](std::vector<uint8_t> &b, const TableLayout &l) {
+             put32(b, l.runs + (l.run_count - 1) * 12, l.count); }},
+        {"keyframes out of order", [](std::vector<uint8_t> &b, const TableLayout &l) {
+             put32(b, l.keyframes + 4, get32(b, l.keyframes)); }},
+        {"keyframe past the end", [](std::vector<uint8_t> &b, const TableLayout &l) {
+             put32(b, l.keyframes + (l.keyframe_count - 1) * 4, l.count); }},
+        {"escape without overflow entry", [](std::vector<uint8_t> &b, const TableLayout &l) {
+             for (size_t n = 0; n < l.count; n++) {
+                 if (b[l.sizes + 2 * n] != 0xFF || b[l.sizes + 2 * n + 1] != 0xFF) {
+                     b[l.sizes + 2 * n] = b[l.sizes + 2 * n + 1] = 0xFF;
+                     return;
+                 }
+             }
+         }},
+        {"overflow entry on a small sample", [](std::vector<uint8_t> &b, const TableLayout &l) {
+             put32(b, l.bigs, get32(b, l.bigs) + 1); }},
+        {"overflow entries out of order", [](std::vector<uint8_t> &b, const TableLayout &l) {
+             uint32_t first = get32(b, l.bigs), second = get32(b, l.bigs + 8);
+             put32(b, l.bigs, second); put32(b, l.bigs + 8, first); }},
+    };
+    for (const Damage &d : kDamage) {
+        std::vector<uint8_t> bytes = good;
+        d.apply(bytes, at);
+        SampleIndex loaded;
+        if (load_tables(loaded, bytes) || loaded.valid()) {
+            char msg[80];
+            snprintf(msg, sizeof(msg), "accepted: %s", d.what);
+            TEST_FAIL_MESSAGE(msg);
+        }
+    }
+    SampleIndex loaded;
+    TEST_ASSERT_TRUE(load_tables(loaded, good));
+    unlink(kTablePath);
+}
+
+template <typename F>
+double ns_per_call(unsigned calls, F &&fn)
+{
+    auto t0 = std::chrono::steady_clock::now();
+    fn();
+    auto t1 = std::chrono::steady_clock::now();
+    return std::chrono::duration<double, std::nano>(t1 - t0).count() / calls;
+}
+
+// One hour of 30 fps video in 15-sample chunks: what demux resolves per
+// sample, through the index and through MP4D_frame_offset()
+void bench_index_vs_frame_offset()
+{
+    const TrackShape shape = {30 * 3600, 15, false, false, false, true};
+    SyntheticTrack t(shape, 42);
+    SampleIndex index;
+    TEST_ASSERT_TRUE(index.build(t.demux, 0));
+
+    volatile uint64_t sink = 0;
+    const unsigned n = shape.count;
+    double seq_index = ns_per_call(n, [&] {
+        uint64_t acc = 0;
+        for (unsigned i = 0; i < n; i++) acc += index.offset(i) + index.size(i) + index.timestamp(i);
+        sink = sink + acc;
+    });
+    double seq_minimp4 = ns_per_call(n, [&] {
+        uint64_t acc = 0;
+        for (unsigned i = 0; i < n; i++) {
+            unsigned bytes, ts;
+            acc += MP4D_frame_offset(&t.demux, 0, i, &bytes, &ts, nullptr) + bytes + ts;
+        }
+        sink = sink + acc;
+    });
+
+    const unsigned jumps = 20000;
+    double rnd_index = ns_per_call(jumps, [&] {
+        uint64_t acc = 0;
+        for (unsigned k = 0; k < jumps; k++) {
+            unsigned i = (unsigned)((k * 2654435761u) % n);
+            acc += index.offset(i) + index.timestamp(i);
+        }
+        sink = sink + acc;
+    });
+    double rnd_minimp4 = ns_per_call(jumps, [&] {
+        uint64_t acc = 0;
+        for (unsigned k = 0; k < jumps; k++) {
+            unsigned i = (unsigned)((k * 2654435761u) % n), bytes, ts;
+            acc += MP4D_frame_offset(&t.demux, 0, i, &bytes, &ts, nullptr) + ts;
+        }
+        sink = sink + acc;
+    });
+
+    printf("%u samples, %u chunks\n", n, t.track.chunk_count);
+    printf("  sequential: index %.1f ns/sample, MP4D_frame_offset %.1f ns/sample (x%.0f)\n",
+           seq_index, seq_minimp4, seq_minimp4 / seq_index);
+    printf("  random:     index %.1f ns/lookup, MP4D_frame_offset %.1f ns/lookup (x%.0f)\n",
+           rnd_index, rnd_minimp4, rnd_minimp4 / rnd_index);
+    TEST_ASSERT_TRUE(seq_index < seq_minimp4);
+}
+
+}  // namespace
+
+void setUp() {}
+void tearDown() {}
+
+int main()
+{
+    UNITY_BEGIN();
+    RUN_TEST(test_sequential_matches_frame_offset);
+    RUN_TEST(test_random_access_matches_frame_offset);
+    RUN_TEST(test_keyframe_queries);
+    RUN_TEST(test_compact_encoding_cost);
+    RUN_TEST(test_compact_encoding_edges);
+    RUN_TEST(test_saved_tables_load_back);
+    RUN_TEST(test_inconsistent_tables_rejected);
+    RUN_TEST(bench_index_vs_frame_offset);
+    RUN_TEST(bench_memory_per_sample);
+    return UNITY_END();
+}
@@ -0,0 +1,316 @@
+// Table-driven YUV420 -> RGB565 kernels against the per-pixel reference
+// (bit for bit), the decode -> YuvFrame -> band path the player runs (1:1
+// copy and ScaleMap gather), and their cycles per pixel.
+//
+//   pio test -e native -f test_yuv2rgb -v
+
+#include <unity.h>
+
+#include <cstdio>
+#include <vector>
+
+#include "esp_cpu.h"
+#include "yuv2rgb.h"
+
+using namespace mp4;
+
+namespace {
+
+struct Lcg {
+    uint32_t s;
+    explicit Lcg(uint32_t seed) : s(seed) {}
+    uint8_t byte() { s = s * 1664525u + 1013904223u; return (uint8_t)(s >> 24); }
+};
+
+// A decoder-shaped I420 frame: planes padded to macroblock multiples
+struct DecoderFrame {
+    int width, height, stride_w, stride_h;
+    std::vector<uint8_t> buf;
+
+    DecoderFrame(int w, int h, uint32_t seed)
+        : width(w), height(h), stride_w(mb_align(w)), stride_h(mb_align(h)),
+          buf((size_t)stride_w * stride_h * 3 / 2) {
+        Lcg rng(seed);
+        for (auto &b : buf) b = rng.byte();
+        // Saturating corners of the gamut in the first rows
+        for (int i = 0; i < stride_w && i < 8; i++) buf[i] = (i & 1) ? 255 : 0;
+    }
+    const uint8_t *y() const { return buf.data(); }
+    const uint8_t *u() const { return y() + (size_t)stride_w * stride_h; }
+    const uint8_t *v() const { return u() + (size_t)(stride_w / 2) * (stride_h / 2); }
+};
+
+// A whole decoder frame through the table-driven kernel as one band
+void i420_to_rgb565_lut(const DecoderFrame &f, uint16_t *rgb565, const Rgb565Lut &lut)
+{
+    i420_planes_to_rgb565_band(f.y(), f.u(), f.v(), f.stride_w, f.stride_w / 2,
+                               rgb565, f.width, 0, f.height, lut);
+}
+
+uint16_t swap16(uint16_t p)
+{
+    return (uint16_t)((p << 8) | (p >> 8));
+}
+
+// Every (y, u, v): one 256-pixel row per chroma pair, y running 0..255
+void test_every_pixel_value_matches_reference()
+{
+    uint8_t y_row[256], u_row[128], v_row[128];
+    uint16_t out[256], out_shifted[256];
+    for (int i = 0; i < 256; i++) y_row[i] = (uint8_t)i;
+    for (int u = 0; u < 256; u++) {
+        for (int v = 0; v < 256; v++) {
+            for (int k = 0; k < 128; k++) {
+                u_row[k] = (uint8_t)u;
+                v_row[k] = (uint8_t)v;
+            }
+            // Pairs share chroma: run each y as the left and as the right pixel
+            i420_row_to_rgb565(y_row, u_row, v_row, out, 256);
+            i420_row_to_rgb565(y_row + 1, u_row, v_row, out_shifted, 255);
+            for (int y = 0; y < 256; y++) {
+                uint16_t ref = yuv_to_rgb565(y, u - 128, v - 128);
+                if (out[y] != ref || (y > 0 && out_shifted[y - 1] != ref)) {
+                    char msg[96];
+                    snprintf(msg, sizeof(msg), "y=%d u=%d v=%d: got %04x want %04x", y, u, v,
+                             out[y], ref);
+                    TEST_FAIL_MESSAGE(msg);
+                }
+            }
+        }
+    }
+}
+
+// Widths through the 16-pixel body, the pair tail and an odd last pixel
+void test_row_kernel_every_width()
+{
+    DecoderFrame f(80, 2, 3);
+    uint16_t out[80];
+    for (int width = 1; width <= 80; width++) {
+        for (int x = 0; x < 80; x++) out[x] = 0xDEAD;
+        i420_row_to_rgb565(f.y(), f.u(), f.v(), out, width);
+        for (int x = 0; x < width; x++) {
+            TEST_ASSERT_EQUAL_HEX16(yuv_to_rgb565(f.y()[x], f.u()[x / 2] - 128, f.v()[x / 2] - 128),
+                                    out[x]);
+        }
+        for (int x = width; x < 80; x++) TEST_ASSERT_EQUAL_HEX16(0xDEAD, out[x]);
+    }
+}
+
+const int kSizes[][2] = {{320, 240}, {128, 128}, {240, 135}, {100, 75}, {33, 17}, {1, 1}};
+
+void test_frame_matches_reference()
+{
+    uint32_t seed = 10;
+    for (const auto &size : kSizes) {
+        DecoderFrame f(size[0], size[1], seed++);
+        std::vector<uint16_t> ref((size_t)f.width * f.height), fast(ref.size());
+        i420_to_rgb565(f.buf.data(), ref.data(), f.width, f.height);
+        i420_to_rgb565_lut(f, fast.data(), kRgb565Lut);
+        TEST_ASSERT_EQUAL_MEMORY(ref.data(), fast.data(), ref.size() * sizeof(uint16_t));
+
+        // Panel byte order: the same pixels, byte-swapped
+        i420_to_rgb565_lut(f, fast.data(), kSwap565Lut);
+        for (size_t i = 0; i < ref.size(); i++) TEST_ASSERT_EQUAL_HEX16(swap16(ref[i]), fast[i]);
+    }
+}
+
+// Bands of any height at any row (odd row0 starts mid chroma row)
+void test_bands_match_reference()
+{
+    DecoderFrame f(240, 135, 20);
+    std::vector<uint16_t> ref((size_t)f.width * f.height), band(ref.size());
+    i420_to_rgb565(f.buf.data(), ref.data(), f.width, f.height);
+    const int kBandRows[] = {1, 7, 16, 135};
+    for (int rows : kBandRows) {
+        for (int row0 = 0; row0 < f.height; row0 += rows) {
+            int n = (row0 + rows <= f.height) ? rows : f.height - row0;
+            i420_planes_to_rgb565_band(f.y(), f.u(), f.v(), f.stride_w, f.stride_w / 2,
+                                       band.data(), f.width, row0, n);
+            TEST_ASSERT_EQUAL_MEMORY(&ref[(size_t)row0 * f.width], band.data(),
+                                     (size_t)n * f.width * sizeof(uint16_t));
+        }
+    }
+}
+
+// What the display shows for a decoded frame: the YuvFrame decode_task
+// fills, converted in display_task's bands
+struct FramePath {
+    std::vector<uint8_t> mem;
+    YuvFrame yuv;
+    ScaleMap map;
+
+    FramePath(int dst_w, int dst_h, bool scaled)
+        : mem(YuvFrame::bytes_for(dst_w, dst_h, scaled)) {
+        yuv.bind(mem.data(), dst_w, dst_h, scaled);
+    }
+    void fill(const DecoderFrame &f) {
+        if (yuv.chroma_full) {
+            i420_gather_to_frame(f.buf.data(), f.width, f.height, map, yuv);
+        } else {
+            i420_copy_to_frame(f.buf.data(), yuv);
+        }
+    }
+    void convert(uint16_t *out, int band_rows) {
+        for (int row = 0; row < yuv.height; row += band_rows) {
+            int rows = (row + band_rows <= yuv.height) ? band_rows : yuv.height - row;
+            yuv_frame_to_rgb565_band(yuv, out + (size_t)row * yuv.width, row, rows, kSwap565Lut);
+        }
+    }
+};
+
+void test_copy_path_matches_reference()
+{
+    uint32_t seed = 40;
+    for (const auto &size : kSizes) {
+        DecoderFrame f(size[0], size[1], seed++);
+        std::vector<uint16_t> ref((size_t)f.width * f.height), out(ref.size());
+        i420_to_rgb565(f.buf.data(), ref.data(), f.width, f.height);
+        FramePath path(f.width, f.height, false);
+        path.fill(f);
+        path.convert(out.data(), 16);
+        for (size_t i = 0; i < ref.size(); i++) TEST_ASSERT_EQUAL_HEX16(swap16(ref[i]), out[i]);
+    }
+}
+
+// The display size decode_task picks: 1:1 when the video fits the panel,
+// else the aspect-preserving fit rounded down to even dimensions
+void test_fit_to_panel()
+{
+    struct Case {
+        int src_w, src_h, max_w, max_h, w, h;
+        bool scaled;
+    };
+    static const Case kCases[] = {
+        {960, 540, 240, 240, 240, 134, true},   // SpotPear: 135 rows rounded down
+        {640, 360, 128, 128, 128, 72, true},    // AtomS3R
+        {960, 540, 128, 128, 128, 72, true},
+        {540, 960, 240, 240, 134, 240, true},   // portrait
+        {333, 201, 128, 128, 128, 76, true},
+        {240, 240, 240, 240, 240, 240, false},
+        {100, 75, 128, 128, 100, 75, false},    // smaller: never upscaled
+    };
+    for (const Case &c : kCases) {
+        int w = 0, h = 0;
+        TEST_ASSERT_EQUAL(c.scaled, fit_to_panel(c.src_w, c.src_h, c.max_w, c.max_h, w, h));
+        TEST_ASSERT_EQUAL_INT(c.w, w);
+        TEST_ASSERT_EQUAL_INT(c.h, h);
+    }
+}
+
+// Downscaled: every output pixel is the source pixel at (x * src_w / dst_w,
+// y * src_h / dst_h), converted with its own 4:2:0 chroma sample
+void test_gather_path_matches_nearest_neighbour()
+{
+    // Sources the player accepts (up to 960x540) on its 240x240 and 128x128
+    // panels, and an odd one
+    const int kGeometries[][4] = {
+        {960, 540, 240, 134}, {640, 360, 128, 72}, {960, 540, 128, 72},
+        {540, 960, 134, 240}, {333, 201, 100, 61},
+    };
+    uint32_t seed = 50;
+    for (const auto &g : kGeometries) {
+        DecoderFrame f(g[0], g[1], seed++);
+        FramePath path(g[2], g[3], true);
+        TEST_ASSERT_TRUE(path.map.init(g[0], g[1], g[2], g[3]));
+        path.fill(f);
+        std::vector<uint16_t> out((size_t)g[2] * g[3]);
+        path.convert(out.data(), 16);
+        for (int j = 0; j < g[3]; j++) {
+            int sy = j * g[1] / g[3];
+            for (int i = 0; i < g[2]; i++) {
+                int sx = i * g[0] / g[2];
+                size_t uv = (size_t)(sy / 2) * (f.stride_w / 2) + sx / 2;
+                uint16_t ref = yuv_to_rgb565(f.y()[(size_t)sy * f.stride_w + sx],
+                                             f.u()[uv] - 128, f.v()[uv] - 128);
+                TEST_ASSERT_EQUAL_HEX16(swap16(ref), out[(size_t)j * g[2] + i]);
+            }
+        }
+    }
+}
+
+// Cycles per pixel as the device counts them (esp_cpu_get_cycle_count();
+// the host TSC here, so only ratios between rows mean anything)
+template <typename F>
+double cycles_per_pixel(int pixels, int reps, F &&fn)
+{
+    uint64_t cycles = 0;
+    for (int r = 0; r < reps; r++) {
+        esp_cpu_cycle_count_t c0 = esp_cpu_get_cycle_count();
+        fn();
+        cycles += (uint32_t)(esp_cpu_get_cycle_count() - c0);
+    }
+    return (double)cycles / ((double)pixels * reps);
+}
+
+// A 320x240 frame through the reference and the table-driven kernel
+void bench_frame_conversion()
+{
+    DecoderFrame f(320, 240, 30);
+    const int pixels = f.width * f.height;
+    std::vector<uint16_t> out(pixels);
+    volatile uint16_t sink = 0;
+
+    double ref = cycles_per_pixel(pixels, 200, [&] {
+        i420_to_rgb565(f.buf.data(), out.data(), f.width, f.height);
+        sink = sink + out[pixels / 2];
+    });
+    double lut = cycles_per_pixel(pixels, 200, [&] {
+        i420_to_rgb565_lut(f, out.data(), kSwap565Lut);
+        sink = sink + out[pixels / 2];
+    });
+    printf("320x240: reference %.2f cycles/pixel, table-driven %.2f cycles/pixel (x%.1f), "
+           "tables %u bytes each\n",
+           ref, lut, ref / lut, (unsigned)sizeof(Rgb565Lut));
+}
+
+// Both halves of the player's video path per displayed pixel: decode_task's
+// hand-off (ScaleMap gather, or the 1:1 copy) and display_task's banded
+// conversion.  Downscales are per output pixel, at the size fit_to_panel()
+// gives on each board's panel.
+void bench_player_paths()
+{
+    // Source size, panel size
+    const int kPaths[][4] = {{960, 540, 240, 240}, {640, 360, 128, 128}, {240, 134, 240, 240}};
+    uint32_t seed = 60;
+    for (const auto &p : kPaths) {
+        int w = 0, h = 0;
+        const bool scaled = fit_to_panel(p[0], p[1], p[2], p[3], w, h);
+        DecoderFrame f(p[0], p[1], seed++);
+        FramePath path(w, h, scaled);
+        if (scaled) TEST_ASSERT_TRUE(path.map.init(p[0], p[1], w, h));
+        const int pixels = w * h;
+        std::vector<uint16_t> out(pixels);
+        volatile uint16_t sink = 0;
+
+        double fill = cycles_per_pixel(pixels, 300, [&] {
+            path.fill(f);
+            sink = sink + path.yuv.y[pixels / 2];
+        });
+        double convert = cycles_per_pixel(pixels, 300, [&] {
+            path.convert(out.data(), 16);
+            sink = sink + out[pixels / 2];
+        });
+        printf("%4dx%-4d -> %dx%d %s: hand-off %.2f cycles/pixel, convert %.2f cycles/pixel\n",
+               p[0], p[1], w, h, scaled ? "gather" : "copy  ", fill, convert);
+    }
+}
+
+}  // namespace
+
+void setUp() {}
+void tearDown() {}
+
+int main()
+{
+    UNITY_BEGIN();
+    RUN_TEST(test_every_pixel_value_matches_reference);
+    RUN_TEST(test_row_kernel_every_width);
+    RUN_TEST(test_frame_matches_reference);
+    RUN_TEST(test_bands_match_reference);
+    RUN_TEST(test_copy_path_matches_reference);
+    RUN_TEST(test_fit_to_panel);
+    RUN_TEST(test_gather_path_matches_nearest_neighbour);
+    RUN_TEST(bench_frame_conversion);
+    RUN_TEST(bench_player_paths);
+    return UNITY_END();
+}